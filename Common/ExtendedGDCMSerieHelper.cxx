@@ -36,6 +36,9 @@
 #include "IRISException.h"
 
 #include "gdcmImageHelper.h"
+#include <cmath>
+#include <locale>
+#include <sstream>
 
 using namespace gdcm;
 
@@ -67,6 +70,7 @@ void ExtendedGDCMSerieHelper
   if (!IPPMultiOrdering( flist, n_images_per_ipp))
     {
     this->FileNameOrdering(flist );
+    n_images_per_ipp = 1;
     }
 
   files.clear();
@@ -196,3 +200,111 @@ ExtendedGDCMSerieHelper
   distmultimap.clear();
   return true;
 }
+
+// Parse a backslash-separated DICOM decimal string with at least n values
+static bool ParseDecimalValues(const std::string &s, size_t n, std::vector<double> &values)
+{
+  values.clear();
+  std::istringstream iss(s);
+  iss.imbue(std::locale::classic());
+  std::string field;
+  while(values.size() < n && std::getline(iss, field, '\\'))
+    {
+    std::istringstream fss(field);
+    fss.imbue(std::locale::classic());
+    double v;
+    if(!(fss >> v))
+      return false;
+    values.push_back(v);
+    }
+  return values.size() == n;
+}
+
+// Orders file indices by filename
+struct FileIndexNameLess
+{
+  const std::vector<std::string> &files;
+  FileIndexNameLess(const std::vector<std::string> &f) : files(f) {}
+  bool operator() (size_t a, size_t b) const { return files[a] < files[b]; }
+};
+
+bool
+ExtendedGDCMSerieHelper
+::OrderByPosition(std::vector<std::string> &files,
+                  const std::vector<std::string> &positions,
+                  const std::vector<std::string> &orientations,
+                  int &n_images_per_ipp)
+{
+  size_t n = files.size();
+  if(n < 2 || positions.size() != n || orientations.size() != n)
+    return false;
+
+  // Sort the files by filename first, as in IPPMultiOrdering
+  std::vector<size_t> presorted(n);
+  for(size_t i = 0; i < n; i++)
+    presorted[i] = i;
+  std::sort(presorted.begin(), presorted.end(), FileIndexNameLess(files));
+
+  // The cosines are taken from the first file. gdcm replaces invalid cosines
+  // with defaults, so leave those files to gdcm
+  std::vector<double> cosines, ipp;
+  if(!ParseDecimalValues(orientations[presorted[0]], 6, cosines))
+    return false;
+
+  double norm1 = 0, norm2 = 0, dot = 0;
+  for(int i = 0; i < 3; i++)
+    {
+    norm1 += cosines[i] * cosines[i];
+    norm2 += cosines[i+3] * cosines[i+3];
+    dot += cosines[i] * cosines[i+3];
+    }
+  if(fabs(sqrt(norm1) - 1) >= 1e-3 || fabs(sqrt(norm2) - 1) >= 1e-3 || fabs(dot) >= 1e-3)
+    return false;
+
+  double normal[3];
+  normal[0] = cosines[1]*cosines[5] - cosines[2]*cosines[4];
+  normal[1] = cosines[2]*cosines[3] - cosines[0]*cosines[5];
+  normal[2] = cosines[0]*cosines[4] - cosines[1]*cosines[3];
+
+  // Use a multimap to sort the distances along the normal. Files at the same
+  // distance stay in filename order
+  std::multimap<double, size_t> distmultimap;
+  double min = 0, max = 0;
+  for(size_t k = 0; k < n; k++)
+    {
+    if(!ParseDecimalValues(positions[presorted[k]], 3, ipp))
+      return false;
+
+    double dist = 0;
+    for(int i = 0; i < 3; ++i)
+      dist += normal[i]*ipp[i];
+
+    distmultimap.insert(std::make_pair(dist, presorted[k]));
+    min = (k == 0 || dist < min) ? dist : min;
+    max = (k == 0 || dist > max) ? dist : max;
+    }
+
+  // The cases that IPPMultiOrdering rejects are left to gdcm as well
+  if(min == max)
+    return false;
+
+  int count_per_ipp = -1;
+  for(std::multimap<double, size_t>::iterator it = distmultimap.begin();
+      it != distmultimap.end(); ++it)
+    {
+    int count = distmultimap.count(it->first);
+    if(count_per_ipp < 0)
+      count_per_ipp = count;
+    else if(count != count_per_ipp)
+      return false;
+    }
+
+  std::vector<std::string> sorted;
+  for(std::multimap<double, size_t>::iterator it = distmultimap.begin();
+      it != distmultimap.end(); ++it)
+    sorted.push_back(files[it->second]);
+
+  files = sorted;
+  n_images_per_ipp = count_per_ipp;
+  return true;
+}
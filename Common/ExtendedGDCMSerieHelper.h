@@ -48,6 +48,18 @@ public:
 
   void SetFilesAndOrder(std::vector<std::string> &files, int &n_images_per_ipp);
 
+  /**
+   * Order the files the same way as SetFilesAndOrder, using the image
+   * position and orientation (patient) strings already read from each file
+   * instead of parsing the files again. Returns false, leaving the files
+   * unchanged, if the values are missing or the files can not be ordered by
+   * position, in which case SetFilesAndOrder should be used.
+   */
+  static bool OrderByPosition(std::vector<std::string> &files,
+                              const std::vector<std::string> &positions,
+                              const std::vector<std::string> &orientations,
+                              int &n_images_per_ipp);
+
 protected:
   bool IPPMultiOrdering(gdcm::FileList *fileList, int &n_images_per_ipp);
 
@@ -55,6 +55,7 @@
 #include "SNAPRegistryIO.h"
 #include "HistoryManager.h"
 #include "UIReporterDelegates.h"
+#include "DicomDirectoryIndex.h"
 #include <itksys/Directory.hxx>
 #include <itksys/SystemTools.hxx>
 #include "itkVoxBoCUBImageIOFactory.h"
@@ -178,6 +179,10 @@ SystemInterface
 
   // Set the preferences file
   m_UserPreferenceFile = appdir + "/UserPreferences.xml";
+
+  // Keep the headers of scanned DICOM directories, so that they load faster
+  // the next time
+  DicomDirectoryIndex::SetIndexDirectory(appdir + "/DicomIndex");
 }
 
 SystemInterface
@@ -295,7 +295,7 @@ ImageIOWizardModel::FileFormat ImageIOWizardModel::GetSelectedFormat()
 
 
 
-void ImageIOWizardModel::LoadImage(std::string filename)
+void ImageIOWizardModel::LoadImage(std::string filename, itk::Command *progressCommand)
 {
   // There is no loaded image to start with
   m_LoadedImage = NULL;
@@ -315,7 +315,7 @@ void ImageIOWizardModel::LoadImage(std::string filename)
     m_LoadDelegate->UnloadCurrentImage();
 
     // Load the data from the image
-    m_GuidedIO->ReadNativeImageData();
+    m_GuidedIO->ReadNativeImageData(progressCommand);
 
     // Validate the image data
     m_LoadDelegate->ValidateImage(m_GuidedIO, m_Warnings);
@@ -432,7 +432,8 @@ ImageIOWizardModel
 
 void ImageIOWizardModel
 ::LoadDicomSeries(const std::string &filename,
-                  const std::string &series_id)
+                  const std::string &series_id,
+                  itk::Command *progressCommand)
 {
   // Get the DICOM registry from the GuidedIO
   typedef GuidedNativeImageIO::DicomDirectoryParseResult ParseResult;
@@ -469,7 +470,7 @@ void ImageIOWizardModel
   std::string dir = GetBrowseDirectory(filename);
 
   // Call the main load method
-  this->LoadImage(dir);
+  this->LoadImage(dir, progressCommand);
 
   // DICOM filenames are meaningless. Assign a nickname based on series name
   if(m_LoadedImage->GetCustomNickname().length() == 0)
@@ -137,9 +137,10 @@ public:
 
   /**
     Load the image from filename, putting warnings into a warning list. This
-    may also fire an exception (e.g., if validation failed)
+    may also fire an exception (e.g., if validation failed). The progress
+    command is called as the image data are read
     */
-  void LoadImage(std::string filename);
+  void LoadImage(std::string filename, itk::Command *progressCommand = NULL);
 
   /**
    Save the image to a filename
@@ -181,7 +182,8 @@ public:
     Load n-th series from DICOM directory
     */
   void LoadDicomSeries(const std::string &filename,
-                       const std::string &series_id);
+                       const std::string &series_id,
+                       itk::Command *progressCommand = NULL);
 
 
   irisGetSetMacro(SuggestedFilename, std::string)
@@ -91,24 +91,34 @@ void InterpolateLabelModel::Interpolate()
   SegmentationUpdateIterator it_trg(liw->GetImage(), liw->GetImage()->GetBufferedRegion(),
                                     this->GetDrawingLabel(), this->GetDrawOverFilter());
 
-  itk::ImageRegionConstIterator<GenericImageData::LabelImageType>
-      it_src(mci->GetOutput(), mci->GetOutput()->GetBufferedRegion());
+  // The interpolation result is visited one run at a time, and each run is
+  // painted into the segmentation as a span
+  typedef GenericImageData::LabelImageType SourceImageType;
+  SourceImageType *src = mci->GetOutput();
+  itk::ImageRegionConstIterator<SourceImageType::BufferType>
+      it_src(src->GetBuffer(), src->GetBuffer()->GetBufferedRegion());
 
   // The way we paint back into the segmentation depends on whether all labels
   // or a specific label are being interpolated
-  if(interp_all)
-    {
-    // Just replace the segmentation by the interpolation, respecting draw-over
-    for(; !it_trg.IsAtEnd(); ++it_trg, ++it_src)
-      it_trg.PaintLabel(it_src.Get());
-    }
-  else
+  LabelType l_interp = this->GetInterpolateLabel();
+  LabelType l_replace = this->GetDrawingLabel();
+  for(; !it_trg.IsAtEndOfLines(); it_trg.NextLine(), ++it_src)
     {
-    LabelType l_interp = this->GetInterpolateLabel();
-    LabelType l_replace = this->GetDrawingLabel();
-    for(; !it_trg.IsAtEnd(); ++it_trg, ++it_src)
-      if(it_src.Get() == l_interp)
-        it_trg.PaintLabelWithExtraProtection(l_interp, l_replace);
+    const SourceImageType::RLLine &line = it_src.Value();
+    long x = src->GetBufferedRegion().GetIndex(0);
+    for(size_t i = 0; i < line.size(); x += line[i].first, i++)
+      {
+      long x_end = x + line[i].first - 1;
+      if(interp_all)
+        {
+        // Just replace the segmentation by the interpolation, respecting draw-over
+        it_trg.PaintSpan(x, x_end, line[i].second);
+        }
+      else if(line[i].second == l_interp)
+        {
+        it_trg.PaintSpanWithExtraProtection(x, x_end, l_interp, l_replace);
+        }
+      }
     }
 
   // Finish the segmentation editing and create an undo point
@@ -16,6 +16,8 @@
 #include "RandomForestClassifier.h"
 #include "RandomForestClassifyImageFilter.h"
 #include "NumericPropertyToggleAdaptor.h"
+#include <sstream>
+#include <iomanip>
 
 SnakeWizardModel::SnakeWizardModel()
 {
@@ -139,6 +141,21 @@ SnakeWizardModel::SnakeWizardModel()
         nullsetter,
         EvolutionIterationEvent());
 
+  void (Self::*nullstringsetter)(std::string) = NULL;
+
+  m_EvolutionPerformanceModel = wrapGetterSetterPairAsProperty(
+        this,
+        &Self::GetEvolutionPerformanceValue,
+        nullstringsetter,
+        EvolutionIterationEvent());
+
+  m_EvolutionCheckpointModel = wrapGetterSetterPairAsProperty(
+        this,
+        &Self::GetEvolutionCheckpointValueAndRange,
+        &Self::SetEvolutionCheckpointValue,
+        EvolutionIterationEvent(),
+        EvolutionIterationEvent());
+
   m_NumberOfClustersModel = wrapGetterSetterPairAsProperty(
         this,
         &Self::GetNumberOfClustersValueAndRange,
@@ -534,6 +551,7 @@ void SnakeWizardModel::SetClassifierBiasValue(double value)
   IRISApplication::RFClassifier *rfc = rfe->GetClassifier();
   assert(rfc);
 
+  AbortRFPreprocessing();
   rfc->SetBiasParameter(value);
 
   InvokeEvent(RFClassifierModifiedEvent());
@@ -618,6 +636,8 @@ void SnakeWizardModel
 
     if(old_weight != new_weight)
       {
+      if(!changed)
+        AbortRFPreprocessing();
       rfc->SetClassWeight(it->first, new_weight);
       changed = true;
       }
@@ -1441,6 +1461,37 @@ int SnakeWizardModel::GetEvolutionIterationValue()
   else return 0;
 }
 
+bool SnakeWizardModel::GetEvolutionPerformanceValue(std::string &value)
+{
+  if(!m_Driver->IsSnakeModeActive() ||
+     !m_Driver->GetSNAPImageData()->IsSegmentationActive())
+    return false;
+
+  double speed;
+  std::vector<double> util;
+  m_Driver->GetSNAPImageData()->GetSegmentationPerformance(speed, util);
+  if(speed <= 0.0)
+    return false;
+
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1) << speed << " it/s";
+  if(util.size())
+    {
+    // Report the mean and the lowest utilization of the threads
+    double umean = 0.0, umin = 1.0;
+    for(size_t i = 0; i < util.size(); i++)
+      {
+      umean += util[i] / util.size();
+      umin = std::min(umin, util[i]);
+      }
+    oss << ", " << util.size() << " threads " << std::setprecision(0)
+        << 100 * umean << "% busy (min " << 100 * umin << "%)";
+    }
+
+  value = oss.str();
+  return true;
+}
+
 ThresholdSettings *SnakeWizardModel::GetThresholdSettings()
 {
   // Get the layer currently being thresholded
@@ -1503,6 +1554,52 @@ void SnakeWizardModel::OnCancelSegmentation()
   m_Parent->SetSegmentationVisibility(true);
 }
 
+bool SnakeWizardModel
+::GetEvolutionCheckpointValueAndRange(unsigned int &value, CheckpointDomain *range)
+{
+  if(!m_Driver->IsSnakeModeActive() ||
+     !m_Driver->GetSNAPImageData()->IsSegmentationActive())
+    return false;
+
+  SNAPImageData *sid = m_Driver->GetSNAPImageData();
+  std::vector<unsigned int> checkpoints = sid->GetSegmentationCheckpoints();
+  if(checkpoints.empty())
+    return false;
+
+  // The value is the latest checkpoint the evolution has gone past
+  unsigned int iter = sid->GetElapsedSegmentationIterations();
+  value = checkpoints.front();
+  for(size_t i = 0; i < checkpoints.size(); i++)
+    if(checkpoints[i] <= iter)
+      value = checkpoints[i];
+
+  if(range)
+    {
+    range->clear();
+    for(size_t i = 0; i < checkpoints.size(); i++)
+      {
+      std::ostringstream oss;
+      oss << "Iteration " << checkpoints[i];
+      (*range)[checkpoints[i]] = oss.str();
+      }
+    }
+
+  return true;
+}
+
+void SnakeWizardModel::SetEvolutionCheckpointValue(unsigned int value)
+{
+  SNAPImageData *sid = m_Driver->GetSNAPImageData();
+  if(sid->IsSegmentationActive()
+     && value != sid->GetElapsedSegmentationIterations())
+    {
+    sid->RestoreSegmentationCheckpoint(value);
+    }
+
+  // Fire an event
+  InvokeEvent(EvolutionIterationEvent());
+}
+
 void SnakeWizardModel::RewindEvolution()
 {
   if(m_Driver->GetSNAPImageData()->IsSegmentationActive())
@@ -1647,6 +1744,15 @@ void SnakeWizardModel::TagRFPreprocessingFilterModified()
       (RFPreprocessingPreviewWrapperType *) m_Driver->GetPreprocessingFilterPreviewer(PREPROCESS_RF);
   junk->SetParameters(ce->GetClassifier());
 
+  // The preview filters classify the displayed slices. Classify the rest of
+  // the volume in the background, so that less is left to do on 'Apply'
+  if(junk->IsPreviewMode())
+    junk->StartComputeOutputVolume();
+}
+
+void SnakeWizardModel::AbortRFPreprocessing()
+{
+  m_Driver->GetPreprocessingFilterPreviewer(PREPROCESS_RF)->AbortComputeOutputVolume();
 }
 
 
@@ -1817,6 +1923,7 @@ void SnakeWizardModel::TrainClassifier()
   IRISApplication::RFEngine *rfengine = m_Driver->GetClassificationEngine();
 
   // Perform the classification
+  AbortRFPreprocessing();
   rfengine->TrainClassifier();
 
   // Create a list of utilized labels
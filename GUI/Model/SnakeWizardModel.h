@@ -142,6 +142,15 @@ public:
   irisGetMacro(StepSizeModel, AbstractRangedIntProperty *)
   irisGetMacro(EvolutionIterationModel, AbstractSimpleIntProperty *)
 
+  // Speed of the evolution and utilization of the threads in the last step
+  irisGetMacro(EvolutionPerformanceModel, AbstractSimpleStringProperty *)
+
+  // Checkpoints of the evolution, identified by their iteration. Setting the
+  // value returns the evolution to that checkpoint
+  typedef SimpleItemSetDomain<unsigned int, std::string> CheckpointDomain;
+  typedef AbstractPropertyModel<unsigned int, CheckpointDomain> AbstractCheckpointModel;
+  irisGetMacro(EvolutionCheckpointModel, AbstractCheckpointModel *)
+
   /** Check the state flags above */
   bool CheckState(UIState state);
 
@@ -372,6 +381,13 @@ protected:
   SmartPtr<AbstractSimpleIntProperty> m_EvolutionIterationModel;
   int GetEvolutionIterationValue();
 
+  SmartPtr<AbstractSimpleStringProperty> m_EvolutionPerformanceModel;
+  bool GetEvolutionPerformanceValue(std::string &value);
+
+  SmartPtr<AbstractCheckpointModel> m_EvolutionCheckpointModel;
+  bool GetEvolutionCheckpointValueAndRange(unsigned int &value, CheckpointDomain *range);
+  void SetEvolutionCheckpointValue(unsigned int value);
+
   // Get the threshold settings for the active layer
   ThresholdSettings *GetThresholdSettings();
 
@@ -479,6 +495,10 @@ protected:
   // TODO: this should be handled through the ITK modified mechanism
   void TagRFPreprocessingFilterModified();
 
+  // Stop the background classification of the speed volume before the
+  // classifier, which it reads, is changed in place
+  void AbortRFPreprocessing();
+
   // Parent model
   GlobalUIModel *m_Parent;
   IRISApplication *m_Driver;
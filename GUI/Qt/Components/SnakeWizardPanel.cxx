@@ -14,6 +14,7 @@
 #include "QtDoubleSpinBoxCoupling.h"
 #include "QtSliderCoupling.h"
 #include "QtRadioButtonCoupling.h"
+#include "QtLabelCoupling.h"
 #include "ColorLabelQuickListWidget.h"
 #include "IRISException.h"
 #include <QMessageBox>
@@ -252,6 +253,8 @@ void SnakeWizardPanel::SetModel(GlobalUIModel *model)
 
   makeCoupling(ui->inStepSize, m_Model->GetStepSizeModel());
   makeCoupling(ui->outIteration, m_Model->GetEvolutionIterationModel());
+  makeCoupling(ui->outEvolutionPerformance, m_Model->GetEvolutionPerformanceModel());
+  makeCoupling(ui->inCheckpoint, m_Model->GetEvolutionCheckpointModel());
 
   // Activation flags
   /*
@@ -397,6 +400,12 @@ void SnakeWizardPanel::on_btnRewind_clicked()
   m_Model->RewindEvolution();
 }
 
+void SnakeWizardPanel::on_inCheckpoint_activated(int index)
+{
+  // Stop the evolution at the checkpoint the user returned to
+  ui->btnPlay->setChecked(false);
+}
+
 void SnakeWizardPanel::on_btnEvolutionParameters_clicked()
 {
   m_ParameterDialog->show();
@@ -95,6 +95,8 @@ private slots:
 
   void on_btnRewind_clicked();
 
+  void on_inCheckpoint_activated(int index);
+
   void on_btnEvolutionParameters_clicked();
 
   void on_btnCancel_clicked();
@@ -504,16 +504,24 @@ bool DICOMPage::validatePage()
   std::string series_id =
       to_utf8(m_Table->item(row, 0)->data(Qt::UserRole).toString());
 
+  // Disable the buttons until we finish loading
+  this->setEnabled(false);
+
   try
     {
     QtCursorOverride curse(Qt::WaitCursor);
-    m_Model->LoadDicomSeries(to_utf8(this->field("Filename").toString()), series_id);
+
+    // Keep the GUI responsive while the slices are decoded
+    SmartPtr<ProcessEventsITKCommand> cmd = ProcessEventsITKCommand::New();
+    m_Model->LoadDicomSeries(to_utf8(this->field("Filename").toString()), series_id, cmd);
     }
   catch(IRISException &exc)
     {
+    this->setEnabled(true);
     return ErrorMessage(exc);
     }
 
+  this->setEnabled(true);
   return true;
 }
 
@@ -92,40 +92,59 @@ SegmentationStatistics
   // Clear and initialize the statistics table
   m_Stats.clear();
 
-  // Start the label image iteration
-  LabelImageWrapper::ConstIterator itLabel = seg->GetImageConstIterator();
-  itk::ImageRegion<3> region = itLabel.GetRegion();
-
-  // Cache the entry to avoid many calls to std::map
-  LabelType runLabel = 0;
-  Entry *cachedEntry = &m_Stats[runLabel];
-  cachedEntry->resize(ngray);
-  itk::Index<3> runStart = itLabel.GetIndex();
-  long runLength = 0;
-
-  // Aggregate the statistical data
-  for( ; !itLabel.IsAtEnd(); ++itLabel, ++runLength)
+  if(ngray == 0)
     {
-    // Get the label and the corresponding entry (use cache to reduce time wasted in std::map)
-    LabelType label = itLabel.Value();
-    if(label != runLabel)
+    // Without intensity layers, only the voxel counts are needed, and these
+    // are maintained by the segmentation layer
+    const LabelImageWrapper::LabelStatisticsMap &ls = seg->GetLabelStatistics(false);
+    for(LabelImageWrapper::LabelStatisticsMap::const_iterator it = ls.begin();
+        it != ls.end(); ++it)
       {
-      // Record the statistics from the last run
-      this->RecordRunLength(ngray, layers, region, runStart, runLength, cachedEntry);
-
-      // Change the cached entry
-      runLabel = label;
-      cachedEntry = &m_Stats[runLabel];
-      if(cachedEntry->count == 0)
-        cachedEntry->resize(ngray);
-
-      runStart = itLabel.GetIndex();
-      runLength = 0;
+      Entry &entry = m_Stats[it->first];
+      entry.resize(ngray);
+      entry.count = it->second.Count;
+      }
+    }
+  else
+    {
+    // Visit the runs of the RLE label image, line by line
+    typedef LabelImageWrapper::ImageType LabelImageType;
+    LabelImageType *img = seg->GetImage();
+    itk::ImageRegion<3> region = img->GetBufferedRegion();
+    itk::ImageRegionConstIterator<LabelImageType::BufferType>
+        itLine(img->GetBuffer(), img->GetBuffer()->GetBufferedRegion());
+
+    // Cache the entry to avoid many calls to std::map
+    LabelType runLabel = 0;
+    Entry *cachedEntry = &m_Stats[runLabel];
+    cachedEntry->resize(ngray);
+
+    // Aggregate the statistical data
+    for( ; !itLine.IsAtEnd(); ++itLine)
+      {
+      const LabelImageType::RLLine &line = itLine.Value();
+      itk::Index<3> runStart;
+      runStart[0] = region.GetIndex(0);
+      runStart[1] = itLine.GetIndex()[0];
+      runStart[2] = itLine.GetIndex()[1];
+      for(size_t i = 0; i < line.size(); i++)
+        {
+        // Get the label and the corresponding entry (use cache to reduce time wasted in std::map)
+        LabelType label = line[i].second;
+        if(label != runLabel)
+          {
+          runLabel = label;
+          cachedEntry = &m_Stats[runLabel];
+          if(cachedEntry->count == 0)
+            cachedEntry->resize(ngray);
+          }
+
+        // Record the statistics from this run
+        this->RecordRunLength(ngray, layers, region, runStart, line[i].first, cachedEntry);
+        runStart[0] += line[i].first;
+        }
       }
     }
-
-  // Record the statistics from the last run
-  this->RecordRunLength(ngray, layers, region, runStart, runLength, cachedEntry);
 
   // Compute the size of a voxel, in mm^3
   const double *spacing = 
@@ -88,6 +88,8 @@
 #include "AffineTransformHelper.h"
 
 #include <stdio.h>
+#include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <iomanip>
 
@@ -770,19 +772,39 @@ IRISApplication
   // Inversion state
   bool invert = m_GlobalState->GetPolygonInvert();
 
-  // Go through both iterators, copy the new over the old
-  while(!itSource.IsAtEnd())
+  // Go through both images one scanline at a time. Consecutive voxels that
+  // are on the same side of the level set are painted as a single span
+  long xFirst = roi.GetROI().GetIndex(0);
+  long xLast = xFirst + roi.GetROI().GetSize(0) - 1;
+  while(!itTarget.IsAtEndOfLines())
     {
-    // Get the level set value
-    float voxSNAP = itSource.Value();
-    if((!invert && voxSNAP <= 0) || (invert && voxSNAP >= 0))
-      itTarget.PaintAsForeground();
+    long xSpan = xFirst;
+    bool inSpan = false;
+    for(long x = xFirst; x <= xLast; ++x, ++itSource)
+      {
+      // Get the level set value
+      float voxSNAP = itSource.Value();
+      bool inside = (!invert && voxSNAP <= 0) || (invert && voxSNAP >= 0);
+
+      // Paint the span that ends before this voxel
+      if(x > xFirst && inside != inSpan)
+        {
+        if(inSpan)
+          itTarget.PaintSpanAsForeground(xSpan, x - 1);
+        else
+          itTarget.PaintSpanAsBackground(xSpan, x - 1);
+        xSpan = x;
+        }
+      inSpan = inside;
+      }
+
+    // Paint the last span on the scanline
+    if(inSpan)
+      itTarget.PaintSpanAsForeground(xSpan, xLast);
     else
-      itTarget.PaintAsBackground();
+      itTarget.PaintSpanAsBackground(xSpan, xLast);
 
-    // Iterate
-    ++itSource;
-    ++itTarget;
+    itTarget.NextLine();
     }
 
   // Finalize the segmentation
@@ -1194,8 +1216,6 @@ IRISApplication
   return nvoxels;
 }
 
-// TODO: This information should be cached at the segmentation layer level
-// by keeping track of label counts after every update operation.
 size_t
 IRISApplication
 ::GetNumberOfVoxelsWithLabel(LabelType label)
@@ -1203,25 +1223,27 @@ IRISApplication
   // Number of voxels matching current label
   size_t nvoxels = 0;
 
-  // We must iterate over all the label images
+  // We must query all the label images. Each keeps track of its label counts
   for(LayerIterator it = this->GetCurrentImageData()->GetLayers(LABEL_ROLE);
       !it.IsAtEnd(); ++it)
     {
     LabelImageWrapper *wrapper = dynamic_cast<LabelImageWrapper *>(it.GetLayer());
-    LabelImageType *seg = wrapper->GetImage();
-
-    // Get the number of voxels
-    for(LabelImageWrapper::ConstIterator it(seg, seg->GetBufferedRegion());
-        !it.IsAtEnd(); ++it)
-      {
-      if(it.Get() == label)
-        ++nvoxels;
-      }
+    nvoxels += wrapper->GetNumberOfVoxelsWithLabel(label);
     }
 
   return nvoxels;
 }
 
+// Test used by RelabelSegmentationWithCutPlane for a single voxel
+static inline bool IsAboveCutPlane(long x, const itk::Index<3> &index,
+                                   const Vector3d &normal, double intercept)
+{
+  double distance =
+    x*normal[0] +
+    index[1]*normal[1] +
+    index[2]*normal[2] - intercept;
+  return distance > 0;
+}
 
 int
 IRISApplication
@@ -1238,22 +1260,52 @@ IRISApplication
   // Adjust the intercept by 0.5 for voxel offset
   intercept -= 0.5 * (normal[0] + normal[1] + normal[2]);
 
-  // Iterate over the image, relabeling labels on one side of the plane
-  while(!it.IsAtEnd())
+  // Extent of the scanlines
+  long xFirst = imgLabel->GetBufferedRegion().GetIndex(0);
+  long xLast = xFirst + imgLabel->GetBufferedRegion().GetSize(0) - 1;
+
+  // Iterate over the scanlines, relabeling labels on one side of the plane.
+  // Along a scanline the distance to the plane is linear in x, so the voxels
+  // on the positive side form a single span that can be computed directly
+  while(!it.IsAtEndOfLines())
     {
-    // Compute the distance to the plane
-    itk::Index<3> index = it.GetIndex();
-    double distance = 
-      index[0]*normal[0] + 
-      index[1]*normal[1] + 
-      index[2]*normal[2] - intercept;
+    // Distance to the plane is roughly x * normal[0] + c
+    itk::Index<3> index = it.GetLineIndex();
+    double c = index[1]*normal[1] + index[2]*normal[2] - intercept;
+
+    long x0 = xFirst, x1 = xLast;
+    if(normal[0] == 0.0)
+      {
+      if(!IsAboveCutPlane(xFirst, index, normal, intercept))
+        x1 = x0 - 1;
+      }
+    else
+      {
+      // Estimate the crossing point, clamped to the scanline
+      double xCross = std::max(std::min(-c / normal[0], xLast + 1.0), xFirst - 1.0);
+      long xc = (long) floor(xCross);
+
+      // Correct for round-off so that the span contains exactly the voxels
+      // that pass the voxel-wise test
+      if(normal[0] > 0)
+        {
+        x0 = xc;
+        while(x0 > xFirst && IsAboveCutPlane(x0 - 1, index, normal, intercept)) x0--;
+        while(x0 <= xLast && !IsAboveCutPlane(x0, index, normal, intercept)) x0++;
+        }
+      else
+        {
+        x1 = xc;
+        while(x1 < xLast && IsAboveCutPlane(x1 + 1, index, normal, intercept)) x1++;
+        while(x1 >= xFirst && !IsAboveCutPlane(x1, index, normal, intercept)) x1--;
+        }
+      }
 
-    // Check the side of the plane
-    if(distance > 0)
-      it.PaintAsForegroundPreserveClear();
+    if(x0 <= x1)
+      it.PaintSpanAsForegroundPreserveClear(x0, x1);
 
-    // Next voxel
-    ++it;
+    // Next scanline
+    it.NextLine();
     }
 
   // Finalize
@@ -2752,7 +2804,7 @@ IRISApplication
   if(wrapper)
     {
     wrapper->ComputeOutputVolume(progress);
-    m_GlobalState->SetSpeedValid(true);
+    m_GlobalState->SetSpeedValid(wrapper->IsOutputVolumeComplete());
     }
 }
 
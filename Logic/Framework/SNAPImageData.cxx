@@ -456,6 +456,50 @@ SNAPImageData
   this->InvokeEvent(LevelSetImageChangeEvent());
 }
 
+unsigned int
+SNAPImageData
+::RestoreSegmentationCheckpoint(unsigned int iteration)
+{
+  // Should be in level set mode
+  assert(m_LevelSetDriver);
+
+  // Enter a thread-safe section
+  m_LevelSetPipelineMutexLock->Lock();
+
+  // Pass through to the level set driver
+  unsigned int restored = m_LevelSetDriver->RestoreCheckpoint(iteration);
+
+  // Leave a thread-safe section
+  m_LevelSetPipelineMutexLock->Unlock();
+
+  // Fire the update event
+  this->InvokeEvent(LevelSetImageChangeEvent());
+
+  return restored;
+}
+
+std::vector<unsigned int>
+SNAPImageData
+::GetSegmentationCheckpoints() const
+{
+  assert(m_LevelSetDriver);
+
+  // The checkpoints change while the segmentation runs in another thread
+  itk::MutexLockHolder<itk::FastMutexLock> holder(*m_LevelSetPipelineMutexLock);
+  return m_LevelSetDriver->GetCheckpointIterations();
+}
+
+void
+SNAPImageData
+::GetSegmentationPerformance(
+    double &itersPerSecond, std::vector<double> &threadUtilization) const
+{
+  assert(m_LevelSetDriver);
+  itk::MutexLockHolder<itk::FastMutexLock> holder(*m_LevelSetPipelineMutexLock);
+  itersPerSecond = m_LevelSetDriver->GetIterationsPerSecond();
+  threadUtilization = m_LevelSetDriver->GetThreadUtilization();
+}
+
 void 
 SNAPImageData
 ::TerminateSegmentation()
@@ -521,24 +565,29 @@ void SNAPImageData::SwapLabelImageWithCompressedAlternative()
     save->Encode(iter.Value());
     }
   save->FinishEncoding();
+  save->Compress();
 
   // Clear the undo manager
   liw->ClearUndoPoints();
 
-  // Decompress the currently saved alternative
+  // Decompress the currently saved alternative. Only the non-zero spans are
+  // stored, so the image is cleared first
+  liw->GetImage()->FillBuffer(0);
   if(m_CompressedAlternateLabelImage)
     {
+    CompressedLabelImageType *alt = m_CompressedAlternateLabelImage;
+    alt->Decompress();
     LabelImageWrapper::Iterator it_write(liw->GetImage(), liw->GetBufferedRegion());
-    for(size_t i = 0; i < m_CompressedAlternateLabelImage->GetNumberOfRLEs(); ++i)
+    size_t pos = 0;
+    for(size_t i = 0; i < alt->GetNumberOfSpans(); ++i)
       {
-      LabelType value = m_CompressedAlternateLabelImage->GetRLEValue(i);
-      for(size_t j = 0; j < m_CompressedAlternateLabelImage->GetRLELength(i); ++j, ++it_write)
+      for(; pos < alt->GetSpanOffset(i); ++pos)
+        ++it_write;
+      LabelType value = alt->GetSpanValue(i);
+      for(size_t j = 0; j < alt->GetSpanLength(i); ++j, ++pos, ++it_write)
         it_write.Set(value);
       }
-    }
-  else
-    {
-    liw->GetImage()->FillBuffer(0);
+    delete alt;
     }
 
   liw->GetImage()->Modified();
@@ -167,6 +167,18 @@ public:
   /** Revert the segmentation to the beginning */
   void RestartSegmentation();
 
+  /** Rewind or advance the segmentation to the latest checkpoint saved at or
+   * before the given iteration. Returns the iteration of the checkpoint */
+  unsigned int RestoreSegmentationCheckpoint(unsigned int iteration);
+
+  /** Iterations at which segmentation checkpoints are available */
+  std::vector<unsigned int> GetSegmentationCheckpoints() const;
+
+  /** Speed of the last segmentation run in iterations per second, and the
+   * fraction of the time each thread spent computing */
+  void GetSegmentationPerformance(
+      double &itersPerSecond, std::vector<double> &threadUtilization) const;
+
   /** Check for convergence */
   bool IsEvolutionConverged();
 
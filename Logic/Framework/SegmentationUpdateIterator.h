@@ -51,6 +51,13 @@
 /**
  * \class SegmentationUpdate
  * \brief This class handles updates to the segmentation image at a high level.
+ *
+ * There are two ways to use this class. The voxel API (PaintLabel, ++, IsAtEnd)
+ * visits the region one voxel at a time. The span API (PaintSpan, NextLine,
+ * IsAtEndOfLines) visits the region one scanline (line of voxels along the x
+ * axis) at a time, and paints whole spans of a scanline at once, updating the
+ * RLE line and the undo delta run by run. The two APIs should not be mixed
+ * in the same update.
  */
 class SegmentationUpdateIterator
 {
@@ -59,6 +66,9 @@ public:
   typedef itk::ImageRegion<3>                                  RegionType;
   typedef LabelImageWrapper::ImageType                         LabelImageType;
   typedef itk::ImageRegionIterator<LabelImageType>             LabelIteratorType;
+  typedef LabelImageType::BufferType                           LineBufferType;
+  typedef itk::ImageRegionIterator<LineBufferType>             LineIteratorType;
+  typedef LabelImageType::RLLine                               RLLine;
 
   typedef UndoDataManager<LabelType>::Delta                    UndoDelta;
 
@@ -74,7 +84,9 @@ public:
       m_ActiveLabel(active_label),
       m_DrawOver(draw_over),
       m_Iterator(labelImage, region),
-      m_ChangedVoxels(0)
+      m_ChangedVoxels(0),
+      m_Image(labelImage),
+      m_LineIterator(labelImage->GetBuffer(), LabelImageType::truncateRegion(region))
   {
     // Create the delta
     m_Delta = new UndoDelta();
@@ -82,6 +94,12 @@ public:
 
     // Set the voxel delta to zero
     m_VoxelDelta = 0;
+
+    // Nothing has been encoded on the first scanline
+    m_LineX = region.GetIndex(0);
+
+    // The delta will describe the changes made from this point on
+    m_ImageTimeBeforeEdit = labelImage->GetMTime();
   }
 
   ~SegmentationUpdateIterator()
@@ -225,6 +243,79 @@ public:
     return m_Iterator.IsAtEnd();
   }
 
+  /**
+   * Span API: index of the first voxel of the current scanline
+   */
+  IndexType GetLineIndex() const
+  {
+    IndexType idx;
+    idx[0] = m_Region.GetIndex(0);
+    idx[1] = m_LineIterator.GetIndex()[0];
+    idx[2] = m_LineIterator.GetIndex()[1];
+    return idx;
+  }
+
+  /**
+   * Span API: paint voxels x0 to x1 (inclusive) of the current scanline with
+   * a label, respecting the draw-over mask (same rule as PaintLabel). Spans
+   * painted on a scanline must be disjoint and given in increasing order.
+   */
+  void PaintSpan(long x0, long x1, LabelType new_label)
+  {
+    this->ApplySpan(x0, x1, PaintLabelRule(m_DrawOver, new_label));
+  }
+
+  /** Span API: same rule as PaintAsForeground */
+  void PaintSpanAsForeground(long x0, long x1)
+  {
+    this->ApplySpan(x0, x1, PaintLabelRule(m_DrawOver, m_ActiveLabel));
+  }
+
+  /** Span API: same rule as PaintAsForegroundPreserveClear */
+  void PaintSpanAsForegroundPreserveClear(long x0, long x1)
+  {
+    this->ApplySpan(x0, x1, PaintLabelRule(m_DrawOver, m_ActiveLabel, true));
+  }
+
+  /** Span API: same rule as PaintAsBackground */
+  void PaintSpanAsBackground(long x0, long x1)
+  {
+    if(m_ActiveLabel != 0)
+      this->ApplySpan(x0, x1, ReplaceLabelRule(m_ActiveLabel, 0));
+  }
+
+  /** Span API: same rule as ReplaceLabel */
+  void ReplaceLabelInSpan(long x0, long x1, LabelType target_label, LabelType new_label)
+  {
+    this->ApplySpan(x0, x1, ReplaceLabelRule(target_label, new_label));
+  }
+
+  /** Span API: same rule as PaintLabelWithExtraProtection */
+  void PaintSpanWithExtraProtection(long x0, long x1, LabelType protect_label, LabelType new_label)
+  {
+    this->ApplySpan(x0, x1, PaintLabelRule(m_DrawOver, new_label, false, true, protect_label));
+  }
+
+  /**
+   * Span API: finish the current scanline and move on to the next one
+   */
+  void NextLine()
+  {
+    // Voxels after the last span are unchanged
+    long xEnd = m_Region.GetIndex(0) + m_Region.GetSize(0);
+    m_Delta->EncodeRun(0, xEnd - m_LineX);
+    m_LineX = m_Region.GetIndex(0);
+    ++m_LineIterator;
+  }
+
+  /**
+   * Span API: have all the scanlines in the region been visited
+   */
+  bool IsAtEndOfLines()
+  {
+    return m_LineIterator.IsAtEnd();
+  }
+
   /**
    * Call this method at the end of the iteration to finish encoding. This will also set the
    * modified flag of the label image if there were any actual updates.
@@ -233,7 +324,8 @@ public:
   {
     m_Delta->FinishEncoding();
     if(m_ChangedVoxels > 0)
-      m_Iterator.GetImage()->Modified();
+      m_Image->Modified();
+    m_Delta->SetImageTimeStamps(m_ImageTimeBeforeEdit, m_Image->GetMTime());
   }
 
   // Keep delta from being deleted
@@ -258,6 +350,97 @@ public:
 
 protected:
 
+  // Rule for the span API: paint with a label, subject to the draw-over mask,
+  // optionally leaving the clear label or a protected label unchanged
+  struct PaintLabelRule
+  {
+    PaintLabelRule(const DrawOverFilter &draw_over, LabelType label,
+                   bool preserve_clear = false, bool protect = false,
+                   LabelType protect_label = 0)
+      : DrawOver(draw_over), Label(label), PreserveClear(preserve_clear),
+        Protect(protect), ProtectLabel(protect_label) {}
+
+    bool operator()(LabelType lOld, LabelType &lNew) const
+    {
+      if(lOld == Label || (PreserveClear && lOld == 0) || (Protect && lOld == ProtectLabel))
+        return false;
+
+      if(DrawOver.CoverageMode == PAINT_OVER_ALL ||
+         (DrawOver.CoverageMode == PAINT_OVER_ONE && lOld == DrawOver.DrawOverLabel) ||
+         (DrawOver.CoverageMode == PAINT_OVER_VISIBLE && lOld != 0))
+        {
+        lNew = Label;
+        return true;
+        }
+      return false;
+    }
+
+    DrawOverFilter DrawOver;
+    LabelType Label;
+    bool PreserveClear, Protect;
+    LabelType ProtectLabel;
+  };
+
+  // Rule for the span API: replace one label with another
+  struct ReplaceLabelRule
+  {
+    ReplaceLabelRule(LabelType target, LabelType label) : Target(target), Label(label) {}
+
+    bool operator()(LabelType lOld, LabelType &lNew) const
+    {
+      lNew = Label;
+      return lOld == Target && lOld != Label;
+    }
+
+    LabelType Target, Label;
+  };
+
+  // Adapts a span rule to RLEImage::RewriteLineSpan: each piece of a run
+  // that the span covers is passed through the rule and recorded in the delta
+  template <class TRule>
+  struct SpanRuleOperation
+  {
+    SpanRuleOperation(const TRule &rule, UndoDelta *delta) : Rule(rule), Delta(delta) {}
+
+    LabelType operator()(LabelType lOld, long n)
+    {
+      LabelType lNew = lOld;
+      if(Rule(lOld, lNew))
+        {
+        Delta->EncodeRun(lNew - lOld, n);
+        return lNew;
+        }
+      Delta->EncodeRun(0, n);
+      return lOld;
+    }
+
+    const TRule &Rule;
+    UndoDelta *Delta;
+  };
+
+  // Apply a rule to voxels x0 to x1 of the current scanline. The RLE line is
+  // rewritten in a single pass over its runs, and the undo delta receives
+  // one entry per run affected by the span
+  template <class TRule>
+  void ApplySpan(long x0, long x1, const TRule &rule)
+  {
+    // Clip the span to the region and to what has not been painted yet
+    x0 = std::max(x0, m_LineX);
+    x1 = std::min(x1, (long) (m_Region.GetIndex(0) + m_Region.GetSize(0) - 1));
+    if(x1 < x0)
+      return;
+
+    // Voxels between the previous span and this one are unchanged
+    m_Delta->EncodeRun(0, x0 - m_LineX);
+    m_LineX = x1 + 1;
+
+    // Positions in the RLE line are relative to the start of the buffer
+    long xBuf = m_Image->GetBufferedRegion().GetIndex(0);
+    SpanRuleOperation<TRule> op(rule, m_Delta);
+    m_ChangedVoxels += m_Image->RewriteLineSpan(
+          m_LineIterator.Value(), x0 - xBuf, x1 + 1 - xBuf, op, m_LineBuffer);
+  }
+
   // Name of the segmentation update (for undo tracking)
   std::string m_Title;
 
@@ -273,6 +456,9 @@ protected:
   // RLE encoding of the segmentation update - for storing undo/redo points
   UndoDelta *m_Delta;
 
+  // Modification time of the image when the iterator was created
+  itk::ModifiedTimeType m_ImageTimeBeforeEdit;
+
   // Iterator used internally
   LabelIteratorType m_Iterator;
 
@@ -281,6 +467,18 @@ protected:
 
   // Number of voxels actually modified
   unsigned long m_ChangedVoxels;
+
+  // The label image being updated
+  LabelImageType *m_Image;
+
+  // Span API: iterator over the RLE lines of the region
+  LineIteratorType m_LineIterator;
+
+  // Span API: first voxel of the current scanline not yet encoded in the delta
+  long m_LineX;
+
+  // Span API: scratch space for rewriting RLE lines
+  RLLine m_LineBuffer;
 };
 
 
@@ -37,13 +37,17 @@
 
 #include <vector>
 #include <list>
+#include <cassert>
 
 #include <RLEImage.h>
 
 /**
  * The Delta class represents a difference between two images used in
- * the Undo system. It only supports linear traversal of images and
- * stores differences in an RLE (run length encoding) format.
+ * the Undo system. It only supports linear traversal of images. The delta
+ * is encoded as a sequence of runs in the raster order of its region, but
+ * only the runs with non-zero values (i.e., the voxels that changed) are
+ * stored, as spans that record their offset from the start of the region.
+ * A delta that is not in active use can be compressed with zlib.
  */
 template <typename TPixel>
 class UndoDelta
@@ -61,32 +65,98 @@ public:
 
   void Encode(const TPixel &value);
 
+  /** Encode a run of n voxels with the same value, same as calling Encode n times */
+  void EncodeRun(const TPixel &value, size_t n);
+
   void FinishEncoding();
 
-  size_t GetNumberOfRLEs()
-  { return m_Array.size(); }
+  /** Number of voxels encoded, i.e., the length of all the runs */
+  size_t GetEncodedLength() const
+  { return m_CurrentOffset; }
+
+  /** Number of spans of non-zero values. The delta must not be compressed. */
+  size_t GetNumberOfSpans() const
+  { return m_NumberOfSpans; }
+
+  /** Position of the first voxel of a span, in raster order in the region */
+  size_t GetSpanOffset(size_t i) const
+  { assert(!IsCompressed()); return (size_t) m_Spans[i].Offset; }
+
+  /** Number of voxels in a span */
+  size_t GetSpanLength(size_t i) const
+  { assert(!IsCompressed()); return m_Spans[i].Length; }
+
+  /** Value of the voxels in a span (never zero) */
+  TPixel GetSpanValue(size_t i) const
+  { assert(!IsCompressed()); return m_Spans[i].Value; }
+
+  /** Compress the spans with zlib. They can not be accessed until the delta
+   * is decompressed. Does nothing if compression does not save memory. */
+  void Compress();
+
+  /** Decompress the spans */
+  void Decompress();
 
-  TPixel GetRLEValue(size_t i)
-  { return m_Array[i].second; }
+  bool IsCompressed() const
+  { return m_Compressed.size() > 0; }
 
-  size_t GetRLELength(size_t i)
-  { return m_Array[i].first; }
+  /** Approximate amount of memory used by the delta, in bytes */
+  size_t GetMemorySize() const;
 
   unsigned long GetUniqueID() const
   { return m_UniqueID; }
 
+  /** Modification times of the image just before and just after the edit
+   * recorded in the delta was made. The owner of the image uses them to tell
+   * whether the delta accounts for every change since it last looked. Zero
+   * if unknown. */
+  void SetImageTimeStamps(itk::ModifiedTimeType before, itk::ModifiedTimeType after)
+  { m_ImageTimeBeforeEdit = before; m_ImageTimeAfterEdit = after; }
+
+  itk::ModifiedTimeType GetImageTimeBeforeEdit() const
+  { return m_ImageTimeBeforeEdit; }
+
+  itk::ModifiedTimeType GetImageTimeAfterEdit() const
+  { return m_ImageTimeAfterEdit; }
+
   UndoDelta & operator = (const UndoDelta &other);
 
 protected:
-  typedef std::pair<size_t, TPixel> RLEPair;
-  typedef std::vector<RLEPair> RLEArray;
-  RLEArray m_Array;
+
+  // A run of voxels with the same non-zero value. For 16-bit pixels, a span
+  // takes 16 bytes.
+  struct Span
+  {
+    unsigned long long Offset;
+    unsigned int Length;
+    TPixel Value;
+  };
+
+  typedef std::vector<Span> SpanArray;
+  SpanArray m_Spans;
+  size_t m_NumberOfSpans;
+
+  // Bytes taken by the fields of a span, without padding
+  static const size_t PackedSpanSize =
+      sizeof(unsigned long long) + sizeof(unsigned int) + sizeof(TPixel);
+
+  // Compressed contents of m_Spans, serialized field by field
+  std::vector<unsigned char> m_Compressed;
+
+  // State of the encoder: the current run and its offset
+  size_t m_CurrentOffset;
   size_t m_CurrentLength;
   TPixel m_LastValue;
 
+  // Store the current run as a span if its value is not zero
+  void FlushRun();
+
   // The delta is associated with an image region
   RegionType m_Region;
 
+  // Modification times of the image around the edit
+  itk::ModifiedTimeType m_ImageTimeBeforeEdit, m_ImageTimeAfterEdit;
+
   // Each delta is assigned a unique ID at creation
   unsigned long m_UniqueID;
   static unsigned long m_UniqueIDCounter;
@@ -122,19 +192,27 @@ public:
   public:
     Commit(const DList &list, const char *name);
     void DeleteDeltas();
-    size_t GetNumberOfRLEs() const;
+    size_t GetNumberOfSpans() const;
+    size_t GetMemorySize() const;
+    void Compress();
+    void Decompress();
     const DList &GetDeltas() const { return m_Deltas; }
   protected:
     DList m_Deltas;
     std::string m_Name;
   };
 
-  UndoDataManager(size_t nMinCommits, size_t nMaxTotalSize);
+  /**
+   * Create the undo manager. The oldest commits are deleted when the memory
+   * used by all commits exceeds nMaxTotalBytes, but the nMinCommits most
+   * recent commits are always kept.
+   */
+  UndoDataManager(size_t nMinCommits, size_t nMaxTotalBytes);
 
   /** Add a delta to the staging list. The staging list must be committed */
   void AddDeltaToStaging(Delta *delta);
 
-  /** Commit the deltas in the staging list - returns total number of RLEs updated */
+  /** Commit the deltas in the staging list - returns total number of spans updated */
   int CommitStaging(const char *text);
 
   /** Clear the undo stack (removes all commits) */
@@ -149,8 +227,29 @@ public:
   size_t GetNumberOfCommits()
     { return m_CommitList.size(); }
 
+  /** Memory used by all the commits, in bytes */
+  size_t GetTotalMemorySize() const;
+
+  /** Set the memory budget for the commits, in bytes */
+  void SetMaxTotalBytes(size_t nBytes)
+    { m_MaxTotalBytes = nBytes; }
+
+  size_t GetMaxTotalBytes() const
+    { return m_MaxTotalBytes; }
+
+  /**
+   * Set how many commits on either side of the current position are kept
+   * uncompressed (default 2). Commits further away from the current position
+   * are unlikely to be needed soon and are compressed.
+   */
+  void SetNumberOfUncompressedCommits(size_t n)
+    { m_NumberOfUncompressedCommits = n; }
+
 private:
 
+  // Compress the commits far from the current position
+  void CompressColdCommits();
+
   // Current staging list - where deltas are added
   DList m_StagingList;
 
@@ -162,7 +261,7 @@ private:
   // A list of commits
   CList m_CommitList;
   CIterator m_Position;
-  size_t m_TotalSize, m_MinCommits, m_MaxTotalSize;
+  size_t m_MinCommits, m_MaxTotalBytes, m_NumberOfUncompressedCommits;
 };
 
 #endif // __UndoDataManager_h_
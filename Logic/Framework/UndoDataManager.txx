@@ -33,13 +33,22 @@
 
 =========================================================================*/
 
+#include "itk_zlib.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
 template<typename TPixel> unsigned long UndoDelta<TPixel>::m_UniqueIDCounter = 0;
 
 template<typename TPixel>
 UndoDelta<TPixel>
 ::UndoDelta()
 {
+  m_CurrentOffset = 0;
   m_CurrentLength = 0;
+  m_NumberOfSpans = 0;
+  m_LastValue = TPixel(0);
+  m_ImageTimeBeforeEdit = m_ImageTimeAfterEdit = 0;
   m_UniqueID = m_UniqueIDCounter++;
 }
 
@@ -48,30 +57,150 @@ void
 UndoDelta<TPixel>
 ::Encode(const TPixel &value)
 {
-  if(m_CurrentLength == 0)
+  if(m_CurrentLength > 0 && value == m_LastValue)
     {
-    m_LastValue = value;
+    m_CurrentLength++;
+    }
+  else
+    {
+    this->FlushRun();
     m_CurrentLength = 1;
+    m_LastValue = value;
     }
-  else if(value == m_LastValue)
+}
+
+template<typename TPixel>
+void
+UndoDelta<TPixel>
+::EncodeRun(const TPixel &value, size_t n)
+{
+  if(n == 0)
+    return;
+
+  if(m_CurrentLength > 0 && value == m_LastValue)
     {
-    m_CurrentLength++;
+    m_CurrentLength += n;
     }
   else
     {
-    m_Array.push_back(std::make_pair(m_CurrentLength, m_LastValue));
-    m_CurrentLength = 1;
+    this->FlushRun();
+    m_CurrentLength = n;
     m_LastValue = value;
     }
 }
 
+template<typename TPixel>
+void
+UndoDelta<TPixel>
+::FlushRun()
+{
+  // Unchanged voxels are not stored, they only advance the offset
+  if(m_CurrentLength > 0 && m_LastValue != TPixel(0))
+    {
+    // Very long runs are split to fit the length field of the span
+    for(size_t done = 0; done < m_CurrentLength; )
+      {
+      Span span;
+      span.Offset = m_CurrentOffset + done;
+      span.Length = (unsigned int) std::min(m_CurrentLength - done, (size_t) UINT_MAX);
+      span.Value = m_LastValue;
+      m_Spans.push_back(span);
+      done += span.Length;
+      }
+    m_NumberOfSpans = m_Spans.size();
+    }
+
+  m_CurrentOffset += m_CurrentLength;
+  m_CurrentLength = 0;
+}
+
 template<typename TPixel>
 void
 UndoDelta<TPixel>
 ::FinishEncoding()
 {
-  if(m_CurrentLength > 0)
-    m_Array.push_back(std::make_pair(m_CurrentLength, m_LastValue));
+  this->FlushRun();
+
+  // Release the memory reserved for further spans
+  SpanArray(m_Spans).swap(m_Spans);
+}
+
+template<typename TPixel>
+void
+UndoDelta<TPixel>
+::Compress()
+{
+  if(this->IsCompressed() || m_Spans.empty())
+    return;
+
+  // The fields of the spans are copied out one by one, so that the padding
+  // of the Span struct is not compressed. All the offsets come first, then
+  // the lengths and the values, which suits zlib better than interleaving.
+  size_t n = m_Spans.size();
+  std::vector<unsigned char> packed(n * PackedSpanSize);
+  unsigned char *pOffset = &packed[0];
+  unsigned char *pLength = pOffset + n * sizeof(m_Spans[0].Offset);
+  unsigned char *pValue = pLength + n * sizeof(m_Spans[0].Length);
+  for(size_t i = 0; i < n; i++)
+    {
+    memcpy(pOffset + i * sizeof(m_Spans[i].Offset), &m_Spans[i].Offset, sizeof(m_Spans[i].Offset));
+    memcpy(pLength + i * sizeof(m_Spans[i].Length), &m_Spans[i].Length, sizeof(m_Spans[i].Length));
+    memcpy(pValue + i * sizeof(m_Spans[i].Value), &m_Spans[i].Value, sizeof(m_Spans[i].Value));
+    }
+
+  uLong nBytes = (uLong) packed.size();
+  uLongf nCompressed = compressBound(nBytes);
+  std::vector<unsigned char> buffer(nCompressed);
+  int rc = compress2(&buffer[0], &nCompressed, &packed[0], nBytes, 1);
+
+  // Keep the spans as they are if compression fails or does not pay off
+  if(rc != Z_OK || nCompressed >= nBytes)
+    return;
+
+  buffer.resize(nCompressed);
+  std::vector<unsigned char>(buffer).swap(m_Compressed);
+  SpanArray().swap(m_Spans);
+}
+
+template<typename TPixel>
+void
+UndoDelta<TPixel>
+::Decompress()
+{
+  if(!this->IsCompressed())
+    return;
+
+  size_t n = m_NumberOfSpans;
+  std::vector<unsigned char> packed(n * PackedSpanSize);
+  uLongf nBytes = (uLongf) packed.size();
+  int rc = uncompress(&packed[0], &nBytes,
+                      &m_Compressed[0], (uLong) m_Compressed.size());
+  assert(rc == Z_OK && nBytes == packed.size());
+  (void) rc;
+
+  // Copy the fields back in the order used by Compress()
+  m_Spans.resize(n);
+  const unsigned char *pOffset = &packed[0];
+  const unsigned char *pLength = pOffset + n * sizeof(m_Spans[0].Offset);
+  const unsigned char *pValue = pLength + n * sizeof(m_Spans[0].Length);
+  for(size_t i = 0; i < n; i++)
+    {
+    memcpy(&m_Spans[i].Offset, pOffset + i * sizeof(m_Spans[i].Offset), sizeof(m_Spans[i].Offset));
+    memcpy(&m_Spans[i].Length, pLength + i * sizeof(m_Spans[i].Length), sizeof(m_Spans[i].Length));
+    memcpy(&m_Spans[i].Value, pValue + i * sizeof(m_Spans[i].Value), sizeof(m_Spans[i].Value));
+    }
+
+  std::vector<unsigned char>().swap(m_Compressed);
+}
+
+template<typename TPixel>
+size_t
+UndoDelta<TPixel>
+::GetMemorySize() const
+{
+  return sizeof(*this)
+      + m_Spans.capacity() * sizeof(Span)
+      + m_Compressed.capacity();
 }
 
 template<typename TPixel>
@@ -79,21 +208,26 @@ UndoDelta<TPixel> &
 UndoDelta<TPixel>
 ::operator = (const UndoDelta<TPixel> &other)
 {
-  m_Array = other.m_Array;
+  m_Spans = other.m_Spans;
+  m_NumberOfSpans = other.m_NumberOfSpans;
+  m_Compressed = other.m_Compressed;
+  m_CurrentOffset = other.m_CurrentOffset;
   m_CurrentLength = other.m_CurrentLength;
   m_LastValue = other.m_LastValue;
   m_Region = other.m_Region;
+  m_ImageTimeBeforeEdit = other.m_ImageTimeBeforeEdit;
+  m_ImageTimeAfterEdit = other.m_ImageTimeAfterEdit;
   return *this;
 }
 
 
 template<typename TPixel>
 UndoDataManager<TPixel>
-::UndoDataManager(size_t nMinCommits, size_t nMaxTotalSize)
+::UndoDataManager(size_t nMinCommits, size_t nMaxTotalBytes)
 {
   this->m_MinCommits = nMinCommits;
-  this->m_MaxTotalSize = nMaxTotalSize;
-  this->m_TotalSize = 0;
+  this->m_MaxTotalBytes = nMaxTotalBytes;
+  this->m_NumberOfUncompressedCommits = 2;
   m_Position = m_CommitList.begin();
 }
 
@@ -110,7 +244,6 @@ UndoDataManager<TPixel>
     m_Position->DeleteDeltas();
     m_Position = m_CommitList.erase(m_Position);
     }
-  m_TotalSize = 0;
 
   // Clear the staging list
   m_StagingList.clear();
@@ -135,7 +268,6 @@ UndoDataManager<TPixel>
   // to the end. So that's the loop that we do
   while(m_Position != m_CommitList.end())
     {
-    m_TotalSize -= m_Position->GetNumberOfRLEs();
     m_Position->DeleteDeltas();
     m_Position = m_CommitList.erase(m_Position);
     }
@@ -146,21 +278,25 @@ UndoDataManager<TPixel>
   // Empty the staging list
   m_StagingList.clear();
 
-  // Get the number of RLEs being added
-  size_t n_new_rles = new_commit.GetNumberOfRLEs();
+  // Get the number of spans being added
+  size_t n_new_spans = new_commit.GetNumberOfSpans();
 
-  // If there are no new rles, the just bail out
-  if(n_new_rles == 0)
+  // If nothing has changed, the just bail out
+  if(n_new_spans == 0)
     {
     new_commit.DeleteDeltas();
     return 0;
     }
 
-  // Check whether we need to prune from the back to keep total size under control
+  // Check whether we need to prune from the back to keep memory use under
+  // control. The commits are compressed before anything is deleted
+  this->CompressColdCommits();
+  size_t new_bytes = new_commit.GetMemorySize();
+  size_t total_bytes = this->GetTotalMemorySize();
   CIterator itHead = m_CommitList.begin();
-  while(m_CommitList.size() > m_MinCommits && m_TotalSize + n_new_rles > m_MaxTotalSize)
+  while(m_CommitList.size() > m_MinCommits && total_bytes + new_bytes > m_MaxTotalBytes)
     {
-    m_TotalSize -= itHead->GetNumberOfRLEs();
+    total_bytes -= itHead->GetMemorySize();
     itHead->DeleteDeltas();
     itHead = m_CommitList.erase(itHead);
     }
@@ -169,10 +305,43 @@ UndoDataManager<TPixel>
   // the current delta to it;
   m_CommitList.push_back(new_commit);
   m_Position = m_CommitList.end();
-  m_TotalSize += n_new_rles;
 
-  // Return the number of RLEs
-  return n_new_rles;
+  // Return the number of spans
+  return n_new_spans;
+}
+
+template<typename TPixel>
+size_t
+UndoDataManager<TPixel>
+::GetTotalMemorySize() const
+{
+  size_t n = 0;
+  for(CConstIterator it = m_CommitList.begin(); it != m_CommitList.end(); ++it)
+    n += it->GetMemorySize();
+  return n;
+}
+
+template<typename TPixel>
+void
+UndoDataManager<TPixel>
+::CompressColdCommits()
+{
+  // Distance of each commit from the current position, counted in the
+  // direction in which it would be reached by undo or redo
+  size_t k = 0;
+  for(CIterator it = m_Position; it != m_CommitList.begin(); )
+    {
+    --it;
+    if(++k > m_NumberOfUncompressedCommits)
+      it->Compress();
+    }
+
+  k = 0;
+  for(CIterator it = m_Position; it != m_CommitList.end(); ++it)
+    {
+    if(++k > m_NumberOfUncompressedCommits)
+      it->Compress();
+    }
 }
 
 template<typename TPixel>
@@ -194,7 +363,9 @@ UndoDataManager<TPixel>
   // Move the position one delta to the beginning
   m_Position--;
 
-  // Return the current delta
+  // Return the current delta, ready for use
+  m_Position->Decompress();
+  this->CompressColdCommits();
   return *m_Position;
 }
 
@@ -214,11 +385,13 @@ UndoDataManager<TPixel>
   // Can't be at the beginning
   assert(IsRedoPossible());
 
-  // Return the delta at the current position
-  const Commit &commit = *m_Position;
+  // Return the delta at the current position, ready for use
+  Commit &commit = *m_Position;
+  commit.Decompress();
 
   // Move the position one delta to the end
   m_Position++;
+  this->CompressColdCommits();
 
   // Return the current delta
   return commit;
@@ -248,18 +421,46 @@ UndoDataManager<TPixel>::Commit::DeleteDeltas()
     }
 }
 
+template<typename TPixel>
+void
+UndoDataManager<TPixel>::Commit::Compress()
+{
+  for(DIterator dit = m_Deltas.begin(); dit != m_Deltas.end(); ++dit)
+    if(*dit)
+      (*dit)->Compress();
+}
 
+template<typename TPixel>
+void
+UndoDataManager<TPixel>::Commit::Decompress()
+{
+  for(DIterator dit = m_Deltas.begin(); dit != m_Deltas.end(); ++dit)
+    if(*dit)
+      (*dit)->Decompress();
+}
 
+template<typename TPixel>
+size_t
+UndoDataManager<TPixel>::Commit::GetNumberOfSpans() const
+{
+  size_t n = 0;
+  for(DConstIterator dit = m_Deltas.begin(); dit != m_Deltas.end(); ++dit)
+    {
+    if(*dit)
+      n += (*dit)->GetNumberOfSpans();
+    }
+  return n;
+}
 
 template<typename TPixel>
 size_t
-UndoDataManager<TPixel>::Commit::GetNumberOfRLEs() const
+UndoDataManager<TPixel>::Commit::GetMemorySize() const
 {
   size_t n = 0;
   for(DConstIterator dit = m_Deltas.begin(); dit != m_Deltas.end(); ++dit)
     {
     if(*dit)
-      n += (*dit)->GetNumberOfRLEs();
+      n += (*dit)->GetMemorySize();
     }
   return n;
 }
@@ -0,0 +1,100 @@
+#include "DerivedQuantityCache.h"
+#include "itkMutexLockHolder.h"
+
+DerivedQuantityCache &
+DerivedQuantityCache::GetInstance()
+{
+  // Never destroyed, so that wrappers with static storage can be released
+  static DerivedQuantityCache *instance = new DerivedQuantityCache();
+  return *instance;
+}
+
+DerivedQuantityCache::DerivedQuantityCache()
+{
+  // Enough for the derived quantities of a few typical multi-channel images
+  m_MemoryBudget = 512 * 1024 * 1024;
+  m_MemoryInUse = 0;
+}
+
+void
+DerivedQuantityCache::SetMemoryBudget(std::size_t bytes)
+{
+  std::list<Entry> released;
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_Mutex);
+    m_MemoryBudget = bytes;
+    TrimToBudget(released);
+
+    // Unlike in Touch(), the most recent buffer may not fit either
+    if(!m_Entries.empty() && m_Entries.front().Bytes > m_MemoryBudget)
+      {
+      m_MemoryInUse -= m_Entries.front().Bytes;
+      released.splice(released.end(), m_Entries, m_Entries.begin());
+      }
+    }
+  Release(released);
+}
+
+void
+DerivedQuantityCache::Touch(void *client, std::size_t bytes, ReleaseCallback callback)
+{
+  std::list<Entry> released;
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_Mutex);
+    std::list<Entry>::iterator it = m_Entries.begin();
+    while(it != m_Entries.end() && it->Client != client)
+      ++it;
+
+    if(it == m_Entries.begin() && it != m_Entries.end() && it->Bytes == bytes)
+      return;
+
+    if(it != m_Entries.end())
+      {
+      m_MemoryInUse -= it->Bytes;
+      m_Entries.erase(it);
+      }
+
+    Entry entry;
+    entry.Client = client;
+    entry.Bytes = bytes;
+    entry.Callback = callback;
+    m_Entries.push_front(entry);
+    m_MemoryInUse += bytes;
+
+    TrimToBudget(released);
+    }
+  Release(released);
+}
+
+void
+DerivedQuantityCache::Remove(void *client)
+{
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_Mutex);
+  for(std::list<Entry>::iterator it = m_Entries.begin(); it != m_Entries.end(); ++it)
+    {
+    if(it->Client == client)
+      {
+      m_MemoryInUse -= it->Bytes;
+      m_Entries.erase(it);
+      return;
+      }
+    }
+}
+
+void
+DerivedQuantityCache::TrimToBudget(std::list<Entry> &released)
+{
+  while(m_MemoryInUse > m_MemoryBudget && m_Entries.size() > 1)
+    {
+    std::list<Entry>::iterator last = --m_Entries.end();
+    m_MemoryInUse -= last->Bytes;
+    released.splice(released.end(), m_Entries, last);
+    }
+}
+
+void
+DerivedQuantityCache::Release(const std::list<Entry> &released)
+{
+  for(std::list<Entry>::const_iterator it = released.begin(); it != released.end(); ++it)
+    it->Callback(it->Client);
+}
@@ -0,0 +1,74 @@
+#ifndef DERIVEDQUANTITYCACHE_H
+#define DERIVEDQUANTITYCACHE_H
+
+#include <cstddef>
+#include <list>
+#include "itkSimpleFastMutexLock.h"
+
+/**
+  Bookkeeping for the derived quantities (magnitude, maximum, mean) of
+  multi-component images that have been materialized into scalar buffers.
+
+  All materialized buffers share one memory budget. Each buffer is registered
+  under a client pointer, together with a callback that makes the client
+  release it. When a buffer is registered and the budget is exceeded, the
+  buffers used least recently are released until it fits. The callbacks are
+  invoked outside of the lock, so they may call Remove().
+
+  There is one cache, shared by all images. It is thread safe.
+  */
+class DerivedQuantityCache
+{
+public:
+  typedef void (*ReleaseCallback)(void *client);
+
+  /** The cache shared by all images */
+  static DerivedQuantityCache &GetInstance();
+
+  /** Set the memory budget in bytes. Releases buffers that no longer fit. */
+  void SetMemoryBudget(std::size_t bytes);
+  std::size_t GetMemoryBudget() const { return m_MemoryBudget; }
+
+  /** Bytes held by the registered buffers */
+  std::size_t GetMemoryInUse() const { return m_MemoryInUse; }
+
+  /** Whether a buffer of this size can be kept at all */
+  bool Fits(std::size_t bytes) const { return bytes <= m_MemoryBudget; }
+
+  /**
+    Register the buffer of a client, or mark it as just used if it is already
+    registered. Buffers of other clients may be released to stay in budget.
+    */
+  void Touch(void *client, std::size_t bytes, ReleaseCallback callback);
+
+  /** Forget the buffer of a client, which has released it on its own */
+  void Remove(void *client);
+
+protected:
+  DerivedQuantityCache();
+
+  struct Entry
+  {
+    void *Client;
+    std::size_t Bytes;
+    ReleaseCallback Callback;
+  };
+
+  // Remove least recently used entries until the budget is met, keeping the
+  // most recent one. Called with the lock held.
+  void TrimToBudget(std::list<Entry> &released);
+
+  // Invoke the callbacks of released entries (without the lock)
+  static void Release(const std::list<Entry> &released);
+
+  // Entries in order of use, the most recent first
+  std::list<Entry> m_Entries;
+  std::size_t m_MemoryBudget, m_MemoryInUse;
+  itk::SimpleFastMutexLock m_Mutex;
+
+private:
+  DerivedQuantityCache(const DerivedQuantityCache &);   //purposely not implemented
+  void operator=(const DerivedQuantityCache &);   //purposely not implemented
+};
+
+#endif // DERIVEDQUANTITYCACHE_H
@@ -0,0 +1,211 @@
+#include "DicomDirectoryIndex.h"
+#include "itksys/SystemTools.hxx"
+#include "itksys/Directory.hxx"
+#include "itksys/MD5.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+std::string DicomDirectoryIndex::m_IndexDirectory;
+
+// First line of an index file. Bump the version when the fields change
+static const char *DicomIndexHeader = "ITK-SNAP DICOM Index 2";
+
+void
+DicomDirectoryIndex::SetIndexDirectory(const std::string &dir)
+{
+  m_IndexDirectory = dir;
+}
+
+std::string
+DicomDirectoryIndex::GetIndexDirectory()
+{
+  return m_IndexDirectory;
+}
+
+std::string
+DicomDirectoryIndex::GetIndexFileName(const std::string &dir)
+{
+  // Name the file after the hash of the full path of the directory
+  std::string path = itksys::SystemTools::CollapseFullPath(dir.c_str());
+  char hex_code[33];
+  hex_code[32] = 0;
+  itksysMD5 *md5 = itksysMD5_New();
+  itksysMD5_Initialize(md5);
+  itksysMD5_Append(md5, (unsigned char *) path.c_str(), path.length());
+  itksysMD5_FinalizeHex(md5, hex_code);
+  itksysMD5_Delete(md5);
+
+  return m_IndexDirectory + "/" + hex_code + ".txt";
+}
+
+// Fields are separated by tabs, one file per line
+static std::string CleanIndexField(const std::string &s)
+{
+  std::string out = s;
+  for(size_t i = 0; i < out.length(); i++)
+    if(out[i] == '\t' || out[i] == '\n' || out[i] == '\r')
+      out[i] = ' ';
+  return out;
+}
+
+bool
+DicomDirectoryIndex::Load(const std::string &dir)
+{
+  m_Entries.clear();
+  if(m_IndexDirectory.empty())
+    return false;
+
+  std::ifstream ifs(GetIndexFileName(dir).c_str());
+  if(!ifs.good())
+    return false;
+
+  // The header names the directory, in case two paths hash the same
+  std::string line;
+  std::string path = itksys::SystemTools::CollapseFullPath(dir.c_str());
+  if(!std::getline(ifs, line) || line != std::string(DicomIndexHeader) + "\t" + path)
+    return false;
+
+  std::vector<std::string> f;
+  while(std::getline(ifs, line))
+    {
+    f.clear();
+    std::istringstream iss(line);
+    std::string field;
+    while(std::getline(iss, field, '\t'))
+      f.push_back(field);
+
+    // The last field may be empty, which getline does not report
+    if(f.size() == 10)
+      f.push_back(std::string());
+    if(f.size() != 11)
+      continue;
+
+    Entry &e = m_Entries[f[0]];
+    e.ModifiedTime = strtoll(f[1].c_str(), NULL, 10);
+    e.FileSize = strtoull(f[2].c_str(), NULL, 10);
+    e.IsDicom = (f[3] == "1");
+    e.SeriesId = f[4];
+    e.SeriesDescription = f[5];
+    e.SeriesNumber = f[6];
+    e.Rows = atoi(f[7].c_str());
+    e.Columns = atoi(f[8].c_str());
+    e.Position = f[9];
+    e.Orientation = f[10];
+    }
+
+  return true;
+}
+
+bool
+DicomDirectoryIndex::Save(const std::string &dir)
+{
+  if(m_IndexDirectory.empty()
+     || !itksys::SystemTools::MakeDirectory(m_IndexDirectory.c_str()))
+    return false;
+
+  // Write a new file and move it over the old one, so that a reader never
+  // sees a partial index
+  std::string fn = GetIndexFileName(dir), fn_tmp = fn + ".tmp";
+  std::ofstream ofs(fn_tmp.c_str());
+  if(!ofs.good())
+    return false;
+
+  ofs << DicomIndexHeader << "\t"
+      << itksys::SystemTools::CollapseFullPath(dir.c_str()) << "\n";
+
+  for(EntryMap::const_iterator it = m_Entries.begin(); it != m_Entries.end(); ++it)
+    {
+    const Entry &e = it->second;
+    ofs << CleanIndexField(it->first) << "\t"
+        << e.ModifiedTime << "\t" << e.FileSize << "\t" << (e.IsDicom ? 1 : 0) << "\t"
+        << CleanIndexField(e.SeriesId) << "\t"
+        << CleanIndexField(e.SeriesDescription) << "\t"
+        << CleanIndexField(e.SeriesNumber) << "\t"
+        << e.Rows << "\t" << e.Columns << "\t"
+        << CleanIndexField(e.Position) << "\t"
+        << CleanIndexField(e.Orientation) << "\n";
+    }
+
+  ofs.close();
+  if(!ofs)
+    {
+    itksys::SystemTools::RemoveFile(fn_tmp.c_str());
+    return false;
+    }
+
+  itksys::SystemTools::RemoveFile(fn.c_str());
+  if(!itksys::SystemTools::RenameFile(fn_tmp.c_str(), fn.c_str()))
+    return false;
+
+  PruneIndexFiles();
+  return true;
+}
+
+void
+DicomDirectoryIndex::PruneIndexFiles()
+{
+  itksys::Directory dir;
+  if(!dir.Load(m_IndexDirectory.c_str()))
+    return;
+
+  // List the index files by the time they were saved
+  std::vector<std::pair<long, std::string> > files;
+  for(unsigned long i = 0; i < dir.GetNumberOfFiles(); i++)
+    {
+    std::string fn = m_IndexDirectory + "/" + dir.GetFile(i);
+    if(itksys::SystemTools::GetFilenameLastExtension(fn) == ".txt"
+       && !itksys::SystemTools::FileIsDirectory(fn.c_str()))
+      files.push_back(std::make_pair(itksys::SystemTools::ModifiedTime(fn.c_str()), fn));
+    }
+
+  if(files.size() <= MaximumIndexFiles)
+    return;
+
+  std::sort(files.begin(), files.end());
+  for(size_t i = 0; i < files.size() - MaximumIndexFiles; i++)
+    itksys::SystemTools::RemoveFile(files[i].second.c_str());
+}
+
+bool
+DicomDirectoryIndex::GetFileStamp(const std::string &file, long long &mtime, unsigned long long &size)
+{
+#ifdef WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attr;
+  if(!GetFileAttributesExA(file.c_str(), GetFileExInfoStandard, &attr))
+    return false;
+  mtime = ((long long) attr.ftLastWriteTime.dwHighDateTime << 32)
+      | attr.ftLastWriteTime.dwLowDateTime;
+  size = ((unsigned long long) attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+#else
+  struct stat st;
+  if(stat(file.c_str(), &st) != 0)
+    return false;
+#ifdef __APPLE__
+  mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+  size = (unsigned long long) st.st_size;
+#endif
+  return true;
+}
+
+const DicomDirectoryIndex::Entry *
+DicomDirectoryIndex::Find(const std::string &file, long long mtime, unsigned long long size) const
+{
+  EntryMap::const_iterator it = m_Entries.find(file);
+  if(it == m_Entries.end()
+     || it->second.ModifiedTime != mtime || it->second.FileSize != size)
+    return NULL;
+  return &it->second;
+}
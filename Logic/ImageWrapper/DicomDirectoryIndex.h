@@ -0,0 +1,87 @@
+#ifndef DICOMDIRECTORYINDEX_H
+#define DICOMDIRECTORYINDEX_H
+
+#include <map>
+#include <string>
+
+/**
+  The header fields of the files in a DICOM directory that are needed to
+  group the files into series and to order the slices of a series. Entries
+  are keyed on the filename, and remember the modification time and size of
+  the file, so that files that have not changed since they were scanned need
+  not be opened again. The modification time is taken at the resolution of
+  the file system (see GetFileStamp), so that a file rewritten within the
+  same second with the same size is still read again.
+
+  The index of each directory is stored in its own file in a common index
+  directory, normally in the user's application data directory. If no index
+  directory is set, indices are not stored. The directory holds the indices
+  of at most MaximumIndexFiles directories; when an index is saved, those
+  that were saved least recently are removed beyond that number.
+  */
+class DicomDirectoryIndex
+{
+public:
+  struct Entry
+  {
+    // Modification time and size of the file when it was scanned
+    long long ModifiedTime;
+    unsigned long long FileSize;
+
+    // Whether the file could be read as DICOM. Other fields are empty if not
+    bool IsDicom;
+
+    // Series id formed from the series UID and the tags that refine it
+    std::string SeriesId;
+
+    std::string SeriesDescription, SeriesNumber;
+    int Rows, Columns;
+
+    // Image position and orientation (patient), as stored in the header
+    std::string Position, Orientation;
+
+    Entry() : ModifiedTime(0), FileSize(0), IsDicom(false), Rows(0), Columns(0) {}
+  };
+
+  typedef std::map<std::string, Entry> EntryMap;
+
+  /** Number of directories whose indices are kept */
+  static const unsigned int MaximumIndexFiles = 100;
+
+  /** Set the directory where the indices of the directories are stored */
+  static void SetIndexDirectory(const std::string &dir);
+  static std::string GetIndexDirectory();
+
+  /** Load the stored index of a directory. Returns false if there is none */
+  bool Load(const std::string &dir);
+
+  /** Store the index of a directory, replacing the stored one */
+  bool Save(const std::string &dir);
+
+  /** Find the entry of a file, if it is still current */
+  const Entry *Find(const std::string &file, long long mtime, unsigned long long size) const;
+
+  /**
+    Get the modification time and size of a file. The time is in the finest
+    units the platform reports (nanoseconds on POSIX systems, 100ns intervals
+    on Windows), and is only meant to be compared with other values returned
+    by this method. Returns false if the file can not be accessed.
+    */
+  static bool GetFileStamp(const std::string &file, long long &mtime, unsigned long long &size);
+
+  /** The entries, keyed on filename */
+  EntryMap &GetEntries() { return m_Entries; }
+
+protected:
+  // Name of the file holding the index of a directory
+  static std::string GetIndexFileName(const std::string &dir);
+
+  // Remove the indices saved least recently, beyond MaximumIndexFiles
+  static void PruneIndexFiles();
+
+  EntryMap m_Entries;
+
+  static std::string m_IndexDirectory;
+};
+
+#endif // DICOMDIRECTORYINDEX_H
@@ -68,8 +68,15 @@
 #include "ExtendedGDCMSerieHelper.h"
 #include "itkComposeImageFilter.h"
 #include "itkStreamingImageFilter.h"
+#include "itkByteSwapper.h"
+#include "itksys/SystemTools.hxx"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
 
 #include <itk_zlib.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 
 using namespace std;
@@ -297,6 +304,17 @@ GuidedNativeImageIO
   m_NativeFileName = "";
   m_NativeByteOrder = itk::ImageIOBase::OrderNotApplicable;
   m_NativeSizeInBytes = 0;
+
+  m_NativeImageStreamed = false;
+  m_StreamingThreshold = 1ul << 30;
+  m_StreamingSlabSize = 64ul << 20;
+
+  m_NativeImageMapped = false;
+  m_MappingThreshold = 1ul << 30;
+  m_MappedDataOffset = 0;
+
+  m_ReadProgress = 0.0;
+  m_ReadProgressCommand = NULL;
 }
 
 GuidedNativeImageIO::FileFormat 
@@ -442,6 +460,10 @@ GuidedNativeImageIO
   // Save the hints
   m_Hints = folder;
 
+  // The IO base of a previously streamed image is about to be replaced
+  m_NativeImageStreamed = false;
+  m_NativeImageMapped = false;
+
   // Create the header corresponding to the current image type
   CreateImageIO(FileName, m_Hints, true);
   if(!m_IOBase)
@@ -488,12 +510,19 @@ GuidedNativeImageIO
                           "Directory '%s' does not appear to contain a "
                           "series of DICOM images.",FileName);
 
-    // Following this quick parsing of the directory, we need to actually
-    // load the image data and sort it in a meaningful order. This is too
-    // complicated to replicate here so we revert to gdcm::SerieHelper, but
-    // we only have it parse the filenames for the current SeriesId
-    ExtendedGDCMSerieHelper helper;
-    helper.SetFilesAndOrder(m_DICOMFiles, m_DICOMImagesPerIPP);
+    // Following this quick parsing of the directory, we need to sort the
+    // files in a meaningful order. Normally the positions read during the
+    // parse are enough. Otherwise we revert to gdcm::SerieHelper, but we
+    // only have it parse the filenames for the current SeriesId
+    const DicomDirectoryParseResult::DicomSeriesInfo &series_info =
+        m_LastDicomParseResult.SeriesMap[SeriesID];
+    if(!ExtendedGDCMSerieHelper::OrderByPosition(
+         m_DICOMFiles, series_info.PositionList, series_info.OrientationList,
+         m_DICOMImagesPerIPP))
+      {
+      ExtendedGDCMSerieHelper helper;
+      helper.SetFilesAndOrder(m_DICOMFiles, m_DICOMImagesPerIPP);
+      }
 
     m_IOBase->SetFileName(m_DICOMFiles[0]);
     m_IOBase->ReadImageInformation();
@@ -564,14 +593,159 @@ GuidedNativeImageIO
 
 void
 GuidedNativeImageIO
-::ReadNativeImageData()
+::ReadNativeImageData(itk::Command *progressCommand)
 {
+  m_ReadProgress = 0.0;
+  m_ReadProgressCommand = progressCommand;
+
+  // Large images are mapped into memory if their data can be used in place.
+  // Otherwise, they are not read here, but slab by slab when they are cast
+  m_NativeImageMapped = this->MapNativeImageFile();
+  m_NativeImageStreamed = !m_NativeImageMapped && this->CanStreamNativeImage();
+
   // Based on the component type, read image in native mode
   DispatchBase *dispatch = this->CreateDispatch(m_IOBase->GetComponentType());
   dispatch->ReadNative(this, m_NativeFileName.c_str(), m_Hints);
   delete dispatch;
 
-  // Get rid of the IOBase, it may store useless data (in case of NIFTI)
+  // The pixel container of the native image now holds on to the mapping
+  m_MappedFile = NULL;
+  m_ReadProgressCommand = NULL;
+  m_ReadProgress = 1.0;
+
+  // Get rid of the IOBase, it may store useless data (in case of NIFTI). A
+  // streamed image still needs it to read the slabs
+  if(!m_NativeImageStreamed)
+    m_IOBase = NULL;
+}
+
+bool
+GuidedNativeImageIO
+::CanStreamNativeImage() const
+{
+  // DICOM series are assembled from many files and 4D images are transposed
+  // in memory, so only plain 3D images can be streamed
+  return m_StreamingThreshold > 0
+      && m_IOBase->GetImageSizeInBytes() > m_StreamingThreshold
+      && m_FileFormat != FORMAT_DICOM_DIR
+      && m_IOBase->GetNumberOfDimensions() == 3
+      && m_IOBase->CanStreamRead();
+}
+
+unsigned int
+GuidedNativeImageIO
+::GetNativeSlabThickness() const
+{
+  size_t bytes_per_slice = (size_t) m_NativeDimensions[0] * m_NativeDimensions[1]
+      * m_NativeComponents * m_IOBase->GetComponentSize();
+  size_t nz = m_StreamingSlabSize / std::max(bytes_per_slice, (size_t) 1);
+  return (unsigned int) std::max(std::min(nz, (size_t) m_NativeDimensions[2]), (size_t) 1);
+}
+
+bool
+GuidedNativeImageIO
+::MapNativeImageFile()
+{
+  // Only these formats can store the voxels uncompressed at the end of a
+  // single file. 4D images are transposed in memory, so they are excluded
+  std::string io_class = m_IOBase->GetNameOfClass();
+  if(m_MappingThreshold == 0
+     || m_FileFormat == FORMAT_DICOM_DIR
+     || (io_class != "NiftiImageIO" && io_class != "MetaImageIO" && io_class != "RawImageIO")
+     || m_IOBase->GetNumberOfDimensions() != 3
+     || m_IOBase->GetImageSizeInBytes() < m_MappingThreshold
+     || !m_IOBase->CanStreamRead())
+    return false;
+
+  // NIfTI stores the components of multi-component images in separate
+  // volumes, which the ImageIO interleaves
+  if(io_class == "NiftiImageIO" && m_IOBase->GetNumberOfComponents() != 1)
+    return false;
+
+  // MetaImage data must follow the header in the same file, uncompressed
+  if(io_class == "MetaImageIO")
+    {
+    MetaImage *meta = static_cast<itk::MetaImageIO *>(m_IOBase.GetPointer())->GetMetaImagePointer();
+    if(meta->CompressedData() || strcmp(meta->ElementDataFileName(), "LOCAL"))
+      return false;
+    }
+
+  // The data must be in the byte order of this machine
+  size_t csize = m_IOBase->GetComponentSize();
+  IOBase::ByteOrder order = itk::ByteSwapper<int>::SystemIsBigEndian()
+      ? IOBase::BigEndian : IOBase::LittleEndian;
+  if(csize > 1 && m_IOBase->GetByteOrder() != order)
+    return false;
+
+  SmartPtr<MemoryMappedFile> mf = MemoryMappedFile::New();
+  size_t bytes = m_IOBase->GetImageSizeInBytes();
+  if(!mf->Map(m_NativeFileName.c_str()) || mf->GetSize() < bytes)
+    return false;
+
+  // Gzipped files (e.g., .nii.gz) must be decompressed by the ImageIO
+  const unsigned char *data = reinterpret_cast<const unsigned char *>(mf->GetData());
+  if(mf->GetSize() >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return false;
+
+  // The voxels should fill the end of the file, properly aligned
+  size_t offset = mf->GetSize() - bytes;
+  if(offset % csize)
+    return false;
+
+  // The ImageIO applies the intensity scaling declared in a NIfTI header
+  // when it reads the voxels, so the file can only be used in place if the
+  // header declares none. The header is in the byte order of this machine,
+  // as checked above. The voxels must start where the header says they do
+  if(io_class == "NiftiImageIO")
+    {
+    int hdrSize;
+    float voxOffset, sclSlope, sclInter;
+    memcpy(&hdrSize, data, sizeof(int));
+    memcpy(&voxOffset, data + 108, sizeof(float));
+    memcpy(&sclSlope, data + 112, sizeof(float));
+    memcpy(&sclInter, data + 116, sizeof(float));
+    if(hdrSize != 348 || (size_t) voxOffset != offset
+       || (sclSlope != 0.0f && (sclSlope != 1.0f || sclInter != 0.0f)))
+      return false;
+    }
+
+  m_MappedFile = mf;
+  m_MappedDataOffset = offset;
+  return true;
+}
+
+void
+GuidedNativeImageIO
+::ReadNativeImageSlab(unsigned int z0, unsigned int nz, void *buffer)
+{
+  assert(m_IOBase && z0 + nz <= m_NativeDimensions[2]);
+
+  // The slab spans whole slices, so it is contiguous in the image buffer
+  itk::ImageIORegion ioRegion(3);
+  for(unsigned int d = 0; d < 3; d++)
+    {
+    ioRegion.SetIndex(d, d < 2 ? 0 : z0);
+    ioRegion.SetSize(d, d < 2 ? m_NativeDimensions[d] : nz);
+    }
+
+  m_IOBase->SetUseStreamedReading(true);
+  m_IOBase->SetIORegion(ioRegion);
+  m_IOBase->Read(buffer);
+}
+
+void
+GuidedNativeImageIO
+::BufferStreamedNativeImage()
+{
+  if(!m_NativeImageStreamed)
+    return;
+
+  // Read the whole image the regular way
+  m_NativeImageStreamed = false;
+  DispatchBase *dispatch = this->CreateDispatch(m_NativeType);
+  dispatch->ReadNative(this, m_NativeFileName.c_str(), m_Hints);
+  delete dispatch;
+
   m_IOBase = NULL;
 }
 
@@ -584,6 +758,177 @@ GuidedNativeImageIO
 }
 
 
+// State shared by the threads decoding a DICOM series. Files are claimed one
+// at a time, in the order of the series
+template <typename TScalar>
+struct GuidedNativeImageIO::DicomDecodeData
+{
+  GuidedNativeImageIO *Self;
+
+  // Output buffer, and the number of pixels and images per slice
+  TScalar *Buffer;
+  size_t SliceSize, ImagesPerIPP;
+  unsigned int Rows, Columns;
+
+  // Metadata of the first file
+  itk::MetaDataDictionary Dictionary;
+
+  // Guarded by the mutex
+  size_t NextFile, NumberDecoded;
+  std::string Error;
+  itk::SimpleFastMutexLock Mutex;
+};
+
+template <typename TScalar>
+ITK_THREAD_RETURN_TYPE
+GuidedNativeImageIO
+::DicomDecodeThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  DicomDecodeData<TScalar> *data = static_cast<DicomDecodeData<TScalar> *>(ti->UserData);
+  GuidedNativeImageIO *self = data->Self;
+
+  // Each thread decodes its slices with its own ImageIO. The reader converts
+  // the pixels to the native type the same way as ImageSeriesReader does
+  typedef itk::Image<TScalar, 3> SliceType;
+  typedef itk::ImageFileReader<SliceType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetImageIO(itk::GDCMImageIO::New());
+
+  size_t n = self->m_DICOMFiles.size();
+  size_t k = data->ImagesPerIPP;
+  while(true)
+    {
+    // Claim the next file, unless another thread has failed
+    size_t i;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      i = data->Error.empty() ? data->NextFile++ : n;
+      }
+    if(i >= n)
+      break;
+
+    std::string error;
+    try
+      {
+      reader->SetFileName(self->m_DICOMFiles[i]);
+      reader->Update();
+
+      SliceType *slice = reader->GetOutput();
+      typename SliceType::SizeType size = slice->GetBufferedRegion().GetSize();
+      if(size[0] != data->Columns || size[1] != data->Rows || size[2] != 1)
+        throw IRISException("Error: DICOM slice size mismatch. "
+                            "File '%s' has dimensions different from the "
+                            "first file in the series.",
+                            self->m_DICOMFiles[i].c_str());
+
+      // File i goes into slice i / k. The images that share a position
+      // (e.g., echoes) become the components of the voxels in that slice
+      const TScalar *src = slice->GetBufferPointer();
+      TScalar *dst = data->Buffer + (i / k) * data->SliceSize * k + (i % k);
+      for(size_t p = 0; p < data->SliceSize; p++, dst += k)
+        *dst = src[p];
+
+      if(i == 0)
+        data->Dictionary = slice->GetMetaDataDictionary();
+      }
+    catch(itk::ExceptionObject &exc)
+      {
+      error = exc.GetDescription();
+      }
+    catch(std::exception &exc)
+      {
+      error = exc.what();
+      }
+
+    size_t n_decoded;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      if(error.size() && data->Error.empty())
+        data->Error = error;
+      n_decoded = ++data->NumberDecoded;
+      }
+
+    // Only the calling thread reports progress, since the command may update
+    // the GUI
+    if(ti->ThreadID == 0 && self->m_ReadProgressCommand)
+      {
+      self->m_ReadProgress = n_decoded * 1.0 / n;
+      self->m_ReadProgressCommand->Execute(self, itk::ProgressEvent());
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template<class TScalar>
+void
+GuidedNativeImageIO
+::DoReadDicomSeries()
+{
+  typedef itk::VectorImage<TScalar, 3> NativeImageType;
+  typedef itk::Image<TScalar, 3> GreyImageType;
+  typedef itk::ImageSeriesReader<GreyImageType> ReaderType;
+
+  // The files are already in the order of the slices. Consecutive files that
+  // share a position hold the images at that position (e.g., multi-echo)
+  size_t k = m_DICOMImagesPerIPP;
+  size_t n_slices = m_DICOMFiles.size() / k;
+
+  // The geometry is that of the volume formed by the first image at each
+  // position, as computed by the series reader without reading any pixels
+  std::vector<std::string> first_files;
+  for(size_t s = 0; s < n_slices; s++)
+    first_files.push_back(m_DICOMFiles[s * k]);
+
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileNames(first_files);
+  reader->SetImageIO(m_IOBase);
+  reader->UpdateOutputInformation();
+  GreyImageType *info = reader->GetOutput();
+
+  typename NativeImageType::Pointer image = NativeImageType::New();
+  image->CopyInformation(info);
+  image->SetRegions(info->GetLargestPossibleRegion());
+  image->SetVectorLength(k);
+  image->Allocate();
+
+  typename NativeImageType::SizeType size = image->GetBufferedRegion().GetSize();
+  if(size[2] != n_slices)
+    throw IRISException("Error: DICOM series has an unexpected number of slices "
+                        "(%d vs. %d).", (int) size[2], (int) n_slices);
+
+  DicomDecodeData<TScalar> data;
+  data.Self = this;
+  data.Buffer = image->GetBufferPointer();
+  data.SliceSize = size[0] * size[1];
+  data.ImagesPerIPP = k;
+  data.Columns = size[0];
+  data.Rows = size[1];
+  data.NextFile = 0;
+  data.NumberDecoded = 0;
+
+  // Decoding compressed slices is bound by the processor
+  itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+  mt->SetNumberOfThreads(
+        (int) std::min((size_t) itk::MultiThreader::GetGlobalDefaultNumberOfThreads(),
+                       m_DICOMFiles.size()));
+  mt->SetSingleMethod(&GuidedNativeImageIO::DicomDecodeThreadCallback<TScalar>, &data);
+  mt->SingleMethodExecute();
+
+  if(data.Error.size())
+    throw IRISException("Error reading DICOM series. %s", data.Error.c_str());
+
+  // Copy the metadata from the first scan in the series
+  image->SetMetaDataDictionary(data.Dictionary);
+  m_NativeImage = image;
+
+  // Set the number of components
+  if(k > 1)
+    m_NativeComponents = k;
+}
+
 template<class TScalar>
 void
 GuidedNativeImageIO
@@ -592,8 +937,14 @@ GuidedNativeImageIO
   // Define the image type of interest
   typedef itk::VectorImage<TScalar, 3> NativeImageType;
 
-  // There is a special handler for the DICOM case!
-  if(m_FileFormat == FORMAT_DICOM_DIR && m_DICOMFiles.size() > 1)
+  // There is a special handler for the DICOM case! Series of single-frame
+  // files are decoded in parallel, straight into their slices of the image
+  if(m_FileFormat == FORMAT_DICOM_DIR && m_DICOMFiles.size() > 1
+     && (m_IOBase->GetNumberOfDimensions() < 3 || m_IOBase->GetDimensions(2) == 1))
+    {
+    this->DoReadDicomSeries<TScalar>();
+    }
+  else if(m_FileFormat == FORMAT_DICOM_DIR && m_DICOMFiles.size() > 1)
     {
     // It seems that ITK can't yet read DICOM into a VectorImage. 
     typedef itk::Image<TScalar, 3> GreyImageType;
@@ -736,7 +1087,20 @@ GuidedNativeImageIO
     region.SetSize(dim);
     image->SetRegions(region);
     image->SetVectorLength(ncomp);
-    image->Allocate();
+
+    // The data of a mapped image stay in the file and are paged in as they
+    // are accessed. The data of a streamed image are read one slab at a time
+    // when the image is cast. In either case there is nothing to read yet
+    if(m_NativeImageMapped)
+      {
+      typedef MemoryMappedImageContainer<TScalar> MappedContainer;
+      typename MappedContainer::Pointer mpc = MappedContainer::New();
+      mpc->SetMappedFile(m_MappedFile, m_MappedDataOffset,
+                         region.GetNumberOfPixels() * ncomp);
+      image->SetPixelContainer(mpc);
+      }
+    else if(!m_NativeImageStreamed)
+      image->Allocate();
 
     // Set the IO region
     if(nd_actual <= 3)
@@ -762,7 +1126,8 @@ GuidedNativeImageIO
       }
 
     // Read the image into the buffer
-    m_IOBase->Read(image->GetBufferPointer());
+    if(!m_NativeImageStreamed && !m_NativeImageMapped)
+      m_IOBase->Read(image->GetBufferPointer());
     m_NativeImage = image;
 
     // If the image is 4-dimensional or more, we must perform an in-place transpose
@@ -831,6 +1196,9 @@ void
 GuidedNativeImageIO
 ::SaveNativeImage(const char *FileName, Registry &folder)
 {
+  // Saving needs the whole image in memory
+  this->BufferStreamedNativeImage();
+
   // Cast image from native format to TPixel
   DispatchBase *dispatch = this->CreateDispatch(this->GetComponentTypeInNativeImage());
   dispatch->SaveNative(this, FileName, folder);
@@ -863,15 +1231,35 @@ GuidedNativeImageIO
   // Create an Image IO based on the folder
   CreateImageIO(FileName, folder, false);
 
+  // A file that is mapped into memory as the data of a loaded image must not
+  // be overwritten in place, so a new file is written and moved over it. The
+  // mapping keeps the data of the old file until it is released
+  std::string fnWrite = FileName;
+  bool replace = MemoryMappedFile::IsFileMapped(FileName);
+  if(replace)
+    {
+    std::string dir = itksys::SystemTools::GetFilenamePath(FileName);
+    fnWrite = (dir.length() ? dir + "/" : dir) + ".~"
+        + itksys::SystemTools::GetFilenameName(FileName);
+    }
+
   // Save the image
   typedef itk::ImageFileWriter<TImageType> WriterType;
   typename WriterType::Pointer writer = WriterType::New();
   
-  writer->SetFileName(FileName);
+  writer->SetFileName(fnWrite.c_str());
   if(m_IOBase)
     writer->SetImageIO(m_IOBase);
   writer->SetInput(image);
   writer->Update();
+
+  if(replace && !itksys::SystemTools::RenameFile(fnWrite.c_str(), FileName))
+    {
+    itksys::SystemTools::RemoveFile(fnWrite.c_str());
+    throw IRISException("Error: Unable to replace file. "
+                        "The image could not be saved to '%s' because that "
+                        "file is in use by a loaded image.", FileName);
+    }
 }
 
 
@@ -907,9 +1295,25 @@ GuidedNativeImageIO
   hex_code[32] = 0;
   itksysMD5 *md5 = itksysMD5_New();
   itksysMD5_Initialize(md5);
-  itksysMD5_Append(md5, 
-    (unsigned char *) input->GetBufferPointer(), 
-    input->GetPixelContainer()->Size() * sizeof(TNative));
+  if(m_NativeImageStreamed)
+    {
+    // Hash the slabs in order, which gives the hash of the whole buffer
+    unsigned int nz = this->GetNativeSlabThickness();
+    size_t slice = (size_t) m_NativeDimensions[0] * m_NativeDimensions[1] * m_NativeComponents;
+    std::vector<TNative> slab(nz * slice);
+    for(unsigned int z = 0; z < m_NativeDimensions[2]; z += nz)
+      {
+      unsigned int n = std::min(nz, m_NativeDimensions[2] - z);
+      this->ReadNativeImageSlab(z, n, &slab[0]);
+      itksysMD5_Append(md5, (unsigned char *) &slab[0], n * slice * sizeof(TNative));
+      }
+    }
+  else
+    {
+    itksysMD5_Append(md5,
+      (unsigned char *) input->GetBufferPointer(),
+      input->GetPixelContainer()->Size() * sizeof(TNative));
+    }
   itksysMD5_FinalizeHex(md5, hex_code);
   itksysMD5_Delete(md5);
 
@@ -928,23 +1332,20 @@ typename RescaleNativeImageToIntegralType<TOutputImage>::OutputImageType *
 RescaleNativeImageToIntegralType<TOutputImage>::operator()(
     GuidedNativeImageIO *nativeIO)
 {
-  // Get the native image pointer
-  itk::ImageBase<3> *native = nativeIO->GetNativeImage();
-
   // Cast image from native format to TPixel
   itk::ImageIOBase::IOComponentType itype = nativeIO->GetComponentTypeInNativeImage();
   switch(itype) 
     {
-    case itk::ImageIOBase::UCHAR:  DoCast<unsigned char>(native);   break;
-    case itk::ImageIOBase::CHAR:   DoCast<signed char>(native);     break;
-    case itk::ImageIOBase::USHORT: DoCast<unsigned short>(native);  break;
-    case itk::ImageIOBase::SHORT:  DoCast<signed short>(native);    break;
-    case itk::ImageIOBase::UINT:   DoCast<unsigned int>(native);    break;
-    case itk::ImageIOBase::INT:    DoCast<signed int>(native);      break;
-    case itk::ImageIOBase::ULONG:  DoCast<unsigned long>(native);   break;
-    case itk::ImageIOBase::LONG:   DoCast<signed long>(native);     break;
-    case itk::ImageIOBase::FLOAT:  DoCast<float>(native);           break;
-    case itk::ImageIOBase::DOUBLE: DoCast<double>(native);          break;
+    case itk::ImageIOBase::UCHAR:  DoCast<unsigned char>(nativeIO);   break;
+    case itk::ImageIOBase::CHAR:   DoCast<signed char>(nativeIO);     break;
+    case itk::ImageIOBase::USHORT: DoCast<unsigned short>(nativeIO);  break;
+    case itk::ImageIOBase::SHORT:  DoCast<signed short>(nativeIO);    break;
+    case itk::ImageIOBase::UINT:   DoCast<unsigned int>(nativeIO);    break;
+    case itk::ImageIOBase::INT:    DoCast<signed int>(nativeIO);      break;
+    case itk::ImageIOBase::ULONG:  DoCast<unsigned long>(nativeIO);   break;
+    case itk::ImageIOBase::LONG:   DoCast<signed long>(nativeIO);     break;
+    case itk::ImageIOBase::FLOAT:  DoCast<float>(nativeIO);           break;
+    case itk::ImageIOBase::DOUBLE: DoCast<double>(nativeIO);          break;
     default: 
       throw IRISException("Unknown pixel type when reading image");
     }
@@ -1033,22 +1434,78 @@ protected:
 
 
 
+/**
+ * Range of the values in a native image, and whether these values are
+ * integers that the output type can represent. The statistics are gathered
+ * block by block, so that streamed images can be scanned one slab at a time.
+ */
+template<typename TNative, typename TOutput>
+class NativeIntensityRangeAccumulator
+{
+public:
+
+  NativeIntensityRangeAccumulator(bool checkIntegral)
+    : m_Empty(true), m_Integral(checkIntegral) {}
+
+  void Update(const TNative *begin, const TNative *end)
+  {
+    if(begin == end)
+      return;
+
+    if(m_Empty)
+      {
+      m_Minimum = m_Maximum = *begin;
+      m_Empty = false;
+      }
+
+    for(const TNative *p = begin; p < end; ++p)
+      {
+      TNative val = *p;
+      if(val < m_Minimum) m_Minimum = val;
+      if(val > m_Maximum) m_Maximum = val;
+      }
+
+    // Test whether the values are actually integers cast to floating point
+    if(m_Integral)
+      {
+      double omin = itk::NumericTraits<TOutput>::min();
+      double omax = itk::NumericTraits<TOutput>::max();
+      for(const TNative *p = begin; p < end; ++p)
+        {
+        TNative vin = *p;
+        if(vin < omin || vin > omax)
+          { m_Integral = false; break; }
+
+        TNative vcmp = static_cast<TNative>(static_cast<TOutput>(vin + 0.5));
+        if(vin != vcmp)
+          { m_Integral = false; break; }
+        }
+      }
+  }
+
+  TNative GetMinimum() const { return m_Minimum; }
+  TNative GetMaximum() const { return m_Maximum; }
+  bool IsIntegral() const { return m_Integral; }
+
+protected:
+
+  TNative m_Minimum, m_Maximum;
+  bool m_Empty, m_Integral;
+};
+
+
 template<class TOutputImage>
 template<typename TNative>
 void
 RescaleNativeImageToIntegralType<TOutputImage>
-::DoCast(itk::ImageBase<3> *native)
+::DoCast(GuidedNativeImageIO *nativeIO)
 {
   // Get the native image
   typedef itk::VectorImage<TNative, 3> InputImageType;
-  typedef itk::ImageRegionConstIterator<InputImageType> InputIterator;
-  SmartPtr<InputImageType> input = dynamic_cast<InputImageType *>(native);
-
-  assert(input);
-  assert(input->GetPixelContainer()->Size() > 0);
+  itk::ImageBase<3> *native = nativeIO->GetNativeImage();
 
   // Get the number of components in the native image
-  size_t ncomp = input->GetNumberOfComponentsPerPixel();
+  size_t ncomp = native->GetNumberOfComponentsPerPixel();
 
   // We must compute a scale and shift factor
   double scale = 1.0, shift = 0.0;
@@ -1065,43 +1522,46 @@ RescaleNativeImageToIntegralType<TOutputImage>
     OutputComponentType omin = itk::NumericTraits<OutputComponentType>::min();
 
     // Scan over all the image components. Avoid using iterators here because of
-    // unnecessary overhead for vector images.
-    TNative *ib_begin = input->GetBufferPointer();
-    TNative *ib_end = ib_begin + input->GetPixelContainer()->Size();
-
-    TNative imin_nat = *ib_begin, imax_nat = *ib_begin;
+    // unnecessary overhead for vector images. For float and double, also check
+    // if the input image is actually an integer image cast to floating point
+    NativeIntensityRangeAccumulator<TNative, OutputComponentType> range(
+          !itk::NumericTraits<TNative>::is_integer && ncomp == 1);
 
-    // Iterate over all the components in the input image
-    for(TNative *buffer = ib_begin + 1; buffer < ib_end; ++buffer)
+    if(nativeIO->IsNativeImageStreamed())
       {
-      TNative val = *buffer;
-      if(val < imin_nat) imin_nat = val;
-      if(val > imax_nat) imax_nat = val;
+      // Scan the image one slab at a time, without ever holding it in full
+      Vector3ui dim = nativeIO->GetDimensionsOfNativeImage();
+      unsigned int nz = nativeIO->GetNativeSlabThickness();
+      size_t slice = (size_t) dim[0] * dim[1] * ncomp;
+      std::vector<TNative> slab(nz * slice);
+      for(unsigned int z = 0; z < dim[2]; z += nz)
+        {
+        unsigned int n = std::min(nz, dim[2] - z);
+        nativeIO->ReadNativeImageSlab(z, n, &slab[0]);
+        range.Update(&slab[0], &slab[0] + n * slice);
+        }
+      }
+    else
+      {
+      SmartPtr<InputImageType> input = dynamic_cast<InputImageType *>(native);
+      assert(input);
+      assert(input->GetPixelContainer()->Size() > 0);
+
+      TNative *ib_begin = input->GetBufferPointer();
+      range.Update(ib_begin, ib_begin + input->GetPixelContainer()->Size());
       }
 
     // Cast the values to double
-    double imin = static_cast<double>(imin_nat), imax = static_cast<double>(imax_nat);
+    double imin = static_cast<double>(range.GetMinimum());
+    double imax = static_cast<double>(range.GetMaximum());
 
     // Now we have to be careful, depending on the type of the input voxel
     // For float and double, we map the input range into the output range
     if(!itk::NumericTraits<TNative>::is_integer)
       {
-      // Test whether the input image is actually an integer image cast to
-      // floating point. In that case, there is no need for conversion
-      bool isint = false;
-      if(1.0 * omin <= imin && 1.0 * omax >= imax && ncomp == 1)
-        {
-        isint = true;
-
-        // Another pass through the image? Why is this necessary?
-        for(TNative *buffer = ib_begin; buffer < ib_end; ++buffer)
-          {
-          TNative vin = *buffer;
-          TNative vcmp = static_cast<TNative>(static_cast<OutputComponentType>(vin + 0.5));
-          if(vin != vcmp)
-            { isint = false; break; }
-          }
-        }
+      // Is the input image actually an integer image cast to floating point?
+      // In that case, there is no need for conversion
+      bool isint = range.IsIntegral();
 
       // If underlying data is really integer, no scale or shift is necessary
       // except that to round (so floating values like 0.9999999 get mapped to
@@ -1163,7 +1623,7 @@ RescaleNativeImageToIntegralType<TOutputImage>
   typedef RescaleVectorNativeImageToVectorFunctor<OutputComponentType, TNative> Functor;
   CastNativeImage<OutputImageType, Functor> caster;
   caster.SetFunctor(Functor(shift, scale));
-  caster.template DoCast<TNative>(native);
+  caster.template DoCast<TNative>(nativeIO);
   m_Output = caster.m_Output;
 }
 
@@ -1172,23 +1632,20 @@ typename CastNativeImage<TOutputImage,TCastFunctor>::OutputImageType *
 CastNativeImage<TOutputImage,TCastFunctor>
 ::operator()(GuidedNativeImageIO *nativeIO)
 {
-  // Get the native image pointer
-  itk::ImageBase<3> *native = nativeIO->GetNativeImage();
-
   // Cast image from native format to TPixel
   itk::ImageIOBase::IOComponentType itype = nativeIO->GetComponentTypeInNativeImage();
   switch(itype) 
     {
-    case itk::ImageIOBase::UCHAR:  DoCast<unsigned char>(native);   break;
-    case itk::ImageIOBase::CHAR:   DoCast<signed char>(native);     break;
-    case itk::ImageIOBase::USHORT: DoCast<unsigned short>(native);  break;
-    case itk::ImageIOBase::SHORT:  DoCast<signed short>(native);    break;
-    case itk::ImageIOBase::UINT:   DoCast<unsigned int>(native);    break;
-    case itk::ImageIOBase::INT:    DoCast<signed int>(native);      break;
-    case itk::ImageIOBase::ULONG:  DoCast<unsigned long>(native);   break;
-    case itk::ImageIOBase::LONG:   DoCast<signed long>(native);     break;
-    case itk::ImageIOBase::FLOAT:  DoCast<float>(native);           break;
-    case itk::ImageIOBase::DOUBLE: DoCast<double>(native);          break;
+    case itk::ImageIOBase::UCHAR:  DoCast<unsigned char>(nativeIO);   break;
+    case itk::ImageIOBase::CHAR:   DoCast<signed char>(nativeIO);     break;
+    case itk::ImageIOBase::USHORT: DoCast<unsigned short>(nativeIO);  break;
+    case itk::ImageIOBase::SHORT:  DoCast<signed short>(nativeIO);    break;
+    case itk::ImageIOBase::UINT:   DoCast<unsigned int>(nativeIO);    break;
+    case itk::ImageIOBase::INT:    DoCast<signed int>(nativeIO);      break;
+    case itk::ImageIOBase::ULONG:  DoCast<unsigned long>(nativeIO);   break;
+    case itk::ImageIOBase::LONG:   DoCast<signed long>(nativeIO);     break;
+    case itk::ImageIOBase::FLOAT:  DoCast<float>(nativeIO);           break;
+    case itk::ImageIOBase::DOUBLE: DoCast<double>(nativeIO);          break;
     default: 
       throw IRISException("Error: Unknown pixel type when reading image."
                           "The voxels in the image you are loading have format '%s', "
@@ -1206,9 +1663,17 @@ template<class TOutputImage, class TCastFunctor>
 template<typename TNative>
 void
 CastNativeImage<TOutputImage,TCastFunctor>
-::DoCast(itk::ImageBase<3> *native)
+::DoCast(GuidedNativeImageIO *nativeIO)
 {
+  // Streamed images are cast as they are read
+  if(nativeIO->IsNativeImageStreamed())
+    {
+    DoStreamedCast<TNative>(nativeIO);
+    return;
+    }
+
   // Get the native image
+  itk::ImageBase<3> *native = nativeIO->GetNativeImage();
   typedef itk::VectorImage<TNative, 3> InputImageType;
   typename InputImageType::Pointer input = 
     reinterpret_cast<InputImageType *>(native);
@@ -1261,6 +1726,19 @@ CastNativeImage<TOutputImage,TCastFunctor>
   // Bytes needed to store the data in target format
   size_t nbTarget = input->GetPixelContainer()->Size() * szTarget;
 
+  // Memory that the input does not own, such as a memory-mapped file, can
+  // not be converted in place. The output gets its own buffer instead
+  if(!ipc->GetContainerManageMemory())
+    {
+    m_Output->Allocate();
+    TNative *pn = ipc->GetImportPointer();
+    OutputComponentType *pt = m_Output->GetBufferPointer();
+    size_t nval = ipc->Size();
+    for(size_t i = 0; i < nval; i++, pt++, pn++)
+      m_Functor(pn, pt);
+    return;
+    }
+
   // This memory is no longer owned by the input
   ipc->SetContainerManageMemory(false);
 
@@ -1315,6 +1793,60 @@ CastNativeImage<TOutputImage,TCastFunctor>
   m_Output->SetPixelContainer(pc);
 }
 
+template<class TOutputImage, class TCastFunctor>
+template<typename TNative>
+void
+CastNativeImage<TOutputImage,TCastFunctor>
+::DoStreamedCast(GuidedNativeImageIO *nativeIO)
+{
+  // The native image only holds the geometry of the image
+  itk::ImageBase<3> *native = nativeIO->GetNativeImage();
+
+  // Allocate the output image
+  m_Output = OutputImageType::New();
+  m_Output->CopyInformation(native);
+  m_Output->SetMetaDataDictionary(native->GetMetaDataDictionary());
+  m_Output->SetRegions(native->GetBufferedRegion());
+
+  // As in DoCast, the number of components must match
+  int ncomp = native->GetNumberOfComponentsPerPixel();
+  int ncomp_out = m_Output->GetNumberOfComponentsPerPixel();
+  if(ncomp != ncomp_out)
+    {
+    throw IRISException("Unable to cast an input image with %d components to "
+                        "an output image with %d components", ncomp, ncomp_out);
+    }
+
+  m_Output->Allocate();
+  OutputComponentType *ob = m_Output->GetBufferPointer();
+
+  // Slabs span whole slices, so each one maps to a contiguous block of the
+  // output buffer. Only the output and one slab of native data are in memory
+  Vector3ui dim = nativeIO->GetDimensionsOfNativeImage();
+  unsigned int nz = nativeIO->GetNativeSlabThickness();
+  size_t slice = (size_t) dim[0] * dim[1] * ncomp;
+
+  // Special case: native image is the same as target image, read in place
+  if(typeid(OutputComponentType) == typeid(TNative))
+    {
+    for(unsigned int z = 0; z < dim[2]; z += nz)
+      nativeIO->ReadNativeImageSlab(z, std::min(nz, dim[2] - z), ob + z * slice);
+    return;
+    }
+
+  std::vector<TNative> slab(nz * slice);
+  for(unsigned int z = 0; z < dim[2]; z += nz)
+    {
+    unsigned int n = std::min(nz, dim[2] - z);
+    nativeIO->ReadNativeImageSlab(z, n, &slab[0]);
+
+    TNative *pn = &slab[0];
+    OutputComponentType *pt = ob + z * slice;
+    for(size_t i = 0; i < n * slice; i++, pt++, pn++)
+      m_Functor(pn, pt);
+    }
+}
+
 GuidedNativeImageIO::FileFormat
 GuidedNativeImageIO::GuessFormatForFileName(
     const std::string &fname, bool checkMagic)
@@ -1381,139 +1913,313 @@ const gdcm::Tag GuidedNativeImageIO::m_tagAcquisitionNumber(0x0020,0x0012);
 const gdcm::Tag GuidedNativeImageIO::m_tagInstanceNumber(0x0020,0x0013);
 const gdcm::Tag GuidedNativeImageIO::m_tagSequenceName(0x0018, 0x0024);
 const gdcm::Tag GuidedNativeImageIO::m_tagSliceThickness(0x0018, 0x0050);
+const gdcm::Tag GuidedNativeImageIO::m_tagImagePositionPatient(0x0020, 0x0032);
+const gdcm::Tag GuidedNativeImageIO::m_tagImageOrientationPatient(0x0020, 0x0037);
 
 
 #include "gdcmDirectory.h"
 #include "gdcmImageReader.h"
 
+// State shared by the threads scanning a DICOM directory. Each file is
+// claimed by one thread; the calling thread also adds the finished files to
+// the parse result, in the order of the directory listing
+struct GuidedNativeImageIO::DicomScanData
+{
+  GuidedNativeImageIO *Self;
+  const gdcm::Directory::FilenamesType *Files;
+  const DicomDirectoryIndex *Index;
+  itk::Command *Progress;
+
+  // Tags read from each file, and those that refine the series UID
+  std::set<gdcm::Tag> TagsAll;
+  std::vector<gdcm::Tag> TagsRefine;
+
+  // Entry of each file, and whether it is finished. Guarded by the mutex
+  std::vector<DicomDirectoryIndex::Entry> Entries;
+  std::vector<char> Ready;
+  size_t NextFile, NumberRead;
+  itk::SimpleFastMutexLock Mutex;
+
+  // Next file to add to the parse result. Only used by the calling thread
+  size_t NextReported;
+};
+
 void
 GuidedNativeImageIO
-::ParseDicomDirectory(const std::string &dir, itk::Command *progressCommand)
+::ReadDicomIndexEntry(const std::string &fn, DicomScanData *data,
+                      DicomDirectoryIndex::Entry &entry)
 {
-  // We will parse the DICOM directory manually to avoid extra time opening
-  // files and also to allow progress reporting
+  gdcm::Reader reader;
+  reader.SetFileName(fn.c_str());
 
-  // Must have a directory
-  if(!itksys::SystemTools::FileIsDirectory(dir.c_str()))
-    throw IRISException(
-        "Error: Not a directory. "
-        "Trying to look for DICOM series in '%s', which is not a directory",
-        dir.c_str());
+  // Try reading this file. Fail quietly.
+  entry.IsDicom = false;
+  try { entry.IsDicom = reader.ReadSelectedTags(data->TagsAll, true); }
+  catch(...) {}
 
-  // List of tags used for refined grouping of files - order matters!
-  std::vector<gdcm::Tag> tags_refine;
-  tags_refine.push_back(m_tagSeriesNumber);
-  tags_refine.push_back(m_tagSequenceName);
-  tags_refine.push_back(m_tagSliceThickness);
-  tags_refine.push_back(m_tagRows);
-  tags_refine.push_back(m_tagCols);
+  // If nothing read, keep going
+  if(!entry.IsDicom)
+    return;
 
-  // List of tags that we want to parse - everything else may be ignored
-  std::set<gdcm::Tag> tags_all;
-  tags_all.insert(tags_refine.begin(), tags_refine.end());
-  tags_all.insert(m_tagDesc);
-  tags_all.insert(m_tagSeriesInstanceUID);
+  // Create a string filter to get tags
+  gdcm::StringFilter sf;
+  sf.SetFile(reader.GetFile());
 
-  // Clear the information about the last parse
-  m_LastDicomParseResult.Reset();
-  m_LastDicomParseResult.Directory = dir;
+  // Start with the ID being the UID
+  std::string uid = sf.ToString(m_tagSeriesInstanceUID);
+  std::string full_id = uid;
 
-  // GDCM directory listing
-  gdcm::Directory dirList;
+  // Iterate over the tags in the refine list
+  for(int iTag = 0; iTag < data->TagsRefine.size(); iTag++)
+    {
+    // Read the tag value
+    std::string s = sf.ToString(data->TagsRefine[iTag]);
 
-  // Load the directory - this should be quick
-  dirList.Load(dir, false);
-  gdcm::Directory::FilenamesType const &filenames = dirList.GetFilenames();
-  for(gdcm::Directory::FilenamesType::const_iterator it = filenames.begin();
-    it != filenames.end(); ++it)
+    // This code is from gdcmSerieHelper
+    if( full_id == uid && !s.empty() )
+      {
+      full_id += "."; // add separator
+      }
+    full_id += s;
+    }
+
+  // Eliminate non-alnum characters, including whitespace...
+  //   that may have been introduced by concats.
+  for(size_t i=0; i<full_id.size(); i++)
     {
-    // Process each filename in the directory
-    gdcm::Reader reader;
-    reader.SetFileName(it->c_str());
+    while(i<full_id.size()
+      && !( full_id[i] == '.'
+        || (full_id[i] >= 'a' && full_id[i] <= 'z')
+        || (full_id[i] >= '0' && full_id[i] <= '9')
+        || (full_id[i] >= 'A' && full_id[i] <= 'Z')))
+      {
+      full_id.erase(i, 1);
+      }
+    }
 
-    // Try reading this file. Fail quietly.
-    bool read = false;
-    try { read = reader.ReadSelectedTags(tags_all, true); }
-    catch(...) {}
+  entry.SeriesId = full_id;
+  entry.SeriesDescription = sf.ToString(m_tagDesc);
+  entry.SeriesNumber = sf.ToString(m_tagSeriesNumber);
+  entry.Rows = std::atoi(sf.ToString(m_tagRows).c_str());
+  entry.Columns = std::atoi(sf.ToString(m_tagCols).c_str());
 
-    // If nothing read, keep going
-    if(!read)
-      continue;
+  // Kept so that the slices can be ordered without reading the files again
+  entry.Position = sf.ToString(m_tagImagePositionPatient);
+  entry.Orientation = sf.ToString(m_tagImageOrientationPatient);
+}
 
-    // Create a string filter to get tags
-    gdcm::StringFilter sf;
-    sf.SetFile(reader.GetFile());
+bool
+GuidedNativeImageIO
+::AddDicomSeriesFile(const std::string &fn, const DicomDirectoryIndex::Entry &entry)
+{
+  if(!entry.IsDicom)
+    return false;
 
-    // Start with the ID being the UID
-    std::string uid = sf.ToString(m_tagSeriesInstanceUID);
-    std::string full_id = uid;
+  // The info for the current series
+  DicomDirectoryParseResult::DicomSeriesInfo &series_info
+      = m_LastDicomParseResult.SeriesMap[entry.SeriesId];
 
-    // Iterate over the tags in the refine list
-    for(int iTag = 0; iTag < tags_refine.size(); iTag++)
-      {
-      // Read the tag value
-      std::string s = sf.ToString(tags_refine[iTag]);
+  // The registry for the current series
+  Registry &r = series_info.MetaData;
 
-      // This code is from gdcmSerieHelper
-      if( full_id == uid && !s.empty() )
-        {
-        full_id += "."; // add separator
-        }
-      full_id += s;
-      }
+  // Have we found this ID before?
+  if(r.IsEmpty())
+    {
+    r["SeriesId"] << entry.SeriesId;
+
+    // Read series description
+    r["SeriesDescription"] << entry.SeriesDescription;
+    r["SeriesNumber"] << entry.SeriesNumber;
+
+    // Read the dimensions
+    r["Rows"] << entry.Rows;
+    r["Columns"] << entry.Columns;
+    r["NumberOfImages"] << 1;
+    }
+  else
+    {
+    // Increement the number of images
+    r["NumberOfImages"] << r["NumberOfImages"][0] + 1;
+    }
+
+  // Update the dimensions string
+  ostringstream oss;
+  oss << r["Rows"][0] << " x " << r["Columns"][0] << " x " << r["NumberOfImages"][0];
+  r["Dimensions"] << oss.str();
+
+  // Update the filelist
+  series_info.FileList.push_back(fn);
+  series_info.PositionList.push_back(entry.Position);
+  series_info.OrientationList.push_back(entry.Orientation);
+  return true;
+}
 
-    // Eliminate non-alnum characters, including whitespace...
-    //   that may have been introduced by concats.
-    for(size_t i=0; i<full_id.size(); i++)
+void
+GuidedNativeImageIO
+::FlushDicomScan(DicomScanData *data)
+{
+  size_t n = data->Files->size();
+  while(data->NextReported < n)
+    {
       {
-      while(i<full_id.size()
-        && !( full_id[i] == '.'
-          || (full_id[i] >= 'a' && full_id[i] <= 'z')
-          || (full_id[i] >= '0' && full_id[i] <= '9')
-          || (full_id[i] >= 'A' && full_id[i] <= 'Z')))
-        {
-        full_id.erase(i, 1);
-        }
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      if(!data->Ready[data->NextReported])
+        break;
       }
 
-    // The info for the current series
-    DicomDirectoryParseResult::DicomSeriesInfo &series_info
-        = m_LastDicomParseResult.SeriesMap[full_id];
+    size_t i = data->NextReported++;
+    bool dicom = this->AddDicomSeriesFile((*data->Files)[i], data->Entries[i]);
 
-    // The registry for the current series
-    Registry &r = series_info.MetaData;
+    // Indicate some progress
+    if(dicom && data->Progress)
+      data->Progress->Execute(this, itk::ProgressEvent());
+    }
+}
 
-    // Have we found this ID before?
-    if(r.IsEmpty())
+ITK_THREAD_RETURN_TYPE
+GuidedNativeImageIO
+::DicomScanThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  DicomScanData *data = static_cast<DicomScanData *>(ti->UserData);
+
+  // The first thread runs on the calling thread, and is the one that may
+  // report progress to the GUI
+  bool reporter = (ti->ThreadID == 0);
+  size_t n = data->Files->size();
+
+  while(true)
+    {
+    // Claim the next file
+    size_t i;
       {
-      r["SeriesId"] << full_id;
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      i = data->NextFile++;
+      }
+    if(i >= n)
+      break;
 
-      // Read series description
-      r["SeriesDescription"] << sf.ToString(m_tagDesc);
-      r["SeriesNumber"] << sf.ToString(m_tagSeriesNumber);
+    // Files that have not changed since the last scan are not opened
+    const std::string &fn = (*data->Files)[i];
+    long long mtime = 0;
+    unsigned long long size = 0;
+    const DicomDirectoryIndex::Entry *stored = NULL;
+    if(DicomDirectoryIndex::GetFileStamp(fn, mtime, size))
+      stored = data->Index->Find(fn, mtime, size);
 
-      // Read the dimensions
-      r["Rows"] << std::atoi(sf.ToString(m_tagRows).c_str());
-      r["Columns"] << std::atoi(sf.ToString(m_tagCols).c_str());
-      r["NumberOfImages"] << 1;
+    DicomDirectoryIndex::Entry entry;
+    if(stored)
+      {
+      entry = *stored;
       }
     else
       {
-      // Increement the number of images
-      r["NumberOfImages"] << r["NumberOfImages"][0] + 1;
+      ReadDicomIndexEntry(fn, data, entry);
+      entry.ModifiedTime = mtime;
+      entry.FileSize = size;
       }
 
-    // Update the dimensions string
-    ostringstream oss;
-    oss << r["Rows"][0] << " x " << r["Columns"][0] << " x " << r["NumberOfImages"][0];
-    r["Dimensions"] << oss.str();
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      data->Entries[i] = entry;
+      data->Ready[i] = 1;
+      if(!stored)
+        data->NumberRead++;
+      }
 
-    // Update the filelist
-    series_info.FileList.push_back(*it);
+    if(reporter)
+      data->Self->FlushDicomScan(data);
+    }
 
-    // Indicate some progress
-    if(progressCommand)
-      progressCommand->Execute(this, itk::ProgressEvent());
+  // Wait for the files still being read by the other threads
+  if(reporter)
+    {
+    data->Self->FlushDicomScan(data);
+    while(data->NextReported < n)
+      {
+      itksys::SystemTools::Delay(10);
+      data->Self->FlushDicomScan(data);
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void
+GuidedNativeImageIO
+::ParseDicomDirectory(const std::string &dir, itk::Command *progressCommand)
+{
+  // We will parse the DICOM directory manually to avoid extra time opening
+  // files and also to allow progress reporting
+
+  // Must have a directory
+  if(!itksys::SystemTools::FileIsDirectory(dir.c_str()))
+    throw IRISException(
+        "Error: Not a directory. "
+        "Trying to look for DICOM series in '%s', which is not a directory",
+        dir.c_str());
+
+  DicomScanData data;
+
+  // List of tags used for refined grouping of files - order matters!
+  data.TagsRefine.push_back(m_tagSeriesNumber);
+  data.TagsRefine.push_back(m_tagSequenceName);
+  data.TagsRefine.push_back(m_tagSliceThickness);
+  data.TagsRefine.push_back(m_tagRows);
+  data.TagsRefine.push_back(m_tagCols);
+
+  // List of tags that we want to parse - everything else may be ignored
+  data.TagsAll.insert(data.TagsRefine.begin(), data.TagsRefine.end());
+  data.TagsAll.insert(m_tagDesc);
+  data.TagsAll.insert(m_tagSeriesInstanceUID);
+  data.TagsAll.insert(m_tagImagePositionPatient);
+  data.TagsAll.insert(m_tagImageOrientationPatient);
+
+  // Clear the information about the last parse
+  m_LastDicomParseResult.Reset();
+  m_LastDicomParseResult.Directory = dir;
+
+  // GDCM directory listing
+  gdcm::Directory dirList;
+
+  // Load the directory - this should be quick
+  dirList.Load(dir, false);
+  gdcm::Directory::FilenamesType const &filenames = dirList.GetFilenames();
+  size_t n = filenames.size();
+
+  // The headers stored when the directory was last scanned
+  DicomDirectoryIndex index;
+  index.Load(dir);
+
+  data.Self = this;
+  data.Files = &filenames;
+  data.Index = &index;
+  data.Progress = progressCommand;
+  data.Entries.resize(n);
+  data.Ready.resize(n, 0);
+  data.NextFile = 0;
+  data.NumberRead = 0;
+  data.NextReported = 0;
+
+  // Reading the headers is bound by the latency of the disk or the network
+  // share rather than by the processor, so more threads than cores are used
+  int n_threads = std::max(itk::MultiThreader::GetGlobalDefaultNumberOfThreads(), 8);
+  n_threads = (int) std::max((size_t) 1, std::min((size_t) n_threads, n));
+
+  itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+  mt->SetNumberOfThreads(n_threads);
+  mt->SetSingleMethod(&GuidedNativeImageIO::DicomScanThreadCallback, &data);
+  mt->SingleMethodExecute();
+
+  // Store the index again if files were read or have been removed
+  DicomDirectoryIndex::EntryMap &entries = index.GetEntries();
+  if(data.NumberRead > 0 || entries.size() != n)
+    {
+    entries.clear();
+    for(size_t i = 0; i < n; i++)
+      entries[filenames[i]] = data.Entries[i];
+    index.Save(dir);
     }
 
   // Complain if no series have been found
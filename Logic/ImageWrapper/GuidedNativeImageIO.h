@@ -41,6 +41,9 @@
 #include "itkImageIOBase.h"
 #include "itkVectorImage.h"
 #include "gdcmTag.h"
+#include "MemoryMappedFile.h"
+#include "DicomDirectoryIndex.h"
+#include "itkMultiThreader.h"
 
   
 namespace itk
@@ -105,6 +108,10 @@ public:
     struct DicomSeriesInfo {
       Registry MetaData;
       FileListType FileList;
+
+      // Image position and orientation (patient) of each file, as read from
+      // the headers when the directory was scanned
+      FileListType PositionList, OrientationList;
     };
 
     typedef std::map<std::string, DicomSeriesInfo> SeriesMapType;
@@ -139,7 +146,16 @@ public:
 
   void ReadNativeImageHeader(const char *FileName, Registry &folder);
 
-  void ReadNativeImageData();
+  /**
+   * Read the data of the image whose header has been read. The slices of a
+   * DICOM series are decoded on a pool of threads, and the progress command,
+   * if given, is called on the calling thread as they are decoded. The
+   * command can use GetReadProgress() to find out how far along the read is.
+   */
+  void ReadNativeImageData(itk::Command *progressCommand = NULL);
+
+  /** Fraction of the image data read so far by ReadNativeImageData() */
+  irisGetMacro(ReadProgress, double)
 
   /**
    * Get the number of components in the native image read by ReadNativeImage.
@@ -193,6 +209,52 @@ public:
   bool IsNativeImageLoaded() const
     { return m_NativeImage.IsNotNull(); }
 
+  /**
+   * Images whose data take up more than this many bytes are streamed: if the
+   * ImageIO supports streamed reading, ReadNativeImageData() only sets up the
+   * native image's geometry, and the voxels are read slab by slab when the
+   * image is cast, straight into the output image. This way the native image
+   * is never held in memory in full. Set to zero to disable. Default is 1GB.
+   */
+  irisGetSetMacro(StreamingThreshold, size_t)
+
+  /** Approximate size of the slabs in which streamed images are read */
+  irisGetSetMacro(StreamingSlabSize, size_t)
+
+  /**
+   * Images whose data take up at least this many bytes are mapped into memory
+   * instead of being read, if they are stored uncompressed at the end of a
+   * NIfTI, MetaImage or raw file, in the byte order of this machine. Pages of
+   * the file are then only loaded as they are accessed, and if the voxel type
+   * matches the type the image is cast to, the mapped data become the buffer
+   * of the cast image. Mapping takes precedence over streaming. NIfTI files
+   * whose header declares an intensity scaling are never mapped. Set to zero
+   * to disable. Default is 1GB, the same as the streaming threshold, so that
+   * the images that would otherwise be streamed are mapped when they can be.
+   */
+  irisGetSetMacro(MappingThreshold, size_t)
+
+  /** Is the data of the native image a memory-mapped file? */
+  bool IsNativeImageMapped() const
+    { return m_NativeImageMapped; }
+
+  /**
+   * Is the native image streamed? In that case GetNativeImage() returns an
+   * image with geometry information but without a buffer, and the data must
+   * be read with ReadNativeImageSlab()
+   */
+  bool IsNativeImageStreamed() const
+    { return m_NativeImageStreamed; }
+
+  /** Number of slices in each slab of a streamed native image */
+  unsigned int GetNativeSlabThickness() const;
+
+  /**
+   * Read slices z0 to z0+nz-1 of a streamed native image into a buffer, which
+   * must have room for all the components of the voxels in these slices
+   */
+  void ReadNativeImageSlab(unsigned int z0, unsigned int nz, void *buffer);
+
   /** 
    * Save the native image it its native format (to a different location and
    * filename, presumably). This function is not meant as part of the normal
@@ -212,7 +274,10 @@ public:
    * the format of interest.
    */
   void DeallocateNativeImage()
-    { m_IOBase = NULL; m_NativeImage = NULL; }
+    {
+    m_IOBase = NULL; m_NativeImage = NULL;
+    m_NativeImageStreamed = false; m_NativeImageMapped = false;
+    }
 
   /** 
    * Get RAI code for an image. If there is nothing in the registry, this will
@@ -257,7 +322,10 @@ public:
   /**
    * Get series information from a DICOM directory. This will list all the
    * files in the DICOM directory and generate a registry for each series in
-   * the directory. The following registry entries are generated for each series:
+   * the directory. The headers are read on a pool of threads, and kept in a
+   * DicomDirectoryIndex, so that files that have not changed are not read
+   * again when the directory is scanned the next time.
+   * The following registry entries are generated for each series:
    *   - SeriesDescription
    *   - Dimensions
    *   - NumberOfImages
@@ -303,6 +371,39 @@ protected:
   /** Templated function that computes an MD5 hash from the stored image */
   template <typename TScalar> std::string DoGetNativeMD5Hash();
 
+  /** Decode the slices of a DICOM series on a pool of threads */
+  template <typename TScalar> void DoReadDicomSeries();
+
+  // Decoding of DICOM slices on a pool of threads
+  template <typename TScalar> struct DicomDecodeData;
+  template <typename TScalar> static ITK_THREAD_RETURN_TYPE DicomDecodeThreadCallback(void *arg);
+
+  /** Whether the image whose header has been read should be streamed */
+  bool CanStreamNativeImage() const;
+
+  // Scanning of DICOM directories on a pool of threads
+  struct DicomScanData;
+  static ITK_THREAD_RETURN_TYPE DicomScanThreadCallback(void *arg);
+
+  /** Read the header fields of a DICOM file needed to group it into series */
+  static void ReadDicomIndexEntry(const std::string &fn, DicomScanData *data,
+                                  DicomDirectoryIndex::Entry &entry);
+
+  /** Add the files scanned so far to the parse result, in order */
+  void FlushDicomScan(DicomScanData *data);
+
+  /** Add a scanned file to its series. Returns false if it is not DICOM */
+  bool AddDicomSeriesFile(const std::string &fn, const DicomDirectoryIndex::Entry &entry);
+
+  /** Read all the data of a streamed native image into its buffer */
+  void BufferStreamedNativeImage();
+
+  /**
+   * Map the file of the image whose header has been read into memory, if
+   * its data can be used in place. Returns false if it can not.
+   */
+  bool MapNativeImageFile();
+
   /** A dispatch class that calls templated functions in the main class. */
   class DispatchBase {
   public:
@@ -342,6 +443,18 @@ protected:
   // The IO base used to read the files
   IOBasePointer m_IOBase;
 
+  // Whether the native image data is read in slabs when the image is cast.
+  // The IO base is then kept until the native image is deallocated
+  bool m_NativeImageStreamed;
+  size_t m_StreamingThreshold, m_StreamingSlabSize;
+
+  // Whether the native image data is a mapped file, and the mapping, which
+  // is handed over to the pixel container of the native image
+  bool m_NativeImageMapped;
+  size_t m_MappingThreshold;
+  SmartPtr<MemoryMappedFile> m_MappedFile;
+  size_t m_MappedDataOffset;
+
   // DICOM directory last processed by ParseDicomSeries
   DicomDirectoryParseResult m_LastDicomParseResult;
 
@@ -367,6 +480,10 @@ protected:
   // Number of images per z-position in the DICOM series (e.g., multi-echo data)
   int m_DICOMImagesPerIPP;
 
+  // Progress of ReadNativeImageData(), and the command notified of it
+  double m_ReadProgress;
+  itk::Command *m_ReadProgressCommand;
+
   /** Registry mappings for these enums */
   static bool m_StaticDataInitialized;
   static RegistryEnumMap<FileFormat> m_EnumFileFormat;
@@ -384,6 +501,8 @@ protected:
   static const gdcm::Tag m_tagInstanceNumber;
   static const gdcm::Tag m_tagSequenceName;
   static const gdcm::Tag m_tagSliceThickness;
+  static const gdcm::Tag m_tagImagePositionPatient;
+  static const gdcm::Tag m_tagImageOrientationPatient;
 
 };
 
@@ -418,7 +537,7 @@ private:
   double m_NativeScale, m_NativeShift;
 
   // Method that does the casting
-  template<typename TNative> void DoCast(itk::ImageBase<3> *native);
+  template<typename TNative> void DoCast(GuidedNativeImageIO *nativeIO);
 };
 
 template<class TPixel> class TrivialCastFunctor
@@ -460,7 +579,10 @@ private:
   TCastFunctor m_Functor;
 
   // Method that does the casting
-  template<typename TNative> void DoCast(itk::ImageBase<3> *native);
+  template<typename TNative> void DoCast(GuidedNativeImageIO *nativeIO);
+
+  // Casting of a streamed native image, one slab at a time
+  template<typename TNative> void DoStreamedCast(GuidedNativeImageIO *nativeIO);
 
   friend class RescaleNativeImageToIntegralType<OutputImageType>;
 };
@@ -43,10 +43,14 @@
 #include "LabelImageWrapper.h"
 #include "UndoDataManager.h"
 #include "Rebroadcaster.h"
+#include <algorithm>
 
 LabelImageWrapper::LabelImageWrapper()
 {
-  m_UndoManager = new UndoManagerType(4, 200000);
+  m_UndoManager = new UndoManagerType(4, 64 * 1024 * 1024);
+  m_CommitsSinceCompaction = 0;
+  m_LabelStatisticsValid = false;
+  m_LabelStatisticsTime = 0;
 }
 
 LabelImageWrapper::~LabelImageWrapper()
@@ -59,6 +63,8 @@ void LabelImageWrapper::UpdateImagePointer(
 {
   Superclass::UpdateImagePointer(image, refSpace, tran);
   m_UndoManager->Clear();
+  m_LabelStatistics.clear();
+  m_LabelStatisticsValid = false;
 
   // Modified event on the image is rebroadcast as the WrapperImageChangeEvent
   Rebroadcaster::Rebroadcast(image, itk::ModifiedEvent(),
@@ -67,6 +73,7 @@ void LabelImageWrapper::UpdateImagePointer(
 
 void LabelImageWrapper::StoreIntermediateUndoDelta(UndoManagerDelta *delta)
 {
+  this->AccountForDelta(delta);
   m_UndoManager->AddDeltaToStaging(delta);
 }
 
@@ -74,10 +81,21 @@ void LabelImageWrapper::StoreUndoPoint(const char *text, UndoManagerDelta *delta
 {
   // If there is a delta, add it to staging
   if(delta)
+    {
+    this->AccountForDelta(delta);
     m_UndoManager->AddDeltaToStaging(delta);
+    }
 
   // Commit the deltas
   m_UndoManager->CommitStaging(text);
+
+  // Lines that shrank during editing keep their larger blocks. Every so
+  // often, return that slack to the RLE segment pool.
+  if(++m_CommitsSinceCompaction >= 16)
+    {
+    this->GetImage()->Compact();
+    m_CommitsSinceCompaction = 0;
+    }
 }
 
 void LabelImageWrapper::ClearUndoPoints()
@@ -96,9 +114,13 @@ void LabelImageWrapper::Undo()
   const UndoManagerType::Commit &commit = m_UndoManager->GetCommitForUndo();
 
   // The label image that will undergo undo
-  typedef itk::ImageRegionIterator<ImageType> IteratorType;
   ImageType *imSeg = this->GetImage();
 
+  // The label statistics can be updated as we go if they are current
+  bool track_stats = this->AreLabelStatisticsCurrent();
+  if(!track_stats)
+    m_LabelStatisticsValid = false;
+
   // Iterate over all the deltas in reverse order
   UndoManagerType::DList::const_reverse_iterator dit = commit.GetDeltas().rbegin();
   for(; dit != commit.GetDeltas().rend(); ++dit)
@@ -106,25 +128,18 @@ void LabelImageWrapper::Undo()
     // Apply the changes in the current delta
     UndoManagerType::Delta *delta = *dit;
 
-    // Iterator for the relevant region in the label image
-    IteratorType lit(imSeg, delta->GetRegion());
+    // Apply the spans of the delta to the RLE lines
+    this->ApplyDelta(delta, -1);
 
-    // Iterate over the rles in the delta
-    for(size_t i = 0; i < delta->GetNumberOfRLEs(); i++)
-      {
-      size_t n = delta->GetRLELength(i);
-      LabelType d = delta->GetRLEValue(i);
-      for(size_t j = 0; j < n; j++)
-        {
-        if(d != 0)
-          lit.Set(lit.Get() - d);
-        ++lit;
-        }
-      }
+    // Keep track of the label statistics
+    if(track_stats)
+      this->UpdateLabelStatistics(delta, -1);
     }
 
   // Set modified flags
   imSeg->Modified();
+  if(track_stats)
+    m_LabelStatisticsTime = imSeg->GetMTime();
 }
 
 bool LabelImageWrapper::IsRedoPossible()
@@ -138,9 +153,13 @@ void LabelImageWrapper::Redo()
   const UndoManagerType::Commit &commit = m_UndoManager->GetCommitForRedo();
 
   // The label image that will undergo redo
-  typedef itk::ImageRegionIterator<ImageType> IteratorType;
   ImageType *imSeg = this->GetImage();
 
+  // The label statistics can be updated as we go if they are current
+  bool track_stats = this->AreLabelStatisticsCurrent();
+  if(!track_stats)
+    m_LabelStatisticsValid = false;
+
   // Iterate over all the deltas in reverse order
   UndoManagerType::DList::const_iterator dit = commit.GetDeltas().begin();
   for(; dit != commit.GetDeltas().end(); ++dit)
@@ -148,25 +167,18 @@ void LabelImageWrapper::Redo()
     // Apply the changes in the current delta
     UndoManagerType::Delta *delta = *dit;
 
-    // Iterator for the relevant region in the label image
-    IteratorType lit(imSeg, delta->GetRegion());
+    // Apply the spans of the delta to the RLE lines
+    this->ApplyDelta(delta, 1);
 
-    // Iterate over the rles in the delta
-    for(size_t i = 0; i < delta->GetNumberOfRLEs(); i++)
-      {
-      size_t n = delta->GetRLELength(i);
-      LabelType d = delta->GetRLEValue(i);
-      for(size_t j = 0; j < n; j++)
-        {
-        if(d != 0)
-          lit.Set(lit.Get() + d);
-        ++lit;
-        }
-      }
+    // Keep track of the label statistics
+    if(track_stats)
+      this->UpdateLabelStatistics(delta, 1);
     }
 
   // Set modified flags
   imSeg->Modified();
+  if(track_stats)
+    m_LabelStatisticsTime = imSeg->GetMTime();
 }
 
 LabelImageWrapper::UndoManagerDelta *
@@ -182,3 +194,239 @@ LabelImageWrapper::CompressImage() const
   new_cumulative->FinishEncoding();
   return new_cumulative;
 }
+
+unsigned long LabelImageWrapper::GetNumberOfVoxelsWithLabel(LabelType label)
+{
+  this->CheckLabelStatistics();
+  LabelStatisticsMap::const_iterator it = m_LabelStatistics.find(label);
+  return it == m_LabelStatistics.end() ? 0 : it->second.Count;
+}
+
+bool LabelImageWrapper::GetLabelBoundingBox(LabelType label, itk::ImageRegion<3> &box)
+{
+  this->CheckLabelStatistics();
+  LabelStatisticsMap::const_iterator it = m_LabelStatistics.find(label);
+  if(it == m_LabelStatistics.end())
+    return false;
+
+  // Boxes only grow during incremental updates, tighten them if needed
+  if(it->second.BoundingBoxIsLoose)
+    {
+    this->RecomputeLabelStatistics();
+    it = m_LabelStatistics.find(label);
+    }
+
+  box.SetIndex(it->second.BoundingBox[0]);
+  box.SetUpperIndex(it->second.BoundingBox[1]);
+  return true;
+}
+
+const LabelImageWrapper::LabelStatisticsMap &
+LabelImageWrapper::GetLabelStatistics(bool tight_boxes)
+{
+  this->CheckLabelStatistics();
+  for(LabelStatisticsMap::const_iterator it = m_LabelStatistics.begin();
+      tight_boxes && it != m_LabelStatistics.end(); ++it)
+    {
+    if(it->second.BoundingBoxIsLoose)
+      {
+      this->RecomputeLabelStatistics();
+      break;
+      }
+    }
+
+  return m_LabelStatistics;
+}
+
+bool LabelImageWrapper::AreLabelStatisticsCurrent() const
+{
+  return m_LabelStatisticsValid && this->GetImage()
+      && m_LabelStatisticsTime == this->GetImage()->GetMTime();
+}
+
+void LabelImageWrapper::CheckLabelStatistics()
+{
+  if(!this->AreLabelStatisticsCurrent())
+    this->RecomputeLabelStatistics();
+}
+
+void LabelImageWrapper::RecomputeLabelStatistics()
+{
+  m_LabelStatistics.clear();
+
+  ImageType *image = this->GetImage();
+  if(image)
+    {
+    // Visit the runs of every RLE line of the image
+    typedef itk::ImageRegionConstIterator<ImageType::BufferType> LineIterator;
+    const ImageType::BufferType *buffer = image->GetBuffer();
+    LineIterator it(buffer, buffer->GetBufferedRegion());
+    itk::Index<3> idx;
+    for(; !it.IsAtEnd(); ++it)
+      {
+      const ImageType::RLLine &line = it.Value();
+      idx[0] = image->GetBufferedRegion().GetIndex(0);
+      idx[1] = it.GetIndex()[0];
+      idx[2] = it.GetIndex()[1];
+      for(size_t i = 0; i < line.size(); i++)
+        {
+        this->AddRunToLabelStatistics(line[i].second, idx, line[i].first);
+        idx[0] += line[i].first;
+        }
+      }
+    }
+
+  m_LabelStatisticsValid = true;
+  m_LabelStatisticsTime = image ? image->GetMTime() : 0;
+}
+
+void LabelImageWrapper::AccountForDelta(UndoManagerDelta *delta)
+{
+  // If the image was modified by other means before or after the edit, the
+  // statistics can not be updated incrementally and will be recomputed when
+  // next needed.
+  ImageType *image = this->GetImage();
+  if(m_LabelStatisticsValid && image
+     && delta->GetImageTimeBeforeEdit() == m_LabelStatisticsTime
+     && delta->GetImageTimeAfterEdit() == image->GetMTime())
+    {
+    this->UpdateLabelStatistics(delta, 1);
+    m_LabelStatisticsTime = image->GetMTime();
+    }
+  else
+    {
+    m_LabelStatisticsValid = false;
+    }
+}
+
+unsigned long LabelImageWrapper::UpdateLabelStatistics(UndoManagerDelta *delta, int sign)
+{
+  ImageType *image = this->GetImage();
+  const itk::ImageRegion<3> &region = delta->GetRegion();
+  itk::IndexValueType xBuffer = image->GetBufferedRegion().GetIndex(0);
+  itk::SizeValueType nx = region.GetSize(0), ny = region.GetSize(1);
+  unsigned long nChanged = 0;
+
+  for(size_t i = 0; i < delta->GetNumberOfSpans(); i++)
+    {
+    itk::SizeValueType pos = delta->GetSpanOffset(i);
+    itk::SizeValueType n = delta->GetSpanLength(i);
+    LabelType d = delta->GetSpanValue(i);
+
+    // Changed voxels are visited one scanline segment at a time
+    for(itk::SizeValueType p = pos; p < pos + n; )
+      {
+      itk::Index<3> idx;
+      idx[0] = region.GetIndex(0) + p % nx;
+      idx[1] = region.GetIndex(1) + (p / nx) % ny;
+      idx[2] = region.GetIndex(2) + p / (nx * ny);
+      itk::IndexValueType len = std::min(pos + n - p, nx - p % nx);
+      itk::IndexValueType xEnd = idx[0] + len;
+
+      // Walk the runs of the image that overlap the segment. The image holds
+      // the labels after the change has been applied (sign = 1) or reverted
+      const ImageType::RLLine &line =
+          image->GetBuffer()->GetPixel(ImageType::truncateIndex(idx));
+      itk::IndexValueType r, remainder;
+      image->LocateRun(line, idx[0] - xBuffer, r, remainder);
+      while(idx[0] < xEnd)
+        {
+        itk::IndexValueType m = std::min(remainder, xEnd - idx[0]);
+        LabelType lCurrent = line[r].second;
+        LabelType lPrevious = (sign > 0) ? lCurrent - d : lCurrent + d;
+        this->AddRunToLabelStatistics(lCurrent, idx, m);
+        this->AddRunToLabelStatistics(lPrevious, idx, -m);
+        idx[0] += m;
+        if(++r < (itk::IndexValueType) line.size())
+          remainder = line[r].first;
+        }
+
+      nChanged += len;
+      p += len;
+      }
+    }
+
+  return nChanged;
+}
+
+// Adds the value of a delta span to the labels it covers
+struct AddLabelOperation
+{
+  LabelType operator()(LabelType label, long) const { return LabelType(label + Delta); }
+  LabelType Delta;
+};
+
+void LabelImageWrapper::ApplyDelta(UndoManagerDelta *delta, int sign)
+{
+  ImageType *image = this->GetImage();
+  const itk::ImageRegion<3> &region = delta->GetRegion();
+  itk::IndexValueType xBuffer = image->GetBufferedRegion().GetIndex(0);
+  itk::SizeValueType nx = region.GetSize(0), ny = region.GetSize(1);
+
+  ImageType::RLLine buffer;
+  for(size_t i = 0; i < delta->GetNumberOfSpans(); i++)
+    {
+    itk::SizeValueType pos = delta->GetSpanOffset(i);
+    itk::SizeValueType n = delta->GetSpanLength(i);
+    AddLabelOperation op;
+    op.Delta = (sign > 0) ? delta->GetSpanValue(i) : LabelType(-delta->GetSpanValue(i));
+
+    // Each scanline segment of the span is applied by rewriting its RLE line
+    for(itk::SizeValueType p = pos; p < pos + n; )
+      {
+      itk::Index<3> idx;
+      idx[0] = region.GetIndex(0) + p % nx;
+      idx[1] = region.GetIndex(1) + (p / nx) % ny;
+      idx[2] = region.GetIndex(2) + p / (nx * ny);
+      itk::IndexValueType len = std::min(pos + n - p, nx - p % nx);
+      itk::IndexValueType s0 = idx[0] - xBuffer, s1 = s0 + len;
+
+      ImageType::RLLine &line =
+          image->GetBuffer()->GetPixel(ImageType::truncateIndex(idx));
+      image->RewriteLineSpan(line, s0, s1, op, buffer);
+      p += len;
+      }
+    }
+}
+
+void LabelImageWrapper::AddRunToLabelStatistics(
+    LabelType label, const itk::Index<3> &start, long length)
+{
+  if(length > 0)
+    {
+    itk::Index<3> end = start; end[0] += length - 1;
+    std::pair<LabelStatisticsMap::iterator, bool> ins =
+        m_LabelStatistics.insert(std::make_pair(label, LabelStatistics()));
+    LabelStatistics &ls = ins.first->second;
+    if(ins.second)
+      {
+      ls.Count = length;
+      ls.BoundingBox[0] = start;
+      ls.BoundingBox[1] = end;
+      ls.BoundingBoxIsLoose = false;
+      }
+    else
+      {
+      ls.Count += length;
+      for(int d = 0; d < 3; d++)
+        {
+        ls.BoundingBox[0][d] = std::min(ls.BoundingBox[0][d], start[d]);
+        ls.BoundingBox[1][d] = std::max(ls.BoundingBox[1][d], end[d]);
+        }
+      }
+    }
+  else if(length < 0)
+    {
+    LabelStatisticsMap::iterator it = m_LabelStatistics.find(label);
+    if(it != m_LabelStatistics.end())
+      {
+      if(it->second.Count <= (unsigned long) -length)
+        m_LabelStatistics.erase(it);
+      else
+        {
+        it->second.Count -= (unsigned long) -length;
+        it->second.BoundingBoxIsLoose = true;
+        }
+      }
+    }
+}
@@ -3,6 +3,7 @@
 
 #include "ImageWrapperTraits.h"
 #include "ScalarImageWrapper.h"
+#include <map>
 
 template <typename TPixel> class UndoDataManager;
 template <typename TPixel> class UndoDelta;
@@ -30,6 +31,23 @@ public:
   typedef UndoDataManager<PixelType> UndoManagerType;
   typedef UndoDelta<PixelType>       UndoManagerDelta;
 
+  /** Number of voxels and bounding box of a label in the segmentation */
+  struct LabelStatistics
+  {
+    // The number of voxels
+    unsigned long Count;
+
+    // The extents of the bounding box (inclusive)
+    itk::Index<3> BoundingBox[2];
+
+    // Whether voxels have been removed from the label since the bounding
+    // box was computed, in which case the box may be too large
+    bool BoundingBoxIsLoose;
+  };
+
+  // Statistics for all labels present in the segmentation, including 0
+  typedef std::map<LabelType, LabelStatistics> LabelStatisticsMap;
+
   /**
    * We override the SetImage method to reset the undo manager when an image is
    * assigned to the segmentation.
@@ -76,6 +94,28 @@ public:
    * array created in this call. */
   UndoManagerDelta *CompressImage() const;
 
+  /**
+   * Get the number of voxels that have the given label. The label counts are
+   * kept up to date using the undo deltas of each edit, so this call does not
+   * require a pass through the image, unless the image has been modified by
+   * other means since the last call.
+   */
+  unsigned long GetNumberOfVoxelsWithLabel(LabelType label);
+
+  /**
+   * Get the bounding box of the voxels that have the given label. Returns
+   * false if there are no such voxels.
+   */
+  bool GetLabelBoundingBox(LabelType label, itk::ImageRegion<3> &box);
+
+  /**
+   * Get the voxel counts and bounding boxes of all labels in the image. If
+   * tight_boxes is false, the bounding boxes of labels that have lost voxels
+   * may be too large (BoundingBoxIsLoose), but no pass through the image is
+   * needed to tighten them.
+   */
+  const LabelStatisticsMap &GetLabelStatistics(bool tight_boxes = true);
+
 protected:
 
   LabelImageWrapper();
@@ -85,6 +125,44 @@ protected:
   // image. These deltas are compressed, allowing us to store a bunch of
   // undo steps with little cost in performance or memory
   UndoManagerType *m_UndoManager;
+
+  // Number of undo points stored since the RLE lines were last compacted
+  unsigned int m_CommitsSinceCompaction;
+
+  // Per-label voxel counts and bounding boxes
+  LabelStatisticsMap m_LabelStatistics;
+
+  // Whether m_LabelStatistics describes the image as it was at the
+  // modification time m_LabelStatisticsTime
+  bool m_LabelStatisticsValid;
+  itk::ModifiedTimeType m_LabelStatisticsTime;
+
+  // Are the label statistics valid for the image as it is now?
+  bool AreLabelStatisticsCurrent() const;
+
+  // Make sure the label statistics are up to date, scanning the image if
+  // there have been changes that were not reported in a delta
+  void CheckLabelStatistics();
+
+  // Compute the label statistics from the image
+  void RecomputeLabelStatistics();
+
+  // Update the label statistics for a delta that has been applied to the
+  // image (sign = 1) or reverted from the image (sign = -1). Returns the
+  // number of voxels changed by the delta
+  unsigned long UpdateLabelStatistics(UndoManagerDelta *delta, int sign);
+
+  // Account for the delta of an edit that has just been applied to the image.
+  // The statistics are updated from the delta only if they were current just
+  // before the edit and the edit is the only change made to the image since.
+  void AccountForDelta(UndoManagerDelta *delta);
+
+  // Apply the changes in a delta to the image (sign = 1) or revert them
+  // (sign = -1), rewriting the affected RLE lines one segment at a time
+  void ApplyDelta(UndoManagerDelta *delta, int sign);
+
+  // Add voxels to a label, or remove voxels from it (length < 0)
+  void AddRunToLabelStatistics(LabelType label, const itk::Index<3> &start, long length);
 };
 
 #endif // LABELIMAGEWRAPPER_H
@@ -0,0 +1,125 @@
+#include "MemoryMappedFile.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+#include "itksys/SystemTools.hxx"
+#include <map>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Number of mappings of each file that is currently mapped, by full path.
+// Never destroyed, so that images with static storage can be released safely
+typedef std::map<std::string, int> MappedFileCountMap;
+
+static MappedFileCountMap &GetMappedFiles()
+{
+  static MappedFileCountMap *files = new MappedFileCountMap();
+  return *files;
+}
+
+static itk::SimpleFastMutexLock &GetMappedFilesMutex()
+{
+  static itk::SimpleFastMutexLock *mutex = new itk::SimpleFastMutexLock();
+  return *mutex;
+}
+
+MemoryMappedFile::MemoryMappedFile()
+{
+  m_Data = NULL;
+  m_Size = 0;
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  this->Unmap();
+}
+
+bool
+MemoryMappedFile::Map(const char *filename)
+{
+  this->Unmap();
+
+  // The file and mapping handles can be closed right away, the mapped view
+  // keeps a reference to the file
+  void *data = NULL;
+  std::size_t size = 0;
+
+#ifdef WIN32
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER fsize;
+  HANDLE mapping = NULL;
+  if(GetFileSizeEx(file, &fsize) && fsize.QuadPart > 0)
+    mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if(mapping)
+    {
+    data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    size = (std::size_t) fsize.QuadPart;
+    CloseHandle(mapping);
+    }
+  CloseHandle(file);
+#else
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+      data = NULL;
+    size = st.st_size;
+    }
+  close(fd);
+#endif
+
+  if(!data)
+    return false;
+
+  m_Data = static_cast<char *>(data);
+  m_Size = size;
+  m_FileName = itksys::SystemTools::CollapseFullPath(filename);
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(GetMappedFilesMutex());
+  GetMappedFiles()[m_FileName]++;
+  return true;
+}
+
+void
+MemoryMappedFile::Unmap()
+{
+  if(!m_Data)
+    return;
+
+#ifdef WIN32
+  UnmapViewOfFile(m_Data);
+#else
+  munmap(m_Data, m_Size);
+#endif
+
+  m_Data = NULL;
+  m_Size = 0;
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(GetMappedFilesMutex());
+  MappedFileCountMap::iterator it = GetMappedFiles().find(m_FileName);
+  if(it != GetMappedFiles().end() && --it->second == 0)
+    GetMappedFiles().erase(it);
+}
+
+bool
+MemoryMappedFile::IsFileMapped(const char *filename)
+{
+  std::string fullpath = itksys::SystemTools::CollapseFullPath(filename);
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(GetMappedFilesMutex());
+  return GetMappedFiles().count(fullpath) > 0;
+}
@@ -0,0 +1,85 @@
+#ifndef MEMORYMAPPEDFILE_H
+#define MEMORYMAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+#include "SNAPCommon.h"
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkImportImageContainer.h"
+
+/**
+  A file mapped into memory. The operating system loads the pages of the
+  file when they are first accessed, and can evict them again when memory is
+  short, since they are backed by the file. The mapping is copy-on-write:
+  changes to the mapped data stay private to the process and never reach the
+  file.
+
+  While a file is mapped, it must not be overwritten in place. Writers should
+  check IsFileMapped() and replace such files instead.
+  */
+class MemoryMappedFile : public itk::Object
+{
+public:
+  irisITKObjectMacro(MemoryMappedFile, itk::Object)
+
+  /** Map a file. Returns false if the file can not be mapped. */
+  bool Map(const char *filename);
+
+  /** Release the mapping */
+  void Unmap();
+
+  /** The mapped data, or NULL if no file is mapped */
+  char *GetData() const { return m_Data; }
+
+  /** Size of the mapped file in bytes */
+  std::size_t GetSize() const { return m_Size; }
+
+  /** Is a file currently mapped by any MemoryMappedFile object? */
+  static bool IsFileMapped(const char *filename);
+
+protected:
+  MemoryMappedFile();
+  virtual ~MemoryMappedFile();
+
+  char *m_Data;
+  std::size_t m_Size;
+
+  // Full path of the mapped file
+  std::string m_FileName;
+};
+
+
+/**
+  Pixel container whose elements are part of a memory-mapped file. It can be
+  used wherever an itk::ImportImageContainer is expected, and holds on to the
+  mapping until it is destroyed. The container does not manage its memory,
+  so code that converts pixel data in place must copy them instead.
+  */
+template <class TElement>
+class MemoryMappedImageContainer
+    : public itk::ImportImageContainer<itk::SizeValueType, TElement>
+{
+public:
+  typedef MemoryMappedImageContainer Self;
+  typedef itk::ImportImageContainer<itk::SizeValueType, TElement> Superclass;
+  typedef itk::SmartPointer<Self> Pointer;
+  typedef itk::SmartPointer<const Self> ConstPointer;
+
+  itkNewMacro(Self)
+  itkTypeMacro(MemoryMappedImageContainer, ImportImageContainer)
+
+  /** Use n elements of the mapped data, starting at the given byte offset */
+  void SetMappedFile(MemoryMappedFile *file, std::size_t offset, itk::SizeValueType n)
+  {
+    m_File = file;
+    this->SetImportPointer(reinterpret_cast<TElement *>(file->GetData() + offset), n, false);
+  }
+
+protected:
+  MemoryMappedImageContainer() {}
+
+  SmartPtr<MemoryMappedFile> m_File;
+};
+
+#endif // MEMORYMAPPEDFILE_H
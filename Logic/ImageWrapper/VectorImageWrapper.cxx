@@ -32,7 +32,10 @@
 #include "UnaryFunctorVectorImageFilter.h"
 #include "GuidedNativeImageIO.h"
 #include "itkImageFileWriter.h"
+#include "itkMultiThreader.h"
+#include "DerivedQuantityCache.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include "itkVectorGradientAnisotropicDiffusionImageFilter.h"
@@ -48,12 +51,20 @@ VectorImageWrapper<TTraits,TBase>
   // Initialize the filters
   m_MinMaxFilter = MinMaxFilterType::New();
   m_HistogramFilter = HistogramFilterType::New();
+
+  m_MaterializeDerivedQuantities = true;
+  m_ObservedImage = NULL;
+  m_ModifiedObserverTag = 0;
 }
 
 template <class TTraits, class TBase>
 VectorImageWrapper<TTraits,TBase>
 ::~VectorImageWrapper()
 {
+  // The cache must not call back into a deleted wrapper
+  ReleaseDerivedQuantities();
+  if(m_ObservedImage)
+    m_ObservedImage->RemoveObserver(m_ModifiedObserverTag);
 }
 
 
@@ -143,6 +154,9 @@ VectorImageWrapper<TTraits,TBase>
 {
   Superclass::SetNativeMapping(mapping);
 
+  // Materialized quantities were computed with the old mapping
+  ReleaseDerivedQuantities();
+
   // Propagate the mapping to the histogram
   m_HistogramFilter->SetIntensityTransform(mapping.GetScale(), mapping.GetShift());
 
@@ -198,6 +212,213 @@ VectorImageWrapper<TTraits,TBase>
   accessor.SetSourceNativeMapping(mapping.GetScale(), mapping.GetShift());
 }
 
+/**
+ * Computes a derived quantity for all voxels of a vector image. Each thread
+ * handles a contiguous range of voxels, in blocks of the functor's block size.
+ */
+template <class TFunctor>
+class DerivedQuantityKernel
+{
+public:
+  typedef typename TFunctor::InputPixelType InputPixelType;
+  typedef typename TFunctor::OutputPixelType OutputPixelType;
+
+  const TFunctor *Functor;
+  const InputPixelType *Input;
+  OutputPixelType *Output;
+  int Components;
+  itk::SizeValueType Voxels;
+
+  void Execute()
+  {
+    int nThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    itk::SizeValueType nBlocks = (Voxels + TFunctor::BlockSize - 1) / TFunctor::BlockSize;
+    nThreads = (int) std::max((itk::SizeValueType) 1,
+                              std::min((itk::SizeValueType) nThreads, nBlocks));
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(nThreads);
+    threader->SetSingleMethod(ThreadCallback, this);
+    threader->SingleMethodExecute();
+  }
+
+  static ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg)
+  {
+    typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+    ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+    DerivedQuantityKernel *self = static_cast<DerivedQuantityKernel *>(info->UserData);
+
+    // Ranges are whole numbers of blocks
+    itk::SizeValueType bs = TFunctor::BlockSize;
+    itk::SizeValueType nBlocks = (self->Voxels + bs - 1) / bs;
+    itk::SizeValueType perThread = (nBlocks + info->NumberOfThreads - 1) / info->NumberOfThreads;
+    itk::SizeValueType start = std::min(self->Voxels, perThread * bs * info->ThreadID);
+    itk::SizeValueType end = std::min(self->Voxels, start + perThread * bs);
+
+    for(itk::SizeValueType j = start; j < end; j += bs)
+      {
+      int n = (int) std::min(bs, end - j);
+      self->Functor->GetBlock(self->Input + j * self->Components, self->Components,
+                              self->Output + j, n);
+      }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+};
+
+template <class TTraits, class TBase>
+template <class TFunctor>
+void
+VectorImageWrapper<TTraits,TBase>
+::MaterializeDerivedWrapper(ScalarImageWrapperBase *w)
+{
+  typedef VectorDerivedQuantityImageWrapperTraits<TFunctor> WrapperTraits;
+  typedef typename WrapperTraits::WrapperType DerivedWrapper;
+  typedef typename DerivedWrapper::ImageType AdaptorType;
+  typedef typename AdaptorType::AccessorType PixelAccessor;
+  typedef typename PixelAccessor::MaterializedContainer Container;
+
+  DerivedWrapper *dw = dynamic_cast<DerivedWrapper *>(w);
+  PixelAccessor &accessor = dw->GetImage()->GetPixelAccessor();
+
+  ImageType *image = this->m_Image;
+  itk::SizeValueType nVoxels = image->GetBufferedRegion().GetNumberOfPixels();
+
+  SmartPtr<Container> values = Container::New();
+  values->Reserve(nVoxels);
+
+  DerivedQuantityKernel<TFunctor> kernel;
+  kernel.Functor = &accessor.GetFunctor();
+  kernel.Input = image->GetBufferPointer();
+  kernel.Output = values->GetBufferPointer();
+  kernel.Components = image->GetNumberOfComponentsPerPixel();
+  kernel.Voxels = nVoxels;
+  kernel.Execute();
+
+  // The values equal the ones computed on access, so there is no need to
+  // modify the adaptor
+  accessor.SetMaterializedValues(image->GetBufferPointer(), values);
+}
+
+template <class TTraits, class TBase>
+template <class TFunctor>
+void
+VectorImageWrapper<TTraits,TBase>
+::ReleaseDerivedWrapper(ScalarImageWrapperBase *w)
+{
+  typedef VectorDerivedQuantityImageWrapperTraits<TFunctor> WrapperTraits;
+  typedef typename WrapperTraits::WrapperType DerivedWrapper;
+  typedef typename DerivedWrapper::ImageType AdaptorType;
+  typedef typename AdaptorType::AccessorType PixelAccessor;
+
+  DerivedWrapper *dw = dynamic_cast<DerivedWrapper *>(w);
+  if(dw)
+    dw->GetImage()->GetPixelAccessor().SetMaterializedValues(NULL, NULL);
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::MaterializeDerivedQuantity(ScalarRepresentation type)
+{
+  ScalarRepIterator itRep = m_ScalarReps.find(std::make_pair(type, 0));
+  if(itRep == m_ScalarReps.end() || !this->m_Image || !this->m_Image->GetBufferPointer())
+    return;
+
+  ScalarImageWrapperBase *w = itRep->second;
+
+  typename DerivedQuantityMap::iterator it = m_DerivedQuantities.find(type);
+  if(it == m_DerivedQuantities.end())
+    {
+    // The derived quantities are single precision floats
+    size_t bytes = this->m_Image->GetBufferedRegion().GetNumberOfPixels() * sizeof(float);
+    if(!DerivedQuantityCache::GetInstance().Fits(bytes))
+      return;
+
+    if(type == SCALAR_REP_MAGNITUDE)
+      this->template MaterializeDerivedWrapper<MagnitudeFunctor>(w);
+    else if(type == SCALAR_REP_MAX)
+      this->template MaterializeDerivedWrapper<MaxFunctor>(w);
+    else
+      this->template MaterializeDerivedWrapper<MeanFunctor>(w);
+
+    DerivedQuantity dq;
+    dq.Owner = this;
+    dq.Type = type;
+    dq.Bytes = bytes;
+    it = m_DerivedQuantities.insert(std::make_pair(type, dq)).first;
+    }
+
+  DerivedQuantityCache::GetInstance().Touch(
+        &it->second, it->second.Bytes, &Self::ReleaseDerivedQuantityCallback);
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::ReleaseDerivedQuantity(ScalarRepresentation type)
+{
+  typename DerivedQuantityMap::iterator it = m_DerivedQuantities.find(type);
+  if(it == m_DerivedQuantities.end())
+    return;
+
+  DerivedQuantityCache::GetInstance().Remove(&it->second);
+  m_DerivedQuantities.erase(it);
+
+  ScalarRepIterator itRep = m_ScalarReps.find(std::make_pair(type, 0));
+  if(itRep == m_ScalarReps.end())
+    return;
+
+  if(type == SCALAR_REP_MAGNITUDE)
+    this->template ReleaseDerivedWrapper<MagnitudeFunctor>(itRep->second);
+  else if(type == SCALAR_REP_MAX)
+    this->template ReleaseDerivedWrapper<MaxFunctor>(itRep->second);
+  else
+    this->template ReleaseDerivedWrapper<MeanFunctor>(itRep->second);
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::ReleaseDerivedQuantities()
+{
+  while(!m_DerivedQuantities.empty())
+    ReleaseDerivedQuantity(m_DerivedQuantities.begin()->first);
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::ReleaseDerivedQuantityCallback(void *client)
+{
+  DerivedQuantity *dq = static_cast<DerivedQuantity *>(client);
+  dq->Owner->ReleaseDerivedQuantity(dq->Type);
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::OnImageModified()
+{
+  // The voxels may have changed, so the quantities are computed again when
+  // they are next requested
+  ReleaseDerivedQuantities();
+}
+
+template <class TTraits, class TBase>
+void
+VectorImageWrapper<TTraits,TBase>
+::SetMaterializeDerivedQuantities(bool flag)
+{
+  if(flag != m_MaterializeDerivedQuantities)
+    {
+    m_MaterializeDerivedQuantities = flag;
+    if(!flag)
+      ReleaseDerivedQuantities();
+    this->Modified();
+    }
+}
+
 template <class TTraits, class TBase>
 template <class TFunctor>
 SmartPtr<ScalarImageWrapperBase>
@@ -235,6 +456,9 @@ void
 VectorImageWrapper<TTraits,TBase>
 ::UpdateImagePointer(ImageType *newImage, ImageBaseType *referenceSpace, ITKTransformType *transform)
 {
+  // Quantities materialized for the old image belong to the old wrappers
+  ReleaseDerivedQuantities();
+
   // Create the component wrappers before calling the parent's method.
   int nc = newImage->GetNumberOfComponentsPerPixel();
 
@@ -328,6 +552,21 @@ VectorImageWrapper<TTraits,TBase>
   // Call the parent's method = this will initialize the display mapping
   Superclass::UpdateImagePointer(newImage, referenceSpace, transform);
 
+  // Derived quantities of the new image are discarded when it is modified
+  if(m_ObservedImage != newImage)
+    {
+    if(m_ObservedImage)
+      m_ObservedImage->RemoveObserver(m_ModifiedObserverTag);
+
+    m_ObservedImage = newImage;
+    if(newImage)
+      {
+      typedef itk::SimpleMemberCommand<Self> CommandType;
+      typename CommandType::Pointer cmd = CommandType::New();
+      cmd->SetCallbackFunction(this, &Self::OnImageModified);
+      m_ModifiedObserverTag = newImage->AddObserver(itk::ModifiedEvent(), cmd);
+      }
+    }
 }
 
 template<class TTraits, class TBase>
@@ -380,6 +619,12 @@ VectorImageWrapper<TTraits,TBase>
     ScalarRepresentation type,
     int index)
 {
+  if(m_MaterializeDerivedQuantities
+     && (type == SCALAR_REP_MAGNITUDE || type == SCALAR_REP_MAX || type == SCALAR_REP_AVERAGE))
+    {
+    this->MaterializeDerivedQuantity(type);
+    }
+
   return m_ScalarReps[std::make_pair(type, index)];
 }
 
@@ -264,6 +264,17 @@ public:
   /** Same as CreateCastToFloatPipeline, but for vector images of single dimension */
   virtual SmartPtr<DoubleVectorImageSource> CreateCastToDoubleVectorPipeline() const ITK_OVERRIDE;
 
+  /**
+    Whether the derived quantities (magnitude, maximum, mean) are computed for
+    the whole image when their scalar representation is requested, instead of
+    from the components on every voxel access. The computed quantities count
+    against the budget of the DerivedQuantityCache, which may release them,
+    and they are discarded whenever the image or its native mapping changes.
+    On by default.
+    */
+  virtual void SetMaterializeDerivedQuantities(bool flag);
+  itkGetMacro(MaterializeDerivedQuantities, bool)
+
 protected:
 
   /**
@@ -275,7 +286,9 @@ protected:
   /**
    * Copy constructor.  Copies the contents of the passed-in image wrapper.
    */
-  VectorImageWrapper(const Self &copy) : Superclass(copy) {}
+  VectorImageWrapper(const Self &copy)
+    : Superclass(copy), m_MaterializeDerivedQuantities(copy.m_MaterializeDerivedQuantities),
+      m_ObservedImage(NULL), m_ModifiedObserverTag(0) {}
 
   virtual void UpdateImagePointer(ImageType *image,
                                   ImageBaseType *refSpace = NULL,
@@ -298,6 +311,27 @@ protected:
   void SetNativeMappingInDerivedWrapper(
       ScalarImageWrapperBase *w, NativeIntensityMapping &mapping);
 
+  /** Compute the derived quantity of a derived wrapper for the whole image */
+  template <class TFunctor>
+  void MaterializeDerivedWrapper(ScalarImageWrapperBase *w);
+
+  /** Go back to computing the derived quantity on every access */
+  template <class TFunctor>
+  void ReleaseDerivedWrapper(ScalarImageWrapperBase *w);
+
+  /** Materialize a derived quantity if needed, and mark it as used */
+  void MaterializeDerivedQuantity(ScalarRepresentation type);
+
+  /** Release materialized derived quantities */
+  void ReleaseDerivedQuantity(ScalarRepresentation type);
+  void ReleaseDerivedQuantities();
+
+  /** Called by the DerivedQuantityCache to release a derived quantity */
+  static void ReleaseDerivedQuantityCallback(void *client);
+
+  /** Called when the image is modified */
+  void OnImageModified();
+
   // Array of derived quantities
   typedef SmartPtr<ScalarImageWrapperBase> ScalarWrapperPointer;
   typedef std::pair<ScalarRepresentation, int> ScalarRepIndex;
@@ -327,6 +361,22 @@ protected:
   typedef VectorToScalarMaxFunctor<InternalPixelType, float> MaxFunctor;
   typedef VectorToScalarMeanFunctor<InternalPixelType,float> MeanFunctor;
 
+  // Materialized derived quantities, registered with the DerivedQuantityCache
+  // by their address
+  struct DerivedQuantity
+  {
+    Self *Owner;
+    ScalarRepresentation Type;
+    size_t Bytes;
+  };
+  typedef std::map<ScalarRepresentation, DerivedQuantity> DerivedQuantityMap;
+  DerivedQuantityMap m_DerivedQuantities;
+
+  bool m_MaterializeDerivedQuantities;
+
+  // The image observed for modifications
+  ImageType *m_ObservedImage;
+  unsigned long m_ModifiedObserverTag;
 };
 
 #endif // __VectorImageWrapper_h_
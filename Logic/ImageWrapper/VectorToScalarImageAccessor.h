@@ -2,6 +2,7 @@
 #define VECTORTOSCALARIMAGEACCESSOR_H
 
 #include "itkDefaultVectorPixelAccessor.h"
+#include "itkImportImageContainer.h"
 
 namespace itk
 {
@@ -12,6 +13,11 @@ template <class TPixel, unsigned int Vdim> class VectorImage;
 /**
  * An accessor very similar to itk::VectorImageToImageAccessor that allows us
  * to extract certain computed quantities from the vectors, such as magnitude
+ *
+ * The quantity may also be materialized: the accessor can be given a buffer
+ * holding the precomputed quantity for every voxel of the vector image. The
+ * buffer is only used for accesses relative to the start of the vector image
+ * buffer it was computed from (as in the pixel access functors of iterators).
  */
 template <class TFunctor>
 class VectorToScalarImageAccessor
@@ -25,6 +31,12 @@ public:
   typedef itk::VariableLengthVector<ExternalType> ActualPixelType;
   typedef unsigned int VectorLengthType;
 
+  /** Container for the materialized values of the quantity */
+  typedef itk::ImportImageContainer<SizeValueType, ExternalType> MaterializedContainer;
+
+  VectorToScalarImageAccessor()
+    : m_MaterializedSource(NULL), m_MaterializedValues(NULL) {}
+
   inline void Set(ActualPixelType output, const ExternalType &input) const
     { output.Fill(input); }
 
@@ -40,7 +52,11 @@ public:
 
   inline ExternalType Get(const InternalType &input,
                           const SizeValueType offset) const
-    { return Get(Superclass::Get(input, offset)); }
+    {
+    if(&input == m_MaterializedSource)
+      return m_MaterializedValues[offset];
+    return Get(Superclass::Get(input, offset));
+    }
 
   void SetVectorLength(VectorLengthType l)
     {
@@ -62,8 +78,31 @@ public:
     m_Functor.SetSourceNativeMapping(scale, shift);
   }
 
+  /** The functor that computes the quantity */
+  const TFunctor &GetFunctor() const { return m_Functor; }
+
+  /**
+   * Use precomputed values of the quantity for the vector image whose buffer
+   * starts at source. The container must hold one value per voxel. Pass NULL
+   * for either argument to compute the quantity on every access again.
+   */
+  void SetMaterializedValues(const InternalType *source, MaterializedContainer *values)
+  {
+    m_Materialized = values;
+    m_MaterializedSource = values ? source : NULL;
+    m_MaterializedValues = (values && source) ? values->GetBufferPointer() : NULL;
+  }
+
+  /** Whether the accessor currently uses precomputed values */
+  bool IsMaterialized() const { return m_MaterializedSource != NULL; }
+
 protected:
   TFunctor m_Functor;
+
+  // Precomputed values, shared by the copies of the accessor
+  itk::SmartPointer<MaterializedContainer> m_Materialized;
+  const InternalType *m_MaterializedSource;
+  const ExternalType *m_MaterializedValues;
 };
 
 /**
@@ -99,6 +138,14 @@ public:
 
   virtual void ParametersUpdated() {};
 
+  /**
+   * Largest number of voxels passed to the GetBlock() methods of the functors
+   * below. These methods compute the quantity for a run of voxels, looping over
+   * the components outside of the loop over the voxels so that the compiler
+   * can vectorize the inner loop. They give exactly the same values as Get().
+   */
+  static const int BlockSize = 256;
+
 protected:
 
   // Mapping from internal to native in the wrapped image
@@ -145,6 +192,29 @@ public:
     return static_cast<OutputPixelType>(norm_raw_out);
   }
 
+  void GetBlock(const InputPixelType *input, int n_comp,
+                OutputPixelType *output, int n) const
+  {
+    double sumT2[BlockSize], sumT[BlockSize];
+    for(int j = 0; j < n; j++)
+      sumT2[j] = sumT[j] = 0.0;
+
+    for(int i = 0; i < n_comp; i++)
+      {
+      const InputPixelType *p = input + i;
+      for(int j = 0; j < n; j++)
+        {
+        double t = p[j * n_comp];
+        sumT2[j] += t * t;
+        sumT[j] += t;
+        }
+      }
+
+    for(int j = 0; j < n; j++)
+      output[j] = static_cast<OutputPixelType>(
+            sqrt(m_CoeffT2 * sumT2[j] + m_CoeffT1 * sumT[j] + m_CoeffT0));
+  }
+
   virtual void ParametersUpdated()
   {
     m_CoeffT2 = (this->m_Scale * this->m_Scale);
@@ -176,6 +246,24 @@ public:
       mymax = std::max(input[i], mymax);
     return static_cast<OutputPixelType>(mymax * this->m_Scale + this->m_Shift);
   }
+
+  void GetBlock(const InputPixelType *input, int n_comp,
+                OutputPixelType *output, int n) const
+  {
+    InputPixelType mymax[BlockSize];
+    for(int j = 0; j < n; j++)
+      mymax[j] = input[j * n_comp];
+
+    for(int i = 1; i < n_comp; i++)
+      {
+      const InputPixelType *p = input + i;
+      for(int j = 0; j < n; j++)
+        mymax[j] = std::max(p[j * n_comp], mymax[j]);
+      }
+
+    for(int j = 0; j < n; j++)
+      output[j] = static_cast<OutputPixelType>(mymax[j] * this->m_Scale + this->m_Shift);
+  }
 };
 
 template <class TInputPixel, class TOutputPixel>
@@ -198,6 +286,24 @@ public:
     mean /= n_comp;
     return static_cast<OutputPixelType>(mean * this->m_Scale + this->m_Shift);
   }
+
+  void GetBlock(const InputPixelType *input, int n_comp,
+                OutputPixelType *output, int n) const
+  {
+    double mean[BlockSize];
+    for(int j = 0; j < n; j++)
+      mean[j] = 0.0;
+
+    for(int i = 0; i < n_comp; i++)
+      {
+      const InputPixelType *p = input + i;
+      for(int j = 0; j < n; j++)
+        mean[j] += p[j * n_comp];
+      }
+
+    for(int j = 0; j < n; j++)
+      output[j] = static_cast<OutputPixelType>((mean[j] / n_comp) * this->m_Scale + this->m_Shift);
+  }
 };
 
 
@@ -39,6 +39,8 @@
 
 #include "SnakeParameters.h"
 #include "SNAPLevelSetFunction.h"
+#include <map>
+#include <vector>
 // #include "SNAPLevelSetStopAndGoFilter.h"
 
 template <class TFilter> class LevelSetExtensionFilter;
@@ -92,6 +94,9 @@ public:
   /** Restart the snake */
   virtual void Restart() = 0;
 
+  /** Go back or forward to a checkpoint of the evolution */
+  virtual unsigned int RestoreCheckpoint(unsigned int iteration) = 0;
+
   /** Clean up the snake's state */
   virtual void CleanUp() = 0;
 };
@@ -105,6 +110,29 @@ public:
  * level set evolution is implemented in ITK.  This gives the software a bit of 
  * modularity.  As far as SNAP cares, the public methods declared in this class are
  * the only ways to control level set evolution.
+ *
+ * The driver saves checkpoints of the level set function every few iterations
+ * (see SetCheckpointInterval), so that the evolution can be rewound to an
+ * earlier iteration, or continued from it with different parameters, without
+ * being replayed from the start. A checkpoint stores the level set function
+ * run-length encoded in raster order. With the sparse field solver, all
+ * voxels outside of the narrow band hold one of two constant values, so a
+ * checkpoint takes about 8 bytes per narrow band voxel plus 16 bytes per
+ * crossing of the band by an image row. For a blob with a surface of 10^5
+ * voxels that is a few megabytes, compared with 4 bytes per voxel (64 MB for
+ * a 256^3 image) for a plain copy. With the dense solver the values vary
+ * everywhere and a checkpoint can take up to twice the size of the image.
+ * When the checkpoints exceed the memory limit, every other one is dropped
+ * and the interval is doubled. The sparse layers are not stored; they are
+ * rebuilt from the level set function when a checkpoint is restored.
+ *
+ * Saving a checkpoint scans the whole image, while an iteration of the
+ * sparse field solver only visits the narrow band, so on a large image with
+ * a small snake a checkpoint can cost more than the iterations between two
+ * of them. A checkpoint that falls due is therefore skipped unless the time
+ * spent evolving since the last one is large enough for the time taken to
+ * save that one to be within a given fraction of it (10% by default, see
+ * SetCheckpointTimeLimit).
  */
 template <unsigned int VDimension> 
 class SNAPLevelSetDriver : public SNAPLevelSetDriverBase
@@ -167,7 +195,54 @@ public:
 
   /** Clean up the snake's state */
   void CleanUp();
-  
+
+  /** Save a checkpoint of the current state of the evolution */
+  void SaveCheckpoint();
+
+  /** Iterations at which checkpoints are available, in increasing order */
+  std::vector<unsigned int> GetCheckpointIterations() const;
+
+  /**
+   * Go back or forward to the latest checkpoint saved at or before the given
+   * iteration, and return the iteration of that checkpoint. The evolution
+   * continues from there on the next call to Run(), with the current snake
+   * parameters. Checkpoints past the restored one can still be restored
+   * until Run() is called, which discards them.
+   */
+  unsigned int RestoreCheckpoint(unsigned int iteration);
+
+  /** Number of iterations between checkpoints (0 turns checkpoints off) */
+  void SetCheckpointInterval(unsigned int n)
+    { m_CheckpointInterval = n; m_CheckpointStride = n; }
+  unsigned int GetCheckpointInterval() const
+    { return m_CheckpointInterval; }
+
+  /** Memory the checkpoints may take, in bytes */
+  void SetCheckpointMemoryLimit(size_t bytes)
+    { m_CheckpointMemoryLimit = bytes; ThinCheckpoints(); }
+  size_t GetCheckpointMemoryLimit() const
+    { return m_CheckpointMemoryLimit; }
+
+  /** Memory taken by the checkpoints, in bytes */
+  size_t GetCheckpointMemory() const;
+
+  /** Largest fraction of the evolution time to spend saving checkpoints
+   * (0 saves every checkpoint that falls due, however long it takes) */
+  void SetCheckpointTimeLimit(double fraction)
+    { m_CheckpointTimeLimit = fraction; }
+  double GetCheckpointTimeLimit() const
+    { return m_CheckpointTimeLimit; }
+
+  /** Speed of the evolution in the last call to Run(), in iterations per second */
+  double GetIterationsPerSecond() const
+    { return m_IterationsPerSecond; }
+
+  /** For each thread, the fraction of the time in the last call to Run() that
+   * it spent computing updates rather than waiting for work. Only available
+   * for the parallel sparse field solver (otherwise the vector is empty) */
+  const std::vector<double> &GetThreadUtilization() const
+    { return m_ThreadUtilization; }
+
 private:
   /** An internal class used to invert an image */
   class InvertFunctor {
@@ -199,6 +274,48 @@ private:
 
   /** Internal routines */
   void DoCreateLevelSetFilter();
+
+  /** A run-length encoded copy of the level set function */
+  struct Checkpoint
+  {
+    std::vector<float> Values;
+    std::vector<unsigned int> Lengths;
+  };
+  typedef std::map<unsigned int, Checkpoint> CheckpointMap;
+
+  /** Checkpoints by iteration */
+  CheckpointMap m_Checkpoints;
+
+  /** Image holding the restored checkpoint, evolved by the filter */
+  FloatImagePointer m_RestoredImage;
+
+  /** Iteration at which the filter was last initialized */
+  unsigned int m_IterationOffset;
+
+  /** Checkpoint interval set by the user and the one currently used */
+  unsigned int m_CheckpointInterval, m_CheckpointStride;
+  size_t m_CheckpointMemoryLimit;
+
+  /** Iteration at which the next checkpoint falls due */
+  unsigned int m_NextCheckpoint;
+
+  /** Time taken to save the last checkpoint and time spent evolving since,
+   * in seconds */
+  double m_CheckpointSaveTime, m_EvolutionTimeSinceCheckpoint;
+  double m_CheckpointTimeLimit;
+
+  /** Start a new set of checkpoints from the current state */
+  void ResetCheckpoints();
+
+  /** Performance of the last call to Run() */
+  double m_IterationsPerSecond;
+  std::vector<double> m_ThreadUtilization;
+
+  /** Remove checkpoints past the current iteration */
+  void DiscardLaterCheckpoints();
+
+  /** Drop every other checkpoint until they fit in the memory limit */
+  void ThinCheckpoints();
 };
 
 // Type definitions
@@ -51,6 +51,12 @@
 #include "LevelSetExtensionFilter.h"
 
 #include "itkParallelSparseFieldLevelSetImageFilter.h"
+#include "itkConstNeighborhoodIterator.h"
+#include "itkBarrier.h"
+#include "itkTimeProbe.h"
+
+#include <algorithm>
+#include <cmath>
 
 // Disable some windows debug length messages
 #if defined(_MSC_VER)
@@ -65,6 +71,17 @@
  * function that computes the timestep from the per-region timesteps then sets
  * the timestep to 0, and the filter stops. The work-around changes the step size
  * for empty regions to 1 and fixes the problem.
+ *
+ * The filter also schedules the computation of the updates dynamically. The
+ * parent class splits the image into slabs along the last axis, one per
+ * thread, and each thread computes the updates for the active layer nodes in
+ * its slab. When the contour occupies a small part of the image, most slabs
+ * hold few nodes and their threads wait for the others. Here, each thread
+ * publishes its active layer nodes, and the threads take blocks of nodes,
+ * first from their own list and then from the lists of the other threads,
+ * until all updates are computed. Updates are still applied to the layers
+ * by the thread that owns them. Any thread, including thread 0, may end up
+ * computing no updates, so the work-around above applies to all of them.
  */
 template< class TInputImage, class TOutputImage >
 class ParallelSparseFieldLevelSetImageFilterBugFix
@@ -77,6 +94,11 @@ public:
   typedef itk::SmartPointer< Self >                                                Pointer;
   typedef itk::SmartPointer< const Self >                                          ConstPointer;
   typedef typename Superclass::TimeStepType                                        TimeStepType;
+  typedef typename Superclass::ValueType                                           ValueType;
+  typedef typename Superclass::LayerType                                           LayerType;
+  typedef typename Superclass::LayerNodeType                                       LayerNodeType;
+  typedef typename Superclass::OutputImageType                                     OutputImageType;
+  typedef typename Superclass::FiniteDifferenceFunctionType                        FiniteDifferenceFunctionType;
 
   /** Method for creation through the object factory. */
   itkNewMacro(Self)
@@ -85,16 +107,207 @@ public:
   itkTypeMacro(ParallelSparseFieldLevelSetImageFilterBugFix,
                itk::ParallelSparseFieldLevelSetImageFilter)
 
+  /** Number of active layer nodes that a thread takes at a time */
+  itkStaticConstMacro(BlockSize, unsigned int, 64);
+
   virtual TimeStepType ThreadedCalculateChange(itk::ThreadIdType ThreadId) ITK_OVERRIDE
   {
-    TimeStepType ts = Superclass::ThreadedCalculateChange(ThreadId);
-    if(ThreadId > 0 && this->m_Data[ThreadId].m_Count == 0)
+    ThreadWork &own = m_Work[ThreadId];
+    itk::TimeProbe callProbe, busyProbe;
+    callProbe.Start();
+
+    // Publish the active layer nodes of this thread
+    std::vector<LayerNodeType *> nodes;
+    nodes.reserve(this->m_Data[ThreadId].m_Layers[0]->Size());
+    typename LayerType::Iterator layerIt = this->m_Data[ThreadId].m_Layers[0]->Begin();
+    typename LayerType::Iterator layerEnd = this->m_Data[ThreadId].m_Layers[0]->End();
+    for( ; layerIt != layerEnd; ++layerIt)
+      nodes.push_back(&(*layerIt));
+
+    own.Mutex.Lock();
+    own.Nodes.swap(nodes);
+    own.Next = 0;
+    own.Mutex.Unlock();
+
+    // Wait until every thread has published its nodes. The lists are not
+    // touched again until the next call, since the parent class makes all
+    // threads wait for each other before the updates are applied
+    m_PublishBarrier->Wait();
+
+    // Take blocks of nodes, starting with the own list
+    typename FiniteDifferenceFunctionType::Pointer df = this->GetDifferenceFunction();
+    ConstNeighborhoodIteratorType outputIt(df->GetRadius(), this->m_OutputImage,
+                                           this->m_OutputImage->GetRequestedRegion());
+    void *globalData = this->m_Data[ThreadId].globalData;
+    ValueType minNorm = this->GetMinimumNorm();
+    unsigned int nThreads = this->m_NumOfThreads, nProcessed = 0;
+    for(unsigned int k = 0; k < nThreads; k++)
+      {
+      ThreadWork &q = m_Work[(ThreadId + k) % nThreads];
+      while(true)
+        {
+        q.Mutex.Lock();
+        size_t start = q.Next, end = std::min(start + BlockSize, q.Nodes.size());
+        q.Next = end;
+        q.Mutex.Unlock();
+
+        if(start >= end)
+          break;
+
+        busyProbe.Start();
+        for(size_t i = start; i < end; i++)
+          this->ComputeNodeUpdate(q.Nodes[i], outputIt, globalData, minNorm);
+        busyProbe.Stop();
+
+        nProcessed += end - start;
+        if(k > 0)
+          own.StolenNodes += end - start;
+        }
+      }
+
+    callProbe.Stop();
+    own.BusyTime += busyProbe.GetTotal();
+    own.CallTime += callProbe.GetTotal();
+    own.ProcessedNodes += nProcessed;
+
+    // Threads that computed no updates must not limit the time step
+    if(nProcessed == 0)
       return 1.0;
-    else
-      return ts;
+
+    return df->ComputeGlobalTimeStep(globalData);
+  }
+
+  /**
+   * Fraction of its time in ThreadedCalculateChange() that each thread spent
+   * computing updates, since the statistics were last reset. The rest is
+   * spent waiting for work.
+   */
+  std::vector<double> GetThreadUtilization() const
+  {
+    std::vector<double> util;
+    for(unsigned int t = 0; t < m_WorkSize; t++)
+      util.push_back(m_Work[t].CallTime > 0 ? m_Work[t].BusyTime / m_Work[t].CallTime : 0.0);
+    return util;
+  }
+
+  /** Number of updates computed by threads other than the owner of the node */
+  unsigned long GetNumberOfStolenNodes() const
+  {
+    unsigned long n = 0;
+    for(unsigned int t = 0; t < m_WorkSize; t++)
+      n += m_Work[t].StolenNodes;
+    return n;
+  }
+
+  void ResetStatistics()
+  {
+    for(unsigned int t = 0; t < m_WorkSize; t++)
+      {
+      m_Work[t].BusyTime = m_Work[t].CallTime = 0.0;
+      m_Work[t].ProcessedNodes = m_Work[t].StolenNodes = 0;
+      }
   }
 
   itk::SimpleFastMutexLock locky;
+
+protected:
+
+  ParallelSparseFieldLevelSetImageFilterBugFix() : m_Work(NULL), m_WorkSize(0) {}
+  ~ParallelSparseFieldLevelSetImageFilterBugFix() { delete [] m_Work; }
+
+  typedef itk::ConstNeighborhoodIterator<OutputImageType> ConstNeighborhoodIteratorType;
+
+  /** The number of threads is known once the parent is initialized */
+  virtual void Initialize() ITK_OVERRIDE
+  {
+    Superclass::Initialize();
+    delete [] m_Work;
+    m_WorkSize = this->m_NumOfThreads;
+    m_Work = new ThreadWork[m_WorkSize];
+    m_PublishBarrier = itk::Barrier::New();
+    m_PublishBarrier->Initialize(m_WorkSize);
+  }
+
+  /** Regularization of the gradient norm, as in the parent class */
+  ValueType GetMinimumNorm()
+  {
+    ValueType minNorm = 1.0e-6;
+    if(this->GetUseImageSpacing())
+      {
+      double minSpacing = itk::NumericTraits<double>::max();
+      for(unsigned int i = 0; i < OutputImageType::ImageDimension; i++)
+        minSpacing = std::min(minSpacing, (double) this->GetInput()->GetSpacing()[i]);
+      minNorm *= minSpacing;
+      }
+    return minNorm;
+  }
+
+  /** Compute the update for one active layer node, as in the parent class */
+  void ComputeNodeUpdate(LayerNodeType *node, ConstNeighborhoodIteratorType &outputIt,
+                         void *globalData, ValueType minNorm)
+  {
+    typename FiniteDifferenceFunctionType::Pointer df = this->GetDifferenceFunction();
+    outputIt.SetLocation(node->m_Index);
+
+    ValueType centerValue = outputIt.GetCenterPixel();
+    if(this->GetInterpolateSurfaceLocation() && centerValue != itk::NumericTraits<ValueType>::Zero)
+      {
+      // The surface is at the zero crossing, so the offset to the surface is
+      // - phi(x) * grad(phi(x)) / norm(grad(phi))^2
+      typename FiniteDifferenceFunctionType::FloatOffsetType offset;
+      ValueType normGradPhiSquared = 0.0;
+      unsigned int center = outputIt.Size() / 2;
+      for(unsigned int i = 0; i < OutputImageType::ImageDimension; i++)
+        {
+        ValueType forwardValue = outputIt.GetPixel(center + outputIt.GetStride(i));
+        ValueType backwardValue = outputIt.GetPixel(center - outputIt.GetStride(i));
+
+        if(forwardValue * backwardValue >= 0)
+          {
+          // Take the one-sided derivative with the larger magnitude
+          ValueType dxForward = forwardValue - centerValue;
+          ValueType dxBackward = centerValue - backwardValue;
+          offset[i] = (std::abs(dxForward) > std::abs(dxBackward)) ? dxForward : dxBackward;
+          }
+        else
+          {
+          // Take the derivative towards the neighbor of opposite sign
+          offset[i] = (centerValue * forwardValue < 0)
+              ? forwardValue - centerValue : centerValue - backwardValue;
+          }
+
+        normGradPhiSquared += offset[i] * offset[i];
+        }
+
+      for(unsigned int i = 0; i < OutputImageType::ImageDimension; i++)
+        offset[i] = (offset[i] * centerValue) / (normGradPhiSquared + minNorm);
+
+      node->m_Value = df->ComputeUpdate(outputIt, globalData, offset);
+      }
+    else
+      {
+      node->m_Value = df->ComputeUpdate(outputIt, globalData);
+      }
+  }
+
+  /** The active layer nodes published by a thread, and its statistics */
+  struct ThreadWork
+  {
+    ThreadWork() : Next(0), BusyTime(0.0), CallTime(0.0),
+      ProcessedNodes(0), StolenNodes(0) {}
+
+    itk::SimpleFastMutexLock Mutex;
+    std::vector<LayerNodeType *> Nodes;
+    size_t Next;
+    double BusyTime, CallTime;
+    unsigned long ProcessedNodes, StolenNodes;
+  };
+
+  ThreadWork *m_Work;
+  unsigned int m_WorkSize;
+
+  /** Makes the threads wait for each other to publish their nodes */
+  itk::Barrier::Pointer m_PublishBarrier;
 };
 
 
@@ -128,6 +341,15 @@ SNAPLevelSetDriver<VDimension>
   // Remember the input and output images for later initialization
   m_InitializationImage = init;
 
+  // Checkpoints every 10 iterations, in up to 256 MB and 10% of the time
+  m_IterationOffset = 0;
+  m_CheckpointInterval = m_CheckpointStride = 10;
+  m_CheckpointMemoryLimit = 256 * 1024 * 1024;
+  m_CheckpointTimeLimit = 0.1;
+  m_NextCheckpoint = 0;
+  m_CheckpointSaveTime = m_EvolutionTimeSinceCheckpoint = 0.0;
+  m_IterationsPerSecond = 0.0;
+
   // Pass the parameters to the level set function
   AssignParametersToPhi(sparms,true);
 
@@ -253,6 +475,10 @@ SNAPLevelSetDriver<VDimension>
   // requested region on this image, so it's important that we always 
   // update the entire image
   m_LevelSetFilter->UpdateLargestPossibleRegion();
+
+  // The new filter starts from the initialization image, so the checkpoints
+  // of the previous filter no longer apply
+  ResetCheckpoints();
 }
 
 template<unsigned int VDimension>
@@ -262,6 +488,7 @@ SNAPLevelSetDriver<VDimension>
 { 
   // Tell the filter to reinitialize next time that an update will 
   // be performed, and set the number of iterations to 0
+  m_LevelSetFilter->SetInput(m_InitializationImage);
   m_LevelSetFilter->SetStateToUninitialized();
   m_LevelSetFilter->SetNumberOfIterations(0);
 
@@ -269,6 +496,23 @@ SNAPLevelSetDriver<VDimension>
   // requested region on this image, so it's important that we always 
   // update the entire image
   m_LevelSetFilter->UpdateLargestPossibleRegion();
+
+  // Start a new set of checkpoints
+  ResetCheckpoints();
+}
+
+template<unsigned int VDimension>
+void
+SNAPLevelSetDriver<VDimension>
+::ResetCheckpoints()
+{
+  m_RestoredImage = NULL;
+  m_IterationOffset = 0;
+  m_CheckpointStride = m_CheckpointInterval;
+  m_Checkpoints.clear();
+  m_CheckpointSaveTime = m_EvolutionTimeSinceCheckpoint = 0.0;
+  if(m_CheckpointInterval > 0)
+    SaveCheckpoint();
 }
 
 template<unsigned int VDimension>
@@ -276,14 +520,68 @@ void
 SNAPLevelSetDriver<VDimension>
 ::Run(unsigned int nIterations)
 {
-  // Increment the number of iterations 
+  // The evolution from here on replaces any that was rewound
+  DiscardLaterCheckpoints();
+
+  // Measure the performance of this run
+  typedef ParallelSparseFieldLevelSetImageFilterBugFix<
+      FloatImageType, FloatImageType> SparseFilterType;
+  SparseFilterType *sparse = dynamic_cast<SparseFilterType *>(m_LevelSetFilter.GetPointer());
+  if(sparse)
+    sparse->ResetStatistics();
+
+  itk::TimeProbe probe;
+  probe.Start();
+  unsigned int nStart = this->GetElapsedIterations();
+
+  // Increment the number of iterations, stopping on the way whenever a
+  // checkpoint is due
   unsigned int nElapsed = m_LevelSetFilter->GetElapsedIterations();
-  m_LevelSetFilter->SetNumberOfIterations(nElapsed + nIterations);
-  
-  // Update the largest possible region. The slicer may be changing the 
-  // requested region on this image, so it's important that we always 
-  // update the entire image
-  m_LevelSetFilter->UpdateLargestPossibleRegion();
+  unsigned int nTarget = nElapsed + nIterations;
+  while(nElapsed < nTarget)
+    {
+    // Stop at the iteration of the filter at which the next checkpoint is due
+    unsigned int nNext = nTarget;
+    if(m_CheckpointStride > 0 && m_NextCheckpoint > nElapsed + m_IterationOffset
+       && m_NextCheckpoint - m_IterationOffset < nNext)
+      nNext = m_NextCheckpoint - m_IterationOffset;
+
+    m_LevelSetFilter->SetNumberOfIterations(nNext);
+
+    // Update the largest possible region. The slicer may be changing the
+    // requested region on this image, so it's important that we always
+    // update the entire image
+    itk::TimeProbe step;
+    step.Start();
+    m_LevelSetFilter->UpdateLargestPossibleRegion();
+    step.Stop();
+    m_EvolutionTimeSinceCheckpoint += step.GetTotal();
+
+    unsigned int nReached = m_LevelSetFilter->GetElapsedIterations();
+    if(m_CheckpointStride > 0 && nReached + m_IterationOffset >= m_NextCheckpoint)
+      {
+      // Skip the checkpoint if saving the last one took too long compared
+      // with the evolution since
+      if(m_CheckpointSaveTime <= m_CheckpointTimeLimit * m_EvolutionTimeSinceCheckpoint
+         || m_CheckpointTimeLimit <= 0.0)
+        SaveCheckpoint();
+      else
+        m_NextCheckpoint = nReached + m_IterationOffset + m_CheckpointStride;
+      }
+
+    // The filter may halt early
+    if(nReached < nNext)
+      break;
+    nElapsed = nReached;
+    }
+
+  probe.Stop();
+  unsigned int nDone = this->GetElapsedIterations() - nStart;
+  m_IterationsPerSecond = probe.GetTotal() > 0 ? nDone / probe.GetTotal() : 0.0;
+  if(sparse)
+    m_ThreadUtilization = sparse->GetThreadUtilization();
+  else
+    m_ThreadUtilization.clear();
 }
 
 template<unsigned int VDimension>
@@ -319,7 +617,7 @@ unsigned int
 SNAPLevelSetDriver<VDimension>
 ::GetElapsedIterations() const
 {
-  return m_LevelSetFilter->GetElapsedIterations();
+  return m_IterationOffset + m_LevelSetFilter->GetElapsedIterations();
 }
 
 template<unsigned int VDimension>
@@ -332,6 +630,149 @@ SNAPLevelSetDriver<VDimension>
   // function to free memory
   m_LevelSetFilter = NULL;
   m_LevelSetFunction = NULL;
+  m_RestoredImage = NULL;
+  m_Checkpoints.clear();
+}
+
+template<unsigned int VDimension>
+void
+SNAPLevelSetDriver<VDimension>
+::SaveCheckpoint()
+{
+  itk::TimeProbe probe;
+  probe.Start();
+
+  // Run-length encode the level set in raster order
+  FloatImageType *phi = m_LevelSetFilter->GetOutput();
+  const float *p = phi->GetBufferPointer();
+  size_t n = phi->GetBufferedRegion().GetNumberOfPixels();
+
+  Checkpoint &cp = m_Checkpoints[this->GetElapsedIterations()];
+  cp.Values.clear();
+  cp.Lengths.clear();
+  for(size_t i = 0; i < n; )
+    {
+    size_t j = i + 1;
+    while(j < n && p[j] == p[i] && j - i < 0xffffffff)
+      j++;
+    cp.Values.push_back(p[i]);
+    cp.Lengths.push_back(static_cast<unsigned int>(j - i));
+    i = j;
+    }
+
+  // Give back the memory reserved by the vectors' growth
+  std::vector<float>(cp.Values).swap(cp.Values);
+  std::vector<unsigned int>(cp.Lengths).swap(cp.Lengths);
+
+  ThinCheckpoints();
+
+  probe.Stop();
+  m_CheckpointSaveTime = probe.GetTotal();
+  m_EvolutionTimeSinceCheckpoint = 0.0;
+  m_NextCheckpoint = this->GetElapsedIterations() + m_CheckpointStride;
+}
+
+template<unsigned int VDimension>
+std::vector<unsigned int>
+SNAPLevelSetDriver<VDimension>
+::GetCheckpointIterations() const
+{
+  std::vector<unsigned int> iters;
+  for(typename CheckpointMap::const_iterator it = m_Checkpoints.begin();
+      it != m_Checkpoints.end(); ++it)
+    iters.push_back(it->first);
+  return iters;
+}
+
+template<unsigned int VDimension>
+unsigned int
+SNAPLevelSetDriver<VDimension>
+::RestoreCheckpoint(unsigned int iteration)
+{
+  if(m_Checkpoints.empty())
+    return this->GetElapsedIterations();
+
+  // Find the latest checkpoint at or before the iteration
+  typename CheckpointMap::const_iterator it = m_Checkpoints.upper_bound(iteration);
+  if(it != m_Checkpoints.begin())
+    --it;
+
+  // Decode the checkpoint into a new image. The filter evolves its input in
+  // place, so the checkpoint itself must not be used as the input
+  m_RestoredImage = FloatImageType::New();
+  m_RestoredImage->CopyInformation(m_InitializationImage);
+  m_RestoredImage->SetRegions(m_InitializationImage->GetLargestPossibleRegion());
+  m_RestoredImage->Allocate();
+
+  const Checkpoint &cp = it->second;
+  float *p = m_RestoredImage->GetBufferPointer();
+  for(size_t k = 0; k < cp.Values.size(); k++)
+    p = std::fill_n(p, cp.Lengths[k], cp.Values[k]);
+
+  // Initialize the filter from the checkpoint. This rebuilds the sparse
+  // layers from the level set function
+  m_LevelSetFilter->SetInput(m_RestoredImage);
+  m_LevelSetFilter->SetStateToUninitialized();
+  m_LevelSetFilter->SetNumberOfIterations(0);
+  m_LevelSetFilter->UpdateLargestPossibleRegion();
+  m_IterationOffset = it->first;
+  m_NextCheckpoint = it->first + m_CheckpointStride;
+  m_EvolutionTimeSinceCheckpoint = 0.0;
+
+  return it->first;
+}
+
+template<unsigned int VDimension>
+size_t
+SNAPLevelSetDriver<VDimension>
+::GetCheckpointMemory() const
+{
+  size_t bytes = 0;
+  for(typename CheckpointMap::const_iterator it = m_Checkpoints.begin();
+      it != m_Checkpoints.end(); ++it)
+    {
+    bytes += it->second.Values.capacity() * sizeof(float)
+        + it->second.Lengths.capacity() * sizeof(unsigned int);
+    }
+  return bytes;
+}
+
+template<unsigned int VDimension>
+void
+SNAPLevelSetDriver<VDimension>
+::DiscardLaterCheckpoints()
+{
+  m_Checkpoints.erase(m_Checkpoints.upper_bound(this->GetElapsedIterations()),
+                      m_Checkpoints.end());
+}
+
+template<unsigned int VDimension>
+void
+SNAPLevelSetDriver<VDimension>
+::ThinCheckpoints()
+{
+  while(m_Checkpoints.size() > 1 && this->GetCheckpointMemory() > m_CheckpointMemoryLimit)
+    {
+    // Drop the checkpoints in odd positions, but never the latest one
+    unsigned int k = 0, nDropped = 0;
+    typename CheckpointMap::iterator it = m_Checkpoints.begin();
+    while(it != m_Checkpoints.end())
+      {
+      typename CheckpointMap::iterator next = it;
+      ++next;
+      if((k++ % 2) == 1 && next != m_Checkpoints.end())
+        {
+        m_Checkpoints.erase(it);
+        nDropped++;
+        }
+      it = next;
+      }
+
+    if(nDropped == 0)
+      m_Checkpoints.erase(m_Checkpoints.begin());
+
+    m_CheckpointStride *= 2;
+    }
 }
 
 template<unsigned int VDimension>
@@ -161,7 +161,7 @@ MeshManager
     pipeline->SetMeshOptions(m_GlobalState->GetMeshOptions());
 
     // Update the meshes
-    pipeline->UpdateMeshes(command);
+    pipeline->UpdateMeshes(command, wrapper);
     }
 
   // Fire a modified event as well
@@ -44,9 +44,27 @@
 #include "IRISVectorTypesToITKConversion.h"
 #include "VTKMeshPipeline.h"
 #include "MeshOptions.h"
+#include "LabelImageWrapper.h"
+#include "IRISException.h"
 
 // ITK includes
 #include "itkBinaryThresholdImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkMutexLockHolder.h"
+#include "itksys/SystemTools.hxx"
+
+// VTK includes
+#include "vtkDiscreteMarchingCubes.h"
+#include "vtkPolyDataNormals.h"
+#include "vtkCleanPolyData.h"
+#include "vtkPoints.h"
+#include "vtkCellArray.h"
+#include "vtkCellData.h"
+#include "vtkIdList.h"
+#include "vtkImageData.h"
+
+#include <algorithm>
+#include <sstream>
 
 using namespace std;
 
@@ -72,6 +90,14 @@ MultiLabelMeshPipeline
   // Set the initial mesh options
   m_MeshOptions = MeshOptions::New();
   m_VTKPipeline->SetMeshOptions(m_MeshOptions);
+
+  // No labels are known until the bounding boxes are computed
+  std::fill(m_Histogram, m_Histogram + MAX_COLOR_LABELS, 0l);
+
+  // Use the default number of threads for computing meshes
+  m_NumberOfThreads = 0;
+  m_MeshingMode = PER_LABEL_MESHING;
+  m_SinglePassSlabSize = 1ul << 24;
 }
 
 MultiLabelMeshPipeline
@@ -98,6 +124,37 @@ MultiLabelMeshPipeline
     }
 }
 
+unsigned long
+MultiLabelMeshPipeline
+::ComputeBoundingBoxes(LabelImageWrapper *seg)
+{
+  itkAssertOrThrowMacro(seg->GetImage() == m_InputImage,
+                        "Segmentation layer does not match the pipeline input");
+
+  // Clear the histogram
+  std::fill(m_Histogram, m_Histogram + MAX_COLOR_LABELS, 0l);
+
+  // The segmentation layer keeps the voxel count and extents of every label
+  // up to date, so there is no need to scan the image here. Boxes that have
+  // not been tightened after voxels were erased still hold their label.
+  unsigned long nTotal = 0;
+  const LabelImageWrapper::LabelStatisticsMap &stats = seg->GetLabelStatistics(false);
+  for(LabelImageWrapper::LabelStatisticsMap::const_iterator it = stats.begin();
+      it != stats.end(); ++it)
+    {
+    LabelType label = it->first;
+    if(label == 0 || label >= MAX_COLOR_LABELS)
+      continue;
+
+    m_Histogram[label] = it->second.Count;
+    m_BoundingBox[label].SetIndex(it->second.BoundingBox[0]);
+    m_BoundingBox[label].SetUpperIndex(it->second.BoundingBox[1]);
+    nTotal += m_BoundingBox[label].GetNumberOfPixels();
+    }
+
+  return nTotal;
+}
+
 unsigned long
 MultiLabelMeshPipeline
 ::GetVoxelsInBoundingBox(LabelType label) const
@@ -200,7 +257,7 @@ void MultiLabelMeshPipeline::UpdateMeshInfoHelper(
   current_meshinfo->Count += run_length;
 }
 
-void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand)
+void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand, LabelImageWrapper *seg)
 {
   // Create a temporary table of mesh info
   MeshInfoMap meshmap;
@@ -213,34 +270,70 @@ void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand)
   // The length of a line
   unsigned long line_length = m_InputImage->GetLargestPossibleRegion().GetSize()[0];
 
+  // Only the lines that cross the bounding box of some label need to be
+  // visited. RLE lines are visited whole, so the x extent is kept.
+  InputImageType::RegionType scan_region = m_InputImage->GetLargestPossibleRegion();
+  if(seg)
+    {
+    this->ComputeBoundingBoxes(seg);
+    bool any_label = false;
+    itk::Index<3> lower = scan_region.GetIndex(), upper = scan_region.GetUpperIndex();
+    for(int label = 1; label < MAX_COLOR_LABELS; label++)
+      {
+      if(m_Histogram[label] == 0)
+        continue;
+      itk::Index<3> bb0 = m_BoundingBox[label].GetIndex();
+      itk::Index<3> bb1 = m_BoundingBox[label].GetUpperIndex();
+      for(int d = 1; d < 3; d++)
+        {
+        lower[d] = any_label ? std::min(lower[d], bb0[d]) : bb0[d];
+        upper[d] = any_label ? std::max(upper[d], bb1[d]) : bb1[d];
+        }
+      any_label = true;
+      }
+    if(any_label)
+      {
+      scan_region.SetIndex(lower);
+      scan_region.SetUpperIndex(upper);
+      }
+    else
+      {
+      // There are no labels to look for
+      scan_region.SetSize(1, 0);
+      }
+    }
+
   // Iterate through the image updating the mesh map. This code takes advantage
   // of the organization of label data. Rather than updating the extents after
   // each pixel read, the code collects runs of pixels of the same label and
   // updates once the run ends (a pixel of another label is found or the end
   // of a line of pixels is reached). This makes for much more efficient code.
   typedef itk::ImageRegionConstIteratorWithIndex<InputImageType> InputIterator;
-  InputIterator it(m_InputImage, m_InputImage->GetLargestPossibleRegion());
-  while( !it.IsAtEnd() )
+  if(scan_region.GetNumberOfPixels() > 0)
     {
-    run_start = it.GetIndex();
-    const InputIterator::RLLine &line=*(it.rlLine);
-    int t = 0;
-    // Iterate through the line
-    for (int x = 0; x < line.size(); x++)
+    InputIterator it(m_InputImage, scan_region);
+    while( !it.IsAtEnd() )
       {
-      run_start[0] = t;
-      current_label = line[x].second;
-      t += line[x].first;
-      if (current_label != 0)
+      run_start = it.GetIndex();
+      const InputIterator::RLLine &line=*(it.rlLine);
+      int t = 0;
+      // Iterate through the line
+      for (int x = 0; x < line.size(); x++)
         {
-        current_meshinfo = &meshmap[current_label];
-        // Update the current mesh info
-        UpdateMeshInfoHelper(current_meshinfo, run_start, it, t);
-        current_meshinfo = &meshmap[current_label];
+        run_start[0] = t;
+        current_label = line[x].second;
+        t += line[x].first;
+        if (current_label != 0)
+          {
+          current_meshinfo = &meshmap[current_label];
+          // Update the current mesh info
+          UpdateMeshInfoHelper(current_meshinfo, run_start, it, t);
+          current_meshinfo = &meshmap[current_label];
+          }
         }
+      ++(it.bi);
+      it.rlLine = &it.bi.Value();
       }
-    ++(it.bi);
-    it.rlLine = &it.bi.Value();
     }
 
   // At this point, meshmap has the number of voxels for every label, as well
@@ -260,7 +353,14 @@ void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand)
 
   // Deal with progress accumulation
   SmartPtr<AllPurposeProgressAccumulator> progress = AllPurposeProgressAccumulator::New();
-  progress->AddObserver(itk::ProgressEvent(), progressCommand);
+  if(progressCommand)
+    progress->AddObserver(itk::ProgressEvent(), progressCommand);
+
+  // The work shared by the mesh computing threads
+  MeshingQueue queue;
+  queue.Self = this;
+  queue.Next = 0;
+  queue.NumberDone = 0;
 
   // Next we check which meshes are new or updated and mark them as needing to
   // be recomputed
@@ -278,49 +378,62 @@ void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand)
       info.BoundingBox[0] = it->second.BoundingBox[0];
       info.BoundingBox[1] = it->second.BoundingBox[1];
       info.Mesh = NULL;
-
-      // Capture progress from this mesh
-      progress->RegisterSource(m_VTKPipeline->GetProgressAccumulator(), info.Count);
       }
-    }
 
-  // Now compute the meshes
-  for(MeshInfoMap::iterator it = m_MeshInfo.begin(); it != m_MeshInfo.end(); it++)
-    {
-    if(it->second.Mesh == NULL)
+    // Schedule the mesh for computation
+    if(info.Mesh == NULL)
       {
-      // Create the mesh
-      MeshInfo &mi = it->second;
-      mi.Mesh = vtkSmartPointer<vtkPolyData>::New();
+      MeshingJob job;
+      job.Label = it->first;
+      job.Info = &info;
+      job.Done = job.Reported = false;
 
-      // TODO: make this more elegant
-      InputImageType::RegionType bbWiderRegion;
+      // The padded bounding box of the label
       for(int d = 0; d < 3; d++)
         {
         unsigned long len =
-            (unsigned long) (1 + mi.BoundingBox[1][d] - mi.BoundingBox[0][d]);
-        bbWiderRegion.SetIndex(d, mi.BoundingBox[0][d]);
-        bbWiderRegion.SetSize(d, len);
+            (unsigned long) (1 + info.BoundingBox[1][d] - info.BoundingBox[0][d]);
+        job.Region.SetIndex(d, info.BoundingBox[0][d]);
+        job.Region.SetSize(d, len);
         }
-      bbWiderRegion.PadByRadius(5);
-      bbWiderRegion.Crop(m_InputImage->GetLargestPossibleRegion());
+      job.Region.PadByRadius(5);
+      job.Region.Crop(m_InputImage->GetLargestPossibleRegion());
 
-      // Pass the region to the ROI filter and propagate the filter
-      m_ROIFilter->SetInput(m_InputImage);
-      m_ROIFilter->SetRegionOfInterest(bbWiderRegion);
-      m_ROIFilter->Update();
+      // Capture progress from this mesh
+      job.ProgressSource = progress->RegisterGenericSource(1, info.Count);
+      queue.Jobs.push_back(job);
+      }
+    }
 
-      // Set the parameters for the thresholding filter
-      m_ThrehsoldFilter->SetLowerThreshold(it->first);
-      m_ThrehsoldFilter->SetUpperThreshold(it->first);
-      m_ThrehsoldFilter->UpdateLargestPossibleRegion();
+  // Labels with the largest bounding boxes take the longest, so they are
+  // scheduled first to keep the threads busy until the end
+  std::stable_sort(queue.Jobs.begin(), queue.Jobs.end(), CompareMeshingJobs);
 
-      // Graft the polydata to the last filter in the pipeline
-      m_VTKPipeline->SetImage(m_ThrehsoldFilter->GetOutput());
-      m_VTKPipeline->ComputeMesh(it->second.Mesh);
+  // Now compute the meshes
+  if(queue.Jobs.size() && m_MeshingMode == SINGLE_PASS_MESHING)
+    {
+    this->ComputeMeshesSinglePass(&queue, progress);
+    }
+  else if(queue.Jobs.size())
+    {
+    int nThreads = m_NumberOfThreads > 0
+        ? m_NumberOfThreads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+    nThreads = std::max(1, std::min(nThreads, (int) queue.Jobs.size()));
 
-      // Update progress
-      progress->StartNextRun(m_VTKPipeline->GetProgressAccumulator());
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(nThreads);
+    threader->SetSingleMethod(MeshingThreadCallback, &queue);
+    threader->SingleMethodExecute();
+
+    // Report the progress of the meshes that finished last
+    this->ReportMeshingProgress(&queue);
+
+    // Errors in the threads are passed on from the calling thread. The labels
+    // that were not meshed keep a NULL mesh and are scheduled again next time
+    if(queue.Error.size())
+      {
+      progress->UnregisterAllSources();
+      throw IRISException("%s", queue.Error.c_str());
       }
     }
 
@@ -331,6 +444,372 @@ void MultiLabelMeshPipeline::UpdateMeshes(itk::Command *progressCommand)
   this->Modified();
 }
 
+bool
+MultiLabelMeshPipeline
+::CompareMeshingJobs(const MeshingJob &a, const MeshingJob &b)
+{
+  return a.Region.GetNumberOfPixels() > b.Region.GetNumberOfPixels();
+}
+
+ITK_THREAD_RETURN_TYPE
+MultiLabelMeshPipeline
+::MeshingThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+  MeshingQueue *queue = static_cast<MeshingQueue *>(info->UserData);
+  queue->Self->RunMeshingThread(queue, info->ThreadID);
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void
+MultiLabelMeshPipeline
+::RunMeshingThread(MeshingQueue *queue, itk::ThreadIdType threadId)
+{
+  // Each thread has its own thresholding filter and VTK pipeline. These are
+  // single-threaded, since the parallelism is over the labels
+  ThresholdFilterPointer threshold = ThresholdFilter::New();
+  threshold->SetInsideValue(1.0f);
+  threshold->SetOutsideValue(-1.0f);
+  threshold->SetNumberOfThreads(1);
+
+  VTKMeshPipeline vtkPipeline;
+  vtkPipeline.SetMeshOptions(m_MeshOptions);
+
+  while(true)
+    {
+    // Take the next label from the queue. After an error, the remaining
+    // labels are skipped, but still counted so that the wait below ends
+    size_t iJob;
+    bool skip;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(queue->Mutex);
+      iJob = queue->Next++;
+      skip = !queue->Error.empty();
+      }
+    if(iJob >= queue->Jobs.size())
+      break;
+
+    MeshingJob &job = queue->Jobs[iJob];
+
+    std::string error;
+    if(!skip)
+      {
+      try
+        {
+        this->ComputeMeshingJob(queue, job, threshold, vtkPipeline);
+        }
+      catch(std::exception &exc)
+        {
+        error = exc.what();
+        }
+      catch(...)
+        {
+        error = "unknown error";
+        }
+      }
+
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(queue->Mutex);
+      if(error.size() && queue->Error.empty())
+        {
+        std::ostringstream oss;
+        oss << "Failed to compute the mesh of label " << job.Label << ": " << error;
+        queue->Error = oss.str();
+        }
+      job.Done = true;
+      queue->NumberDone++;
+      }
+
+    // Progress observers expect to be called from the thread that started
+    // the update, so only the first thread reports progress
+    if(threadId == 0)
+      this->ReportMeshingProgress(queue);
+    }
+
+  // When it runs out of work, the first thread keeps reporting progress
+  // until the other threads are done
+  if(threadId == 0)
+    {
+    while(true)
+      {
+        {
+        itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(queue->Mutex);
+        if(queue->NumberDone == queue->Jobs.size())
+          break;
+        }
+      this->ReportMeshingProgress(queue);
+      itksys::SystemTools::Delay(50);
+      }
+    }
+}
+
+void
+MultiLabelMeshPipeline
+::ComputeMeshingJob(MeshingQueue *queue, MeshingJob &job,
+                    ThresholdFilter *threshold, VTKMeshPipeline &vtkPipeline)
+{
+  // Extract the bounding box of the label. The input image is shared, and
+  // updating a filter modifies its requested region, so this step is done
+  // one thread at a time. The extracted region is then detached from the
+  // ROI filter so that the rest of the pipeline does not touch the input.
+  InputImagePointer roiImage;
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(queue->InputMutex);
+    ROIFilterPointer roi = ROIFilter::New();
+    roi->SetInput(m_InputImage);
+    roi->SetRegionOfInterest(job.Region);
+    roi->Update();
+    roiImage = roi->GetOutput();
+    roiImage->DisconnectPipeline();
+    }
+
+  // Set the parameters for the thresholding filter
+  threshold->SetInput(roiImage);
+  threshold->SetLowerThreshold(job.Label);
+  threshold->SetUpperThreshold(job.Label);
+  threshold->UpdateLargestPossibleRegion();
+
+  // Compute the mesh
+  vtkSmartPointer<vtkPolyData> mesh = vtkSmartPointer<vtkPolyData>::New();
+  vtkPipeline.SetImage(threshold->GetOutput());
+  vtkPipeline.ComputeMesh(mesh);
+  job.Info->Mesh = mesh;
+}
+
+void
+MultiLabelMeshPipeline
+::ReportMeshingProgress(MeshingQueue *queue)
+{
+  for(size_t i = 0; i < queue->Jobs.size(); i++)
+    {
+    MeshingJob &job = queue->Jobs[i];
+    bool done;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(queue->Mutex);
+      done = job.Done;
+      }
+    if(done && !job.Reported)
+      {
+      AllPurposeProgressAccumulator::GenericProgressCallback(job.ProgressSource, 1.0);
+      job.Reported = true;
+      }
+    }
+}
+
+void
+MultiLabelMeshPipeline
+::ComputeMeshesSinglePass(MeshingQueue *queue, AllPurposeProgressAccumulator *progress)
+{
+  // The region that contains all the labels to mesh, with a margin of one
+  // voxel so that marching cubes can close the surfaces
+  itk::Index<3> lower, upper;
+  for(int d = 0; d < 3; d++)
+    {
+    lower[d] = queue->Jobs[0].Info->BoundingBox[0][d];
+    upper[d] = queue->Jobs[0].Info->BoundingBox[1][d];
+    for(size_t i = 1; i < queue->Jobs.size(); i++)
+      {
+      lower[d] = std::min(lower[d], (itk::IndexValueType) queue->Jobs[i].Info->BoundingBox[0][d]);
+      upper[d] = std::max(upper[d], (itk::IndexValueType) queue->Jobs[i].Info->BoundingBox[1][d]);
+      }
+    }
+  InputImageType::RegionType region;
+  region.SetIndex(lower);
+  region.SetUpperIndex(upper);
+  region.PadByRadius(1);
+  region.Crop(m_InputImage->GetBufferedRegion());
+
+  // The region is decompressed and swept in slabs along z that hold at most
+  // m_SinglePassSlabSize voxels. Consecutive slabs share a plane of voxels,
+  // so every cube of the marching cubes grid is visited exactly once.
+  unsigned long sliceSize = region.GetSize(0) * region.GetSize(1);
+  long zFirst = region.GetIndex(2), zLast = region.GetUpperIndex()[2];
+  long nz = std::max(2l, (long) (m_SinglePassSlabSize / std::max(sliceSize, 1ul)));
+
+  // The triangles of each label are collected over all slabs
+  std::map<LabelType, LabelSurface> surfaces;
+  double totalWeight = 0.0;
+  for(size_t i = 0; i < queue->Jobs.size(); i++)
+    {
+    LabelSurface &ls = surfaces[queue->Jobs[i].Label];
+    ls.Points = vtkSmartPointer<vtkPoints>::New();
+    ls.Polys = vtkSmartPointer<vtkCellArray>::New();
+    totalWeight += queue->Jobs[i].Info->Count;
+    }
+  void *sweepProgress = progress->RegisterGenericSource(1, totalWeight);
+
+  int nSlabs = 0;
+  for(long z0 = zFirst; ; )
+    {
+    long z1 = std::min(z0 + nz - 1, zLast);
+    InputImageType::RegionType slab = region;
+    slab.SetIndex(2, z0);
+    slab.SetSize(2, z1 - z0 + 1);
+    this->ExtractSurfacesInSlab(queue, slab, surfaces);
+    AllPurposeProgressAccumulator::GenericProgressCallback(
+          sweepProgress, (z1 - zFirst + 1.0) / (zLast - zFirst + 1.0));
+    nSlabs++;
+    if(z1 >= zLast)
+      break;
+    z0 = z1;
+    }
+
+  // The mesh stages of the VTK pipeline are applied to each label
+  VTKMeshPipeline vtkPipeline;
+  vtkPipeline.SetMeshOptions(m_MeshOptions);
+  vtkPipeline.SetTransformFromImage(m_InputImage);
+
+  for(size_t i = 0; i < queue->Jobs.size(); i++)
+    {
+    MeshingJob &job = queue->Jobs[i];
+    LabelSurface &ls = surfaces[job.Label];
+
+    vtkSmartPointer<vtkPolyData> labelSurface = vtkSmartPointer<vtkPolyData>::New();
+    labelSurface->SetPoints(ls.Points);
+    labelSurface->SetPolys(ls.Polys);
+
+    // Points on the planes shared by two slabs were created by both
+    vtkSmartPointer<vtkCleanPolyData> clean;
+    vtkAlgorithmOutput *surfacePort = NULL;
+    if(nSlabs > 1)
+      {
+      clean = vtkSmartPointer<vtkCleanPolyData>::New();
+      clean->SetInputData(labelSurface);
+      clean->PointMergingOn();
+      clean->SetTolerance(0.0);
+      surfacePort = clean->GetOutputPort();
+      }
+
+    // Compute the normals of each label separately, since the surfaces of
+    // adjacent labels share points but face in opposite directions
+    vtkSmartPointer<vtkPolyDataNormals> normals = vtkSmartPointer<vtkPolyDataNormals>::New();
+    if(surfacePort)
+      normals->SetInputConnection(surfacePort);
+    else
+      normals->SetInputData(labelSurface);
+    normals->SplittingOff();
+    normals->ConsistencyOff();
+    normals->Update();
+
+    job.Info->Mesh = vtkSmartPointer<vtkPolyData>::New();
+    vtkPipeline.ProcessMesh(normals->GetOutput(), job.Info->Mesh);
+
+    // Release the triangles of the label
+    ls.Points = NULL;
+    ls.Polys = NULL;
+
+    job.Done = true;
+    this->ReportMeshingProgress(queue);
+    }
+}
+
+void
+MultiLabelMeshPipeline
+::ExtractSurfacesInSlab(MeshingQueue *queue,
+                        const InputImageType::RegionType &slab,
+                        std::map<LabelType, LabelSurface> &surfaces)
+{
+  // Decompress the slab into a VTK image in a single sweep over the RLE lines
+  vtkSmartPointer<vtkImageData> labels = vtkSmartPointer<vtkImageData>::New();
+  const InputImageType::PointType &origin = m_InputImage->GetOrigin();
+  const InputImageType::SpacingType &spacing = m_InputImage->GetSpacing();
+  labels->SetOrigin(origin[0], origin[1], origin[2]);
+  labels->SetSpacing(spacing[0], spacing[1], spacing[2]);
+  labels->SetExtent(slab.GetIndex(0), slab.GetUpperIndex()[0],
+                    slab.GetIndex(1), slab.GetUpperIndex()[1],
+                    slab.GetIndex(2), slab.GetUpperIndex()[2]);
+  labels->AllocateScalars(VTK_UNSIGNED_SHORT, 1);
+
+  LabelType *out = static_cast<LabelType *>(labels->GetScalarPointer());
+  long x0 = slab.GetIndex(0) - m_InputImage->GetBufferedRegion().GetIndex(0);
+  long x1 = x0 + slab.GetSize(0);
+  typedef itk::ImageRegionConstIterator<InputImageType::BufferType> LineIterator;
+  const InputImageType *input = m_InputImage;
+  for(LineIterator itLine(input->GetBuffer(), InputImageType::truncateRegion(slab));
+      !itLine.IsAtEnd(); ++itLine)
+    {
+    const InputImageType::RLLine &line = itLine.Value();
+    long t = 0;
+    for(size_t i = 0; i < line.size() && t < x1; i++)
+      {
+      long tEnd = t + line[i].first;
+      long a = std::max(t, x0), b = std::min(tEnd, x1);
+      if(a < b)
+        {
+        std::fill(out, out + (b - a), line[i].second);
+        out += b - a;
+        }
+      t = tEnd;
+      }
+    }
+
+  // Extract the boundaries of all the labels at once. The label of each
+  // triangle is stored in the cell scalars.
+  vtkSmartPointer<vtkDiscreteMarchingCubes> dmc = vtkSmartPointer<vtkDiscreteMarchingCubes>::New();
+  dmc->SetInputData(labels);
+  dmc->ComputeNormalsOff();
+  dmc->ComputeGradientsOff();
+  dmc->ComputeScalarsOn();
+  dmc->SetNumberOfContours(queue->Jobs.size());
+  for(size_t i = 0; i < queue->Jobs.size(); i++)
+    dmc->SetValue(i, queue->Jobs[i].Label);
+  dmc->Update();
+
+  vtkPolyData *surface = dmc->GetOutput();
+  vtkDataArray *cellLabels = surface->GetCellData()->GetScalars();
+  vtkPoints *points = surface->GetPoints();
+  if(!points || !cellLabels)
+    return;
+
+  // Sort the triangles by label
+  std::map<LabelType, std::vector<vtkIdType> > triangles;
+  vtkSmartPointer<vtkIdList> ids = vtkSmartPointer<vtkIdList>::New();
+  vtkCellArray *polys = surface->GetPolys();
+  polys->InitTraversal();
+  for(vtkIdType c = 0; polys->GetNextCell(ids); c++)
+    {
+    std::vector<vtkIdType> &tri = triangles[(LabelType) cellLabels->GetTuple1(c)];
+    for(vtkIdType k = 0; k < ids->GetNumberOfIds(); k++)
+      tri.push_back(ids->GetId(k));
+    }
+
+  // Append the triangles of each label to its surface
+  std::vector<vtkIdType> pointMap(points->GetNumberOfPoints(), -1);
+  std::vector<vtkIdType> pointsUsed;
+  std::map<LabelType, std::vector<vtkIdType> >::const_iterator itTri;
+  for(itTri = triangles.begin(); itTri != triangles.end(); ++itTri)
+    {
+    std::map<LabelType, LabelSurface>::iterator itSurf = surfaces.find(itTri->first);
+    if(itSurf == surfaces.end())
+      continue;
+
+    const std::vector<vtkIdType> &tri = itTri->second;
+    LabelSurface &ls = itSurf->second;
+    for(size_t k = 0; k + 2 < tri.size(); k += 3)
+      {
+      vtkIdType cell[3];
+      for(int m = 0; m < 3; m++)
+        {
+        vtkIdType &q = pointMap[tri[k + m]];
+        if(q < 0)
+          {
+          q = ls.Points->InsertNextPoint(points->GetPoint(tri[k + m]));
+          pointsUsed.push_back(tri[k + m]);
+          }
+        cell[m] = q;
+        }
+      ls.Polys->InsertNextCell(3, cell);
+      }
+
+    // Reset the point map for the next label
+    for(size_t k = 0; k < pointsUsed.size(); k++)
+      pointMap[pointsUsed[k]] = -1;
+    pointsUsed.clear();
+    }
+}
+
+
 void 
 MultiLabelMeshPipeline
 ::SetImage(MultiLabelMeshPipeline::InputImageType *image)
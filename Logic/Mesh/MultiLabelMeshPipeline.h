@@ -44,6 +44,10 @@
 #include "ImageWrapperTraits.h"
 #include "RLERegionOfInterestImageFilter.h"
 #include "RLEImageScanlineIterator.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMultiThreader.h"
+#include <string>
+#include <vector>
 
 
 // Forward reference to itk classes
@@ -58,7 +62,10 @@ namespace itk {
 class MeshOptions;
 class VTKMeshPipeline;
 class vtkPolyData;
+class vtkPoints;
+class vtkCellArray;
 class AllPurposeProgressAccumulator;
+class LabelImageWrapper;
 
 
 /**
@@ -108,8 +115,10 @@ public:
   void SetImage(InputImageType *input);
 
   /** Compute the bounding boxes for different regions.  Prerequisite for 
-   * calling ComputeMesh(). Returns the total number of voxels in all boxes */
-  unsigned long ComputeBoundingBoxes();
+   * calling ComputeMesh(). Returns the total number of voxels in all boxes.
+   * The boxes are taken from the label statistics maintained by the 
+   * segmentation layer, whose image must be the input to this pipeline */
+  unsigned long ComputeBoundingBoxes(LabelImageWrapper *seg);
 
   unsigned long GetVoxelsInBoundingBox(LabelType label) const;
 
@@ -128,8 +137,40 @@ public:
    * the color label is not present in the image */
   bool ComputeMesh(LabelType label, vtkPolyData *outData);
 
-  /** Update the meshes */
-  void UpdateMeshes(itk::Command *progressCommand);
+  /** Update the meshes. The meshes of labels that have changed since the last
+   * update are computed in parallel, each thread using its own pipeline.
+   * If the segmentation layer is given (its image must be the input), the
+   * label extents it maintains limit the search for changed labels to the
+   * lines that hold labels, instead of the whole image */
+  void UpdateMeshes(itk::Command *progressCommand, LabelImageWrapper *seg = NULL);
+
+  /** How UpdateMeshes computes the meshes of the labels */
+  enum MeshingMode
+  {
+    /** Each label is thresholded over its bounding box and passed through
+     * the VTK mesh pipeline separately, in parallel (default) */
+    PER_LABEL_MESHING,
+
+    /** All labels are extracted in one sweep over the label image with
+     * discrete marching cubes, and the surface is then split by label and
+     * passed through the mesh stages of the VTK pipeline (decimation, mesh
+     * smoothing). Gaussian smoothing of the image is not used in this mode */
+    SINGLE_PASS_MESHING
+  };
+
+  itkSetMacro(MeshingMode, MeshingMode)
+  itkGetMacro(MeshingMode, MeshingMode)
+
+  /** Maximum number of voxels decompressed at once in SINGLE_PASS_MESHING
+   * mode. The labels are swept in slabs along z of at most this size (but at
+   * least two slices thick). The default is 16M voxels */
+  itkSetMacro(SinglePassSlabSize, unsigned long)
+  itkGetMacro(SinglePassSlabSize, unsigned long)
+
+  /** Number of threads used by UpdateMeshes. If zero (default), the ITK global
+   * default number of threads is used */
+  itkSetMacro(NumberOfThreads, int)
+  itkGetMacro(NumberOfThreads, int)
 
   /** Get the collection of computed meshes */
   std::map<LabelType, vtkSmartPointer<vtkPolyData> > GetMeshCollection();
@@ -183,6 +224,66 @@ private:
   // The VTK pipeline
   VTKMeshPipeline *           m_VTKPipeline;
 
+  // Number of threads used to compute meshes
+  int m_NumberOfThreads;
+
+  // How the meshes are computed
+  MeshingMode m_MeshingMode;
+
+  // Voxels per slab in SINGLE_PASS_MESHING mode
+  unsigned long m_SinglePassSlabSize;
+
+  // A mesh to be computed by UpdateMeshes
+  struct MeshingJob
+  {
+    LabelType Label;
+    MeshInfo *Info;
+    InputImageType::RegionType Region;
+    void *ProgressSource;
+    bool Done, Reported;
+  };
+
+  // The meshes to be computed, shared by the threads
+  struct MeshingQueue
+  {
+    MultiLabelMeshPipeline *Self;
+    std::vector<MeshingJob> Jobs;
+    size_t Next, NumberDone;
+
+    // The first error raised by a thread. Once it is set, the jobs that
+    // remain are counted as done without being computed
+    std::string Error;
+
+    // Protects Next, NumberDone, Error and the Done flags
+    itk::SimpleFastMutexLock Mutex;
+
+    // Serializes access to the input image
+    itk::SimpleFastMutexLock InputMutex;
+  };
+
+  static bool CompareMeshingJobs(const MeshingJob &a, const MeshingJob &b);
+  static ITK_THREAD_RETURN_TYPE MeshingThreadCallback(void *arg);
+  void RunMeshingThread(MeshingQueue *queue, itk::ThreadIdType threadId);
+  void ComputeMeshingJob(MeshingQueue *queue, MeshingJob &job,
+                         ThresholdFilter *threshold, VTKMeshPipeline &vtkPipeline);
+  void ReportMeshingProgress(MeshingQueue *queue);
+
+  // The triangles of a label collected in SINGLE_PASS_MESHING mode
+  struct LabelSurface
+  {
+    vtkSmartPointer<vtkPoints> Points;
+    vtkSmartPointer<vtkCellArray> Polys;
+  };
+
+  // Compute the meshes in the queue in SINGLE_PASS_MESHING mode
+  void ComputeMeshesSinglePass(MeshingQueue *queue, AllPurposeProgressAccumulator *progress);
+
+  // Run marching cubes over a slab of the input and append the triangles of
+  // the labels in the queue to their surfaces
+  void ExtractSurfacesInSlab(MeshingQueue *queue,
+                             const InputImageType::RegionType &slab,
+                             std::map<LabelType, LabelSurface> &surfaces);
+
   // Helper routine for the update command
   void UpdateMeshInfoHelper(
       MeshInfo *current_meshinfo,
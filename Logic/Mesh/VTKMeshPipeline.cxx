@@ -272,18 +272,47 @@ VTKMeshPipeline
 
   // In the case that the jacobian of the transform is negative,
   // flip the normals around
+  this->FlipNormalsIfNeeded(m_StripperFilter->GetOutput());
+
+  // Disconnect pipeline
+  m_StripperFilter->SetOutput(NULL);
+}
+
+void
+VTKMeshPipeline
+::ProcessMesh(vtkPolyData *inMesh, vtkPolyData *outMesh)
+{
+  // Reset the progress meter
+  m_Progress->ResetProgress();
+
+  // Graft the polydata to the last filter in the pipeline
+  m_StripperFilter->SetOutput(outMesh);
+
+  // Feed the mesh to the transform filter in place of the marching cubes
+  m_TransformFilter->SetInputData(inMesh);
+  m_StripperFilter->Update();
+  this->FlipNormalsIfNeeded(m_StripperFilter->GetOutput());
+
+  // Restore and disconnect pipeline
+  m_TransformFilter->SetInputConnection(m_MarchingCubesFilter->GetOutputPort());
+  m_StripperFilter->SetOutput(NULL);
+}
+
+void
+VTKMeshPipeline
+::FlipNormalsIfNeeded(vtkPolyData *mesh)
+{
   if(m_Transform->GetMatrix()->Determinant() < 0)
     {
-    vtkPointData *pd = m_StripperFilter->GetOutput()->GetPointData();
+    vtkPointData *pd = mesh->GetPointData();
     vtkDataArray *nrm = pd->GetNormals();
+    if(!nrm)
+      return;
     for(size_t i = 0; i < (size_t)nrm->GetNumberOfTuples(); i++)
       for(size_t j = 0; j < (size_t)nrm->GetNumberOfComponents(); j++)
         nrm->SetComponent(i,j,-nrm->GetComponent(i,j));
     nrm->Modified();
     }
-
-  // Disconnect pipeline
-  m_StripperFilter->SetOutput(NULL);
 }
 
 void
@@ -293,6 +322,14 @@ VTKMeshPipeline
   // Store the image 
   m_InputImage = image;
 
+  // Compute the transform from VTK coordinates to NIFTI/RAS coordinates
+  this->SetTransformFromImage(image);
+}
+
+void
+VTKMeshPipeline
+::SetTransformFromImage(const itk::ImageBase<3> *image)
+{
   // Compute the transform from VTK coordinates to NIFTI/RAS coordinates
   vnl_matrix_fixed<double, 4, 4> vtk2nii = 
     ImageWrapperBase::ConstructVTKtoNiftiTransform(
@@ -89,6 +89,17 @@ public:
   /** Compute a mesh for a particular color label */
   void ComputeMesh(vtkPolyData *outData, itk::FastMutexLock *lock = NULL);
 
+  /** Set the transform from VTK to RAS coordinates using the geometry of
+   * an image. This is done by SetImage(), but must be called explicitly
+   * before calling ProcessMesh() */
+  void SetTransformFromImage(const itk::ImageBase<3> *image);
+
+  /** Apply the mesh stages of the pipeline (transform to RAS coordinates,
+   * decimation, mesh smoothing, triangle strips) to a mesh that has been
+   * computed in VTK coordinates by other means. The image stages (Gaussian
+   * smoothing, marching cubes) are skipped. */
+  void ProcessMesh(vtkPolyData *inMesh, vtkPolyData *outMesh);
+
   /** Get the progress accumulator */
   AllPurposeProgressAccumulator *GetProgressAccumulator()
     { return m_Progress; }
@@ -142,6 +153,9 @@ private:
   // Progress event monitor
   AllPurposeProgressAccumulator::Pointer m_Progress;
 
+  // Flip the normals of the output if the transform reverses orientation
+  void FlipNormalsIfNeeded(vtkPolyData *mesh);
+
 };
 
 #endif // __VTKMeshPipeline_h_
@@ -47,10 +47,12 @@
 
 namespace itk {
   template <class TIn, class TOut> class DiscreteGaussianImageFilter;
+  template <class TIn, class TOut> class SmoothingRecursiveGaussianImageFilter;
   template <class TIn, class TOut> class GradientMagnitudeImageFilter;
   template <class TIn, class TOut, class Fun> class UnaryFunctorImageFilter;
   template <class TIn, class TOut> class StreamingImageFilter;
   template <class TIn, class TOut> class CastImageFilter;
+  template <class TIn, class TOut> class ExtractImageFilter;
 }
 
 
@@ -101,12 +103,83 @@ private:
   float m_Exponent;
 };
 
+/**
+ * \class EdgeGradientRemappingImageFilter
+ * \brief Gradient magnitude followed by an intensity remapping, in one pass.
+ *
+ * Computes the gradient magnitude by central differences, the same way as
+ * itk::GradientMagnitudeImageFilter with image spacing, and passes it through
+ * the functor. This saves the intermediate gradient magnitude image.
+ */
+template <typename TInputImage, typename TOutputImage, typename TFunctor>
+class EdgeGradientRemappingImageFilter:
+  public itk::ImageToImageFilter<TInputImage,TOutputImage>
+{
+public:
+
+  /** Standard class typedefs. */
+  typedef EdgeGradientRemappingImageFilter                         Self;
+  typedef itk::ImageToImageFilter<TInputImage,TOutputImage>  Superclass;
+  typedef itk::SmartPointer<Self>                               Pointer;
+  typedef itk::SmartPointer<const Self>                    ConstPointer;
+
+  typedef TInputImage                                    InputImageType;
+  typedef TOutputImage                                  OutputImageType;
+  typedef typename Superclass::OutputImageRegionType
+                                                  OutputImageRegionType;
+  typedef TFunctor                                          FunctorType;
+
+  itkTypeMacro(EdgeGradientRemappingImageFilter, ImageToImageFilter)
+
+  itkNewMacro(Self)
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TInputImage::ImageDimension);
+
+  /** Set the remapping functor */
+  void SetFunctor(const FunctorType &functor)
+    {
+    if(m_Functor != functor)
+      {
+      m_Functor = functor;
+      this->Modified();
+      }
+    }
+
+protected:
+
+  EdgeGradientRemappingImageFilter() {}
+  virtual ~EdgeGradientRemappingImageFilter() {}
+
+  /** The input region is padded by one voxel for the derivatives */
+  void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  void ThreadedGenerateData(const OutputImageRegionType &region,
+                            itk::ThreadIdType threadId) ITK_OVERRIDE;
+
+private:
+
+  EdgeGradientRemappingImageFilter(const Self &); //purposely not implemented
+  void operator=(const Self &);                   //purposely not implemented
+
+  FunctorType m_Functor;
+};
+
 /**
  * \class EdgePreprocessingImageFilter
  * \brief A filter used for edge preprocessing of images in the IRIS application.
  * 
  * This functor implements a Gaussian blur, followed by a gradient magnitude
  * operator, followed by a 'contrast enhancement' intensity remapping filter.
+ *
+ * The blur is computed either with a discrete Gaussian kernel, whose width
+ * grows with the blur scale, or with a recursive (IIR) Gaussian, whose cost
+ * does not depend on the blur scale. The recursive path computes the
+ * gradient magnitude and the remapping in a single pass. Both paths only
+ * blur the requested region padded by a margin: the radius of the kernel,
+ * or four standard deviations for the recursive Gaussian, whose response
+ * beyond that is negligible. A streamed update (slabs or bricks) therefore
+ * never holds more than one padded piece of the blurred image.
  */
 template <typename TInputImage,typename TOutputImage>
 class EdgePreprocessingImageFilter: 
@@ -164,6 +237,27 @@ public:
   /** Get the parameters pointer */
   EdgePreprocessingSettings *GetParameters();
 
+  /** How the Gaussian blur is computed */
+  enum BlurMode
+    {
+    KERNEL_BLUR,      // discrete Gaussian kernel
+    RECURSIVE_BLUR,   // recursive (IIR) Gaussian
+    AUTOMATIC_BLUR    // whichever path has the smaller estimated cost
+    };
+
+  /** Set how the Gaussian blur is computed. In the automatic mode (default)
+    the path is chosen from the blur scale and the size of the volume, so
+    that slice previews and the whole volume are computed the same way: the
+    recursive path for large blur scales, and the kernel for small ones. The
+    results of the two paths differ by a fraction of a percent. */
+  itkSetMacro(BlurMode, BlurMode)
+  itkGetMacro(BlurMode, BlurMode)
+
+  /** Radius of the neighborhood of input voxels needed to compute an output
+    voxel, for the blur path that is used. The output information must be up
+    to date, because the path depends on the size of the volume */
+  unsigned int GetStreamingRadius();
+
 protected:
 
   EdgePreprocessingImageFilter();
@@ -179,10 +273,25 @@ protected:
    */
   void GenerateInputRequestedRegion() ITK_OVERRIDE;
 
+  /** Decide whether the recursive Gaussian is cheaper for blurring the
+    whole volume */
+  bool IsRecursiveGaussianCheaper(double scale);
+
+  /** Whether the blur is computed with the recursive Gaussian */
+  bool UseRecursiveGaussian(double scale);
+
+  /** Radius of the discrete Gaussian kernel */
+  static unsigned int GetKernelRadius(double scale);
+
+  /** Margin by which the recursive Gaussian pads the requested region */
+  static unsigned int GetRecursiveGaussianMargin(double scale);
+
 private:
 
   double m_InputImageMaximumGradientMagnitude;
 
+  BlurMode m_BlurMode;
+
   typedef itk::CastImageFilter<InputImageType, InternalImageType>   CastFilter;
 
   typedef itk::DiscreteGaussianImageFilter<InternalImageType,
@@ -202,11 +311,26 @@ private:
                                        OutputImageType,
                                        FunctorType>                RemapFilter;
 
+  typedef itk::ExtractImageFilter<InternalImageType,
+                                  InternalImageType>         MarginFilter;
+
+  typedef itk::SmoothingRecursiveGaussianImageFilter<InternalImageType,
+                                                     InternalImageType>
+                                                      RecursiveBlurFilter;
+
+  typedef EdgeGradientRemappingImageFilter<InternalImageType,
+                                           OutputImageType,
+                                           FunctorType>  GradMagRemapFilter;
+
   SmartPtr<CastFilter> m_CastFilter;
   SmartPtr<BlurFilter> m_BlurFilter;
   SmartPtr<GradMagFilter> m_GradMagFilter;
   SmartPtr<RemapFilter> m_RemapFilter;
 
+  SmartPtr<MarginFilter> m_MarginFilter;
+  SmartPtr<RecursiveBlurFilter> m_RecursiveBlurFilter;
+  SmartPtr<GradMagRemapFilter> m_GradMagRemapFilter;
+
 #ifdef SNAP_USE_GPU
   SmartPtr<GPUImageSource> m_GPUImageSource;
   SmartPtr<GPUBlurFilter>  m_GPUBlurFilter;
@@ -38,9 +38,14 @@
 
 #include <itkCastImageFilter.h>
 #include <itkDiscreteGaussianImageFilter.h>
+#include <itkExtractImageFilter.h>
+#include <itkSmoothingRecursiveGaussianImageFilter.h>
+#include <itkImageScanlineIterator.h>
 #include <itkGradientMagnitudeImageFilter.h>
 #include <itkUnaryFunctorImageFilter.h>
 #include <IRISException.h>
+#include <algorithm>
+#include <cmath>
 
 template<typename TInputImage,typename TOutputImage>
 EdgePreprocessingImageFilter<TInputImage,TOutputImage>
@@ -52,6 +57,9 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
   // Set the gradient magnitude to default value
   m_InputImageMaximumGradientMagnitude = 0.0;
 
+  // Pick the blur path based on cost by default
+  m_BlurMode = AUTOMATIC_BLUR;
+
   // Initialize the mini-pipeline
   m_CastFilter = CastFilter::New();
   m_CastFilter->ReleaseDataFlagOn();
@@ -92,6 +100,20 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
 
   m_RemapFilter = RemapFilter::New();
   m_RemapFilter->SetInput(m_GradMagFilter->GetOutput());
+
+  // The recursive Gaussian path. The recursive filter blurs all of its
+  // input, so it is given a padded piece of the image, which keeps its index
+  m_MarginFilter = MarginFilter::New();
+  m_MarginFilter->SetInput(m_CastFilter->GetOutput());
+  m_MarginFilter->SetDirectionCollapseToSubmatrix();
+  m_MarginFilter->ReleaseDataFlagOn();
+
+  m_RecursiveBlurFilter = RecursiveBlurFilter::New();
+  m_RecursiveBlurFilter->SetInput(m_MarginFilter->GetOutput());
+  m_RecursiveBlurFilter->ReleaseDataFlagOn();
+
+  m_GradMagRemapFilter = GradMagRemapFilter::New();
+  m_GradMagRemapFilter->SetInput(m_RecursiveBlurFilter->GetOutput());
 }
 
 template<typename TInputImage,typename TOutputImage>
@@ -113,6 +135,48 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
   itk::ProgressAccumulator::Pointer pac = itk::ProgressAccumulator::New();
   pac->SetMiniPipelineFilter(this);
 
+  // Configure the pipeline
+  m_CastFilter->SetInput(inputImage);
+
+  // Construct the functor
+  // TODO: fixme!
+  FunctorType functor;
+  functor.SetParameters(0.0, m_InputImageMaximumGradientMagnitude,
+                        settings->GetRemappingExponent(),
+                        settings->GetRemappingSteepness());
+
+  // The blur scale is in voxel units, as in the kernel path
+  double scale = settings->GetGaussianBlurScale();
+  typename RecursiveBlurFilter::SigmaArrayType sigma;
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    sigma[d] = scale * inputImage->GetSpacing()[d];
+  m_RecursiveBlurFilter->SetSigmaArray(sigma);
+
+  if(this->UseRecursiveGaussian(scale))
+    {
+    pac->RegisterInternalFilter(m_RecursiveBlurFilter, 0.8);
+    pac->RegisterInternalFilter(m_GradMagRemapFilter, 0.2);
+
+    // Blur the requested region padded by the margin of the Gaussian, and by
+    // one more voxel for the central differences
+    OutputImageRegionType rAll = outputImage->GetLargestPossibleRegion();
+    OutputImageRegionType rPadded = outputImage->GetRequestedRegion();
+    rPadded.PadByRadius(GetRecursiveGaussianMargin(scale) + 1);
+    rPadded.Crop(inputImage->GetLargestPossibleRegion());
+    m_MarginFilter->SetExtractionRegion(rPadded);
+
+    m_GradMagRemapFilter->SetFunctor(functor);
+
+    // Graft outputs and update the filter
+    m_GradMagRemapFilter->GraftOutput(outputImage);
+    m_GradMagRemapFilter->Update();
+    this->GraftOutput(m_GradMagRemapFilter->GetOutput());
+
+    // The mini-pipeline only knows the padded piece of the image
+    outputImage->SetLargestPossibleRegion(rAll);
+    return;
+    }
+
 #ifndef SNAP_USE_GPU
   pac->RegisterInternalFilter(m_BlurFilter, 0.8);
 #else
@@ -121,9 +185,6 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
 
     pac->RegisterInternalFilter(m_RemapFilter, 0.2);
 
-  // Configure the pipeline
-  m_CastFilter->SetInput(inputImage);
-
   // Configure the Gaussian
 #ifndef SNAP_USE_GPU
   m_BlurFilter->SetUseImageSpacingOff();
@@ -135,13 +196,6 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
         settings->GetGaussianBlurScale() * settings->GetGaussianBlurScale());
 #endif
 
-  // Construct the functor
-  // TODO: fixme!
-  FunctorType functor;
-  functor.SetParameters(0.0, m_InputImageMaximumGradientMagnitude,
-                        settings->GetRemappingExponent(),
-                        settings->GetRemappingSteepness());
-
   // Configure the remapping filter
   m_RemapFilter->SetFunctor(functor);
 
@@ -151,6 +205,81 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
   this->GraftOutput(m_RemapFilter->GetOutput());
 }
 
+template<typename TInputImage,typename TOutputImage>
+bool
+EdgePreprocessingImageFilter<TInputImage,TOutputImage>
+::IsRecursiveGaussianCheaper(double scale)
+{
+  double radius = GetKernelRadius(scale);
+
+  // The choice depends only on the blur scale and on the size of the volume,
+  // never on the requested region, so that a slice preview uses the same
+  // path as the update of the whole volume and shows the same result. The
+  // costs compared are those of blurring the whole volume. In each dimension,
+  // the kernel filter applies up to 2r+1 taps to every voxel (fewer when the
+  // volume is thinner than the kernel), and the recursive filter runs a
+  // fourth order causal and anti-causal filter over every voxel
+  OutputImageRegionType rAll = this->GetOutput()->GetLargestPossibleRegion();
+  double nVoxels = rAll.GetNumberOfPixels();
+  double kernelCost = 0.0, recursiveCost = 0.0;
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    {
+    if(rAll.GetSize(d) > 1)
+      {
+      kernelCost += nVoxels * std::min(2 * radius + 1, (double) rAll.GetSize(d));
+      recursiveCost += nVoxels * 16.0;
+      }
+    }
+
+  return recursiveCost < kernelCost;
+}
+
+template<typename TInputImage,typename TOutputImage>
+bool
+EdgePreprocessingImageFilter<TInputImage,TOutputImage>
+::UseRecursiveGaussian(double scale)
+{
+  return m_BlurMode == RECURSIVE_BLUR ||
+      (m_BlurMode == AUTOMATIC_BLUR && this->IsRecursiveGaussianCheaper(scale));
+}
+
+template<typename TInputImage,typename TOutputImage>
+unsigned int
+EdgePreprocessingImageFilter<TInputImage,TOutputImage>
+::GetKernelRadius(double scale)
+{
+  // The kernel filter truncates the Gaussian where its tail falls below the
+  // maximum error of 0.1, roughly at 2.2 sigma, and limits the width to 32
+  return static_cast<unsigned int>(std::min(15.0, std::ceil(2.2 * scale)));
+}
+
+template<typename TInputImage,typename TOutputImage>
+unsigned int
+EdgePreprocessingImageFilter<TInputImage,TOutputImage>
+::GetRecursiveGaussianMargin(double scale)
+{
+  // Beyond four sigma, the weights of the Gaussian add up to less than 1e-4,
+  // so blurring a piece padded by that much matches blurring the whole image
+  // to well within the precision of the output
+  return static_cast<unsigned int>(std::ceil(4.0 * scale));
+}
+
+template<typename TInputImage,typename TOutputImage>
+unsigned int
+EdgePreprocessingImageFilter<TInputImage,TOutputImage>
+::GetStreamingRadius()
+{
+  EdgePreprocessingSettings *settings = this->GetParameters();
+  if(!settings)
+    return 1;
+
+  // One more voxel is needed for the gradient
+  double scale = settings->GetGaussianBlurScale();
+  if(this->UseRecursiveGaussian(scale))
+    return GetRecursiveGaussianMargin(scale) + 1;
+  return GetKernelRadius(scale) + 1;
+}
+
 template<typename TInputImage,typename TOutputImage>
 void
 EdgePreprocessingImageFilter<TInputImage,TOutputImage>
@@ -202,3 +331,76 @@ EdgePreprocessingImageFilter<TInputImage,TOutputImage>
         inputPtr->GetLargestPossibleRegion());
 }
 
+
+
+template<typename TInputImage,typename TOutputImage,typename TFunctor>
+void
+EdgeGradientRemappingImageFilter<TInputImage,TOutputImage,TFunctor>
+::GenerateInputRequestedRegion()
+{
+  Superclass::GenerateInputRequestedRegion();
+
+  // Pad the requested region by one voxel for the central differences
+  InputImageType *inputPtr = const_cast<InputImageType *>(this->GetInput());
+  typename InputImageType::RegionType region = inputPtr->GetRequestedRegion();
+  region.PadByRadius(1);
+  region.Crop(inputPtr->GetLargestPossibleRegion());
+  inputPtr->SetRequestedRegion(region);
+}
+
+template<typename TInputImage,typename TOutputImage,typename TFunctor>
+void
+EdgeGradientRemappingImageFilter<TInputImage,TOutputImage,TFunctor>
+::ThreadedGenerateData(const OutputImageRegionType &region,
+                       itk::ThreadIdType itkNotUsed(threadId))
+{
+  typedef typename InputImageType::PixelType InputPixelType;
+  typedef typename InputImageType::OffsetValueType OffsetValueType;
+
+  const InputImageType *input = this->GetInput();
+  const typename InputImageType::RegionType &bufferedRegion = input->GetBufferedRegion();
+  const OffsetValueType *offsetTable = input->GetOffsetTable();
+
+  // Derivative weights, as in the derivative operator used by the gradient
+  // magnitude filter: 0.5 / spacing
+  double weight[ImageDimension];
+  for(unsigned int d = 0; d < ImageDimension; d++)
+    weight[d] = 0.5 / input->GetSpacing()[d];
+
+  // Each thread uses its own copy of the functor
+  FunctorType functor = m_Functor;
+
+  itk::ImageScanlineIterator<OutputImageType> itOut(this->GetOutput(), region);
+  while(!itOut.IsAtEnd())
+    {
+    // Offsets of the neighbors of the first voxel in the line. Voxels on the
+    // edge of the buffered region are repeated, like the zero flux Neumann
+    // boundary condition of the gradient magnitude filter
+    typename InputImageType::IndexType idx = itOut.GetIndex();
+    const InputPixelType *pCenter = input->GetBufferPointer() + input->ComputeOffset(idx);
+    OffsetValueType offMinus[ImageDimension], offPlus[ImageDimension];
+    for(unsigned int d = 1; d < ImageDimension; d++)
+      {
+      long lo = bufferedRegion.GetIndex(d);
+      long hi = lo + bufferedRegion.GetSize(d) - 1;
+      offMinus[d] = (idx[d] > lo) ? -offsetTable[d] : 0;
+      offPlus[d] = (idx[d] < hi) ? offsetTable[d] : 0;
+      }
+
+    long xlo = bufferedRegion.GetIndex(0);
+    long xhi = xlo + bufferedRegion.GetSize(0) - 1;
+    for(long x = idx[0]; !itOut.IsAtEndOfLine(); ++itOut, ++x, ++pCenter)
+      {
+      double dx = (x < xhi ? pCenter[1] : pCenter[0]) - (x > xlo ? pCenter[-1] : pCenter[0]);
+      double gm2 = dx * dx * weight[0] * weight[0];
+      for(unsigned int d = 1; d < ImageDimension; d++)
+        {
+        double dd = (pCenter[offPlus[d]] - pCenter[offMinus[d]]) * weight[d];
+        gm2 += dd * dd;
+        }
+      itOut.Set(functor(static_cast<InputPixelType>(sqrt(gm2))));
+      }
+
+    itOut.NextLine();
+    }
+}
@@ -1,9 +1,16 @@
 #include "EMGaussianMixtures.h"
 #include <iostream>
 #include <ctime>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+// Number of samples in a block. The blocks are the unit of work for the
+// threads and their number does not depend on the number of threads
+const int EM_BLOCK_SIZE = 1024;
 
 EMGaussianMixtures::EMGaussianMixtures(double **x, int dataSize, int dataDim, int numOfClass)
-  :m_x(x), m_numOfData(dataSize), m_dimOfGaussian(dataDim), m_numOfGaussian(numOfClass), m_setPriorFlag(0), m_numOfIteration(0), m_fail(0)
+  :m_numOfData(dataSize), m_dimOfGaussian(dataDim), m_numOfGaussian(numOfClass), m_setPriorFlag(0), m_numOfIteration(0), m_fail(0)
 {
   m_latent = new double*[dataSize];
   m_probs = new double[dataSize*numOfClass];
@@ -17,38 +24,53 @@ EMGaussianMixtures::EMGaussianMixtures(double **x, int dataSize, int dataDim, in
     {
     m_log_pdf[i] = &m_probs2[i*numOfClass];
     }
-  m_tmp1 = new double[numOfClass];
   m_tmp2 = new double[dataDim];
   m_tmp3 = new double[dataDim*dataDim];
   m_sum = new double[numOfClass];
   m_weight = new double[numOfClass];
 
+  // Copy the samples into a contiguous buffer, one component at a time, so
+  // that the loops over the samples access memory sequentially
+  m_samples.resize(dataSize * dataDim);
+  for (int i = 0; i < dataSize; i++)
+    {
+    for (int k = 0; k < dataDim; k++)
+      {
+      m_samples[k * dataSize + i] = x[i][k];
+      }
+    }
+
+  m_numOfBlocks = (dataSize + EM_BLOCK_SIZE - 1) / EM_BLOCK_SIZE;
+  m_numOfThreads = 0;
+  m_logWeight.resize(numOfClass);
+  m_means.resize(numOfClass * dataDim);
+  m_isDelta.resize(numOfClass);
+
   m_gmm = GaussianMixtureModel::New();
   m_gmm->Initialize(dataDim, numOfClass);
 
   m_maxIteration = 30;
   m_precision = 1.0e-7;
-  m_logLikelihood = std::numeric_limits<double>::infinity();
+  m_logLikelihood = -std::numeric_limits<double>::infinity();
 }
 
 EMGaussianMixtures::~EMGaussianMixtures()
 {
-  delete m_probs;
-  delete m_probs2;
-  delete m_latent;
-  delete m_log_pdf;
-  delete m_tmp1;
-  delete m_tmp2;
-  delete m_tmp3;
-  delete m_sum;
-  delete m_weight;
+  delete[] m_probs;
+  delete[] m_probs2;
+  delete[] m_latent;
+  delete[] m_log_pdf;
+  delete[] m_tmp2;
+  delete[] m_tmp3;
+  delete[] m_sum;
+  delete[] m_weight;
 }
 
 void EMGaussianMixtures::Reset(void)
 {
   m_numOfIteration = 0;
   m_fail = 0;
-  m_logLikelihood = std::numeric_limits<double>::infinity();
+  m_logLikelihood = -std::numeric_limits<double>::infinity();
   for (int i = 0; i < m_numOfData*m_numOfGaussian; i++)
     {
     m_probs[i] = 0;
@@ -102,6 +124,11 @@ int EMGaussianMixtures::GetMaxIteration(void)
   return m_maxIteration;
 }
 
+void EMGaussianMixtures::SetNumberOfThreads(int nThreads)
+{
+  m_numOfThreads = nThreads;
+}
+
 double ** EMGaussianMixtures::Update(void)
 {
   double currentLogLikelihood = 0;
@@ -109,10 +136,10 @@ double ** EMGaussianMixtures::Update(void)
   m_fail = 0;
   while ((fabs(m_logLikelihood - currentLogLikelihood) > m_precision) && (m_numOfIteration < m_maxIteration))
     {
-    if (m_logLikelihood < currentLogLikelihood)
+    if (m_numOfIteration > 1 && currentLogLikelihood < m_logLikelihood)
       {
       m_fail = 1;
-      std::cout << "!!!!!! Log Likelihood increase, EM fails" << std::endl;
+      std::cout << "!!!!!! Log Likelihood decrease, EM fails" << std::endl;
       std::cout << "old=" <<m_logLikelihood << std::endl << "new=" << currentLogLikelihood << std::endl;
       // break;
       }
@@ -149,10 +176,10 @@ double ** EMGaussianMixtures::UpdateOnce(void)
   double currentLogLikelihood = EvaluateLogLikelihood();
   end = clock();
   std::cout << "evaluate likelihood spending " << (end-start)/1000 << std::endl;
-  if (m_logLikelihood < currentLogLikelihood)
+  if (currentLogLikelihood < m_logLikelihood)
     {
     m_fail = 1;
-    std::cout << "!!!!!! Log Likelihood increase, EM fails" << std::endl;
+    std::cout << "!!!!!! Log Likelihood decrease, EM fails" << std::endl;
     std::cout << "old=" <<m_logLikelihood << std::endl << "new=" << currentLogLikelihood << std::endl;
     }
   if (fabs(m_logLikelihood - currentLogLikelihood) <= m_precision)
@@ -196,22 +223,162 @@ double ** EMGaussianMixtures::UpdateOnce(void)
 
 void EMGaussianMixtures::EvaluatePDF(void)
 {
-  for (int i = 0; i < m_numOfData; i++)
+  this->RunStage(STAGE_PDF, 0, NULL);
+  if (m_setPriorFlag == 0)
     {
     for (int j = 0; j < m_numOfGaussian; j++)
       {
-      m_log_pdf[i][j] = m_gmm->EvaluateLogPDF(j, m_x[i]);
+      m_weight[j] = m_gmm->GetWeight(j);
       }
     }
-  if (m_setPriorFlag == 0)
+}
+
+void EMGaussianMixtures::RunStage(Stage stage, int nSums, double *sums)
+{
+  m_stage = stage;
+  m_numOfSums = nSums;
+  m_blockSums.assign(m_numOfBlocks * nSums, 0.0);
+
+  int nThreads = (m_numOfThreads > 0)
+      ? m_numOfThreads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  nThreads = std::max(1, std::min(nThreads, m_numOfBlocks));
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(nThreads);
+  threader->SetSingleMethod(StageThreadCallback, this);
+  threader->SingleMethodExecute();
+
+  // Add up the partial sums in block order
+  for (int s = 0; s < nSums; s++)
     {
-    for (int j = 0; j < m_numOfGaussian; j++)
+    sums[s] = 0.0;
+    }
+  for (int b = 0; b < m_numOfBlocks; b++)
+    {
+    for (int s = 0; s < nSums; s++)
       {
-      m_weight[j] = m_gmm->GetWeight(j);
+      sums[s] += m_blockSums[b * nSums + s];
       }
     }
 }
 
+ITK_THREAD_RETURN_TYPE EMGaussianMixtures::StageThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+  EMGaussianMixtures *self = static_cast<EMGaussianMixtures *>(info->UserData);
+
+  // Scratch space for the block computations
+  std::vector<double> scratch(
+        std::max(2, self->m_dimOfGaussian) * EM_BLOCK_SIZE);
+
+  // Blocks are assigned to the threads in turn
+  for (int b = info->ThreadID; b < self->m_numOfBlocks; b += info->NumberOfThreads)
+    {
+    double *partial = self->m_numOfSums > 0
+        ? &self->m_blockSums[b * self->m_numOfSums] : NULL;
+    self->RunStageForBlock(self->m_stage, b, partial, &scratch[0]);
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+void EMGaussianMixtures::RunStageForBlock(Stage stage, int block, double *partial, double *scratch)
+{
+  int i0 = block * EM_BLOCK_SIZE;
+  int n = std::min(EM_BLOCK_SIZE, m_numOfData - i0);
+  int G = m_numOfGaussian, D = m_dimOfGaussian;
+
+  switch(stage)
+    {
+    case STAGE_PDF:
+      for (int j = 0; j < G; j++)
+        {
+        m_gmm->GetGaussian(j)->EvaluateLogPDF(
+              &m_samples[i0], m_numOfData, n, &m_probs2[i0 * G + j], G, scratch);
+        }
+      break;
+
+    case STAGE_LIKELIHOOD:
+      for (int i = i0; i < i0 + n; i++)
+        {
+        double tmp1 = 0;
+        for (int j = 0; j < G; j++)
+          {
+          if(!m_isDelta[j])
+            {
+            double w = (m_setPriorFlag == 0) ? m_weight[j] : m_prior[i][j];
+            tmp1 += w * exp(m_log_pdf[i][j]);
+            }
+          }
+        partial[0] += log(tmp1);
+        }
+      break;
+
+    case STAGE_LATENT:
+      for (int i = i0; i < i0 + n; i++)
+        {
+        for (int j = 0; j < G; j++)
+          {
+          m_latent[i][j] = ComputePosterior(G, m_log_pdf[i], m_weight, &m_logWeight[0], j);
+          partial[j] += m_latent[i][j];
+          }
+        }
+      break;
+
+    case STAGE_MEAN:
+      // Partial sums of latent * x, for each class and component
+      for (int j = 0; j < G; j++)
+        {
+        for (int k = 0; k < D; k++)
+          {
+          const double *xk = &m_samples[k * m_numOfData + i0];
+          const double *lat = &m_probs[i0 * G + j];
+          double sum = 0.0;
+          for (int s = 0; s < n; s++)
+            {
+            sum += lat[s * G] * xk[s];
+            }
+          partial[j * D + k] = sum;
+          }
+        }
+      break;
+
+    case STAGE_COVARIANCE:
+      // Partial sums of latent * (x - mean)(x - mean)^T, for each class. Only
+      // the upper triangle is summed, the matrix is symmetric
+      for (int j = 0; j < G; j++)
+        {
+        const double *lat = &m_probs[i0 * G + j];
+        for (int k = 0; k < D; k++)
+          {
+          const double *xk = &m_samples[k * m_numOfData + i0];
+          double mk = m_means[j * D + k];
+          for (int s = 0; s < n; s++)
+            {
+            scratch[k * EM_BLOCK_SIZE + s] = xk[s] - mk;
+            }
+          }
+        for (int k = 0; k < D; k++)
+          {
+          const double *dk = scratch + k * EM_BLOCK_SIZE;
+          for (int l = k; l < D; l++)
+            {
+            const double *dl = scratch + l * EM_BLOCK_SIZE;
+            double sum = 0.0;
+            for (int s = 0; s < n; s++)
+              {
+              sum += dk[s] * dl[s] * lat[s * G];
+              }
+            partial[(j * D + k) * D + l] = sum;
+            partial[(j * D + l) * D + k] = sum;
+            }
+          }
+        }
+      break;
+    }
+}
+
 #include <vnl/vnl_math.h>
 
 double EMGaussianMixtures::ComputePosterior(int nGauss, double *log_pdf, double *w, double *log_w, int j)
@@ -266,160 +433,68 @@ double EMGaussianMixtures::ComputePosterior(int nGauss, double *log_pdf, double
 
 void EMGaussianMixtures::UpdateLatent(void)
 {
-  double sum = 0;
-  for (int i = 0; i < m_numOfGaussian; i++)
-    {
-    m_sum[i] = 0;
-    }
-
-  // Compute log of the weights and store in logw
-  vnl_vector<double> logw(m_numOfGaussian);
+  // Compute log of the weights
   for(int i = 0; i < m_numOfGaussian; i++)
-    logw(i) = log(m_weight[i]);
-  
+    m_logWeight[i] = log(m_weight[i]);
+
   if (m_setPriorFlag == 0)
     {
-    for (int i = 0; i < m_numOfData; i++)
-      {
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        m_latent[i][j] = ComputePosterior(m_numOfGaussian, m_log_pdf[i], m_weight, logw.data_block(), j);
-        m_sum[j] += m_latent[i][j];
-        }
-
-
-      /*
-      sum = 0;
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        m_tmp1[j] = m_weight[j] * m_pdf[i][j];
-        sum += m_tmp1[j];
-        }
-      if(sum == 0)
-        {
-        for (int j = 0; j < m_numOfGaussian; j++)
-          {
-          m_latent[i][j] = 1.0 / m_numOfGaussian;
-          m_sum[j] += m_latent[i][j];
-          }
-        }
-      else
-        {
-        for (int j = 0; j < m_numOfGaussian; j++)
-          {
-          m_latent[i][j] = m_tmp1[j] / sum;
-          m_sum[j] += m_latent[i][j];
-          }
-        }
-        */
-      }
+    this->RunStage(STAGE_LATENT, m_numOfGaussian, m_sum);
     }
   else
     {
-    /**= THIS IS NOT USED
-    for (int i = 0; i < m_numOfData; i++)
+    // The latent variables are not updated when there is a prior
+    for (int i = 0; i < m_numOfGaussian; i++)
       {
-      sum = 0;
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        m_tmp1[j] = m_prior[i][j] * m_pdf[i][j];
-        sum += m_tmp1[j];
-        }
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        m_latent[i][j] = m_tmp1[j] / sum;
-        m_sum[j] += m_latent[i][j];
-        }
+      m_sum[i] = 0;
       }
-      */
     }
 }
 
 void EMGaussianMixtures::UpdateMean(void)
 {
+  std::vector<double> sums(m_numOfGaussian * m_dimOfGaussian);
+  this->RunStage(STAGE_MEAN, sums.size(), &sums[0]);
+
   for (int i = 0; i < m_numOfGaussian; i++)
     {
-    for (int j = 0; j < m_dimOfGaussian; j++)
-      {
-      m_tmp2[j] = 0;
-      }
-    
-    for (int j = 0; j < m_numOfData; j++)
-      {
-      for (int k = 0; k < m_dimOfGaussian; k++)
-        {
-        m_tmp2[k] += m_latent[j][i] * m_x[j][k];
-        }
-      }
-
     // This can lead to a possible divide by zero situation. In case the sum
     // of latent variables for class i is zero, we set the mean of that class
     // to infinity
-    if(m_sum[i] > 0)
-      {
-      for (int j = 0; j < m_dimOfGaussian; j++)
-        {
-        m_tmp2[j] = m_tmp2[j] / m_sum[i];
-        }
-      }
-    else
+    for (int j = 0; j < m_dimOfGaussian; j++)
       {
-      for (int j = 0; j < m_dimOfGaussian; j++)
-        {
-        m_tmp2[j] = - std::numeric_limits<double>::infinity();
-        }
+      m_tmp2[j] = (m_sum[i] > 0)
+          ? sums[i * m_dimOfGaussian + j] / m_sum[i]
+          : - std::numeric_limits<double>::infinity();
       }
 
-
     m_gmm->SetMean(i, VectorType(m_tmp2, m_dimOfGaussian));
     }
 }
 
 void EMGaussianMixtures::UpdateCovariance(void)
 {
+  // Cache the means for the threads
   for (int i = 0; i < m_numOfGaussian; i++)
     {
     const VectorType &current_mean = m_gmm->GetMean(i);
-    
     for (int j = 0; j < m_dimOfGaussian; j++)
       {
-      for (int k = 0; k < m_dimOfGaussian; k++)
-        {
-        m_tmp3[j*m_dimOfGaussian+k] = 0;
-        }
-      }
-    
-    for (int j = 0; j < m_numOfData; j++)
-      {
-      for (int k = 0; k < m_dimOfGaussian; k++)
-        {
-        m_tmp2[k] = m_x[j][k] - current_mean[k];
-        }
-      for (int k = 0; k < m_dimOfGaussian; k++)
-        {
-        for (int l = 0; l < m_dimOfGaussian; l++)
-          {
-          m_tmp3[k*m_dimOfGaussian+l] += m_tmp2[k] * m_tmp2[l] * m_latent[j][i];
-          }
-        }
+      m_means[i * m_dimOfGaussian + j] = current_mean[j];
       }
+    }
 
-    if(m_sum[i] > 0)
-      {
-      for (int j = 0; j < m_dimOfGaussian*m_dimOfGaussian; j++)
-        {
-        m_tmp3[j] = m_tmp3[j] / m_sum[i];
-        }
-      }
-    else
+  int dd = m_dimOfGaussian * m_dimOfGaussian;
+  std::vector<double> sums(m_numOfGaussian * dd);
+  this->RunStage(STAGE_COVARIANCE, sums.size(), &sums[0]);
+
+  for (int i = 0; i < m_numOfGaussian; i++)
+    {
+    for (int j = 0; j < dd; j++)
       {
-      for (int j = 0; j < m_dimOfGaussian*m_dimOfGaussian; j++)
-        {
-        m_tmp3[j] = 0.0;
-        }
+      m_tmp3[j] = (m_sum[i] > 0) ? sums[i * dd + j] / m_sum[i] : 0.0;
       }
 
-
     m_gmm->SetCovariance(i, MatrixType(m_tmp3, m_dimOfGaussian, m_dimOfGaussian));
     }
 }
@@ -434,35 +509,14 @@ void EMGaussianMixtures::UpdateWeight(void)
 
 double EMGaussianMixtures::EvaluateLogLikelihood(void)
 {
-  double tmp1 = 0;
-  double tmp2 = 0;
-  if (m_setPriorFlag == 0)
+  for (int j = 0; j < m_numOfGaussian; j++)
     {
-    for (int i = 0; i < m_numOfData; i++)
-      {
-      tmp1 = 0;
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        if(!m_gmm->GetGaussian(j)->isDeltaFunction())
-          tmp1 += m_weight[j] * exp(m_log_pdf[i][j]);
-        }
-      tmp2 += log(tmp1);
-      }
+    m_isDelta[j] = m_gmm->GetGaussian(j)->isDeltaFunction();
     }
-  else
-    {
-    for (int i = 0; i < m_numOfData; i++)
-      {
-      tmp1 = 0;
-      for (int j = 0; j < m_numOfGaussian; j++)
-        {
-        if(!m_gmm->GetGaussian(j)->isDeltaFunction())
-          tmp1 += m_prior[i][j] * exp(m_log_pdf[i][j]);
-        }
-      tmp2 += log(tmp1);
-      }
-    }
-  return tmp1;
+
+  double logLikelihood = 0;
+  this->RunStage(STAGE_LIKELIHOOD, 1, &logLikelihood);
+  return logLikelihood;
 }
 
 void EMGaussianMixtures::PrintParameters(void)
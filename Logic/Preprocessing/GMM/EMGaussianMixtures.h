@@ -3,6 +3,8 @@
 
 #include "GaussianMixtureModel.h"
 #include "SNAPCommon.h"
+#include "itkMultiThreader.h"
+#include <vector>
 
 class EMGaussianMixtures
 {
@@ -29,6 +31,9 @@ public:
   
   int GetMaxIteration(void);
 
+  // Set the number of threads used for the E and M steps (0: ITK default)
+  void SetNumberOfThreads(int nThreads);
+
   double ** Update(void);
   double ** UpdateOnce(void);
   double EvaluateLogLikelihood(void);
@@ -42,14 +47,26 @@ private:
   void UpdateMean(void);
   void UpdateCovariance(void);
   void UpdateWeight(void);
-  
+
+  // The E and M steps are computed in parallel over fixed blocks of samples.
+  // Each block stores its partial sums, and the partial sums are added up in
+  // block order, so that the results do not depend on the number of threads
+  enum Stage
+    {
+    STAGE_PDF, STAGE_LIKELIHOOD, STAGE_LATENT, STAGE_MEAN, STAGE_COVARIANCE
+    };
+
+  // Run a stage over all blocks; each block produces nSums partial sums,
+  // which are added up into the sums array (may be NULL if nSums is 0)
+  void RunStage(Stage stage, int nSums, double *sums);
+  static ITK_THREAD_RETURN_TYPE StageThreadCallback(void *arg);
+  void RunStageForBlock(Stage stage, int block, double *partial, double *scratch);
+
   double **m_latent;
   double **m_log_pdf;
   double **m_prior;
-  double **m_x;
   double *m_probs;
   double *m_probs2;
-  double *m_tmp1;
   double *m_tmp2;
   double *m_tmp3;
   double *m_sum;
@@ -64,6 +81,20 @@ private:
   int m_fail;
   double m_precision;
 
+  // The samples, stored component by component: component k of sample i is
+  // m_samples[k * m_numOfData + i]
+  std::vector<double> m_samples;
+
+  // State of the current stage, shared by the threads
+  Stage m_stage;
+  int m_numOfBlocks;
+  int m_numOfThreads;
+  int m_numOfSums;
+  std::vector<double> m_blockSums;
+  std::vector<double> m_logWeight;
+  std::vector<double> m_means;
+  std::vector<bool> m_isDelta;
+
   SmartPtr<GaussianMixtureModel> m_gmm;
 };
 
@@ -95,6 +95,48 @@ double Gaussian::EvaluateLogPDF(VectorType &x, VectorType &xscratch)
   return 0.5 * logz;
 }
 
+void Gaussian::EvaluateLogPDF(const double *x, int stride, int n,
+                              double *out, int outStride, double *scratch) const
+{
+  // Accumulate 2*log(p(z)) for all the samples at once, one eigenvector of
+  // the covariance at a time, so that the inner loops run over the samples
+  double *logz = scratch, *z = scratch + n;
+  for(int s = 0; s < n; s++)
+    logz[s] = 0.0;
+
+  for(int i = 0; i < m_dimension; i++)
+    {
+    // Project the mean-subtracted samples on the i-th eigenvector
+    for(int s = 0; s < n; s++)
+      z[s] = 0.0;
+    for(int j = 0; j < m_dimension; j++)
+      {
+      double v = m_Vt(i,j), m = m_mean_vector[j];
+      const double *xj = x + j * stride;
+      for(int s = 0; s < n; s++)
+        z[s] += v * (xj[s] - m);
+      }
+
+    if(m_Lambda[i] == 0)
+      {
+      // Zero variance: p(x) = 0 unless z[i] == 0, see the method above
+      for(int s = 0; s < n; s++)
+        if(z[s] != 0)
+          logz[s] = -std::numeric_limits<double>::infinity();
+      }
+    else
+      {
+      double fac = m_DiagNormFac[i], lambda = m_Lambda[i];
+      for(int s = 0; s < n; s++)
+        logz[s] -= fac + (z[s] * z[s] / lambda);
+      }
+    }
+
+  // Final value needs to be divided by two
+  for(int s = 0; s < n; s++)
+    out[s * outStride] = 0.5 * logz[s];
+}
+
 double Gaussian::EvaluatePDF(double *x)
 {
   // We got to exponentiate somewhere, so might as well do it here
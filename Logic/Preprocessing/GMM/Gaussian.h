@@ -26,6 +26,13 @@ public:
   // Evaluate log PDF with user-provided scratch buffer
   double EvaluateLogPDF(VectorType &x, VectorType &xscratch);
 
+  // Evaluate log PDF for a block of n samples stored component by component,
+  // i.e., component k of sample i is x[k * stride + i]. The result for sample
+  // i is written to out[i * outStride]. The scratch buffer must hold 2n
+  // values. Unlike the methods above, this can be called from several threads
+  void EvaluateLogPDF(const double *x, int stride, int n,
+                      double *out, int outStride, double *scratch) const;
+
   void PrintParameters();
 
   // Tests whether the Gaussian is a delta function (i.e., has zero total variance)
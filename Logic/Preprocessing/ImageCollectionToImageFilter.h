@@ -176,6 +176,18 @@ public:
     return *(dataPtr);
   }
 
+  /**
+   * Get a component in the neighborhood of the voxel at the given offset from
+   * the start of the buffer (no bounds check). This does not depend on the
+   * position of the iterator, so it may be called from several threads.
+   */
+  const InternalPixelType &NeighborValueAtOffset(
+      OffsetValueType offset, unsigned int comp, unsigned int nbr_idx) const
+  {
+    offset += m_NeighborhoodOffsetTable[nbr_idx];
+    return *(m_Start[comp] + offset * m_OffsetScaling[comp]);
+  }
+
 protected:
 
   // Collection of scalar images
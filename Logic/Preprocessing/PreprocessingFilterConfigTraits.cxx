@@ -43,7 +43,10 @@
 #include "IRISApplication.h"
 #include "UnsupervisedClustering.h"
 #include "RFClassificationEngine.h"
+#include "EdgePreprocessingSettings.h"
 #include "Rebroadcaster.h"
+#include <algorithm>
+#include <cmath>
 
 void
 SmoothBinaryThresholdFilterConfigTraits
@@ -135,6 +138,16 @@ EdgePreprocessingFilterConfigTraits
   filter->SetParameters(p);
 }
 
+unsigned int
+EdgePreprocessingFilterConfigTraits
+::GetStreamingRadius(FilterType *filter)
+{
+  // The blur path, and therefore the radius, depends on the size of the volume
+  if(filter->GetInput())
+    filter->UpdateOutputInformation();
+  return filter->GetStreamingRadius();
+}
+
 
 
 void
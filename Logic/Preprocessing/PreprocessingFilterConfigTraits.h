@@ -71,6 +71,9 @@ public:
   // This filter always has preview ready
   static bool IsPreviewable(FilterType *filter[]) { return true; }
 
+  // The threshold is applied voxel by voxel
+  static unsigned int GetStreamingRadius(FilterType *filter) { return 0; }
+
   static ScalarImageWrapperBase* GetDefaultScalarLayer(SNAPImageData *sid);
   static void SetActiveScalarLayer(
       ScalarImageWrapperBase *layer, FilterType *filter, int channel);
@@ -96,6 +99,9 @@ public:
   // This filter always has preview ready
   static bool IsPreviewable(FilterType *filter[]) { return true; }
 
+  // The margin needed by the blur path in use plus one voxel for the gradient
+  static unsigned int GetStreamingRadius(FilterType *filter);
+
   static ScalarImageWrapperBase* GetDefaultScalarLayer(SNAPImageData *sid) { return NULL; }
   static void SetActiveScalarLayer(
       ScalarImageWrapperBase *layer, FilterType *filter, int channel) {}
@@ -125,6 +131,9 @@ public:
   // This filter always has preview ready
   static bool IsPreviewable(FilterType *filter[]) { return true; }
 
+  // The mixture model classifies voxel by voxel
+  static unsigned int GetStreamingRadius(FilterType *filter) { return 0; }
+
   static ScalarImageWrapperBase* GetDefaultScalarLayer(SNAPImageData *sid) { return NULL; }
   static void SetActiveScalarLayer(
       ScalarImageWrapperBase *layer, FilterType *filter, int channel) {}
@@ -155,6 +164,10 @@ public:
   // This filter always has preview ready
   static bool IsPreviewable(FilterType *filter[]);
 
+  // The classifier pads its requests by the patch radius itself, and the
+  // patches are small compared to the smallest brick
+  static unsigned int GetStreamingRadius(FilterType *filter) { return 0; }
+
   static ScalarImageWrapperBase* GetDefaultScalarLayer(SNAPImageData *sid) { return NULL; }
   static void SetActiveScalarLayer(
       ScalarImageWrapperBase *layer, FilterType *filter, int channel) {}
@@ -5,11 +5,184 @@
 #include "ImageWrapper.h"
 #include "ImageCollectionToImageFilter.h"
 #include "RLEImageRegionIterator.h"
+#include "itkMultiThreader.h"
+#include "itkTimeProbe.h"
+#include <algorithm>
+#include <cmath>
+#include <set>
 
 // Includes from the random forest library
 #include "Library/classification.h"
 #include "Library/data.h"
 
+typedef ImageCollectionConstRegionIteratorWithIndex<
+    AnatomicScalarImageWrapper::ImageType,
+    AnatomicImageWrapper::ImageType> RFCollectionIter;
+
+/**
+ * Shared state of the threads that collect the training sample. The region
+ * is processed one slice (z position) at a time, with the slices handed to
+ * the threads in turn. The labeled voxels are found by walking the runs of
+ * the RLE label lines. The first pass counts the labeled voxels in each
+ * slice, which determines where the rows of each slice go in the sample, and
+ * the second pass fills the rows in.
+ */
+struct RFSampleCollector
+{
+  typedef LabelImageWrapper::ImageType LabelImageType;
+  typedef itk::OffsetValueType OffsetValueType;
+
+  const LabelImageType *LabelImage;
+  const RFCollectionIter *FeatureIter;
+  itk::ImageRegion<3> Region;
+  bool UseCoordinates;
+  int NumberOfComponents, PatchSize, NumberOfColumns;
+
+  // The sample from the previous round, ordered by offset
+  const std::vector<OffsetValueType> *OldOffsets;
+  const std::vector<LabelType> *OldLabels;
+  const std::vector<GreyType> *OldFeatures;
+
+  // The sample being collected
+  std::vector<OffsetValueType> *Offsets;
+  std::vector<LabelType> *Labels;
+  std::vector<GreyType> *Features;
+
+  // Number of samples in each slice (first pass) and the first row of each
+  // slice (second pass), and the number of reused rows in each slice and how
+  // many of them kept their label
+  std::vector<unsigned long> SliceCount, SliceStart, SliceReused, SliceUnchanged;
+  bool FillPass;
+
+  void ProcessSlice(itk::SizeValueType slice);
+  static ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg);
+};
+
+void RFSampleCollector::ProcessSlice(itk::SizeValueType slice)
+{
+  const LabelImageType::BufferType *buffer = LabelImage->GetBuffer();
+  const itk::ImageRegion<3> &rBuffer = LabelImage->GetBufferedRegion();
+
+  // Range of x covered by the region, relative to the start of the lines
+  long x0 = Region.GetIndex(0) - rBuffer.GetIndex(0);
+  long x1 = x0 + Region.GetSize(0);
+
+  itk::Index<3> idx;
+  idx[0] = rBuffer.GetIndex(0);
+  idx[1] = Region.GetIndex(1);
+  idx[2] = Region.GetIndex(2) + slice;
+
+  unsigned long row = FillPass ? SliceStart[slice] : 0;
+  unsigned long nReused = 0, nUnchanged = 0;
+
+  // Position in the old sample. The voxels of the slice are visited in the
+  // order of their offsets, so the position only moves forward
+  size_t iOld = 0;
+  if(FillPass && OldOffsets->size())
+    iOld = std::lower_bound(OldOffsets->begin(), OldOffsets->end(),
+                            LabelImage->ComputeOffset(idx)) - OldOffsets->begin();
+
+  for(itk::SizeValueType iy = 0; iy < Region.GetSize(1); iy++, idx[1]++)
+    {
+    const LabelImageType::RLLine &line =
+        buffer->GetPixel(LabelImageType::truncateIndex(idx));
+    OffsetValueType lineOffset = LabelImage->ComputeOffset(idx);
+
+    long t = 0;
+    for(size_t i = 0; i < line.size() && t < x1; i++)
+      {
+      long tEnd = t + line[i].first;
+      long a = std::max(t, x0), b = std::min(tEnd, x1);
+      t = tEnd;
+      if(a >= b || line[i].second == 0)
+        continue;
+
+      if(!FillPass)
+        {
+        row += b - a;
+        continue;
+        }
+
+      for(long x = a; x < b; x++, row++)
+        {
+        OffsetValueType offset = lineOffset + x;
+        GreyType *f = &(*Features)[row * NumberOfColumns];
+        (*Offsets)[row] = offset;
+        (*Labels)[row] = line[i].second;
+
+        // Reuse the features computed in the previous round
+        while(iOld < OldOffsets->size() && (*OldOffsets)[iOld] < offset)
+          iOld++;
+        if(iOld < OldOffsets->size() && (*OldOffsets)[iOld] == offset)
+          {
+          std::copy(OldFeatures->begin() + iOld * NumberOfColumns,
+                    OldFeatures->begin() + (iOld + 1) * NumberOfColumns, f);
+          nReused++;
+          if((*OldLabels)[iOld] == line[i].second)
+            nUnchanged++;
+          continue;
+          }
+
+        // Gather the patch around the voxel in each component
+        int k = 0;
+        for(int c = 0; c < NumberOfComponents; c++)
+          for(int j = 0; j < PatchSize; j++)
+            f[k++] = FeatureIter->NeighborValueAtOffset(offset, c, j);
+
+        // Add the coordinate features if used
+        if(UseCoordinates)
+          {
+          f[k++] = rBuffer.GetIndex(0) + x;
+          f[k++] = idx[1];
+          f[k++] = idx[2];
+          }
+        }
+      }
+    }
+
+  if(FillPass)
+    {
+    SliceReused[slice] = nReused;
+    SliceUnchanged[slice] = nUnchanged;
+    }
+  else
+    SliceCount[slice] = row;
+}
+
+ITK_THREAD_RETURN_TYPE RFSampleCollector::ThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+  RFSampleCollector *self = static_cast<RFSampleCollector *>(info->UserData);
+
+  for(itk::SizeValueType z = info->ThreadID; z < self->Region.GetSize(2);
+      z += info->NumberOfThreads)
+    self->ProcessSlice(z);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+/** Set up the parameters for growing a forest of the given size */
+static void SetUpTrainingParameters(
+    TrainingParameters &params, int treeDepth, int nTrees, unsigned long nSamples)
+{
+  params.treeDepth = treeDepth;
+  params.treeNum = nTrees;
+  params.candidateNodeClassifierNum = 10;
+  params.candidateClassifierThresholdNum = 10;
+  params.subSamplePercent = 0;
+  params.splitIG = 0.1;
+  params.leafEntropy = 0.05;
+  params.verbose = false;
+
+  // Cap the number of training voxels at some reasonable number
+  if(nSamples > 10000)
+    params.subSamplePercent = 100 * 10000.0 / nSamples;
+  else
+    params.subSamplePercent = 0;
+}
+
 template <class TPixel, class TLabel, int VDim>
 RFClassificationEngine<TPixel,TLabel,VDim>::RFClassificationEngine()
 {
@@ -20,6 +193,20 @@ RFClassificationEngine<TPixel,TLabel,VDim>::RFClassificationEngine()
   m_TreeDepth = 30;
   m_PatchRadius.Fill(0);
   m_UseCoordinateFeatures = false;
+  m_SampleColumns = 0;
+  m_SamplePatchRadius.Fill(0);
+  m_SampleUseCoordinates = false;
+  m_NumberOfThreads = 0;
+  m_NumberOfReusedSamples = 0;
+  m_NumberOfChangedSamples = 0;
+  m_IncrementalTraining = false;
+  m_IncrementalTrainingFraction = 0.2;
+  m_TrainedTreeDepth = -1;
+  m_TrainedColumns = -1;
+  m_NextTreeToReplace = 0;
+  m_NumberOfRetrainedTrees = 0;
+  m_LastCollectionTime = 0.0;
+  m_LastTrainingTime = 0.0;
 }
 
 template <class TPixel, class TLabel, int VDim>
@@ -39,6 +226,9 @@ void RFClassificationEngine<TPixel,TLabel,VDim>::SetDataSource(SNAPImageData *im
 
     // Reset the classifier
     m_Classifier->Reset();
+
+    // Features cached for the old data are meaningless
+    this->ClearSampleCache();
     }
 }
 
@@ -53,82 +243,25 @@ void RFClassificationEngine<TPixel,TLabel,VDim>:: TrainClassifier()
 {
   assert(m_DataSource && m_DataSource->IsMainLoaded());
 
-  typedef ImageCollectionConstRegionIteratorWithIndex<
-      AnatomicScalarImageWrapper::ImageType,
-      AnatomicImageWrapper::ImageType> CollectionIter;
-
-  // TODO: in the future, we should only recompute the sample when we know
-  // that the data has changed. However, currently, we are just going to
-  // compute a new sample every time
+  // Collect the labeled voxels and their features
+  itk::TimeProbe collectionProbe;
+  collectionProbe.Start();
+  this->CollectSamples();
+  collectionProbe.Stop();
+  m_LastCollectionTime = collectionProbe.GetTotal();
 
-  // Delete the sample
+  // Copy the sample into the structure used by the random forest code
   if(m_Sample)
     delete m_Sample;
 
-  // Get the segmentation image - which determines the samples
-  // TODO: this is defaulting to the first image - is this correct?
-  LabelImageWrapper *wrpSeg = m_DataSource->GetFirstSegmentationLayer();
-  LabelImageWrapper::ImagePointer imgSeg = wrpSeg->GetImage();
-  typedef itk::ImageRegionConstIteratorWithIndex<LabelImageWrapper::ImageType> LabelIter;
-
-  // Shrink the buffered region by radius because we can't handle BCs
-  itk::ImageRegion<3> reg = imgSeg->GetBufferedRegion();
-  reg.ShrinkByRadius(m_PatchRadius);
-
-  // We need to iterate throught the label image once to determine the
-  // number of samples to allocate.
-  unsigned long nSamples = 0;
-  for(LabelIter lit(imgSeg, reg); !lit.IsAtEnd(); ++lit)
-    if(lit.Value())
-      nSamples++;
-
-  // Create an iterator for going over all the anatomical image data
-  CollectionIter cit(reg);
-  cit.SetRadius(m_PatchRadius);
-
-  // Add all the anatomical images to this iterator
-  for(LayerIterator it = m_DataSource->GetLayers(MAIN_ROLE | OVERLAY_ROLE);
-      !it.IsAtEnd(); ++it)
-    {
-    cit.AddImage(it.GetLayer()->GetImageBase());
-    }
-
-  // Get the number of components
-  int nComp = cit.GetTotalComponents();
-  int nPatch = cit.GetNeighborhoodSize();
-  int nColumns = nComp * nPatch;
-
-  // Are we using coordinate informtion
-  if(m_UseCoordinateFeatures)
-    nColumns += 3;
-
-  // Create a new sample
-  m_Sample = new SampleType(nSamples, nColumns);
-
-  // Now fill out the samples
-  int iSample = 0;
-  for(LabelIter lit(imgSeg, reg); !lit.IsAtEnd(); ++lit, ++cit)
+  unsigned long nSamples = m_SampleLabels.size();
+  m_Sample = new SampleType(nSamples, m_SampleColumns);
+  for(unsigned long i = 0; i < nSamples; i++)
     {
-    LabelType label = lit.Value();
-    if(label)
-      {
-      // Fill in the data
-      std::vector<GreyType> &column = m_Sample->data[iSample];
-      int k = 0;
-      for(int i = 0; i < nComp; i++)
-        for(int j = 0; j < nPatch; j++)
-          column[k++] = cit.NeighborValue(i,j);
-
-      // Add the coordinate features if used
-      if(m_UseCoordinateFeatures)
-        for(int d = 0; d < 3; d++)
-          column[k++] = lit.GetIndex()[d];
-
-      // Fill in the label
-      m_Sample->label[iSample] = label;
-
-      ++iSample;
-      }
+    std::copy(m_SampleFeatures.begin() + i * m_SampleColumns,
+              m_SampleFeatures.begin() + (i + 1) * m_SampleColumns,
+              m_Sample->data[i].begin());
+    m_Sample->label[i] = m_SampleLabels[i];
     }
 
   // Check that the sample has at least two distinct labels
@@ -143,23 +276,35 @@ void RFClassificationEngine<TPixel,TLabel,VDim>:: TrainClassifier()
                         "data contain fewer than two classes. Please label "
                         "examples of two or more tissue classes in the image.");
 
+  // Train a new forest, or regrow some of the trees of the current forest if
+  // the sample has changed little since it was trained
+  itk::TimeProbe probe;
+  probe.Start();
+  int nTrees = this->GetNumberOfTreesToRetrain();
+  if(nTrees < m_ForestSize && this->RetrainTrees(nTrees))
+    {
+    m_NumberOfRetrainedTrees = nTrees;
+    }
+  else
+    {
+    this->TrainForest();
+    m_NumberOfRetrainedTrees = m_ForestSize;
+    m_NextTreeToReplace = 0;
+    }
+  probe.Stop();
+  m_LastTrainingTime = probe.GetTotal();
+
+  // Remember the settings that the forest was trained with
+  m_TrainedTreeDepth = m_TreeDepth;
+  m_TrainedColumns = m_SampleColumns;
+}
+
+template <class TPixel, class TLabel, int VDim>
+void RFClassificationEngine<TPixel,TLabel,VDim>::TrainForest()
+{
   // Set up the classifier parameters
   TrainingParameters params;
-  // TODO:
-  params.treeDepth = m_TreeDepth;
-  params.treeNum = m_ForestSize;
-  params.candidateNodeClassifierNum = 10;
-  params.candidateClassifierThresholdNum = 10;
-  params.subSamplePercent = 0;
-  params.splitIG = 0.1;
-  params.leafEntropy = 0.05;
-  params.verbose = true;
-
-  // Cap the number of training voxels at some reasonable number
-  if(m_Sample->Size() > 10000)
-    params.subSamplePercent = 100 * 10000.0 / m_Sample->Size();
-  else
-    params.subSamplePercent = 0;
+  SetUpTrainingParameters(params, m_TreeDepth, m_ForestSize, m_Sample->Size());
 
   // Create the classification engine
   typedef typename ClassifierType::RFAxisClassifierType RFAxisClassifierType;
@@ -227,6 +372,206 @@ void RFClassificationEngine<TPixel,TLabel,VDim>:: TrainClassifier()
   m_Classifier->SetUseCoordinateFeatures(m_UseCoordinateFeatures);
 }
 
+
+template <class TPixel, class TLabel, int VDim>
+int RFClassificationEngine<TPixel,TLabel,VDim>::GetNumberOfTreesToRetrain() const
+{
+  // Incremental training needs a forest that was trained on the same kind
+  // of features with the same settings
+  if(!m_IncrementalTraining || !m_Classifier->IsValidClassifier()
+     || m_Classifier->GetForest()->GetForestSize() != m_ForestSize
+     || m_TrainedTreeDepth != m_TreeDepth
+     || m_TrainedColumns != m_SampleColumns)
+    return m_ForestSize;
+
+  // The classes of the new trees must stand for the same labels as those of
+  // the forest, so if a label was added to or removed from the sample, the
+  // whole forest is grown again, without growing replacement trees first
+  std::set<LabelType> sampleLabels, forestLabels;
+  for(size_t i = 0; i < m_SampleLabels.size(); i++)
+    if(i == 0 || m_SampleLabels[i] != m_SampleLabels[i-1])
+      sampleLabels.insert(m_SampleLabels[i]);
+  for(typename ClassifierType::MappingType::const_iterator it =
+      m_Classifier->GetClassToLabelMapping().begin();
+      it != m_Classifier->GetClassToLabelMapping().end(); ++it)
+    forestLabels.insert(it->second);
+  if(sampleLabels != forestLabels)
+    return m_ForestSize;
+
+  // Regrow the configured fraction of the trees, or the fraction of the
+  // sample that changed if that is larger
+  double changed = m_SampleLabels.size()
+      ? m_NumberOfChangedSamples / (double) m_SampleLabels.size() : 1.0;
+  double fraction = std::max(m_IncrementalTrainingFraction, changed);
+  int nTrees = (int) std::ceil(fraction * m_ForestSize);
+  return std::max(1, std::min(nTrees, m_ForestSize));
+}
+
+template <class TPixel, class TLabel, int VDim>
+bool RFClassificationEngine<TPixel,TLabel,VDim>::RetrainTrees(int nTrees)
+{
+  // Grow the replacement trees in a separate classifier
+  SmartPtr<ClassifierType> update = ClassifierType::New();
+
+  TrainingParameters params;
+  SetUpTrainingParameters(params, m_TreeDepth, nTrees, m_Sample->Size());
+
+  typedef typename ClassifierType::RFAxisClassifierType RFAxisClassifierType;
+  typedef Classification<GreyType, LabelType, RFAxisClassifierType> ClassificationType;
+  ClassificationType classification;
+  classification.Learning(
+        params, *m_Sample,
+        *update->GetForest(),
+        update->GetValidLabel(),
+        update->GetClassToLabelMapping());
+
+  // The labels of the sample were checked before, but a label may still be
+  // missing from the part of the sample the new trees were grown on
+  if(update->GetClassToLabelMapping() != m_Classifier->GetClassToLabelMapping())
+    return false;
+
+  // Exchange the new trees for the oldest trees of the forest. The old trees
+  // are deleted along with the temporary classifier. The class weights and
+  // the rest of the classifier are kept
+  for(int i = 0; i < nTrees; i++)
+    {
+    m_NextTreeToReplace %= m_ForestSize;
+    std::swap(m_Classifier->GetForest()->trees_[m_NextTreeToReplace],
+              update->GetForest()->trees_[i]);
+    m_NextTreeToReplace++;
+    }
+
+  m_Classifier->Modified();
+  return true;
+}
+
+template <class TPixel, class TLabel, int VDim>
+void RFClassificationEngine<TPixel,TLabel,VDim>::CollectSamples()
+{
+  // Get the segmentation image - which determines the samples
+  // TODO: this is defaulting to the first image - is this correct?
+  LabelImageWrapper *wrpSeg = m_DataSource->GetFirstSegmentationLayer();
+  LabelImageWrapper::ImagePointer imgSeg = wrpSeg->GetImage();
+
+  // Shrink the buffered region by radius because we can't handle BCs
+  itk::ImageRegion<3> reg = imgSeg->GetBufferedRegion();
+  reg.ShrinkByRadius(m_PatchRadius);
+
+  // Create an iterator for accessing all the anatomical image data
+  RFCollectionIter cit(reg);
+  cit.SetRadius(m_PatchRadius);
+
+  // Add all the anatomical images to this iterator
+  std::vector<SourceStamp> sources;
+  for(LayerIterator it = m_DataSource->GetLayers(MAIN_ROLE | OVERLAY_ROLE);
+      !it.IsAtEnd(); ++it)
+    {
+    itk::ImageBase<3> *image = it.GetLayer()->GetImageBase();
+    cit.AddImage(image);
+    sources.push_back(std::make_pair(image, image->GetMTime()));
+    }
+
+  // Get the number of components
+  int nComp = cit.GetTotalComponents();
+  int nPatch = cit.GetNeighborhoodSize();
+  int nColumns = nComp * nPatch;
+
+  // Are we using coordinate informtion
+  if(m_UseCoordinateFeatures)
+    nColumns += 3;
+
+  // The features from the previous round can only be reused if they were
+  // computed from the same images with the same settings
+  if(sources != m_SampleSources || nColumns != m_SampleColumns
+     || m_PatchRadius != m_SamplePatchRadius
+     || m_UseCoordinateFeatures != m_SampleUseCoordinates)
+    this->ClearSampleCache();
+
+  // Set up the collector
+  RFSampleCollector rsc;
+  rsc.LabelImage = imgSeg;
+  rsc.FeatureIter = &cit;
+  rsc.Region = reg;
+  rsc.UseCoordinates = m_UseCoordinateFeatures;
+  rsc.NumberOfComponents = nComp;
+  rsc.PatchSize = nPatch;
+  rsc.NumberOfColumns = nColumns;
+  rsc.OldOffsets = &m_SampleOffsets;
+  rsc.OldLabels = &m_SampleLabels;
+  rsc.OldFeatures = &m_SampleFeatures;
+
+  std::vector<itk::OffsetValueType> offsets;
+  std::vector<LabelType> labels;
+  std::vector<GreyType> features;
+  rsc.Offsets = &offsets;
+  rsc.Labels = &labels;
+  rsc.Features = &features;
+
+  itk::SizeValueType nSlices = reg.GetSize(2);
+  rsc.SliceCount.resize(nSlices, 0);
+  rsc.SliceStart.resize(nSlices, 0);
+  rsc.SliceReused.resize(nSlices, 0);
+  rsc.SliceUnchanged.resize(nSlices, 0);
+
+  int nThreads = (m_NumberOfThreads > 0)
+      ? m_NumberOfThreads : itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  nThreads = std::max(1, (int) std::min((itk::SizeValueType) nThreads, nSlices));
+
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  threader->SetNumberOfThreads(nThreads);
+  threader->SetSingleMethod(RFSampleCollector::ThreadCallback, &rsc);
+
+  // Count the samples in each slice
+  rsc.FillPass = false;
+  if(nSlices)
+    threader->SingleMethodExecute();
+
+  unsigned long nSamples = 0;
+  for(itk::SizeValueType z = 0; z < nSlices; z++)
+    {
+    rsc.SliceStart[z] = nSamples;
+    nSamples += rsc.SliceCount[z];
+    }
+
+  // Fill in the samples
+  offsets.resize(nSamples);
+  labels.resize(nSamples);
+  features.resize(nSamples * nColumns);
+  rsc.FillPass = true;
+  if(nSamples)
+    threader->SingleMethodExecute();
+
+  // Samples that are new, relabeled or no longer labeled count as changed
+  unsigned long nUnchanged = 0;
+  m_NumberOfReusedSamples = 0;
+  for(itk::SizeValueType z = 0; z < nSlices; z++)
+    {
+    m_NumberOfReusedSamples += rsc.SliceReused[z];
+    nUnchanged += rsc.SliceUnchanged[z];
+    }
+  m_NumberOfChangedSamples = (nSamples - nUnchanged)
+      + (m_SampleOffsets.size() - m_NumberOfReusedSamples);
+
+  // The new sample replaces the cache
+  m_SampleOffsets.swap(offsets);
+  m_SampleLabels.swap(labels);
+  m_SampleFeatures.swap(features);
+  m_SampleColumns = nColumns;
+  m_SampleSources = sources;
+  m_SamplePatchRadius = m_PatchRadius;
+  m_SampleUseCoordinates = m_UseCoordinateFeatures;
+}
+
+template <class TPixel, class TLabel, int VDim>
+void RFClassificationEngine<TPixel,TLabel,VDim>::ClearSampleCache()
+{
+  m_SampleOffsets.clear();
+  m_SampleLabels.clear();
+  m_SampleFeatures.clear();
+  m_SampleColumns = 0;
+  m_SampleSources.clear();
+}
+
 template <class TPixel, class TLabel, int VDim>
 void RFClassificationEngine<TPixel,TLabel,VDim>::SetClassifier(ClassifierType *rf)
 {
@@ -235,6 +580,11 @@ void RFClassificationEngine<TPixel,TLabel,VDim>::SetClassifier(ClassifierType *r
 
   // Update the forest size
   m_ForestSize = m_Classifier->GetForest()->GetForestSize();
+
+  // The settings the classifier was trained with are unknown, so the next
+  // round of training starts from scratch
+  m_TrainedTreeDepth = -1;
+  m_TrainedColumns = -1;
 }
 
 template <class TPixel, class TLabel, int VDim>
@@ -2,9 +2,11 @@
 #define RFCLASSIFICATIONENGINE_H
 
 #include <itkObject.h>
+#include <itkDataObject.h>
 #include <itkObjectFactory.h>
 #include "SNAPCommon.h"
 #include <itkSize.h>
+#include <vector>
 
 template <class TPixel, class TLabel, int VDim> class RandomForestClassifier;
 template <class TData, class TLabel> class MLData;
@@ -62,6 +64,45 @@ public:
   /** Get the number of components passed to the classifier */
   int GetNumberOfComponents() const;
 
+  /** Number of threads used to collect the training sample (0 for the ITK
+   * default) */
+  itkGetMacro(NumberOfThreads, int)
+  itkSetMacro(NumberOfThreads, int)
+
+  /** Number of samples whose features were reused from the previous round
+   * of training by the last call to TrainClassifier */
+  itkGetMacro(NumberOfReusedSamples, unsigned long)
+
+  /** Number of samples that were added, removed or relabeled since the
+   * previous round of training */
+  itkGetMacro(NumberOfChangedSamples, unsigned long)
+
+  /**
+   * Incremental training. When on, and the forest was trained before with
+   * the same settings, training only regrows a fraction of the trees on the
+   * updated sample and keeps the others. The fraction is the larger of the
+   * IncrementalTrainingFraction and the fraction of the sample that changed,
+   * so the cost of retraining grows with the amount of new training data.
+   * The oldest trees are replaced first. If a label was added to or removed
+   * from the sample, the whole forest is grown again. Off by default, since
+   * the forest then depends on the order in which the examples were given.
+   */
+  itkGetMacro(IncrementalTraining, bool)
+  itkSetMacro(IncrementalTraining, bool)
+  itkBooleanMacro(IncrementalTraining)
+
+  /** Smallest fraction of the trees regrown by incremental training */
+  itkGetMacro(IncrementalTrainingFraction, double)
+  itkSetClampMacro(IncrementalTrainingFraction, double, 0.0, 1.0)
+
+  /** Number of trees grown by the last call to TrainClassifier */
+  itkGetMacro(NumberOfRetrainedTrees, int)
+
+  /** Time (in seconds) the last call to TrainClassifier spent collecting the
+   * sample and growing trees */
+  itkGetMacro(LastCollectionTime, double)
+  itkGetMacro(LastTrainingTime, double)
+
 
 protected:
 
@@ -93,6 +134,62 @@ protected:
   typedef MLData<GreyType, LabelType> SampleType;
   SampleType *m_Sample;
 
+  // Collect the labeled voxels and their features into the sample cache
+  void CollectSamples();
+
+  // Discard the features cached from the previous round of training
+  void ClearSampleCache();
+
+  // Grow a new forest from the sample
+  void TrainForest();
+
+  // Number of trees to regrow in this round (the forest size if the forest
+  // cannot be updated incrementally)
+  int GetNumberOfTreesToRetrain() const;
+
+  // Regrow the given number of trees of the current forest. Returns false if
+  // the new trees are not compatible with the forest
+  bool RetrainTrees(int nTrees);
+
+  // The sample cache. The features of the samples are stored in one row-major
+  // matrix, one row per labeled voxel in the order of the voxels in memory.
+  // The voxels are identified by their offsets in the image buffer, so that
+  // their features can be reused when the labels are edited and the
+  // classifier is trained again
+  std::vector<itk::OffsetValueType> m_SampleOffsets;
+  std::vector<LabelType> m_SampleLabels;
+  std::vector<GreyType> m_SampleFeatures;
+  int m_SampleColumns;
+
+  // The inputs and settings that the cached features were computed from
+  typedef std::pair<const itk::DataObject *, itk::ModifiedTimeType> SourceStamp;
+  std::vector<SourceStamp> m_SampleSources;
+  RadiusType m_SamplePatchRadius;
+  bool m_SampleUseCoordinates;
+
+  // Number of threads for sample collection
+  int m_NumberOfThreads;
+
+  // Number of samples reused and changed in the last round
+  unsigned long m_NumberOfReusedSamples;
+  unsigned long m_NumberOfChangedSamples;
+
+  // Incremental training settings
+  bool m_IncrementalTraining;
+  double m_IncrementalTrainingFraction;
+
+  // Settings the current forest was trained with (-1 if unknown)
+  int m_TrainedTreeDepth;
+  int m_TrainedColumns;
+
+  // The oldest tree in the forest, which is replaced next
+  int m_NextTreeToReplace;
+
+  // Timing counters for the last round of training
+  int m_NumberOfRetrainedTrees;
+  double m_LastCollectionTime;
+  double m_LastTrainingTime;
+
 };
 
 #endif // RFCLASSIFICATIONENGINE_H
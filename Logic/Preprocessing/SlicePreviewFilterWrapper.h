@@ -4,6 +4,9 @@
 #include "SNAPCommon.h"
 #include "itkDataObject.h"
 #include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include <atomic>
+#include <vector>
 
 class ImageWrapperBase;
 class ScalarImageWrapperBase;
@@ -11,11 +14,8 @@ class ScalarImageWrapperBase;
 template <typename TInputImage, typename TOutputImage, typename TPreviewImage>
 class AdaptiveSlicingPipeline;
 
-namespace itk {
-  template<class TIn, class TOut> class StreamingImageFilter;
-}
-
 class SNAPImageData;
+class TrivalProgressSource;
 
 /**
   Abstract parent class for SlicePreviewFilterWrapper. Allows us to call
@@ -41,6 +41,30 @@ public:
   /** Compute the output volume (corresponds to the 'Apply' operation) */
   virtual void ComputeOutputVolume(itk::Command *progress) = 0;
 
+  /**
+    Start computing the output volume in a background thread, while the
+    preview filters take care of the displayed slices. No progress is
+    reported and the output volume is not marked as modified from the
+    background thread. ComputeOutputVolume waits for the background thread,
+    completes the volume from where it got, and marks it as modified.
+    */
+  virtual void StartComputeOutputVolume() = 0;
+
+  /**
+    Interrupt the computation of the output volume: the one started by
+    StartComputeOutputVolume, or a call to ComputeOutputVolume running in
+    another thread (or from the progress callback). The parts of the volume
+    computed so far are kept, and the next computation resumes from there.
+    This method returns once the background computation has stopped, so it
+    must be called before the parameters of the filter, such as the
+    classifier, are changed in place. Calling it when no computation is
+    running has no effect.
+    */
+  virtual void AbortComputeOutputVolume() = 0;
+
+  /** Whether the last call to ComputeOutputVolume computed the whole volume */
+  virtual bool IsOutputVolumeComplete() const = 0;
+
   /** Select the active scalar layer (for filters that operate on only one) */
   virtual void SetActiveScalarLayer(ScalarImageWrapperBase *layer) = 0;
 
@@ -85,6 +109,11 @@ protected:
 
         This sets the parameters of the filter
 
+    static unsigned int GetStreamingRadius(FilterType *filter)
+
+        This returns the radius of the neighborhood of input voxels that
+        the filter uses to compute an output voxel (0 for voxelwise filters)
+
 
   What does this filter do? It creates an assembly consisting
   of three slice preview filters, and one whole-volume filter. The four
@@ -100,6 +129,23 @@ protected:
 
   The user can also ask this wrapper to apply the filter to generate the
   entire speed image volume. This can be done in or out of preview mode.
+  The volume is computed brick by brick: the pipeline is run end to end on
+  one small block of the image at a time, and the result is copied into the
+  speed image while it is still in cache. This way, the intermediate images
+  of the pipeline never take more memory than a brick padded by the radius
+  of the filter (see GetStreamingRadius), whatever the size of the volume.
+
+  The wrapper remembers which bricks of the speed image are current, i.e.,
+  were computed by this wrapper with the current inputs and parameters of
+  the pipeline, and the speed image has not been written to since. Only the
+  bricks that are not current are computed again. This way, a computation
+  that was aborted can be resumed, and applying the filter again after
+  toggling the preview mode costs nothing if nothing has changed.
+
+  The bricks can also be computed in a background thread, which is started
+  after the parameters change, so that by the time the user applies the
+  filter, much of the volume is already done. Changing the parameters, the
+  inputs or the preview mode stops the background thread first.
 
   The filter is smart enough to know when the whole volume is up to date. If
   the parameters of the preview filters have not been changed since the last
@@ -125,6 +171,7 @@ public:
   typedef typename TFilterConfigTraits::FilterType               FilterType;
   typedef typename FilterType::OutputImageType              OutputImageType;
   typedef typename OutputImageType::PixelType               OutputPixelType;
+  typedef typename OutputImageType::RegionType             OutputRegionType;
 
   typedef typename TFilterConfigTraits::InputDataType         InputDataType;
 
@@ -161,21 +208,68 @@ public:
   /** Compute the output volume (corresponds to the 'Apply' operation) */
   void ComputeOutputVolume(itk::Command *progress) ITK_OVERRIDE;
 
+  /** Compute the output volume in a background thread */
+  void StartComputeOutputVolume() ITK_OVERRIDE;
+
+  /** Interrupt the computation of the output volume */
+  void AbortComputeOutputVolume() ITK_OVERRIDE;
+
+  /** Whether the last call to ComputeOutputVolume computed the whole volume */
+  irisIsMacroWithOverride(OutputVolumeComplete)
+
+  /**
+    State of the computation of a volume by bricks, which allows bricks that
+    are current to be skipped. For each brick, this holds the version of the
+    pipeline it was computed with (0 if it has not been). The version is the
+    later of the pipeline time and the parameter time. The latter is set when
+    the parameters change in place, e.g., when the classifier is trained
+    again, which the pipeline time does not see. The state is valid for the
+    target image as of the given modified time.
+    */
+  struct BrickState
+  {
+    std::vector<OutputRegionType> Bricks;
+    std::vector<itk::ModifiedTimeType> BrickTime;
+    const OutputImageType *Target;
+    OutputRegionType Region;
+    unsigned int Radius;
+    itk::ModifiedTimeType TargetTime;
+    itk::ModifiedTimeType ParameterTime;
+
+    BrickState() : Target(NULL), Radius(0), TargetTime(0), ParameterTime(0) {}
+  };
+
+  /**
+    Compute the buffered region of the target image by running the filter
+    on one brick at a time. The bricks are at least 64 voxels wide, and wider
+    for filters with large neighborhoods (given by radius), so that the
+    overlap between the inputs of neighboring bricks remains small.
+
+    If state is given, the bricks that it lists as current are skipped. If
+    abort is given, the computation stops before the next brick once the
+    flag is raised, which may be done from another thread. The number of
+    bricks computed is returned.
+    */
+  static unsigned int UpdateByBricks(FilterType *filter, OutputImageType *target,
+                                     unsigned int radius, TrivalProgressSource *progress,
+                                     BrickState *state = NULL,
+                                     const std::atomic<bool> *abort = NULL);
+
+  /** Split a region into bricks, listed in raster order */
+  static void SplitIntoBricks(const OutputRegionType &region, unsigned int radius,
+                              std::vector<OutputRegionType> &bricks);
+
 protected:
 
   SlicePreviewFilterWrapper();
-  ~SlicePreviewFilterWrapper() {}
+  ~SlicePreviewFilterWrapper();
 
   void UpdatePipeline();
 
   OutputWrapperType *m_OutputWrapper;
 
-  // Streamer - to allow reduced memory footprint
-  typedef itk::StreamingImageFilter<OutputImageType, OutputImageType> Streamer;
-
   SmartPtr<FilterType> m_PreviewFilter[3];
   SmartPtr<FilterType> m_VolumeFilter;
-  SmartPtr<Streamer> m_VolumeStreamer;
 
   // So we can loop over all four filters
   FilterType *GetNthFilter(int);
@@ -185,6 +279,27 @@ protected:
 
   bool m_PreviewMode;
 
+  // Which bricks of the output volume are current
+  BrickState m_BrickState;
+
+  // Raised by AbortComputeOutputVolume, possibly from another thread
+  std::atomic<bool> m_AbortRequested;
+
+  // Whether the whole output volume was computed by the last call
+  bool m_OutputVolumeComplete;
+
+  // The thread computing the output volume in the background, if any
+  itk::MultiThreader::Pointer m_BackgroundThreader;
+  itk::ThreadIdType m_BackgroundThreadId;
+
+  // Whether the background thread wrote to the output volume
+  bool m_BackgroundBricksComputed;
+
+  // When the parameters were last set
+  itk::TimeStamp m_ParameterTime;
+
+  static ITK_THREAD_RETURN_TYPE BackgroundThreadCallback(void *arg);
+
   void UpdateOutputPipelineReadyStatus();
 };
 
@@ -2,10 +2,12 @@
 
 #include "SmoothBinaryThresholdImageFilter.h"
 #include "EdgePreprocessingImageFilter.h"
-#include "itkStreamingImageFilter.h"
+#include "AllPurposeProgressAccumulator.h"
+#include "itkImageAlgorithm.h"
 #include <AdaptiveSlicingPipeline.h>
 #include <ColorMap.h>
 #include <itkTimeProbe.h>
+#include <algorithm>
 
 
 template <class TFilterConfigTraits>
@@ -21,18 +23,23 @@ SlicePreviewFilterWrapper<TFilterConfigTraits>
   for(int i = 0; i < 3; i++)
     m_PreviewFilter[i] = FilterType::New();
 
-  // Allocate the streamer and attach to the volume filter
-  m_VolumeStreamer = Streamer::New();
-  m_VolumeStreamer->SetInput(m_VolumeFilter->GetOutput());
-
-  // Set up a streaming filter to reduce the memory footprint during execution
-  m_VolumeStreamer->SetNumberOfStreamDivisions(9);
-
   // No active layer by default
   m_ActiveScalarLayer = NULL;
 
   // Set the output wrapper to NULL
   m_OutputWrapper = NULL;
+
+  m_OutputVolumeComplete = false;
+  m_AbortRequested = false;
+  m_BackgroundThreadId = 0;
+  m_BackgroundBricksComputed = false;
+}
+
+template <class TFilterConfigTraits>
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::~SlicePreviewFilterWrapper()
+{
+  this->AbortComputeOutputVolume();
 }
 
 template <class TFilterConfigTraits>
@@ -40,10 +47,20 @@ void
 SlicePreviewFilterWrapper<TFilterConfigTraits>
 ::SetParameters(ParameterType *param)
 {
+  // The background computation must not see the parameters change
+  this->AbortComputeOutputVolume();
+
   // Set the parameters of all the filters
   for(int i = 0; i < 4; i++)
     Traits::SetParameters(param, this->GetNthFilter(i), i);
 
+  // The parameters may be the same object as before, changed in place, in
+  // which case the pipeline time does not change. The bricks computed with
+  // the old parameters are out of date either way
+  m_ParameterTime.Modified();
+  m_BrickState.ParameterTime = m_ParameterTime.GetMTime();
+  m_OutputVolumeComplete = false;
+
   // After updates to the parameters/filters update the pipeline readiness
   // status in the output wrapper
   this->UpdateOutputPipelineReadyStatus();
@@ -65,6 +82,8 @@ void
 SlicePreviewFilterWrapper<TFilterConfigTraits>
 ::AttachInputs(InputDataType *sid)
 {
+  this->AbortComputeOutputVolume();
+
   // Get the default scalar layer for the traits. If this is NULL, the method
   // does not expect an active layer to be specified (acts on all inputs)
   m_ActiveScalarLayer = Traits::GetDefaultScalarLayer(sid);
@@ -83,6 +102,11 @@ SlicePreviewFilterWrapper<TFilterConfigTraits>
 {
   if(m_PreviewMode != mode)
     {
+    // Outside of preview mode, the slices are read from the output volume,
+    // which the background thread must not write to at the same time. The
+    // bricks computed so far are kept
+    this->AbortComputeOutputVolume();
+
     m_PreviewMode = mode;
     this->Modified();
     this->UpdatePipeline();
@@ -104,6 +128,8 @@ void
 SlicePreviewFilterWrapper<TFilterConfigTraits>
 ::DetachInputsAndOutputs()
 {
+  this->AbortComputeOutputVolume();
+
   if(m_OutputWrapper)
     {
     for(unsigned int i = 0; i < 3; i++)
@@ -111,13 +137,15 @@ SlicePreviewFilterWrapper<TFilterConfigTraits>
       // Disconnect wrapper from this pipeline
       m_OutputWrapper->GetSlicer(i)->SetPreviewImage(NULL);
       }
-
-    // Undo the graft
-    m_VolumeStreamer->GraftOutput(m_VolumeStreamer->GetOutput());
     }
 
   m_OutputWrapper = NULL;
 
+  // Forget which parts of the output volume were computed
+  m_BrickState = BrickState();
+  m_OutputVolumeComplete = false;
+  m_BackgroundBricksComputed = false;
+
   for(unsigned int i = 0; i < 4; i++)
     {
     // Disconnect wrapper from this pipeline
@@ -154,32 +182,225 @@ void
 SlicePreviewFilterWrapper<TFilterConfigTraits>
 ::ComputeOutputVolume(itk::Command *progress)
 {
-  // Attach the progress monitor
-  unsigned long tag = 0;
+  // Stop the background computation. This one picks up where it got
+  this->AbortComputeOutputVolume();
 
-  if(progress)
-    tag = m_VolumeStreamer->AddObserver(itk::ProgressEvent(), progress);
+  // Requests to abort an earlier computation do not apply to this one
+  m_AbortRequested = false;
 
-  // Temporarily graft the target volume as output of the filter
-  m_VolumeStreamer->GraftOutput(m_OutputWrapper->GetImage());
+  // Create a progress tracker
+  SmartPtr<TrivalProgressSource> tracker = TrivalProgressSource::New();
+  if(progress)
+    {
+    tracker->AddObserver(itk::StartEvent(), progress);
+    tracker->AddObserver(itk::ProgressEvent(), progress);
+    tracker->AddObserver(itk::EndEvent(), progress);
+    }
 
-  // Execute the preprocessing on the whole image extent
+  // Execute the preprocessing on the whole image extent, writing the
+  // result directly into the target volume. Bricks that are still current
+  // from an earlier call are skipped
+  OutputImageType *target = m_OutputWrapper->GetImage();
   // itk::TimeProbe probe;
   // probe.Start();
-  m_VolumeStreamer->UpdateLargestPossibleRegion();
+  unsigned int nComputed = UpdateByBricks(
+        m_VolumeFilter, target, Traits::GetStreamingRadius(m_VolumeFilter),
+        tracker, &m_BrickState, &m_AbortRequested);
   // probe.Stop();
   // std::cout << "Time Elapsed: " << probe.GetTotal() << std::endl;
 
-  // Remove the progress monitor
+  // Check if all of the bricks are current now
+  itk::ModifiedTimeType version = std::max(
+        m_VolumeFilter->GetOutput()->GetPipelineMTime(), m_BrickState.ParameterTime);
+  m_OutputVolumeComplete = true;
+  for(unsigned int i = 0; i < m_BrickState.BrickTime.size(); i++)
+    if(m_BrickState.BrickTime[i] != version)
+      m_OutputVolumeComplete = false;
+
+  // Update the m-time of the output image, and remember it, so that changes
+  // made to the image by others invalidate the bricks. This includes the
+  // bricks written by the background thread, which could not do it
+  if(nComputed || m_BackgroundBricksComputed)
+    {
+    target->Modified();
+    target->DisconnectPipeline();
+    m_BrickState.TargetTime = target->GetMTime();
+    m_BackgroundBricksComputed = false;
+    }
+}
+
+template <class TFilterConfigTraits>
+void
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::StartComputeOutputVolume()
+{
+  // Only one background computation at a time
+  this->AbortComputeOutputVolume();
+
+  // There must be a volume to compute, and parameters to compute it with
+  FilterType *array[] = {m_PreviewFilter[0], m_PreviewFilter[1], m_PreviewFilter[2]};
+  if(!m_OutputWrapper || !Traits::IsPreviewable(array))
+    return;
+
+  // The request is cleared here rather than in the thread, so that an abort
+  // that comes before the thread gets going is not lost
+  m_AbortRequested = false;
+  m_BackgroundThreader = itk::MultiThreader::New();
+  m_BackgroundThreadId = m_BackgroundThreader->SpawnThread(
+        &Self::BackgroundThreadCallback, this);
+}
+
+template <class TFilterConfigTraits>
+ITK_THREAD_RETURN_TYPE
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::BackgroundThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  Self *self = static_cast<Self *>(ti->UserData);
+
+  // The observers of the progress and of the output volume expect to be
+  // called on the main thread, so neither is reported here
+  try
+    {
+    if(UpdateByBricks(self->m_VolumeFilter, self->m_OutputWrapper->GetImage(),
+                      Traits::GetStreamingRadius(self->m_VolumeFilter), NULL,
+                      &self->m_BrickState, &self->m_AbortRequested))
+      self->m_BackgroundBricksComputed = true;
+    }
+  catch(itk::ExceptionObject &)
+    {
+    // The brick that failed is not current, so ComputeOutputVolume computes
+    // it again and reports the error
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TFilterConfigTraits>
+void
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::AbortComputeOutputVolume()
+{
+  m_AbortRequested = true;
+
+  // Wait for the background thread to get to the end of its brick
+  if(m_BackgroundThreader)
+    {
+    m_BackgroundThreader->TerminateThread(m_BackgroundThreadId);
+    m_BackgroundThreader = NULL;
+    }
+}
+
+template <class TFilterConfigTraits>
+unsigned int
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::UpdateByBricks(FilterType *filter, OutputImageType *target,
+                 unsigned int radius, TrivalProgressSource *progress,
+                 BrickState *state, const std::atomic<bool> *abort)
+{
+  // Bring the information of the pipeline up to date. This is done once, the
+  // bricks only change the requested region
+  OutputImageType *output = filter->GetOutput();
+  output->UpdateOutputInformation();
+
+  // Split the target region into bricks. The bricks of the state are only
+  // kept if the target has not been touched by anyone else since
+  BrickState local;
+  if(!state)
+    state = &local;
+
+  // The version of the inputs and parameters (e.g., the classifier) that the
+  // bricks are computed with
+  itk::ModifiedTimeType version =
+      std::max(output->GetPipelineMTime(), state->ParameterTime);
+
+  const OutputRegionType &region = target->GetBufferedRegion();
+  if(state->Target != target || state->TargetTime != target->GetMTime()
+     || state->Region != region || state->Radius != radius)
+    {
+    SplitIntoBricks(region, radius, state->Bricks);
+    state->BrickTime.assign(state->Bricks.size(), 0);
+    state->Target = target;
+    state->Region = region;
+    state->Radius = radius;
+    state->TargetTime = target->GetMTime();
+    }
+
+  // List the bricks that are not current
+  std::vector<unsigned int> todo;
+  for(unsigned int i = 0; i < state->Bricks.size(); i++)
+    if(state->BrickTime[i] != version)
+      todo.push_back(i);
+
   if(progress)
-    m_VolumeStreamer->RemoveObserver(tag);
+    progress->StartProgress(todo.size());
+
+  unsigned int nComputed = 0;
+  for(; nComputed < todo.size() && !(abort && *abort); nComputed++)
+    {
+    const OutputRegionType &brick = state->Bricks[todo[nComputed]];
 
-  // Undo the graft
-  m_VolumeStreamer->GraftOutput(m_VolumeStreamer->GetOutput());
+    // Run the whole pipeline on the brick. This is what itk::StreamingImageFilter
+    // does for each of its pieces
+    output->SetRequestedRegion(brick);
+    output->PropagateRequestedRegion();
+    output->UpdateOutputData();
 
-  // Update the m-time of the output image
-  m_OutputWrapper->GetImage()->Modified();
-  m_OutputWrapper->GetImage()->DisconnectPipeline();
+    // Copy the brick into the target while it is still in cache
+    itk::ImageAlgorithm::Copy(output, target, brick, brick);
+    state->BrickTime[todo[nComputed]] = version;
+
+    if(progress)
+      progress->AddProgress(1.0);
+    }
+
+  // The filter output only holds the last brick, which is not needed anymore
+  output->ReleaseData();
+
+  if(progress)
+    progress->EndProgress();
+
+  return nComputed;
+}
+
+template <class TFilterConfigTraits>
+void
+SlicePreviewFilterWrapper<TFilterConfigTraits>
+::SplitIntoBricks(const OutputRegionType &region, unsigned int radius,
+                  std::vector<OutputRegionType> &bricks)
+{
+  typedef typename OutputRegionType::SizeValueType SizeValueType;
+  const unsigned int VDim = OutputImageType::ImageDimension;
+
+  // The brick size: 64 voxels fit a brick of floats into a typical L2 cache.
+  // For filters with large neighborhoods, the bricks are made larger, so that
+  // padding each brick by the radius adds at most 25% in each dimension
+  SizeValueType brickSize = std::max(64u, 8 * radius);
+
+  SizeValueType nBricks[VDim], total = 1;
+  for(unsigned int d = 0; d < VDim; d++)
+    {
+    nBricks[d] = (region.GetSize(d) + brickSize - 1) / brickSize;
+    total *= nBricks[d];
+    }
+
+  bricks.clear();
+  bricks.reserve(total);
+  for(SizeValueType k = 0; k < total; k++)
+    {
+    // Position of the brick in the grid of bricks, x fastest
+    OutputRegionType brick;
+    SizeValueType rem = k;
+    for(unsigned int d = 0; d < VDim; d++)
+      {
+      SizeValueType pos = (rem % nBricks[d]) * brickSize;
+      rem /= nBricks[d];
+      brick.SetIndex(d, region.GetIndex(d) + static_cast<itk::IndexValueType>(pos));
+      brick.SetSize(d, std::min(brickSize, region.GetSize(d) - pos));
+      }
+    bricks.push_back(brick);
+    }
 }
 
 template <class TFilterConfigTraits>
@@ -196,6 +417,8 @@ void
 SlicePreviewFilterWrapper<TFilterConfigTraits>
 ::SetActiveScalarLayer(ScalarImageWrapperBase *layer)
 {
+  this->AbortComputeOutputVolume();
+
   m_ActiveScalarLayer = layer;
   for(int i = 0; i < 4; i++)
     Traits::SetActiveScalarLayer(m_ActiveScalarLayer, this->GetNthFilter(i), i);
@@ -1,8 +1,10 @@
 #include "MomentTextures.h"
 #include "itkImage.h"
 #include "itkVectorImage.h"
+#include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkNeighborhoodIterator.h"
+#include <vector>
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -11,19 +13,95 @@ const int MAX_VAL=100000;
 
 namespace bilwaj {
 
+// Size of the tiles into which the running sum implementation divides the
+// thread region in the first two dimensions
+const int MOMENT_TILE_SIZE=64;
+
+// Sums of a signal of length n + 2r over a sliding window of width 2r+1
+static void SlidingWindowSum(const double *src, double *dst, long n, long r)
+{
+  double sum = 0.0;
+  for(long i = 0; i < 2*r+1; i++)
+    sum += src[i];
+  dst[0] = sum;
+  for(long i = 1; i < n; i++)
+    {
+    sum += src[i+2*r] - src[i-1];
+    dst[i] = sum;
+    }
+}
+
+// Minimum and maximum of a signal of length n + 2r over a sliding window of
+// width 2r+1. The van Herk / Gil-Werman algorithm takes a constant number of
+// comparisons per sample: the signal is cut into blocks of the window width
+// and every window is covered by the suffix of one block and the prefix of
+// the next.
+static void SlidingWindowMinMax(const double *src, double *dstMin, double *dstMax,
+                                long n, long r, std::vector<double> &work)
+{
+  long w = 2*r+1, m = n + 2*r;
+  work.resize(4 * m);
+  double *gMin = &work[0], *gMax = gMin + m, *hMin = gMax + m, *hMax = hMin + m;
+  for(long i = 0; i < m; i++)
+    {
+    bool first = (i % w == 0);
+    gMin[i] = first ? src[i] : MIN(gMin[i-1], src[i]);
+    gMax[i] = first ? src[i] : MAX(gMax[i-1], src[i]);
+    }
+  for(long i = m - 1; i >= 0; i--)
+    {
+    bool last = (i % w == w - 1 || i == m - 1);
+    hMin[i] = last ? src[i] : MIN(hMin[i+1], src[i]);
+    hMax[i] = last ? src[i] : MAX(hMax[i+1], src[i]);
+    }
+  for(long i = 0; i < n; i++)
+    {
+    dstMin[i] = MIN(hMin[i], gMin[i+2*r]);
+    dstMax[i] = MAX(hMax[i], gMax[i+2*r]);
+    }
+}
+
 template <class TInputImage, class TOutputImage>
 void
 MomentTextureFilter<TInputImage, TOutputImage>
 ::ThreadedGenerateData(const RegionType & outputRegionForThread,
-                       itk::ThreadIdType threadId)
+                       itk::ThreadIdType itkNotUsed(threadId))
+{
+  if(!m_UseRunningSums || ImageDimension != 3)
+    {
+    this->GenerateDataWithNeighborhoods(outputRegionForThread);
+    return;
+    }
+
+  // Process the thread region in tiles, to keep the buffers small
+  const typename RegionType::IndexType &idx = outputRegionForThread.GetIndex();
+  const typename RegionType::SizeType &size = outputRegionForThread.GetSize();
+  for(unsigned int y = 0; y < size[1]; y += MOMENT_TILE_SIZE)
+    {
+    for(unsigned int x = 0; x < size[0]; x += MOMENT_TILE_SIZE)
+      {
+      RegionType tile = outputRegionForThread;
+      tile.SetIndex(0, idx[0] + x);
+      tile.SetIndex(1, idx[1] + y);
+      tile.SetSize(0, MIN((unsigned int) MOMENT_TILE_SIZE, size[0] - x));
+      tile.SetSize(1, MIN((unsigned int) MOMENT_TILE_SIZE, size[1] - y));
+      this->GenerateDataWithRunningSums(tile);
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+MomentTextureFilter<TInputImage, TOutputImage>
+::GenerateDataWithNeighborhoods(const RegionType & region)
 {
   // Iterator for the output region
   typedef itk::ImageRegionIteratorWithIndex<OutputImageType> OutputIteratorType;
-  OutputIteratorType TexIt(this->GetOutput(), outputRegionForThread);
+  OutputIteratorType TexIt(this->GetOutput(), region);
 
   // Neighborhood iterator for the input region
   typedef itk::ConstNeighborhoodIterator<InputImageType> NeighborhoodIterator;
-  NeighborhoodIterator InpIt(m_Radius,this->GetInput(), outputRegionForThread);
+  NeighborhoodIterator InpIt(m_Radius,this->GetInput(), region);
 
   // Accumulator array
   vnl_vector<float> accumX(m_HighestDegree);
@@ -79,6 +157,179 @@ MomentTextureFilter<TInputImage, TOutputImage>
     }
 }
 
+
+template <class TInputImage, class TOutputImage>
+void
+MomentTextureFilter<TInputImage, TOutputImage>
+::GenerateDataWithRunningSums(const RegionType & tile)
+{
+  const InputImageType *input = this->GetInput();
+  const InputPixelType *buffer = input->GetBufferPointer();
+  const RegionType &bufferedRegion = input->GetBufferedRegion();
+  const typename InputImageType::OffsetValueType *offsetTable = input->GetOffsetTable();
+
+  // The neighborhood iterator repeats the voxels on the edge of the buffered
+  // region, which amounts to clamping the coordinates to the region
+  long lo[3], hi[3], t0[3], tn[3], r[3];
+  for(int d = 0; d < 3; d++)
+    {
+    lo[d] = bufferedRegion.GetIndex(d);
+    hi[d] = lo[d] + bufferedRegion.GetSize(d) - 1;
+    t0[d] = tile.GetIndex(d);
+    tn[d] = tile.GetSize(d);
+    r[d] = m_Radius[d];
+    }
+
+  unsigned int nDeg = m_HighestDegree;
+  long nx = tn[0], ny = tn[1], nPlane = nx * ny;
+  long nPadX = nx + 2*r[0], nPadY = ny + 2*r[1], w = 2*r[2]+1;
+  double nVoxels = (2*r[0]+1) * (2*r[1]+1) * w;
+
+  // The powers are taken relative to a voxel in the tile. This does not
+  // change the central moments but keeps the power sums small
+  long cidx[3];
+  for(int d = 0; d < 3; d++)
+    cidx[d] = MAX(lo[d], MIN(hi[d], t0[d] + tn[d] / 2));
+  double shift = buffer[cidx[0] - lo[0] + (cidx[1] - lo[1]) * offsetTable[1]
+      + (cidx[2] - lo[2]) * offsetTable[2]];
+
+  // Ring of the slices that are in the current window in the last dimension.
+  // Each slice holds the sums of powers 1 to nDeg, the minimum and maximum
+  // over the box in the first two dimensions
+  unsigned int nPlanes = nDeg + 2;
+  std::vector<double> ring(w * nPlanes * nPlane);
+  std::vector<double> acc(nDeg * nPlane, 0.0);
+
+  // Buffers for the separable passes
+  std::vector<double> line(MAX(nPadX, nPadY)), pw(MAX(nPadX, nPadY)), work;
+  std::vector<double> rows(nPlanes * nPadY * nx);
+  std::vector<double> col(nPadY), colOut(3 * ny);
+
+  // Binomial coefficients for expanding the central moments
+  std::vector<double> binom((nDeg + 1) * (nDeg + 1), 0.0);
+  for(unsigned int k = 0; k <= nDeg; k++)
+    {
+    binom[k * (nDeg + 1)] = 1.0;
+    for(unsigned int j = 1; j <= k; j++)
+      binom[k * (nDeg + 1) + j] = binom[(k - 1) * (nDeg + 1) + j - 1]
+          + (j < k ? binom[(k - 1) * (nDeg + 1) + j] : 0.0);
+    }
+
+  // Output iterator and pixel
+  typedef itk::ImageRegionIterator<OutputImageType> OutputIteratorType;
+  OutputIteratorType TexIt(this->GetOutput(), tile);
+  OutputPixelType out_pix(nDeg);
+  std::vector<double> sums(nDeg + 1), mpow(nDeg + 1);
+
+  // Slices k = 0 .. tn[2] + 2r[2] - 1 of the padded tile are filtered in the
+  // first two dimensions as they enter the window in the last dimension
+  for(long k = 0; k < tn[2] + 2*r[2]; k++)
+    {
+    double *slice = &ring[(k % w) * nPlanes * nPlane];
+    long zi = MAX(lo[2], MIN(hi[2], t0[2] - r[2] + k));
+
+    // Remove the slice that is leaving the window from the running sums
+    if(k >= w)
+      {
+      for(long i = 0; i < (long) nDeg * nPlane; i++)
+        acc[i] -= slice[i];
+      }
+
+    // Filter the rows of the slice in the first dimension
+    for(long q = 0; q < nPadY; q++)
+      {
+      long yi = MAX(lo[1], MIN(hi[1], t0[1] - r[1] + q));
+      const InputPixelType *row = buffer + (yi - lo[1]) * offsetTable[1]
+          + (zi - lo[2]) * offsetTable[2] - lo[0];
+      for(long i = 0; i < nPadX; i++)
+        line[i] = row[MAX(lo[0], MIN(hi[0], t0[0] - r[0] + i))];
+
+      SlidingWindowMinMax(&line[0], &rows[(nDeg * nPadY + q) * nx],
+                          &rows[((nDeg + 1) * nPadY + q) * nx], nx, r[0], work);
+      for(long i = 0; i < nPadX; i++)
+        pw[i] = line[i] - shift;
+      for(unsigned int j = 0; j < nDeg; j++)
+        {
+        if(j > 0)
+          for(long i = 0; i < nPadX; i++)
+            pw[i] *= line[i] - shift;
+        SlidingWindowSum(&pw[0], &rows[(j * nPadY + q) * nx], nx, r[0]);
+        }
+      }
+
+    // Filter the columns in the second dimension
+    for(long x = 0; x < nx; x++)
+      {
+      for(unsigned int j = 0; j < nDeg; j++)
+        {
+        for(long q = 0; q < nPadY; q++)
+          col[q] = rows[(j * nPadY + q) * nx + x];
+        SlidingWindowSum(&col[0], &colOut[0], ny, r[1]);
+        for(long y = 0; y < ny; y++)
+          slice[j * nPlane + y * nx + x] = colOut[y];
+        }
+
+      for(long q = 0; q < nPadY; q++)
+        line[q] = rows[(nDeg * nPadY + q) * nx + x];
+      for(long q = 0; q < nPadY; q++)
+        pw[q] = rows[((nDeg + 1) * nPadY + q) * nx + x];
+      SlidingWindowMinMax(&line[0], &colOut[0], &colOut[ny], ny, r[1], work);
+      for(long y = 0; y < ny; y++)
+        slice[nDeg * nPlane + y * nx + x] = colOut[y];
+      SlidingWindowMinMax(&pw[0], &colOut[ny], &colOut[2 * ny], ny, r[1], work);
+      for(long y = 0; y < ny; y++)
+        slice[(nDeg + 1) * nPlane + y * nx + x] = colOut[2 * ny + y];
+      }
+
+    // Add the new slice to the running sums
+    for(long i = 0; i < (long) nDeg * nPlane; i++)
+      acc[i] += slice[i];
+
+    // Once the window is full, compute the moments for the output slice
+    if(k < w - 1)
+      continue;
+
+    for(long i = 0; i < nPlane; i++, ++TexIt)
+      {
+      // The intensity range over the window, as in the neighborhood version
+      // the range always includes zero
+      double min = 0, max = 0;
+      for(long s = 0; s < w; s++)
+        {
+        min = MIN(min, ring[(s * nPlanes + nDeg) * nPlane + i]);
+        max = MAX(max, ring[(s * nPlanes + nDeg + 1) * nPlane + i]);
+        }
+      float range = max - min;
+
+      // Mean relative to the shift and actual mean
+      sums[0] = nVoxels;
+      for(unsigned int j = 1; j <= nDeg; j++)
+        sums[j] = acc[(j - 1) * nPlane + i];
+      double mean_rel = sums[1] / nVoxels;
+      float mean = mean_rel + shift;
+
+      // Expand the sum of (pix - mean)^k in terms of the power sums
+      mpow[0] = 1.0;
+      for(unsigned int j = 1; j <= nDeg; j++)
+        mpow[j] = mpow[j - 1] * (-mean_rel);
+
+      out_pix[0] = static_cast<OutputComponentType>(1000 * (mean / range));
+      double range_k = range;
+      for(unsigned int deg = 2; deg <= nDeg; deg++)
+        {
+        double central = 0.0;
+        for(unsigned int j = 0; j <= deg; j++)
+          central += binom[deg * (nDeg + 1) + j] * sums[j] * mpow[deg - j];
+        range_k *= range;
+        float moment = central / (range_k * nVoxels);
+        out_pix[deg - 1] = static_cast<OutputComponentType>(1000 * moment);
+        }
+
+      TexIt.Set(out_pix);
+      }
+    }
+}
+
 template <class TInputImage, class TOutputImage>
 void
 MomentTextureFilter<TInputImage, TOutputImage>
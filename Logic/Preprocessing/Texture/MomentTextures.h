@@ -45,14 +45,31 @@ public:
   itkSetMacro(HighestDegree, unsigned int)
   itkGetMacro(HighestDegree, unsigned int)
 
+  /**
+   * Compute the moments from running sums of the powers of the intensity
+   * (default). The box sums are computed separably, one dimension at a
+   * time, so the cost per voxel does not depend on the radius. When off,
+   * every neighborhood is visited voxel by voxel.
+   */
+  itkSetMacro(UseRunningSums, bool)
+  itkGetMacro(UseRunningSums, bool)
+  itkBooleanMacro(UseRunningSums)
+
 protected:
 
-  MomentTextureFilter() : m_HighestDegree(2) { m_Radius.Fill(1); }
+  MomentTextureFilter() : m_HighestDegree(2), m_UseRunningSums(true) { m_Radius.Fill(1); }
   ~MomentTextureFilter() {}
 
   virtual void ThreadedGenerateData(const RegionType & outputRegionForThread,
                                     itk::ThreadIdType threadId) ITK_OVERRIDE;
 
+  // Compute the moments by visiting the neighborhood of each voxel
+  void GenerateDataWithNeighborhoods(const RegionType &region);
+
+  // Compute the moments from separable running sums over a tile of the output
+  // that spans the full extent of the thread region in the last dimension
+  void GenerateDataWithRunningSums(const RegionType &tile);
+
   virtual void UpdateOutputInformation() ITK_OVERRIDE;
 
   // Highest degree for which to generate the textures
@@ -61,6 +78,9 @@ protected:
   // Radius of the neighborhood for texture generation
   SizeType m_Radius;
 
+  // Whether to use the running sum implementation
+  bool m_UseRunningSums;
+
 private:
 
   MomentTextureFilter(const Self &); //purposely not implemented
@@ -1,10 +1,12 @@
 #ifndef RLEImage_h
 #define RLEImage_h
 
+#include <atomic>
 #include <utility> //std::pair
 #include <vector>
 #include <itkImageBase.h>
 #include <itkImage.h>
+#include "RLESegmentPool.h"
 
 /** Run-Length Encoded image.
 * It saves memory for label images at the expense of processing times.
@@ -16,6 +18,10 @@
 * It is best if pixel type and counter type have the same byte size
 * (for memory alignment purposes).
 *
+* The segments of all lines are stored in blocks drawn from a shared
+* RLESegmentPool rather than in individual heap allocations. Lines always
+* use the full capacity of their block, so they can grow in place.
+*
 * Copied and adapted from itk::Image.
 */
 template< typename TPixel, unsigned int VImageDimension = 3, typename CounterType = unsigned short >
@@ -47,8 +53,11 @@ public:
     * second element is the pixel value. */
     typedef std::pair<CounterType, PixelType> RLSegment;
 
+    /** Allocator for the segments of a line. */
+    typedef RLESegmentAllocator<RLSegment> RLSegmentAllocator;
+
     /** A Run-Length encoded line of pixels. */
-    typedef std::vector<RLSegment> RLLine;
+    typedef std::vector<RLSegment, RLSegmentAllocator> RLLine;
 
     /** Internal Pixel representation. Used to maintain a uniform API
     * with Image Adaptors and allow to keep a particular internal
@@ -107,6 +116,17 @@ public:
         Superclass::Initialize();
         m_OnTheFlyCleanup = true;
         myBuffer = BufferType::New();
+        m_RunIndex.clear();
+        m_RunIndexStamp.clear();
+    }
+
+    /** Called by the pipeline after a filter has written into this image.
+    * Filters write RLE lines directly, so the run index is rebuilt here. */
+    virtual void DataHasBeenGenerated() ITK_OVERRIDE
+    {
+        Superclass::DataHasBeenGenerated();
+        if (m_UseRunIndex)
+            RebuildRunIndex();
     }
 
     /** Fill the image buffer with a value.  Be sure to call Allocate()
@@ -174,8 +194,13 @@ public:
     /** Typedef for the internally used buffer. */
     typedef typename itk::Image<RLLine, VImageDimension - 1> BufferType;
 
-    /** We need to allow itk-style iterators to be constructed. */
-    typename BufferType::Pointer GetBuffer() { return myBuffer; }
+    /** We need to allow itk-style iterators to be constructed.
+    * The caller may rewrite any line, so this invalidates the run index. */
+    typename BufferType::Pointer GetBuffer()
+    {
+        InvalidateRunIndex();
+        return myBuffer;
+    }
 
     /** We need to allow itk-style const iterators to be constructed. */
     typename BufferType::Pointer GetBuffer() const { return myBuffer; }
@@ -196,6 +221,108 @@ public:
     * Automatically called when turning on OnTheFlyCleanup. */
     void CleanUp() const;
 
+    /** Run ends of a line: entry i is one past the last pixel of segment i,
+    * i.e. the prefix sum of segment lengths up to and including i. */
+    typedef std::vector<CounterType, RLESegmentAllocator<CounterType> > RunIndexLine;
+
+    /** Should a per-line index of run offsets be maintained? With the index,
+    * locating the segment which covers a pixel (GetPixel, SetPixel, iterator
+    * positioning) is a binary search instead of a linear scan of the line.
+    * The index costs memory for every line, so it is meant for images which
+    * are probed at random locations many times. Off by default.
+    *
+    * Each line of the index is stamped with the generation it was built in.
+    * The non-const GetBuffer() and InvalidateRunIndex() start a new generation,
+    * and lines with an older stamp are scanned until they are rewritten by
+    * SetPixel or RewriteLineSpan, passed to UpdateRunIndex(), or the whole
+    * index is rebuilt with RebuildRunIndex(). FillBuffer, Allocate and the
+    * pipeline (after a filter generates the image) rebuild the index. */
+    bool GetUseRunIndex() const { return m_UseRunIndex; }
+
+    /** Should a per-line index of run offsets be maintained? */
+    void SetUseRunIndex(bool value)
+    {
+        if (value == m_UseRunIndex)
+            return;
+        m_UseRunIndex = value;
+        if (m_UseRunIndex)
+            RebuildRunIndex();
+        else
+        {
+            //release the memory
+            RunIndexType().swap(m_RunIndex);
+            std::vector<unsigned long>().swap(m_RunIndexStamp);
+        }
+    }
+
+    /** Recompute the run index of all lines. */
+    void RebuildRunIndex();
+
+    /** Mark the run index of all lines as out of date, e.g. after lines
+    * were rewritten through a buffer pointer obtained earlier. */
+    void InvalidateRunIndex()
+    {
+        if (m_UseRunIndex)
+            ++m_RunIndexGeneration;
+    }
+
+    /** Recompute the run index of a single line of this image, after it has
+    * been rewritten through GetBuffer(). Does nothing if the index is off. */
+    void UpdateRunIndex(const RLLine & line)
+    {
+        itk::OffsetValueType offset = m_UseRunIndex ? GetLineOffset(line) : -1;
+        if (offset >= 0)
+            RebuildRunIndexLine(line, offset);
+    }
+
+    /** Finds the segment of the line containing pixel x (relative to the start
+    * of the buffered region). Sets realIndex to the segment and segmentRemainder
+    * to the number of pixels remaining in the segment, including x. Uses the run
+    * index if it is enabled and current for the line, otherwise scans the line. */
+    void LocateRun(const RLLine & line, IndexValueType x,
+        IndexValueType & realIndex, IndexValueType & segmentRemainder) const;
+
+    /** Moves every line into the smallest pool block that holds it,
+    * returning the slack left behind by shrinking lines to the pool.
+    * Lines which already fit their block are not touched. */
+    void Compact();
+
+    /** Appends a run of n pixels to a line, merging it into the last segment
+    * if that segment has the same value. Does nothing if n is not positive. */
+    static inline void AppendRun(RLLine & line, const TPixel & value, IndexValueType n)
+    {
+        if (n <= 0)
+            return;
+        if (!line.empty() && line.back().second == value)
+            line.back().first += n;
+        else
+            line.push_back(RLSegment(CounterType(n), value));
+    }
+
+    /** Rewrites pixels s0 to s1-1 of a line (relative to the start of the
+    * buffered region) in a single pass over its segments. For each piece of a
+    * segment that overlaps the span, in order, op(value, n) is called with the
+    * value and length of the piece, and returns the new value. Segments are
+    * split and merged as needed, and the run index of the line is updated.
+    * The line is only written if a value changes. The new line is assembled
+    * in buffer, which the caller can reuse between calls. Returns the number
+    * of pixels whose value changed. */
+    template< typename TOperation >
+    SizeValueType RewriteLineSpan(RLLine & line, IndexValueType s0, IndexValueType s1,
+        TOperation & op, RLLine & buffer);
+
+    /** Memory used by the lines: line headers plus the pool blocks
+    * holding the segments, in bytes. */
+    itk::SizeValueType GetLineStorageInBytes() const;
+
+    /** Makes sure the line can hold n segments, growing it to the full
+    * capacity of the pool block, so later insertions are done in place. */
+    static inline void ReserveLine(RLLine & line, SizeValueType n)
+    {
+        if (n > line.capacity())
+            line.reserve(RLSegmentAllocator::PoolType::GetInstance().GetBlockCapacity(n));
+    }
+
     /** Should same-valued segments be merged on the fly?
     * On the fly merging usually provides better performance. */
     bool GetOnTheFlyCleanup() const { return m_OnTheFlyCleanup; }
@@ -216,6 +343,8 @@ protected:
     RLEImage() : itk::ImageBase < VImageDimension >()
     {
         m_OnTheFlyCleanup = true;
+        m_UseRunIndex = false;
+        m_RunIndexGeneration = 0;
         myBuffer = BufferType::New();
     }
     void PrintSelf(std::ostream & os, itk::Indent indent) const ITK_OVERRIDE;
@@ -235,9 +364,39 @@ protected:
     /** Merges adjacent segments with duplicate values in a single line. */
     void CleanUpLine(RLLine & line) const;
 
+    /** Implementation of SetPixel on a line, without run index maintenance. */
+    int SetPixelInLine(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & realIndex, const TPixel & value);
+
+    /** Position of the line in the buffer, or -1 if the line is not from this image. */
+    inline itk::OffsetValueType GetLineOffset(const RLLine & line) const
+    {
+        const RLLine *first = myBuffer->GetBufferPointer();
+        if (first == NULL || &line < first || &line >= first + m_RunIndex.size())
+            return -1;
+        return &line - first;
+    }
+
+    /** Recompute the run index of the line at the given offset, and stamp it
+    * with the current generation. */
+    void RebuildRunIndexLine(const RLLine & line, itk::OffsetValueType offset);
+
+    /** Is the run index of the line at the given offset up to date? */
+    bool IsRunIndexCurrent(itk::OffsetValueType offset) const
+    {
+        return offset >= 0 && m_RunIndexStamp[offset] == m_RunIndexGeneration;
+    }
+
 private:
     bool m_OnTheFlyCleanup; //should same-valued segments be merged on the fly
 
+    /** Per-line run index, in the same order as lines in the buffer, and
+    * the generation each line was built in. */
+    typedef std::vector<RunIndexLine> RunIndexType;
+    RunIndexType m_RunIndex;
+    std::vector<unsigned long> m_RunIndexStamp;
+    std::atomic<unsigned long> m_RunIndexGeneration; //filters get the buffer from several threads
+    bool m_UseRunIndex;
+
     RLEImage(const Self &);          //purposely not implemented
     void operator=(const Self &); //purposely not implemented
 
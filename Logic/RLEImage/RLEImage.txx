@@ -3,6 +3,8 @@
 
 #include "RLEImage.h"
 #include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include <algorithm>
 
 template< typename TPixel, unsigned int VImageDimension, typename CounterType >
 inline typename RLEImage<TPixel, VImageDimension, CounterType>::BufferType::IndexType
@@ -56,6 +58,8 @@ void RLEImage<TPixel, VImageDimension, CounterType>::Allocate(bool initialize)
         line[0] = segment;
         myBuffer->FillBuffer(line);
     }
+    if (m_UseRunIndex)
+        RebuildRunIndex();
 }
 
 template< typename TPixel, unsigned int VImageDimension, typename CounterType >
@@ -66,6 +70,63 @@ void RLEImage<TPixel, VImageDimension, CounterType>
     RLLine line(1);
     line[0] = segment;
     myBuffer->FillBuffer(line);
+    if (m_UseRunIndex)
+        RebuildRunIndex();
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+void RLEImage<TPixel, VImageDimension, CounterType>
+::RebuildRunIndexLine(const RLLine & line, itk::OffsetValueType offset)
+{
+    RunIndexLine & index = m_RunIndex[offset];
+    m_RunIndexStamp[offset] = m_RunIndexGeneration;
+    index.resize(line.size());
+    CounterType t = 0;
+    for (SizeValueType x = 0; x < line.size(); x++)
+        index[x] = (t += line[x].first);
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+void RLEImage<TPixel, VImageDimension, CounterType>::RebuildRunIndex()
+{
+    SizeValueType nLines = myBuffer->GetBufferPointer()
+        ? myBuffer->GetBufferedRegion().GetNumberOfPixels() : 0;
+    m_RunIndex.resize(nLines);
+    m_RunIndexStamp.resize(nLines);
+    const RLLine *lines = myBuffer->GetBufferPointer();
+    for (SizeValueType i = 0; i < nLines; i++)
+        RebuildRunIndexLine(lines[i], i);
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+void RLEImage<TPixel, VImageDimension, CounterType>
+::LocateRun(const RLLine & line, IndexValueType x,
+    IndexValueType & realIndex, IndexValueType & segmentRemainder) const
+{
+    //a line with an older stamp may have been rewritten through GetBuffer(),
+    //so it is scanned; it is not rebuilt here, as readers may share the image
+    itk::OffsetValueType offset = m_UseRunIndex ? GetLineOffset(line) : -1;
+    if (IsRunIndexCurrent(offset))
+    {
+        //binary search for the first segment ending after x
+        const RunIndexLine & index = m_RunIndex[offset];
+        typename RunIndexLine::const_iterator it =
+            std::upper_bound(index.begin(), index.end(), CounterType(x));
+        realIndex = it - index.begin();
+        segmentRemainder = (it == index.end() ? 0 : *it - x);
+        return;
+    }
+
+    CounterType t = 0;
+    SizeValueType r = 0;
+    for (; r < line.size(); r++)
+    {
+        t += line[r].first;
+        if (t > x)
+            break;
+    }
+    realIndex = r;
+    segmentRemainder = t - x;
 }
 
 template< typename TPixel, unsigned int VImageDimension, typename CounterType >
@@ -73,7 +134,7 @@ void RLEImage<TPixel, VImageDimension, CounterType>::CleanUpLine(RLLine & line)
 {
     CounterType x = 0;
     RLLine out;
-    out.reserve(this->GetLargestPossibleRegion().GetSize(0));
+    ReserveLine(out, line.size());
     do
     {
         out.push_back(line[x]);
@@ -83,6 +144,82 @@ void RLEImage<TPixel, VImageDimension, CounterType>::CleanUpLine(RLLine & line)
     out.swap(line);
 }
 
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+void RLEImage<TPixel, VImageDimension, CounterType>::Compact()
+{
+    const typename RLSegmentAllocator::PoolType & pool =
+        RLSegmentAllocator::PoolType::GetInstance();
+    itk::ImageRegionIterator<BufferType> it(myBuffer, myBuffer->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+        RLLine & line = it.Value();
+        if (line.capacity() > pool.GetBlockCapacity(line.size()))
+        {
+            RLLine fitted;
+            ReserveLine(fitted, line.size());
+            fitted.assign(line.begin(), line.end());
+            fitted.swap(line);
+        }
+    }
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+template< typename TOperation >
+typename RLEImage<TPixel, VImageDimension, CounterType>::SizeValueType
+RLEImage<TPixel, VImageDimension, CounterType>
+::RewriteLineSpan(RLLine & line, IndexValueType s0, IndexValueType s1,
+    TOperation & op, RLLine & buffer)
+{
+    buffer.clear();
+    ReserveLine(buffer, line.size() + 2);
+
+    SizeValueType changed = 0;
+    IndexValueType t = 0;
+    for (SizeValueType r = 0; r < line.size(); r++)
+    {
+        IndexValueType tEnd = t + line[r].first;
+        TPixel value = line[r].second;
+        if (tEnd <= s0 || t >= s1)
+            AppendRun(buffer, value, tEnd - t);
+        else
+        {
+            //split the segment into the parts before, inside and after the span
+            IndexValueType a = std::max(t, s0), b = std::min(tEnd, s1);
+            AppendRun(buffer, value, a - t);
+            TPixel newValue = op(value, b - a);
+            if (newValue != value)
+                changed += b - a;
+            AppendRun(buffer, newValue, b - a);
+            AppendRun(buffer, value, tEnd - b);
+        }
+        t = tEnd;
+    }
+
+    if (changed > 0)
+    {
+        ReserveLine(line, buffer.size());
+        line.assign(buffer.begin(), buffer.end());
+        UpdateRunIndex(line);
+    }
+    return changed;
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+itk::SizeValueType RLEImage<TPixel, VImageDimension, CounterType>::GetLineStorageInBytes() const
+{
+    const typename RLSegmentAllocator::PoolType & pool =
+        RLSegmentAllocator::PoolType::GetInstance();
+    itk::SizeValueType bytes = 0;
+    itk::ImageRegionConstIterator<BufferType> it(myBuffer, myBuffer->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+    {
+        bytes += sizeof(RLLine);
+        if (it.Get().capacity() > 0)
+            bytes += pool.GetBlockCapacity(it.Get().capacity()) * sizeof(RLSegment);
+    }
+    return bytes;
+}
+
 template< typename TPixel, unsigned int VImageDimension, typename CounterType >
 void RLEImage<TPixel, VImageDimension, CounterType>::CleanUp() const
 {
@@ -98,6 +235,39 @@ void RLEImage<TPixel, VImageDimension, CounterType>::CleanUp() const
 template< typename TPixel, unsigned int VImageDimension, typename CounterType >
 int RLEImage<TPixel, VImageDimension, CounterType>::
 SetPixel(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & realIndex, const TPixel & value)
+{
+    IndexValueType oldRealIndex = realIndex;
+    int delta = SetPixelInLine(line, segmentRemainder, realIndex, value);
+
+    itk::OffsetValueType offset = m_UseRunIndex ? GetLineOffset(line) : -1;
+    if (offset >= 0)
+    {
+        RunIndexLine & index = m_RunIndex[offset];
+        if (!IsRunIndexCurrent(offset))
+            RebuildRunIndexLine(line, offset);
+        else
+        {
+            //SetPixelInLine only modifies segments oldRealIndex-1 to oldRealIndex+2
+            //(numbered after the update), segments outside of that window keep
+            //their end positions and only need to be shifted by delta
+            SizeValueType w0 = oldRealIndex > 0 ? oldRealIndex - 1 : 0;
+            if (delta > 0)
+                index.insert(index.begin() + std::min(w0 + 1, SizeValueType(index.size())), delta, 0);
+            else if (delta < 0)
+                index.erase(index.begin() + w0 + 1, index.begin() + w0 + 1 - delta);
+
+            CounterType t = w0 > 0 ? index[w0 - 1] : 0;
+            SizeValueType w1 = std::min(w0 + 4, SizeValueType(line.size()));
+            for (SizeValueType x = w0; x < w1; x++)
+                index[x] = (t += line[x].first);
+        }
+    }
+    return delta;
+}
+
+template< typename TPixel, unsigned int VImageDimension, typename CounterType >
+int RLEImage<TPixel, VImageDimension, CounterType>::
+SetPixelInLine(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & realIndex, const TPixel & value)
 {
     //complete Run-Length Lines have to be buffered
     itkAssertOrThrowMacro(this->GetBufferedRegion().GetSize(0)
@@ -157,6 +327,7 @@ SetPixel(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & real
     }
     else if (segmentRemainder == 1) //insert after
     {
+        ReserveLine(line, line.size() + 1);
         line[realIndex].first--;
         line.insert(line.begin() + realIndex + 1, RLSegment(1, value));
         realIndex++;
@@ -164,6 +335,7 @@ SetPixel(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & real
     }
     else if (segmentRemainder == line[realIndex].first) //insert before
     {
+        ReserveLine(line, line.size() + 1);
         line[realIndex].first--;
         line.insert(line.begin() + realIndex, RLSegment(1, value));
         segmentRemainder = 1;
@@ -172,6 +344,7 @@ SetPixel(RLLine & line, IndexValueType & segmentRemainder, IndexValueType & real
     else //general case: split a segment into 3 segments
     {
         //first take care of values
+        ReserveLine(line, line.size() + 2);
         line.insert(line.begin() + realIndex + 1, 2, RLSegment(1, value));
         line[realIndex + 2].second = line[realIndex].second;
 
@@ -195,16 +368,12 @@ SetPixel(const IndexType & index, const TPixel & value)
     IndexValueType bri0 = this->GetBufferedRegion().GetIndex(0);
     typename BufferType::IndexType bi = truncateIndex(index);
     RLLine & line = myBuffer->GetPixel(bi);
-    IndexValueType t = 0;
-    for (IndexValueType x = 0; x < line.size(); x++)
+    IndexValueType x, t;
+    LocateRun(line, index[0] - bri0, x, t);
+    if (x < line.size())
     {
-        t += line[x].first;
-        if (t > index[0] - bri0)
-        {
-            t -= index[0] - bri0; //we need to supply a reference
-            SetPixel(line, t, x, value);
-            return;
-        }
+        SetPixel(line, t, x, value);
+        return;
     }
     throw itk::ExceptionObject(__FILE__, __LINE__, "Reached past the end of Run-Length line!", __FUNCTION__);
 }
@@ -220,13 +389,10 @@ GetPixel(const IndexType & index) const
     IndexValueType bri0 = this->GetBufferedRegion().GetIndex(0);
     typename BufferType::IndexType bi = truncateIndex(index);
     RLLine & line = myBuffer->GetPixel(bi);
-    IndexValueType t = 0;
-    for (IndexValueType x = 0; x < line.size(); x++)
-    {
-        t += line[x].first;
-        if (t > index[0] - bri0)
-            return line[x].second;
-    }
+    IndexValueType x, t;
+    LocateRun(line, index[0] - bri0, x, t);
+    if (x < line.size())
+        return line[x].second;
     throw itk::ExceptionObject(__FILE__, __LINE__, "Reached past the end of Run-Length line!", __FUNCTION__);
 }
 
@@ -246,11 +412,11 @@ void RLEImage<TPixel, VImageDimension, CounterType>
         ++it;
     }
 
-    double cr = double(c*(sizeof(PixelType) + sizeof(CounterType))
-        + sizeof(std::vector<RLLine>) * this->GetOffsetTable()[VImageDimension] / this->GetOffsetTable()[1])
+    double cr = double(GetLineStorageInBytes())
         / (this->GetOffsetTable()[VImageDimension] * sizeof(PixelType));
 
     os << indent << "OnTheFlyCleanup: " << (m_OnTheFlyCleanup ? "On" : "Off") << std::endl;
+    os << indent << "UseRunIndex: " << (m_UseRunIndex ? "On" : "Off") << std::endl;
     os << indent << "RLEImage compressed pixel count: " << c << std::endl;
     int prec = os.precision(3);
     os << indent << "Compressed size in relation to original size: "<< cr*100 <<"%" << std::endl;
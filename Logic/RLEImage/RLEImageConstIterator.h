@@ -87,7 +87,7 @@ public:
   /** Copy Constructor. The copy constructor is provided to make sure the
    * handle to the image is properly reference counted. */
   ImageConstIterator(const Self & it)
-      :myBuffer(const_cast<ImageType *>(it.GetImage())->GetBuffer())
+      :myBuffer(it.GetImage()->GetBuffer())
   {
     rlLine = it.rlLine;
     m_Image = it.m_Image;     // copy the smart pointer
@@ -103,7 +103,7 @@ public:
   /** Constructor establishes an iterator to walk a particular image and a
    * particular region of that image. */
   ImageConstIterator(const ImageType *ptr, const RegionType & region)
-      :myBuffer(const_cast<ImageType *>(ptr)->GetBuffer())
+      :myBuffer(ptr->GetBuffer())
   {
     m_Image = ptr;
     SetRegion(region);
@@ -303,18 +303,7 @@ protected: //made protected so other iterators can access
   {
       m_Index0 = ind0;
       rlLine = &bi.Value();
-
-      CounterType t = 0;
-      SizeValueType x = 0;
-
-      for (; x < (*rlLine).size(); x++)
-      {
-          t += (*rlLine)[x].first;
-          if (t > m_Index0)
-              break;
-      }
-      realIndex = x;
-      segmentRemainder = t - m_Index0;
+      m_Image->LocateRun(*rlLine, m_Index0, realIndex, segmentRemainder);
   }
 
   typename ImageType::ConstWeakPointer m_Image;
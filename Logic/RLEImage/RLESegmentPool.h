@@ -0,0 +1,289 @@
+#ifndef RLESegmentPool_h
+#define RLESegmentPool_h
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+/** Memory pool for the segments of run-length encoded lines.
+*
+* A label volume has one RLE line per row of voxels, and most lines hold only
+* a handful of segments. Allocating each line separately from the heap costs
+* allocator headers and rounding for every line and fragments the heap as
+* lines grow and shrink during editing. This pool carves line storage out of
+* large contiguous chunks instead. Blocks are rounded up to a size class
+* (classes grow by about 25%), and freed blocks are kept on per-class free
+* lists for reuse by other lines. Blocks larger than the largest class are
+* taken from the heap directly.
+*
+* The pool is divided into shards, each with its own chunks, free lists and
+* lock. Each thread allocates from a shard of its own, so threads filling
+* lines at the same time (e.g. the workers of a filter) do not wait on each
+* other. Chunks are aligned to their size and start with the address of their
+* shard, so a block is always returned to the shard it came from, whichever
+* thread frees it. When all the blocks of a shard have been freed, its chunks
+* are returned to the heap, except for the last one which is reused.
+*
+* Chunks are not returned to the heap one by one: a freed block stays on the
+* free list of its size class until the whole shard is empty, and is only
+* reused for blocks of the same class. While any block of a shard is in use,
+* the shard therefore holds, in the worst case, the sum over size classes of
+* the peak bytes in use in that class, plus one partly carved chunk. Editing
+* which moves lines between classes back and forth stays within that bound,
+* but a long-lived image can pin the peak memory of a shard that other,
+* released images grew. Compact() on the remaining images does not lower it.
+*
+* There is one pool per element size, shared by all images. It is thread safe.
+*/
+template< std::size_t VElementSize >
+class RLESegmentPool
+{
+public:
+    /** The pool shared by all lines with elements of this size. It is never
+    * destroyed, so that images with static storage can be released safely. */
+    static RLESegmentPool & GetInstance()
+    {
+        static RLESegmentPool *instance = new RLESegmentPool();
+        return *instance;
+    }
+
+    /** Allocate a block that can hold n elements. */
+    void * Allocate(std::size_t n)
+    {
+        if (n > m_ClassCapacity.back())
+            return ::operator new(n * VElementSize);
+
+        std::size_t c = GetSizeClass(n);
+        std::size_t bytes = m_ClassCapacity[c] * VElementSize;
+        Shard & shard = GetThreadShard();
+        itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(shard.Mutex);
+        shard.BytesInUse += bytes;
+        if (!shard.FreeLists[c].empty())
+        {
+            void *block = shard.FreeLists[c].back();
+            shard.FreeLists[c].pop_back();
+            return block;
+        }
+
+        if (shard.ChunkRemaining < bytes)
+            AddChunk(shard);
+        void *block = shard.ChunkPosition;
+        shard.ChunkPosition += bytes;
+        shard.ChunkRemaining -= bytes;
+        return block;
+    }
+
+    /** Return a block of n elements, obtained from Allocate(n), to the pool. */
+    void Deallocate(void *block, std::size_t n)
+    {
+        if (n > m_ClassCapacity.back())
+        {
+            ::operator delete(block);
+            return;
+        }
+
+        std::size_t c = GetSizeClass(n);
+        Shard & shard = *GetChunkHeader(block)->Owner;
+        itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(shard.Mutex);
+        shard.BytesInUse -= m_ClassCapacity[c] * VElementSize;
+        if (shard.BytesInUse == 0)
+            ReleaseChunks(shard);
+        else
+            shard.FreeLists[c].push_back(block);
+    }
+
+    /** Number of elements a block requested for n elements can really hold. */
+    std::size_t GetBlockCapacity(std::size_t n) const
+    {
+        return n > m_ClassCapacity.back() ? n : m_ClassCapacity[GetSizeClass(n)];
+    }
+
+    /** Bytes obtained from the heap in chunks (excludes large blocks).
+    * Includes free blocks which are held until their shard is empty. */
+    std::size_t GetBytesReserved() const
+    {
+        std::size_t bytes = 0;
+        for (unsigned int i = 0; i < NumberOfShards; i++)
+        {
+            itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_Shards[i].Mutex);
+            bytes += m_Shards[i].Chunks.size() * ChunkSize;
+        }
+        return bytes;
+    }
+
+    /** Bytes in pooled blocks that are currently handed out. */
+    std::size_t GetBytesInUse() const
+    {
+        std::size_t bytes = 0;
+        for (unsigned int i = 0; i < NumberOfShards; i++)
+        {
+            itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_Shards[i].Mutex);
+            bytes += m_Shards[i].BytesInUse;
+        }
+        return bytes;
+    }
+
+    /** Bytes the pool keeps reserved when no block is in use: one chunk
+    * per shard that has been used. */
+    std::size_t GetMaximumIdleBytesReserved() const
+    { return NumberOfShards * ChunkSize; }
+
+protected:
+    /** Size of the chunks the blocks are carved from, in bytes. Chunks are
+    * aligned to this size. */
+    static const std::size_t ChunkSize = 1 << 20;
+
+    /** Number of shards. Threads beyond this number share shards. */
+    static const unsigned int NumberOfShards = 16;
+
+    /** Space reserved at the start of each chunk for its header. */
+    static const std::size_t ChunkHeaderSize = 16;
+
+    /** A part of the pool with its own lock, used by one or a few threads. */
+    struct Shard
+    {
+        Shard() : ChunkPosition(NULL), ChunkRemaining(0), BytesInUse(0) {}
+
+        std::vector<std::vector<void *> > FreeLists;
+        std::vector<char *> Chunks;
+        char *ChunkPosition;
+        std::size_t ChunkRemaining;
+        std::size_t BytesInUse;
+        mutable itk::SimpleFastMutexLock Mutex;
+    };
+
+    /** Stored at the start of every chunk. */
+    struct ChunkHeader
+    {
+        Shard *Owner;
+    };
+
+    RLESegmentPool() : m_NextShard(0)
+    {
+        //exact classes for short lines, then about 25% growth
+        for (std::size_t cap = 1; cap <= ChunkSize / (16 * VElementSize); )
+        {
+            m_ClassCapacity.push_back(cap);
+            cap = (cap < 8) ? cap + 1 : cap + cap / 4;
+        }
+        for (unsigned int i = 0; i < NumberOfShards; i++)
+            m_Shards[i].FreeLists.resize(m_ClassCapacity.size());
+    }
+
+    std::size_t GetSizeClass(std::size_t n) const
+    {
+        return std::lower_bound(m_ClassCapacity.begin(), m_ClassCapacity.end(), n)
+            - m_ClassCapacity.begin();
+    }
+
+    /** The shard of the calling thread. Threads are given shards in turn the
+    * first time they allocate. */
+    Shard & GetThreadShard()
+    {
+        static thread_local int shard = -1;
+        if (shard < 0)
+        {
+            itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(m_ShardMutex);
+            shard = m_NextShard++ % NumberOfShards;
+        }
+        return m_Shards[shard];
+    }
+
+    /** The header of the chunk a pooled block was carved from. */
+    static ChunkHeader * GetChunkHeader(void *block)
+    {
+        std::size_t address = reinterpret_cast<std::size_t>(block);
+        return reinterpret_cast<ChunkHeader *>(address & ~(ChunkSize - 1));
+    }
+
+    /** Start carving blocks from a new chunk. Called with the shard locked. */
+    void AddChunk(Shard & shard)
+    {
+        void *chunk = NULL;
+#ifdef _WIN32
+        chunk = _aligned_malloc(ChunkSize, ChunkSize);
+#else
+        if (posix_memalign(&chunk, ChunkSize, ChunkSize) != 0)
+            chunk = NULL;
+#endif
+        if (chunk == NULL)
+            throw std::bad_alloc();
+
+        static_cast<ChunkHeader *>(chunk)->Owner = &shard;
+        shard.Chunks.push_back(static_cast<char *>(chunk));
+        shard.ChunkPosition = shard.Chunks.back() + ChunkHeaderSize;
+        shard.ChunkRemaining = ChunkSize - ChunkHeaderSize;
+    }
+
+    /** Return the chunks of a shard that has no block in use to the heap,
+    * keeping the last one for the next allocations. Called with the shard
+    * locked. */
+    void ReleaseChunks(Shard & shard)
+    {
+        for (std::size_t c = 0; c < shard.FreeLists.size(); c++)
+            std::vector<void *>().swap(shard.FreeLists[c]);
+
+        char *last = shard.Chunks.back();
+        shard.Chunks.pop_back();
+        for (std::size_t i = 0; i < shard.Chunks.size(); i++)
+        {
+#ifdef _WIN32
+            _aligned_free(shard.Chunks[i]);
+#else
+            free(shard.Chunks[i]);
+#endif
+        }
+        std::vector<char *>(1, last).swap(shard.Chunks);
+        shard.ChunkPosition = last + ChunkHeaderSize;
+        shard.ChunkRemaining = ChunkSize - ChunkHeaderSize;
+    }
+
+    std::vector<std::size_t> m_ClassCapacity;
+    Shard m_Shards[NumberOfShards];
+    unsigned int m_NextShard;
+    itk::SimpleFastMutexLock m_ShardMutex;
+
+private:
+    RLESegmentPool(const RLESegmentPool &);   //purposely not implemented
+    void operator=(const RLESegmentPool &);   //purposely not implemented
+};
+
+/** Standard library allocator which draws from the RLESegmentPool.
+* Used as the allocator of RLE lines (RLEImage::RLLine). */
+template< typename T >
+class RLESegmentAllocator
+{
+public:
+    typedef T value_type;
+    typedef RLESegmentPool<sizeof(T)> PoolType;
+
+    RLESegmentAllocator() {}
+
+    template< typename U >
+    RLESegmentAllocator(const RLESegmentAllocator<U> &) {}
+
+    template< typename U >
+    struct rebind { typedef RLESegmentAllocator<U> other; };
+
+    T * allocate(std::size_t n)
+    { return static_cast<T *>(PoolType::GetInstance().Allocate(n)); }
+
+    void deallocate(T *p, std::size_t n)
+    { PoolType::GetInstance().Deallocate(p, n); }
+
+    template< typename U >
+    bool operator==(const RLESegmentAllocator<U> &) const { return true; }
+
+    template< typename U >
+    bool operator!=(const RLESegmentAllocator<U> &) const { return false; }
+};
+
+#endif //RLESegmentPool_h
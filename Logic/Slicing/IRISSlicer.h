@@ -316,9 +316,16 @@ protected:
   virtual void CallCopyOutputRegionToInputRegion(InputImageRegionType &destRegion,
                                                  const OutputImageRegionType &srcRegion) ITK_OVERRIDE;
 
-  void GenerateData() ITK_OVERRIDE;
-  //void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
-  //    itk::ThreadIdType threadId);
+  /** Selects the input (main or preview) and validates the run cache */
+  void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  /**
+    * The output slice is split by ITK along the line direction, and each
+    * thread decodes only the RLE lines (or, for lines running along the
+    * image X axis, only the X range) that map into its portion of the slice.
+    */
+  void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                            itk::ThreadIdType threadId) ITK_OVERRIDE;
 
   /** Uncompresses a RLE line into a buffer pointed by out.
     * After each pixel is written, adds stride to the pointer.
@@ -345,6 +352,56 @@ protected:
         }
   }
 
+  /** Uncompresses the pixels [x0, x1) of a RLE line into a buffer pointed
+    * by out, adding stride to the pointer after each pixel is written. */
+  inline void uncompressLineRange(const typename InputImageType::RLLine & line,
+                                  long x0, long x1, TPixel *out, long stride)
+  {
+    // Skip the runs that lie entirely before x0
+    long t = 0;
+    size_t x = 0;
+    while (x < line.size() && t + line[x].first <= x0)
+      t += line[x++].first;
+
+    // Write out the remaining runs, clipped to the range
+    for (long i = x0; x < line.size() && i < x1; x++)
+      {
+      long tEnd = std::min(t + (long) line[x].first, x1);
+      for (; i < tEnd; i++)
+        {
+        *out = line[x].second;
+        out += stride;
+        }
+      t += line[x].first;
+      }
+  }
+
+  /** Position of a run within a RLE line: run index and first pixel */
+  struct RunCursor
+  {
+    long Run, Start;
+    RunCursor() : Run(0), Start(0) {}
+  };
+
+  /** Look up the value of pixel x in a line, starting the search from the
+    * cursor (which is updated). When scrolling through X slices the target
+    * pixel moves by one, so the search typically takes a single step. */
+  inline const TPixel & lookupUsingCursor(const typename InputImageType::RLLine & line,
+                                          long x, RunCursor &cursor)
+  {
+    // The cursor is stale if the line has been edited to have fewer runs
+    if (cursor.Run >= (long) line.size())
+      cursor = RunCursor();
+
+    while (x < cursor.Start)
+      cursor.Start -= line[--cursor.Run].first;
+
+    while (cursor.Start + line[cursor.Run].first <= x)
+      cursor.Start += line[cursor.Run++].first;
+
+    return line[cursor.Run].second;
+  }
+
 private:
   IRISSlicer(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -370,6 +427,14 @@ private:
   // Whether the main input should always be bypassed
   bool m_BypassMainInput;
 
+  // The input (main or preview) selected for the current update
+  const InputImageType *m_ActiveInput;
+
+  // Per-line run cursors used when slicing along the X axis, indexed by
+  // y + z * sizeY. They remain valid as long as the input is unmodified.
+  std::vector<RunCursor> m_RunCursorCache;
+  const InputImageType *m_RunCursorCacheInput;
+  unsigned long m_RunCursorCacheMTime;
 };
 
 #ifndef ITK_MANUAL_INSTANTIATION
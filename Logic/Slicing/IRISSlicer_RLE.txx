@@ -40,7 +40,7 @@
 #include "itkVectorImageToImageAdaptor.h"
 
 //now goes version specialized for RLEImage
-//The only difference is ThreadedGenerateData method
+//The only difference is (Before)ThreadedGenerateData methods
 template< typename TPixel, typename CounterType, class TOutputImage, class TPreviewImage>
 IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
 ::IRISSlicer()
@@ -65,6 +65,11 @@ IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
 
   // Initialize to a zero slice index
   m_SliceIndex = 0;
+
+  m_BypassMainInput = false;
+  m_ActiveInput = NULL;
+  m_RunCursorCacheInput = NULL;
+  m_RunCursorCacheMTime = 0;
 }
 
 template< typename TPixel, typename CounterType, class TOutputImage, class TPreviewImage>
@@ -201,22 +206,47 @@ void IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
 
 template< typename TPixel, typename CounterType, class TOutputImage, class TPreviewImage>
 void IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
-::GenerateData()
+::BeforeThreadedGenerateData()
 {
-  // Here's the input and output
-  const InputImageType *inputPtr = this->GetInput();
-  OutputImageType *outputPtr = this->GetOutput();
+  // Here's the input
+  m_ActiveInput = this->GetInput();
 
   // Decide if we want to use the preview input instead
   const InputImageType *preview =
       (InputImageType *) this->GetInputs()[1].GetPointer();
 
-  if (preview && preview->GetMTime() > inputPtr->GetMTime())
+  if (preview && preview->GetMTime() > m_ActiveInput->GetMTime())
     {
-    inputPtr = preview;
+    m_ActiveInput = preview;
+    }
+
+  // The run cursors are only needed when slicing along x. They are reset
+  // whenever the input changes, otherwise they are reused from the previous
+  // slice, which is typically one pixel away
+  if (m_SliceDirectionImageAxis == 0)
+    {
+    size_t nLines = m_ActiveInput->GetBufferedRegion().GetSize(1)
+        * m_ActiveInput->GetBufferedRegion().GetSize(2);
+
+    if (m_RunCursorCacheInput != m_ActiveInput
+        || m_RunCursorCacheMTime != m_ActiveInput->GetMTime()
+        || m_RunCursorCache.size() != nLines)
+      {
+      m_RunCursorCache.assign(nLines, RunCursor());
+      m_RunCursorCacheInput = m_ActiveInput;
+      m_RunCursorCacheMTime = m_ActiveInput->GetMTime();
+      }
     }
+}
 
-  this->AllocateOutputs();
+template< typename TPixel, typename CounterType, class TOutputImage, class TPreviewImage>
+void IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread,
+                       itk::ThreadIdType itkNotUsed(threadId))
+{
+  // Here's the input and output
+  const InputImageType *inputPtr = m_ActiveInput;
+  OutputImageType *outputPtr = this->GetOutput();
 
   // Important: the size needs to be cast to long to avoid problems with
   // pointer arithmetic on some MSVC versions!
@@ -240,79 +270,92 @@ void IRISSlicer<RLEImage<TPixel, 3, CounterType>, TOutputImage, TPreviewImage>
 
   typename OutputImageType::PixelType *outSlice = &outputPtr->GetPixel(oStartInd);
 
+  // The range of output lines assigned to this thread, converted to the
+  // range [l0, l1) of the corresponding image coordinate
+  long r0 = outputRegionForThread.GetIndex(1) - outputPtr->GetBufferedRegion().GetIndex(1);
+  long r1 = r0 + outputRegionForThread.GetSize(1);
+  long l0 = (m_LineTraverseForward) ? r0 : szSlice[1] - r1;
+  long l1 = (m_LineTraverseForward) ? r1 : szSlice[1] - r0;
+
   if (m_SliceDirectionImageAxis == 2) //slicing along z
     {
-#pragma omp parallel for
-    for (int y = 0; y < szVol[1]; y++)
+    if (m_LineDirectionImageAxis == 1) //y is line coordinate
       {
-      typename InputImageType::BufferType::IndexType lineIndex = { { y, (int) m_SliceIndex } };
-      const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
-      if (m_LineDirectionImageAxis == 1) //y is line coordinate
+      assert(m_PixelDirectionImageAxis == 0); //x is pixel coordinate
+      for (long y = l0; y < l1; y++)
         {
-        assert(m_PixelDirectionImageAxis == 0); //x is pixel coordinate
+        typename InputImageType::BufferType::IndexType lineIndex = { { y, (int) m_SliceIndex } };
+        const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
         uncompressLine(line, outSlice + s_line*y*szVol[0], s_pixel * 1);
         }
-      else if (m_LineDirectionImageAxis == 0) //x is line coordinate
+      }
+    else if (m_LineDirectionImageAxis == 0) //x is line coordinate
+      {
+      assert(m_PixelDirectionImageAxis == 1); //y is pixel coordinate
+      for (long y = 0; y < szVol[1]; y++)
         {
-        assert(m_PixelDirectionImageAxis == 1); //y is pixel coordinate
-        uncompressLine(line, outSlice + s_pixel*y, s_line*szVol[1]);
+        typename InputImageType::BufferType::IndexType lineIndex = { { y, (int) m_SliceIndex } };
+        const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
+        uncompressLineRange(line, l0, l1, outSlice + s_pixel*y + s_line*l0*szVol[1], s_line*szVol[1]);
         }
-      else
-        throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 2!", __FUNCTION__);
       }
+    else
+      throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 2!", __FUNCTION__);
     }
   else if (m_SliceDirectionImageAxis == 1) //slicing along y
     {
-#pragma omp parallel for
-    for (int z = 0; z < szVol[2]; z++)
+    if (m_LineDirectionImageAxis == 2) //z is line coordinate
       {
-      typename InputImageType::BufferType::IndexType lineIndex = { { (int) m_SliceIndex, z } };
-      const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
-      if (m_LineDirectionImageAxis == 2) //z is line coordinate
+      assert(m_PixelDirectionImageAxis == 0); //x is pixel coordinate
+      for (long z = l0; z < l1; z++)
         {
-        assert(m_PixelDirectionImageAxis == 0); //x is pixel coordinate
+        typename InputImageType::BufferType::IndexType lineIndex = { { (int) m_SliceIndex, z } };
+        const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
         uncompressLine(line, outSlice + s_line*z*szVol[0], s_pixel * 1);
         }
-      else if (m_LineDirectionImageAxis == 0) //x is line coordinate
+      }
+    else if (m_LineDirectionImageAxis == 0) //x is line coordinate
+      {
+      assert(m_PixelDirectionImageAxis == 2); //z is pixel coordinate
+      for (long z = 0; z < szVol[2]; z++)
         {
-        assert(m_PixelDirectionImageAxis == 2); //z is pixel coordinate
-        uncompressLine(line, outSlice + s_pixel*z, s_line*szVol[2]);
+        typename InputImageType::BufferType::IndexType lineIndex = { { (int) m_SliceIndex, z } };
+        const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
+        uncompressLineRange(line, l0, l1, outSlice + s_pixel*z + s_line*l0*szVol[2], s_line*szVol[2]);
         }
-      else
-        throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 1!", __FUNCTION__);
       }
+    else
+      throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 1!", __FUNCTION__);
     }
   else //slicing along x, the low-preformance case
     {
     assert(m_SliceDirectionImageAxis == 0);
-#pragma omp parallel for
-    for (int z = 0; z < szVol[2]; z++)
-      for (int y = 0; y < szVol[1]; y++)
-        {
-        typename InputImageType::BufferType::IndexType lineIndex = { { y, z } };
-        const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
-        int t = 0;
-        for (int x = 0; x < line.size(); x++)
+    if (m_LineDirectionImageAxis == 2) //z is line coordinate
+      {
+      assert(m_PixelDirectionImageAxis == 1); //y is pixel coordinate
+      for (long z = l0; z < l1; z++)
+        for (long y = 0; y < szVol[1]; y++)
           {
-          t += line[x].first;
-          if (t > m_SliceIndex)
-            {
-            if (m_LineDirectionImageAxis == 2) //z is line coordinate
-              {
-              assert(m_PixelDirectionImageAxis == 1); //y is pixel coordinate
-              *(outSlice + s_line*z*szVol[1] + s_pixel *y) = line[x].second;;
-              }
-            else if (m_LineDirectionImageAxis == 1) //y is line coordinate
-              {
-              assert(m_PixelDirectionImageAxis == 2); //z is pixel coordinate
-              *(outSlice + s_pixel*z + s_line *y*szVol[2]) = line[x].second;
-              }
-            else
-              throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 0!", __FUNCTION__);
-            break;
-            }
+          typename InputImageType::BufferType::IndexType lineIndex = { { y, z } };
+          const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
+          *(outSlice + s_line*z*szVol[1] + s_pixel*y) =
+              lookupUsingCursor(line, m_SliceIndex, m_RunCursorCache[y + z * szVol[1]]);
           }
-        }
+      }
+    else if (m_LineDirectionImageAxis == 1) //y is line coordinate
+      {
+      assert(m_PixelDirectionImageAxis == 2); //z is pixel coordinate
+      for (long y = l0; y < l1; y++)
+        for (long z = 0; z < szVol[2]; z++)
+          {
+          typename InputImageType::BufferType::IndexType lineIndex = { { y, z } };
+          const typename InputImageType::RLLine & line = inputPtr->GetBuffer()->GetPixel(lineIndex);
+          *(outSlice + s_pixel*z + s_line*y*szVol[2]) =
+              lookupUsingCursor(line, m_SliceIndex, m_RunCursorCache[y + z * szVol[1]]);
+          }
+      }
+    else
+      throw itk::ExceptionObject(__FILE__, __LINE__, "SliceDirectionImageAxis and SliceDirectionImageAxis cannot both have a value of 0!", __FUNCTION__);
     }
 }
 
@@ -188,15 +188,31 @@ public:
   typedef RLEImage<TPixel, 3, CounterType> InputImageType;
   typedef typename TOutputImage::InternalPixelType OutputComponentType;
 
-  NonOrthogonalSlicerPixelAccessTraitsWorker(InputImageType *adaptor) {}
+  NonOrthogonalSlicerPixelAccessTraitsWorker(InputImageType *image)
+    : m_Image(image), m_Region(image->GetBufferedRegion()) {}
   ~NonOrthogonalSlicerPixelAccessTraitsWorker() {}
 
+  // Labels are never interpolated, so nearest neighbor is always used. The
+  // lookup in the RLE line is a binary search if the image has a run index.
   inline void ProcessVoxel(double *cix, bool use_nn, OutputComponentType **out_ptr)
   {
-    assert(0);
+    typename InputImageType::IndexType idx;
+    for(unsigned int d = 0; d < 3; d++)
+      idx[d] = (itk::IndexValueType) std::floor(cix[d] + 0.5);
+
+    *(*out_ptr)++ = m_Region.IsInside(idx)
+        ? static_cast<OutputComponentType>(m_Image->GetPixel(idx)) : 0;
   }
 
-  inline void SkipVoxels(int n, OutputComponentType **out_ptr) {}
+  inline void SkipVoxels(int n, OutputComponentType **out_ptr)
+  {
+    for(int i = 0; i < n; i++)
+      *(*out_ptr)++ = 0;
+  }
+
+protected:
+  InputImageType *m_Image;
+  typename InputImageType::RegionType m_Region;
 };
 
 
@@ -0,0 +1,246 @@
+#include "LayerCache.h"
+#include "ParallelFileUploader.h"
+#include "IRISException.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+using itksys::SystemTools;
+
+std::string LayerCache::m_Directory;
+unsigned long long LayerCache::m_MaximumSize = 8ull << 30;
+
+// Guards the counter of temporary files and the pruning of the store
+static itk::SimpleFastMutexLock &LayerCacheMutex()
+{
+  static itk::SimpleFastMutexLock *mutex = new itk::SimpleFastMutexLock();
+  return *mutex;
+}
+
+// A name that no other thread or process writes to at the same time
+static std::string TemporaryFileName(const std::string &target)
+{
+  static unsigned long counter = 0;
+  std::ostringstream oss;
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(LayerCacheMutex());
+  oss << target << ".tmp" << getpid() << "_" << counter++;
+  return oss.str();
+}
+
+void
+LayerCache::SetDirectory(const std::string &dir)
+{
+  m_Directory = dir;
+}
+
+std::string
+LayerCache::GetDirectory()
+{
+  return m_Directory;
+}
+
+std::string
+LayerCache::GetDefaultDirectory()
+{
+  std::vector<std::string> split_path;
+  SystemTools::SplitPath("~/.alfabis/layers", split_path, true);
+  return SystemTools::JoinPath(split_path);
+}
+
+void
+LayerCache::SetMaximumSize(unsigned long long bytes)
+{
+  m_MaximumSize = bytes;
+}
+
+unsigned long long
+LayerCache::GetMaximumSize()
+{
+  return m_MaximumSize;
+}
+
+std::string
+LayerCache::GetContentFileName(const std::string &md5)
+{
+  return GetDirectory() + "/" + md5;
+}
+
+std::string
+LayerCache::GetKeyFileName(const std::string &key)
+{
+  return GetDirectory() + "/" + key + ".key";
+}
+
+// Content files are named by their MD5 alone
+static bool IsContentFileName(const std::string &name)
+{
+  return name.length() == 32
+      && name.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+std::string
+LayerCache::FindContent(const std::string &md5)
+{
+  if(GetDirectory().empty() || !IsContentFileName(md5))
+    return std::string();
+
+  std::string fn = GetContentFileName(md5);
+  if(!SystemTools::FileExists(fn.c_str()))
+    return std::string();
+
+  // A damaged file is removed, so that it is replaced the next time
+  std::string md5_found;
+  try
+    {
+    md5_found = ParallelFileUploader::ComputeFileMD5(fn.c_str());
+    }
+  catch(IRISException &)
+    {
+    return std::string();
+    }
+
+  if(md5_found != md5)
+    {
+    SystemTools::RemoveFile(fn.c_str());
+    return std::string();
+    }
+
+  return fn;
+}
+
+bool
+LayerCache::CopyIntoPlace(const std::string &source, const std::string &target)
+{
+  std::string fn_tmp = TemporaryFileName(target);
+
+  if(!SystemTools::CopyFileAlways(source.c_str(), fn_tmp.c_str()))
+    {
+    SystemTools::RemoveFile(fn_tmp.c_str());
+    return false;
+    }
+
+  SystemTools::RemoveFile(target.c_str());
+  if(!SystemTools::RenameFile(fn_tmp.c_str(), target.c_str()))
+    {
+    SystemTools::RemoveFile(fn_tmp.c_str());
+    return false;
+    }
+
+  return true;
+}
+
+bool
+LayerCache::WriteIntoPlace(const std::string &text, const std::string &target)
+{
+  std::string fn_tmp = TemporaryFileName(target);
+
+  std::ofstream ofs(fn_tmp.c_str());
+  ofs << text << "\n";
+  ofs.close();
+  if(!ofs)
+    {
+    SystemTools::RemoveFile(fn_tmp.c_str());
+    return false;
+    }
+
+  SystemTools::RemoveFile(target.c_str());
+  return SystemTools::RenameFile(fn_tmp.c_str(), target.c_str());
+}
+
+bool
+LayerCache::AddContent(const std::string &md5, const std::string &filename)
+{
+  if(GetDirectory().empty() || !IsContentFileName(md5)
+     || !SystemTools::MakeDirectory(GetDirectory().c_str()))
+    return false;
+
+  std::string fn = GetContentFileName(md5);
+  if(!SystemTools::FileExists(fn.c_str()) && !CopyIntoPlace(filename, fn))
+    return false;
+
+  Prune();
+  return true;
+}
+
+std::string
+LayerCache::FindLayer(const std::string &key)
+{
+  if(GetDirectory().empty())
+    return std::string();
+
+  std::ifstream ifs(GetKeyFileName(key).c_str());
+  std::string md5;
+  if(!(ifs >> md5))
+    return std::string();
+
+  return FindContent(md5);
+}
+
+bool
+LayerCache::AddLayer(const std::string &key, const std::string &filename)
+{
+  if(GetDirectory().empty())
+    return false;
+
+  std::string md5;
+  try
+    {
+    md5 = ParallelFileUploader::ComputeFileMD5(filename.c_str());
+    }
+  catch(IRISException &)
+    {
+    return false;
+    }
+
+  return AddContent(md5, filename) && WriteIntoPlace(md5, GetKeyFileName(key));
+}
+
+void
+LayerCache::Prune()
+{
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(LayerCacheMutex());
+
+  // The keys are small, and a key whose file is gone is simply not found,
+  // so only the content files are counted
+  typedef std::pair<long, std::string> AgedFile;
+  std::vector<AgedFile> files;
+  unsigned long long total = 0;
+
+  itksys::Directory dir;
+  if(!dir.Load(GetDirectory().c_str()))
+    return;
+
+  for(unsigned long i = 0; i < dir.GetNumberOfFiles(); i++)
+    {
+    std::string name = dir.GetFile(i);
+    if(!IsContentFileName(name))
+      continue;
+
+    std::string fn = GetDirectory() + "/" + name;
+    total += SystemTools::FileLength(fn.c_str());
+    files.push_back(std::make_pair(SystemTools::ModifiedTime(fn.c_str()), fn));
+    }
+
+  if(total <= m_MaximumSize)
+    return;
+
+  std::sort(files.begin(), files.end());
+  for(size_t i = 0; i < files.size() && total > m_MaximumSize; i++)
+    {
+    total -= SystemTools::FileLength(files[i].second.c_str());
+    SystemTools::RemoveFile(files[i].second.c_str());
+    }
+}
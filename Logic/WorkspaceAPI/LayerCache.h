@@ -0,0 +1,75 @@
+#ifndef LAYERCACHE_H
+#define LAYERCACHE_H
+
+#include <string>
+
+/**
+  A local store of the layer files that workspaces have been exported to and
+  downloaded as. Files are stored under the MD5 of their contents, so that a
+  file can be found from the hash the server reports for it.
+
+  Exported layers are also indexed by a key formed from the hash of the voxel
+  data and the geometry of the image. A layer that has not changed since it
+  was last exported is then copied from the store instead of being compressed
+  again, and since the copy has the same bytes as the file uploaded before,
+  the server can recognize it by its MD5 and need not receive it again.
+
+  The store is off until a directory is set, since it keeps a copy of every
+  layer exported or downloaded. WorkspaceTool turns it on with the
+  -dss-layer-cache option.
+
+  When the files in the store take up more than the maximum size, the files
+  stored longest ago are removed. The store is shared by all the threads and
+  processes that use it; files are written under temporary names and renamed
+  into place, so that a reader never sees a partial file.
+  */
+class LayerCache
+{
+public:
+
+  /**
+   * Set the directory of the store. An empty string, the default, turns the
+   * store off
+   */
+  static void SetDirectory(const std::string &dir);
+  static std::string GetDirectory();
+
+  /** The usual place of the store, ~/.alfabis/layers, next to the server settings */
+  static std::string GetDefaultDirectory();
+
+  /** Total size of the stored files above which old files are removed */
+  static void SetMaximumSize(unsigned long long bytes);
+  static unsigned long long GetMaximumSize();
+
+  /**
+   * Find the stored file with the given MD5. Returns an empty string if there
+   * is none. The contents of the file are checked against the MD5
+   */
+  static std::string FindContent(const std::string &md5);
+
+  /** Store a copy of a file whose MD5 the caller has computed or checked */
+  static bool AddContent(const std::string &md5, const std::string &filename);
+
+  /** Find the stored file of an exported layer. Empty if there is none */
+  static std::string FindLayer(const std::string &key);
+
+  /** Store a copy of an exported layer under its key */
+  static bool AddLayer(const std::string &key, const std::string &filename);
+
+protected:
+
+  static std::string GetContentFileName(const std::string &md5);
+  static std::string GetKeyFileName(const std::string &key);
+
+  // Write a file under a temporary name and move it into place
+  static bool CopyIntoPlace(const std::string &source, const std::string &target);
+  static bool WriteIntoPlace(const std::string &text, const std::string &target);
+
+  // Remove the oldest files until the store fits in the maximum size
+  static void Prune();
+
+  static std::string m_Directory;
+  static unsigned long long m_MaximumSize;
+};
+
+#endif // LAYERCACHE_H
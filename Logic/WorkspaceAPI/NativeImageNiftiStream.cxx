@@ -0,0 +1,199 @@
+#include "NativeImageNiftiStream.h"
+#include "GuidedNativeImageIO.h"
+#include "IRISException.h"
+#include "itkVectorImage.h"
+#include "nifti1_io.h"
+#include <algorithm>
+#include <cstring>
+
+// Size of the header and of the extension flag that follows it
+static const size_t NIFTI_HEADER_SIZE = 348;
+static const size_t NIFTI_VOX_OFFSET = 352;
+
+// Buffer of the native image, which is a vector image of the native type
+template <class TNative>
+static const unsigned char *GetNativeBuffer(GuidedNativeImageIO *io, size_t &component_size)
+{
+  typedef itk::VectorImage<TNative, 3> ImageType;
+  ImageType *image = static_cast<ImageType *>(io->GetNativeImage());
+  component_size = sizeof(TNative);
+  return reinterpret_cast<const unsigned char *>(image->GetBufferPointer());
+}
+
+// NIfTI datatype of an integral type of the given size
+static int GetNiftiIntegerType(size_t size, bool is_signed)
+{
+  switch(size)
+    {
+    case 1: return is_signed ? DT_INT8 : DT_UINT8;
+    case 2: return is_signed ? DT_INT16 : DT_UINT16;
+    case 4: return is_signed ? DT_INT32 : DT_UINT32;
+    default: return is_signed ? DT_INT64 : DT_UINT64;
+    }
+}
+
+NativeImageNiftiStream::NativeImageNiftiStream(GuidedNativeImageIO *io)
+{
+  if(!io->IsNativeImageLoaded() || io->IsNativeImageStreamed())
+    throw IRISException("Error: The image to export is not held in memory.");
+
+  m_IO = io;
+  m_Position = 0;
+
+  // Find the voxel data and the NIfTI type of the components
+  int datatype;
+  switch(io->GetComponentTypeInNativeImage())
+    {
+    case itk::ImageIOBase::UCHAR:
+      m_Data = GetNativeBuffer<unsigned char>(io, m_ComponentSize);
+      datatype = DT_UINT8;
+      break;
+    case itk::ImageIOBase::CHAR:
+      m_Data = GetNativeBuffer<signed char>(io, m_ComponentSize);
+      datatype = DT_INT8;
+      break;
+    case itk::ImageIOBase::USHORT:
+      m_Data = GetNativeBuffer<unsigned short>(io, m_ComponentSize);
+      datatype = DT_UINT16;
+      break;
+    case itk::ImageIOBase::SHORT:
+      m_Data = GetNativeBuffer<short>(io, m_ComponentSize);
+      datatype = DT_INT16;
+      break;
+    case itk::ImageIOBase::UINT:
+      m_Data = GetNativeBuffer<unsigned int>(io, m_ComponentSize);
+      datatype = GetNiftiIntegerType(m_ComponentSize, false);
+      break;
+    case itk::ImageIOBase::INT:
+      m_Data = GetNativeBuffer<int>(io, m_ComponentSize);
+      datatype = GetNiftiIntegerType(m_ComponentSize, true);
+      break;
+    case itk::ImageIOBase::ULONG:
+      m_Data = GetNativeBuffer<unsigned long>(io, m_ComponentSize);
+      datatype = GetNiftiIntegerType(m_ComponentSize, false);
+      break;
+    case itk::ImageIOBase::LONG:
+      m_Data = GetNativeBuffer<long>(io, m_ComponentSize);
+      datatype = GetNiftiIntegerType(m_ComponentSize, true);
+      break;
+    case itk::ImageIOBase::FLOAT:
+      m_Data = GetNativeBuffer<float>(io, m_ComponentSize);
+      datatype = DT_FLOAT32;
+      break;
+    case itk::ImageIOBase::DOUBLE:
+      m_Data = GetNativeBuffer<double>(io, m_ComponentSize);
+      datatype = DT_FLOAT64;
+      break;
+    default:
+      throw IRISException("Error: Unsupported voxel type in the image to export.");
+    }
+
+  m_Components = io->GetNumberOfComponentsInNativeImage();
+  m_Voxels = io->GetNativeImage()->GetBufferedRegion().GetNumberOfPixels();
+  m_DataSize = (unsigned long long) m_Voxels * m_Components * m_ComponentSize;
+
+  this->BuildHeader(io, datatype);
+}
+
+void NativeImageNiftiStream::BuildHeader(GuidedNativeImageIO *io, int datatype)
+{
+  itk::ImageBase<3> *image = io->GetNativeImage();
+  itk::ImageBase<3>::SizeType size = image->GetBufferedRegion().GetSize();
+  itk::ImageBase<3>::SpacingType spacing = image->GetSpacing();
+  itk::ImageBase<3>::PointType origin = image->GetOrigin();
+  itk::ImageBase<3>::DirectionType dir = image->GetDirection();
+
+  nifti_image *nim = nifti_simple_init_nim();
+
+  // A multi-component image is stored as a vector at each voxel of a single
+  // time point, which is how the NIfTI ImageIO writes vector images
+  nim->ndim = nim->dim[0] = (m_Components > 1) ? 5 : 3;
+  nim->nx = nim->dim[1] = (int) size[0];
+  nim->ny = nim->dim[2] = (int) size[1];
+  nim->nz = nim->dim[3] = (int) size[2];
+  nim->nt = nim->dim[4] = 1;
+  nim->nu = nim->dim[5] = (int) m_Components;
+  nim->nvox = m_Voxels * m_Components;
+  nim->dx = nim->pixdim[1] = (float) spacing[0];
+  nim->dy = nim->pixdim[2] = (float) spacing[1];
+  nim->dz = nim->pixdim[3] = (float) spacing[2];
+  if(m_Components > 1)
+    nim->intent_code = NIFTI_INTENT_VECTOR;
+
+  nim->datatype = datatype;
+  nim->nbyper = (int) m_ComponentSize;
+  nim->scl_slope = 1.0f;
+  nim->scl_inter = 0.0f;
+  nim->xyz_units = NIFTI_UNITS_MM;
+  nim->time_units = NIFTI_UNITS_SEC;
+  nim->nifti_type = NIFTI_FTYPE_NIFTI1_1;
+  nim->iname_offset = NIFTI_VOX_OFFSET;
+
+  // The NIfTI world coordinates are RAS, while ITK's are LPS
+  mat44 m;
+  memset(&m, 0, sizeof(m));
+  for(unsigned int i = 0; i < 3; i++)
+    {
+    double flip = (i < 2) ? -1.0 : 1.0;
+    for(unsigned int j = 0; j < 3; j++)
+      m.m[i][j] = (float) (flip * dir(i, j) * spacing[j]);
+    m.m[i][3] = (float) (flip * origin[i]);
+    }
+  m.m[3][3] = 1.0f;
+
+  nim->qform_code = nim->sform_code = NIFTI_XFORM_SCANNER_ANAT;
+  nim->sto_xyz = m;
+  nim->sto_ijk = nifti_mat44_inverse(m);
+  nifti_mat44_to_quatern(m,
+                         &nim->quatern_b, &nim->quatern_c, &nim->quatern_d,
+                         &nim->qoffset_x, &nim->qoffset_y, &nim->qoffset_z,
+                         NULL, NULL, NULL, &nim->qfac);
+  nim->qto_xyz = nifti_quatern_to_mat44(
+        nim->quatern_b, nim->quatern_c, nim->quatern_d,
+        nim->qoffset_x, nim->qoffset_y, nim->qoffset_z,
+        nim->dx, nim->dy, nim->dz, nim->qfac);
+  nim->qto_ijk = nifti_mat44_inverse(nim->qto_xyz);
+
+  nifti_1_header hdr = nifti_convert_nim2nhdr(nim);
+  nifti_image_free(nim);
+
+  // The header is followed by four zero bytes, meaning no extensions
+  m_Header.assign(NIFTI_VOX_OFFSET, 0);
+  memcpy(&m_Header[0], &hdr, NIFTI_HEADER_SIZE);
+}
+
+size_t NativeImageNiftiStream::Read(unsigned char *buffer, size_t n)
+{
+  size_t done = 0;
+  while(done < n && m_Position < this->GetSize())
+    {
+    size_t k;
+    if(m_Position < m_Header.size())
+      {
+      // Header
+      k = std::min(n - done, (size_t) (m_Header.size() - m_Position));
+      memcpy(buffer + done, &m_Header[m_Position], k);
+      }
+    else if(m_Components == 1)
+      {
+      // Voxel data, stored the same way in memory and in the file
+      unsigned long long offset = m_Position - m_Header.size();
+      k = (size_t) std::min((unsigned long long) (n - done), m_DataSize - offset);
+      memcpy(buffer + done, m_Data + offset, k);
+      }
+    else
+      {
+      // Component c of voxel v, with the components stored one after the
+      // other in the file and next to each other in memory
+      unsigned long long offset = m_Position - m_Header.size();
+      unsigned long long element = offset / m_ComponentSize;
+      size_t byte = (size_t) (offset % m_ComponentSize);
+      size_t c = (size_t) (element / m_Voxels), v = (size_t) (element % m_Voxels);
+      k = std::min(n - done, m_ComponentSize - byte);
+      memcpy(buffer + done, m_Data + (v * m_Components + c) * m_ComponentSize + byte, k);
+      }
+    done += k;
+    m_Position += k;
+    }
+  return done;
+}
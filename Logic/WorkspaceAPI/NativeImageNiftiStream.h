@@ -0,0 +1,53 @@
+#ifndef NATIVEIMAGENIFTISTREAM_H
+#define NATIVEIMAGENIFTISTREAM_H
+
+#include "ParallelGzipCompressor.h"
+#include "SNAPCommon.h"
+#include <vector>
+
+class GuidedNativeImageIO;
+
+/**
+  Produces the bytes of a NIfTI file holding the native image of an IO
+  object, straight from the image in memory. The file is the one the NIfTI
+  ImageIO writes: a single-file header in the byte order of this machine,
+  the geometry in both the qform and the sform, and the components of a
+  multi-component image stored one after the other, as a vector intent. This
+  lets a layer be compressed as it is exported, without being written out
+  uncompressed and read back first.
+
+  The IO object must hold the whole native image in memory, i.e., the image
+  must not be streamed, and it must be kept until the stream has been read.
+  */
+class NativeImageNiftiStream : public ParallelGzipCompressor::InputStream
+{
+public:
+
+  NativeImageNiftiStream(GuidedNativeImageIO *io);
+
+  virtual size_t Read(unsigned char *buffer, size_t n);
+
+  /** Total size of the file, in bytes */
+  unsigned long long GetSize() const
+    { return m_Header.size() + m_DataSize; }
+
+protected:
+
+  // Fill in the header of the file
+  void BuildHeader(GuidedNativeImageIO *io, int datatype);
+
+  SmartPtr<GuidedNativeImageIO> m_IO;
+
+  // Header and extension flag
+  std::vector<unsigned char> m_Header;
+
+  // The voxel data, with the components of each voxel next to each other
+  const unsigned char *m_Data;
+  unsigned long long m_DataSize;
+  size_t m_ComponentSize, m_Components, m_Voxels;
+
+  // Number of bytes of the file read so far
+  unsigned long long m_Position;
+};
+
+#endif // NATIVEIMAGENIFTISTREAM_H
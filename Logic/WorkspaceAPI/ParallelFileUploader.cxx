@@ -0,0 +1,347 @@
+#include "ParallelFileUploader.h"
+#include "IRISException.h"
+#include "itkMutexLockHolder.h"
+#include "itksys/MD5.h"
+#include "itksys/SystemTools.hxx"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+
+using namespace std;
+using itksys::SystemTools;
+
+typedef itk::MutexLockHolder<itk::SimpleFastMutexLock> UploaderLockHolder;
+
+// Time to wait before sending a failed file again, multiplied by the number
+// of attempts made so far
+static const unsigned int UploadRetryDelay = 250;
+
+// The body of a response, without the white space around it
+static string TrimResponse(const char *output)
+{
+  string text = output;
+  size_t first = text.find_first_not_of(" \t\r\n");
+  if(first == string::npos)
+    return string();
+  return text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+}
+
+// Whether a response is an MD5, as 32 hex digits
+static bool IsMD5Response(const string &text)
+{
+  return text.size() == 32
+      && text.find_first_not_of("0123456789abcdefABCDEF") == string::npos;
+}
+
+ParallelFileUploader::ParallelFileUploader()
+{
+  m_NumberOfThreads = 4;
+  m_MaximumAttempts = 3;
+  m_NextFile = 0;
+  m_ThreadsDone = 0;
+  m_Closed = false;
+  m_Aborted = false;
+  m_AskKnown = true;
+}
+
+ParallelFileUploader::~ParallelFileUploader()
+{
+    {
+    UploaderLockHolder holder(m_Mutex);
+    m_Aborted = true;
+    }
+  this->Join();
+}
+
+void ParallelFileUploader::Start(const char *rel_url)
+{
+  m_URL = rel_url;
+
+  // The thread data must not move once the threads are running
+  m_ThreadData.resize(std::max(m_NumberOfThreads, 1));
+  m_Threader = itk::MultiThreader::New();
+  for(size_t i = 0; i < m_ThreadData.size(); i++)
+    {
+    m_ThreadData[i].Self = this;
+    m_ThreadData[i].File = 0;
+    m_ThreadIds.push_back(
+          m_Threader->SpawnThread(&ParallelFileUploader::UploadThreadCallback, &m_ThreadData[i]));
+    }
+}
+
+void ParallelFileUploader::AddFile(const char *filename)
+{
+  FileStatus fs;
+  fs.FileName = filename;
+  fs.Progress = 0.0;
+  fs.Attempts = 0;
+  fs.Known = false;
+
+  UploaderLockHolder holder(m_Mutex);
+  m_Files.push_back(fs);
+}
+
+void ParallelFileUploader::Finish(void *cb_data, ProgressCallbackFunction fn)
+{
+    {
+    UploaderLockHolder holder(m_Mutex);
+    m_Closed = true;
+    }
+
+  // Report progress on this thread until all the threads are done
+  while(true)
+    {
+    double progress = 0.0;
+    bool done;
+      {
+      UploaderLockHolder holder(m_Mutex);
+      for(size_t i = 0; i < m_Files.size(); i++)
+        progress += m_Files[i].Progress;
+      if(m_Files.size())
+        progress /= m_Files.size();
+      done = (m_ThreadsDone == (int) m_ThreadIds.size());
+      }
+
+    if(fn)
+      fn(cb_data, progress);
+
+    if(done)
+      break;
+
+    SystemTools::Delay(50);
+    }
+
+  this->Join();
+
+  if(m_Error.size())
+    throw IRISException("%s", m_Error.c_str());
+
+  for(size_t i = 0; i < m_Files.size(); i++)
+    {
+    cout << "Upload " << m_Files[i].FileName << " (" << m_Files[i].Statistics;
+    if(m_Files[i].Attempts > 1)
+      cout << ", " << m_Files[i].Attempts << " attempts";
+    cout << ")" << endl;
+    }
+}
+
+int ParallelFileUploader::GetNumberOfRetriedFiles() const
+{
+  UploaderLockHolder holder(m_Mutex);
+  int n = 0;
+  for(size_t i = 0; i < m_Files.size(); i++)
+    if(m_Files[i].Attempts > 1)
+      n++;
+  return n;
+}
+
+int ParallelFileUploader::GetNumberOfKnownFiles() const
+{
+  UploaderLockHolder holder(m_Mutex);
+  int n = 0;
+  for(size_t i = 0; i < m_Files.size(); i++)
+    if(m_Files[i].Known)
+      n++;
+  return n;
+}
+
+void ParallelFileUploader::Join()
+{
+  for(size_t i = 0; i < m_ThreadIds.size(); i++)
+    m_Threader->TerminateThread(m_ThreadIds[i]);
+  m_ThreadIds.clear();
+}
+
+string ParallelFileUploader::ComputeFileMD5(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if(!f)
+    throw IRISException("Error: Cannot open file %s for reading.", filename);
+
+  itksysMD5 *md5 = itksysMD5_New();
+  itksysMD5_Initialize(md5);
+
+  vector<unsigned char> buffer(1 << 20);
+  size_t n_read;
+  while((n_read = fread(&buffer[0], 1, buffer.size(), f)) > 0)
+    itksysMD5_Append(md5, &buffer[0], (int) n_read);
+
+  bool failed = (ferror(f) != 0);
+  fclose(f);
+
+  char hex_code[33];
+  hex_code[32] = 0;
+  itksysMD5_FinalizeHex(md5, hex_code);
+  itksysMD5_Delete(md5);
+
+  if(failed)
+    throw IRISException("Error: Failed to read file %s.", filename);
+
+  return hex_code;
+}
+
+void ParallelFileUploader::UploadProgressCallback(void *cb_data, double progress)
+{
+  ThreadData *td = static_cast<ThreadData *>(cb_data);
+  UploaderLockHolder holder(td->Self->m_Mutex);
+  td->Self->m_Files[td->File].Progress = progress;
+}
+
+void ParallelFileUploader::UploadFile(RESTClient *rc, ThreadData *td)
+{
+  string fn;
+    {
+    UploaderLockHolder holder(m_Mutex);
+    fn = m_Files[td->File].FileName;
+    }
+
+  // The server checks the file it receives against this hash
+  std::map<string, string> fields;
+  fields["md5"] = ComputeFileMD5(fn.c_str());
+
+  // The server may have this file from an earlier upload. A server that
+  // does not support the request is not asked again for the other files
+  bool known = false, ask;
+    {
+    UploaderLockHolder holder(m_Mutex);
+    ask = m_AskKnown;
+    }
+  if(ask)
+    {
+    known = rc->UploadFileByHash(m_URL.c_str(), fn.c_str(), fields["md5"].c_str());
+    if(!known && rc->GetHTTPCode() == 404)
+      {
+      UploaderLockHolder holder(m_Mutex);
+      m_AskKnown = false;
+      }
+    }
+
+  if(known)
+    {
+    UploaderLockHolder holder(m_Mutex);
+    m_Files[td->File].Attempts = 1;
+    m_Files[td->File].Progress = 1.0;
+    m_Files[td->File].Known = true;
+    m_Files[td->File].Statistics = "already on the server";
+    return;
+    }
+
+  rc->SetProgressCallback(td, &ParallelFileUploader::UploadProgressCallback);
+  for(int attempt = 1; ; attempt++)
+    {
+      {
+      UploaderLockHolder holder(m_Mutex);
+      m_Files[td->File].Attempts = attempt;
+      m_Files[td->File].Progress = 0.0;
+      }
+
+    // The URL has been expanded already, so no arguments follow the fields.
+    // A server that answers with the MD5 of the file it received has a file
+    // that arrived damaged sent again. Any other successful answer is taken
+    // to mean the file has arrived
+    string error;
+    try
+      {
+      rc->UploadFile(m_URL.c_str(), fn.c_str(), fields);
+      long code = rc->GetHTTPCode();
+      if(code >= 200 && code < 300)
+        {
+        string echoed = TrimResponse(rc->GetOutput());
+        if(!IsMD5Response(echoed) || SystemTools::LowerCase(echoed) == fields["md5"])
+          break;
+        error = "server received MD5 " + echoed + ", expected " + fields["md5"];
+        }
+      else
+        {
+        error = rc->GetResponseText();
+        }
+      }
+    catch(IRISException &exc)
+      {
+      error = exc.what();
+      }
+
+    bool aborted;
+      {
+      UploaderLockHolder holder(m_Mutex);
+      aborted = m_Aborted || m_Error.size();
+      }
+
+    if(attempt >= m_MaximumAttempts || aborted)
+      throw IRISException("Failed to upload file %s (%s)", fn.c_str(), error.c_str());
+
+    cout << "Upload of " << fn << " failed, trying again (" << error << ")" << endl;
+    SystemTools::Delay(UploadRetryDelay * attempt);
+    }
+
+  UploaderLockHolder holder(m_Mutex);
+  m_Files[td->File].Progress = 1.0;
+  m_Files[td->File].Statistics = rc->GetUploadStatistics();
+}
+
+ITK_THREAD_RETURN_TYPE ParallelFileUploader::UploadThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  ThreadData *td = static_cast<ThreadData *>(ti->UserData);
+  ParallelFileUploader *self = td->Self;
+
+  // The client, and the connection it keeps open, serve all the files this
+  // thread sends
+  RESTClient *rc = RESTClientPool::Acquire();
+
+  while(true)
+    {
+    // Claim the next file. Wait if the files to come have not been added yet
+    bool claimed = false, finished = false;
+      {
+      UploaderLockHolder holder(self->m_Mutex);
+      if(self->m_Aborted || self->m_Error.size())
+        finished = true;
+      else if(self->m_NextFile < self->m_Files.size())
+        {
+        td->File = self->m_NextFile++;
+        claimed = true;
+        }
+      else
+        finished = self->m_Closed;
+      }
+
+    if(finished)
+      break;
+
+    if(!claimed)
+      {
+      SystemTools::Delay(20);
+      continue;
+      }
+
+    string error;
+    try
+      {
+      self->UploadFile(rc, td);
+      }
+    catch(IRISException &exc)
+      {
+      error = exc.what();
+      }
+    catch(std::exception &exc)
+      {
+      error = exc.what();
+      }
+
+    if(error.size())
+      {
+      UploaderLockHolder holder(self->m_Mutex);
+      if(self->m_Error.empty())
+        self->m_Error = error;
+      }
+    }
+
+  RESTClientPool::Release(rc);
+
+  UploaderLockHolder holder(self->m_Mutex);
+  self->m_ThreadsDone++;
+  return ITK_THREAD_RETURN_VALUE;
+}
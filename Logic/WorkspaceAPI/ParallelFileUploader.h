@@ -0,0 +1,117 @@
+#ifndef PARALLELFILEUPLOADER_H
+#define PARALLELFILEUPLOADER_H
+
+#include <string>
+#include <vector>
+#include "RESTClient.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+
+/**
+ * This class uploads files to the server on several threads. Files can be
+ * added while earlier files are being sent, so that the upload of a workspace
+ * can start as soon as its first layer has been exported. The threads take
+ * their clients from the RESTClientPool, so the connections to the server are
+ * opened once and reused for all the files.
+ *
+ * The MD5 of each file is sent with it, in the "md5" field of the form, so
+ * that the server can check what it received. Any 2xx answer counts as a
+ * successful upload. A server that answers with the MD5 of the file it
+ * stored has it compared with the MD5 of the file, and an upload whose MD5
+ * does not match counts as failed. Other answers, such as a plain "OK", are
+ * taken as they are. Each file is written in full before it is added, and
+ * is sent from disk as a whole.
+ *
+ * Before a file is sent, the server is asked whether it already has a file
+ * with that MD5, in which case the file is not sent at all. A server that
+ * answers this request with 404 is not asked again. A file whose upload
+ * fails is sent again from the start, up to a maximum number of attempts,
+ * without sending the files that have already arrived.
+ */
+class ParallelFileUploader
+{
+public:
+
+  typedef RESTClient::ProgressCallbackFunction ProgressCallbackFunction;
+
+  ParallelFileUploader();
+
+  /** Stops the uploads that have not started and waits for the others */
+  ~ParallelFileUploader();
+
+  /** Number of files sent at the same time. Default is 4 */
+  void SetNumberOfThreads(int n) { m_NumberOfThreads = n; }
+  int GetNumberOfThreads() const { return m_NumberOfThreads; }
+
+  /** Number of times the upload of a file is tried. Default is 3 */
+  void SetMaximumAttempts(int n) { m_MaximumAttempts = n; }
+  int GetMaximumAttempts() const { return m_MaximumAttempts; }
+
+  /** Start the threads. Files will be sent to the given relative URL */
+  void Start(const char *rel_url);
+
+  /** Add a file to be sent. This can be called from any thread */
+  void AddFile(const char *filename);
+
+  /**
+   * Wait until all the files that were added have been sent. The progress,
+   * as the fraction of the data sent, is passed to the callback on the
+   * calling thread. Throws an exception if a file could not be sent.
+   */
+  void Finish(void *cb_data = NULL, ProgressCallbackFunction fn = NULL);
+
+  /** Number of files that took more than one attempt to send */
+  int GetNumberOfRetriedFiles() const;
+
+  /** Number of files that were not sent because the server had them */
+  int GetNumberOfKnownFiles() const;
+
+  /** Compute the MD5 of the contents of a file, as a hex string */
+  static std::string ComputeFileMD5(const char *filename);
+
+protected:
+
+  // The state of each file added
+  struct FileStatus
+  {
+    std::string FileName, Statistics;
+    double Progress;
+    int Attempts;
+    bool Known;
+  };
+
+  // What the progress callback of each thread needs to find its file
+  struct ThreadData
+  {
+    ParallelFileUploader *Self;
+    size_t File;
+  };
+
+  static ITK_THREAD_RETURN_TYPE UploadThreadCallback(void *arg);
+
+  static void UploadProgressCallback(void *cb_data, double progress);
+
+  // Send one file, trying again if it fails
+  void UploadFile(RESTClient *rc, ThreadData *td);
+
+  // Stop the threads and wait for them
+  void Join();
+
+  int m_NumberOfThreads, m_MaximumAttempts;
+
+  std::string m_URL;
+
+  // Guarded by the mutex
+  std::vector<FileStatus> m_Files;
+  size_t m_NextFile;
+  int m_ThreadsDone;
+  bool m_Closed, m_Aborted, m_AskKnown;
+  std::string m_Error;
+  mutable itk::SimpleFastMutexLock m_Mutex;
+
+  std::vector<ThreadData> m_ThreadData;
+  std::vector<itk::ThreadIdType> m_ThreadIds;
+  itk::MultiThreader::Pointer m_Threader;
+};
+
+#endif // PARALLELFILEUPLOADER_H
@@ -0,0 +1,252 @@
+#include "ParallelGzipCompressor.h"
+#include "IRISException.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+#include "itksys/SystemTools.hxx"
+#include <itk_zlib.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+// Deflate looks back at most this far, so this much of the preceding input
+// is enough to prime each block
+static const size_t GzipWindowSize = 32768;
+
+struct ParallelGzipCompressor::RoundData
+{
+  std::vector<Block> *Blocks;
+  size_t NumberOfBlocks, NextBlock;
+  int Level;
+  itk::SimpleFastMutexLock Mutex;
+};
+
+ParallelGzipCompressor::ParallelGzipCompressor()
+{
+  m_NumberOfThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  m_BlockSize = 1 << 20;
+  m_Level = Z_DEFAULT_COMPRESSION;
+}
+
+void
+ParallelGzipCompressor::CompressBlock(Block &block, int level)
+{
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+
+  // Raw deflate, the gzip header and trailer are written around all blocks
+  block.Failed = (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK);
+  if(block.Failed)
+    return;
+
+  if(block.DictionarySize)
+    deflateSetDictionary(&strm, block.Dictionary, (uInt) block.DictionarySize);
+
+  strm.next_in = block.Input.size() ? &block.Input[0] : NULL;
+  strm.avail_in = (uInt) block.Input.size();
+
+  // Blocks other than the last end on a byte boundary, with no end of
+  // stream marker, so that the next block can be appended to them
+  int flush = block.Last ? Z_FINISH : Z_SYNC_FLUSH;
+  block.Output.resize(deflateBound(&strm, (uLong) block.Input.size()) + 16);
+  size_t have = 0;
+  while(true)
+    {
+    if(have == block.Output.size())
+      block.Output.resize(block.Output.size() * 2);
+
+    strm.next_out = &block.Output[have];
+    strm.avail_out = (uInt) (block.Output.size() - have);
+    int rc = deflate(&strm, flush);
+    have = block.Output.size() - strm.avail_out;
+
+    if(rc == Z_STREAM_ERROR)
+      {
+      block.Failed = true;
+      break;
+      }
+    if(block.Last ? rc == Z_STREAM_END : strm.avail_out > 0)
+      break;
+    }
+
+  block.Output.resize(have);
+  deflateEnd(&strm);
+}
+
+ITK_THREAD_RETURN_TYPE
+ParallelGzipCompressor::CompressThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  RoundData *data = static_cast<RoundData *>(ti->UserData);
+
+  while(true)
+    {
+    size_t i;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      i = data->NextBlock++;
+      }
+    if(i >= data->NumberOfBlocks)
+      break;
+
+    CompressBlock((*data->Blocks)[i], data->Level);
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+// Input stream reading a file
+class GzipFileInputStream : public ParallelGzipCompressor::InputStream
+{
+public:
+  GzipFileInputStream(FILE *f) : m_File(f) {}
+
+  virtual size_t Read(unsigned char *buffer, size_t n)
+  {
+    size_t n_read = fread(buffer, 1, n, m_File);
+    if(ferror(m_File))
+      throw IRISException("Error: Failed to read the file being compressed.");
+    return n_read;
+  }
+
+protected:
+  FILE *m_File;
+};
+
+// Write a 32-bit value in the little-endian order of the gzip format
+static void WriteGzipInt(FILE *f, unsigned long value)
+{
+  unsigned char b[4];
+  for(int i = 0; i < 4; i++)
+    b[i] = (unsigned char) ((value >> (8 * i)) & 0xff);
+  fwrite(b, 1, 4, f);
+}
+
+void
+ParallelGzipCompressor::DoCompress(InputStream *input, FILE *fout)
+{
+  // Minimal gzip header: deflate, no name, no time, unknown OS
+  static const unsigned char header[] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+  fwrite(header, 1, sizeof(header), fout);
+
+  // Each round reads a few blocks per thread, so that the memory used does
+  // not depend on the size of the file
+  int n_threads = std::max(m_NumberOfThreads, 1);
+  std::vector<Block> blocks(2 * n_threads);
+  std::vector<unsigned char> tail;
+
+  uLong crc = crc32(0L, Z_NULL, 0);
+  unsigned long long total = 0;
+  bool done = false;
+
+  // The byte read ahead of each block to find out if the block is the last
+  unsigned char ahead = 0;
+  bool have_ahead = false;
+  while(!done)
+    {
+    // Read the blocks of this round. A block is the last if nothing follows
+    size_t nb = 0;
+    while(nb < blocks.size() && !done)
+      {
+      Block &b = blocks[nb++];
+      b.Input.resize(m_BlockSize);
+      size_t n_read = 0;
+      if(have_ahead)
+        b.Input[n_read++] = ahead;
+      if(n_read < m_BlockSize)
+        n_read += input->Read(&b.Input[n_read], m_BlockSize - n_read);
+      b.Input.resize(n_read);
+
+      have_ahead = (n_read == m_BlockSize && input->Read(&ahead, 1) == 1);
+      done = !have_ahead;
+      b.Last = done;
+      }
+
+    // Prime each block with the end of the input before it
+    for(size_t i = 0; i < nb; i++)
+      {
+      const std::vector<unsigned char> &prev = (i == 0) ? tail : blocks[i-1].Input;
+      blocks[i].DictionarySize = std::min(prev.size(), GzipWindowSize);
+      blocks[i].Dictionary = blocks[i].DictionarySize
+          ? &prev[prev.size() - blocks[i].DictionarySize] : NULL;
+      }
+
+    RoundData data;
+    data.Blocks = &blocks;
+    data.NumberOfBlocks = nb;
+    data.NextBlock = 0;
+    data.Level = m_Level;
+
+    itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+    mt->SetNumberOfThreads((int) std::min((size_t) n_threads, nb));
+    mt->SetSingleMethod(&ParallelGzipCompressor::CompressThreadCallback, &data);
+    mt->SingleMethodExecute();
+
+    // Write the blocks in order. The checksum is of the uncompressed data
+    for(size_t i = 0; i < nb; i++)
+      {
+      Block &b = blocks[i];
+      if(b.Failed)
+        throw IRISException("Error: Failed to compress a block of data.");
+
+      if(b.Input.size())
+        crc = crc32(crc, &b.Input[0], (uInt) b.Input.size());
+      total += b.Input.size();
+
+      if(b.Output.size() && fwrite(&b.Output[0], 1, b.Output.size(), fout) != b.Output.size())
+        throw IRISException("Error: Failed to write compressed data.");
+      }
+
+    const std::vector<unsigned char> &last = blocks[nb-1].Input;
+    tail.assign(last.end() - std::min(last.size(), GzipWindowSize), last.end());
+    }
+
+  // The trailer holds the checksum and the size modulo 2^32
+  WriteGzipInt(fout, crc);
+  WriteGzipInt(fout, (unsigned long) (total & 0xffffffffull));
+}
+
+void
+ParallelGzipCompressor::CompressFile(const char *fn_input, const char *fn_output)
+{
+  FILE *fin = fopen(fn_input, "rb");
+  if(!fin)
+    throw IRISException("Error: Cannot open file %s for reading.", fn_input);
+
+  GzipFileInputStream input(fin);
+  try
+    {
+    this->Compress(&input, fn_output);
+    }
+  catch(...)
+    {
+    fclose(fin);
+    throw;
+    }
+  fclose(fin);
+}
+
+void
+ParallelGzipCompressor::Compress(InputStream *input, const char *fn_output)
+{
+  FILE *fout = fopen(fn_output, "wb");
+  if(!fout)
+    throw IRISException("Error: Cannot open file %s for writing.", fn_output);
+
+  try
+    {
+    this->DoCompress(input, fout);
+    }
+  catch(...)
+    {
+    fclose(fout);
+    itksys::SystemTools::RemoveFile(fn_output);
+    throw;
+    }
+
+  if(fclose(fout) != 0)
+    {
+    itksys::SystemTools::RemoveFile(fn_output);
+    throw IRISException("Error: Failed to write file %s.", fn_output);
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef PARALLELGZIPCOMPRESSOR_H
+#define PARALLELGZIPCOMPRESSOR_H
+
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+#include "itkMultiThreader.h"
+
+/**
+ * This class compresses a file into a standard gzip file on several threads.
+ * The input is cut into blocks that are deflated independently, each primed
+ * with the end of the block before it, and the compressed blocks are joined
+ * into a single deflate stream, like pigz does. The result can be read by
+ * any gzip reader, including the one in the NIfTI library. The input is
+ * either a file or an InputStream, which produces the data as they are
+ * compressed, so that they need not be written out first.
+ */
+class ParallelGzipCompressor
+{
+public:
+
+  /** Source of the data to compress */
+  class InputStream
+  {
+  public:
+    virtual ~InputStream() {}
+
+    /** Copy up to n bytes into buffer. Returns fewer only at the end */
+    virtual size_t Read(unsigned char *buffer, size_t n) = 0;
+  };
+
+  ParallelGzipCompressor();
+
+  /** Number of threads compressing blocks. Default is the ITK default */
+  void SetNumberOfThreads(int n) { m_NumberOfThreads = n; }
+  int GetNumberOfThreads() const { return m_NumberOfThreads; }
+
+  /** Size of the blocks compressed independently. Default is 1MB */
+  void SetBlockSize(size_t n) { m_BlockSize = n > 0 ? n : 1; }
+  size_t GetBlockSize() const { return m_BlockSize; }
+
+  /** The zlib compression level. Default is Z_DEFAULT_COMPRESSION */
+  void SetLevel(int level) { m_Level = level; }
+  int GetLevel() const { return m_Level; }
+
+  /**
+   * Compress the input file into the output file. Throws an exception if the
+   * files can not be read or written, in which case the output is removed
+   */
+  void CompressFile(const char *fn_input, const char *fn_output);
+
+  /**
+   * Compress the data produced by the input stream into the output file.
+   * Throws an exception if the file can not be written or the stream fails,
+   * in which case the output is removed
+   */
+  void Compress(InputStream *input, const char *fn_output);
+
+protected:
+
+  // A block of the input and its compressed form
+  struct Block
+  {
+    std::vector<unsigned char> Input, Output;
+
+    // End of the input before this block, used as the deflate dictionary
+    const unsigned char *Dictionary;
+    size_t DictionarySize;
+
+    // Whether this block ends the file, and whether it could be compressed
+    bool Last, Failed;
+  };
+
+  // Blocks being compressed by the threads
+  struct RoundData;
+  static ITK_THREAD_RETURN_TYPE CompressThreadCallback(void *arg);
+
+  // Deflate one block into its output
+  static void CompressBlock(Block &block, int level);
+
+  // Read and compress the input, writing the gzip stream to the output
+  void DoCompress(InputStream *input, FILE *fout);
+
+  int m_NumberOfThreads, m_Level;
+  size_t m_BlockSize;
+};
+
+#endif // PARALLELGZIPCOMPRESSOR_H
@@ -6,6 +6,8 @@
 #include "itksys/SystemTools.hxx"
 #include "itksys/MD5.h"
 #include "FormattedTable.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
 
 using itksys::SystemTools;
 
@@ -30,6 +32,8 @@ int progress_callback(void *clientp,
 
   typedef std::pair<void *, RESTClient::ProgressCallbackFunction> CallbackInfo;
   CallbackInfo *cbi = static_cast<CallbackInfo *>(clientp);
+  if(!cbi->second)
+    return 0;
   cbi->second(cbi->first, bytes_done * 1.0 / bytes_total);
   return 0;
 }
@@ -53,6 +57,9 @@ RESTClient::RESTClient()
   m_ErrorBuffer[0] = 0;
   curl_easy_setopt(m_Curl, CURLOPT_ERRORBUFFER, m_ErrorBuffer);
 
+  // Signals can not be used for timeouts when clients run on several threads
+  curl_easy_setopt(m_Curl, CURLOPT_NOSIGNAL, 1L);
+
   m_UploadMessageBuffer[0] = 0;
   m_MessageBuffer[0] = 0;
   m_OutputFile = NULL;
@@ -220,6 +227,8 @@ bool RESTClient::PostVA(const char *rel_url, const char *post_string, std::va_li
     }
   else 
     {
+    // The handle may have been used for a POST before
+    curl_easy_setopt(m_Curl, CURLOPT_HTTPGET, 1L);
     cout << "GET " << url << endl;
     }
 
@@ -265,6 +274,8 @@ bool RESTClient::PostVA(const char *rel_url, const char *post_string, std::va_li
 void RESTClient::SetProgressCallback(void *cb_data, ProgressCallbackFunction fn)
 {
   m_CallbackInfo = make_pair(cb_data, fn);
+  if(!fn)
+    curl_easy_setopt(m_Curl, CURLOPT_NOPROGRESS, 1L);
 }
 
 bool RESTClient::UploadFile(
@@ -351,6 +362,16 @@ bool RESTClient::UploadFile(
   // Make request
   CURLcode res = curl_easy_perform(m_Curl);
 
+  /* the handle may be used again, so it must not keep pointers to the form */
+  curl_easy_setopt(m_Curl, CURLOPT_HTTPPOST, NULL);
+  curl_easy_setopt(m_Curl, CURLOPT_HTTPHEADER, NULL);
+
+  /* then cleanup the formpost chain */
+  curl_formfree(formpost);
+
+  /* free slist */
+  curl_slist_free_all(headerlist);
+
   if(res != CURLE_OK)
 	throw IRISException("CURL library error: %s\n%s", curl_easy_strerror(res), m_ErrorBuffer);
 
@@ -360,12 +381,6 @@ bool RESTClient::UploadFile(
   curl_easy_getinfo(m_Curl, CURLINFO_TOTAL_TIME, &upload_time);
   sprintf( m_UploadMessageBuffer, "%.1f Mb in %.1f s", upload_size / 1.0e6, upload_time);
 
-  /* then cleanup the formpost chain */
-  curl_formfree(formpost);
-
-  /* free slist */
-  curl_slist_free_all(headerlist);
-
   // Capture the response code
   m_HTTPCode = 0L;
   curl_easy_getinfo(m_Curl, CURLINFO_RESPONSE_CODE, &m_HTTPCode);
@@ -374,6 +389,34 @@ bool RESTClient::UploadFile(
   return m_HTTPCode == 200L;
 }
 
+bool RESTClient::UploadFileByHash(const char *rel_url, const char *filename, const char *md5)
+{
+  // Only the name of the file is sent, escaped for the post string
+  string fn_name = SystemTools::GetFilenameName(filename);
+  char *fn_escaped = curl_easy_escape(m_Curl, fn_name.c_str(), (int) fn_name.length());
+  string fn_post = fn_escaped;
+  curl_free(fn_escaped);
+
+  // The request is optional for the server, so a failed request only means
+  // the file is not known
+  try
+    {
+    if(!this->Post("%s/known", "filename=%s&md5=%s", rel_url, fn_post.c_str(), md5))
+      return false;
+    }
+  catch(IRISException &)
+    {
+    return false;
+    }
+
+  // A server that has taken the file answers with its MD5. Any other answer,
+  // such as that of a server that ignores the request, means it has not
+  string answer = m_Output;
+  size_t first = answer.find_first_not_of(" \t\r\n");
+  size_t last = answer.find_last_not_of(" \t\r\n");
+  return first != string::npos && answer.substr(first, last - first + 1) == md5;
+}
+
 const char *RESTClient::GetOutput()
 {
   return m_Output.c_str();
@@ -399,6 +442,46 @@ const char *RESTClient::GetUploadStatistics()
   return m_UploadMessageBuffer;
 }
 
+std::vector<RESTClient *> &RESTClientPool::GetClients()
+{
+  static std::vector<RESTClient *> *clients = new std::vector<RESTClient *>();
+  return *clients;
+}
+
+// Guards the pool. Clients are also created under it, since the first CURL
+// handle initializes the library, which is not thread-safe
+static itk::SimpleFastMutexLock &RESTClientPoolMutex()
+{
+  static itk::SimpleFastMutexLock *mutex = new itk::SimpleFastMutexLock();
+  return *mutex;
+}
+
+RESTClient *RESTClientPool::Acquire()
+{
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(RESTClientPoolMutex());
+  std::vector<RESTClient *> &clients = GetClients();
+  if(clients.empty())
+    return new RESTClient();
+
+  RESTClient *client = clients.back();
+  clients.pop_back();
+  return client;
+}
+
+void RESTClientPool::Release(RESTClient *client)
+{
+  // Clear the state that belongs to the last user of the client
+  client->SetOutputFile(NULL);
+  client->SetProgressCallback(NULL, NULL);
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(RESTClientPoolMutex());
+  std::vector<RESTClient *> &clients = GetClients();
+  if(clients.size() < MaximumSize)
+    clients.push_back(client);
+  else
+    delete client;
+}
+
 string RESTClient::GetDataDirectory()
 {
   // Compute the platform-independent home directory
@@ -4,6 +4,7 @@
 #include <string>
 #include <cstdarg>
 #include <map>
+#include <vector>
 
 /**
  * This class encapsulates the client side of the ALFABIS RESTful API.
@@ -69,19 +70,35 @@ public:
   typedef  void ( *ProgressCallbackFunction )(void *, double);
 
   /**
-   * Set the callback command for uploads and downloads
+   * Set the callback command for uploads and downloads. Passing a NULL
+   * function turns progress reporting off
    */
   void SetProgressCallback(void *cb_data, ProgressCallbackFunction fn);
 
   bool UploadFile(const char *rel_url, const char *filename,
     std::map<std::string,std::string> extra_fields, ...);
 
+  /**
+   * Ask the server whether it already has a file with the given MD5, from an
+   * earlier upload, and if so to take that file as the upload of the named
+   * file to the given URL. The server confirms that it has taken the file by
+   * answering with its MD5, in which case this returns true and the file
+   * need not be sent. Returns false on any other answer, i.e., if the server
+   * does not have the file or does not support this request, which most
+   * servers do not and answer with 404. This is not an error, so nothing is
+   * thrown and the file should just be sent. The URL is not expanded
+   */
+  bool UploadFileByHash(const char *rel_url, const char *filename, const char *md5);
+
   const char *GetOutput();
 
   std::string GetFormattedCSVOutput(bool header);
 
   const char *GetResponseText();
 
+  /** HTTP code of the last request */
+  long GetHTTPCode() const { return m_HTTPCode; }
+
   const char *GetUploadStatistics();
 
 protected:
@@ -131,6 +148,27 @@ protected:
 
 };
 
+/**
+ * A pool of clients that can be shared by several threads. The connections
+ * that a client has opened stay open while it is in the pool, so a client
+ * taken from the pool can send its next request without connecting again.
+ */
+class RESTClientPool
+{
+public:
+
+  /** Take a client from the pool, or create one if the pool is empty */
+  static RESTClient *Acquire();
 
+  /** Return a client to the pool once it is no longer used */
+  static void Release(RESTClient *client);
+
+protected:
+
+  // Clients kept in the pool at most; others are deleted when released
+  static const size_t MaximumSize = 8;
+
+  static std::vector<RESTClient *> &GetClients();
+};
 
 #endif // RESTCLIENT_H
@@ -9,7 +9,15 @@
 #include "ColorLabelTable.h"
 #include "MultiChannelDisplayMode.h"
 #include "RESTClient.h"
+#include "ParallelGzipCompressor.h"
+#include "NativeImageNiftiStream.h"
+#include "ParallelFileUploader.h"
+#include "LayerCache.h"
 #include "itkCommand.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include "itkMutexLockHolder.h"
+#include <algorithm>
 
 using namespace std;
 using itksys::SystemTools;
@@ -17,6 +25,12 @@ using itksys::RegularExpression;
 using itksys::Directory;
 
 
+WorkspaceAPI::WorkspaceAPI()
+{
+  m_Moved = false;
+  m_ExportLayersInFlight = 2;
+}
+
 void WorkspaceAPI::ReadFromXMLFile(const char *proj_file)
 {
   // Read the contents of the project from the file
@@ -607,8 +621,10 @@ void WorkspaceAPI::RenameLayer(const string &layer_key, const string &new_filena
   if((layer_io_hints = this->GetLayerIOHints(layer_folder)))
     io_hints.Update(*layer_io_hints);
 
-  // Create a native image IO object for this image
+  // Create a native image IO object for this image. The layer is compressed
+  // from the image in memory, so the image must not be streamed
   SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+  io->SetStreamingThreshold(0);
 
   // Load the header of the image and the image data
   io->ReadNativeImage(fn_layer.c_str(), io_hints);
@@ -759,9 +775,220 @@ string WorkspaceAPI::GetTempDirName()
 
 #include "AllPurposeProgressAccumulator.h"
 
+// State shared by the threads exporting the layers of a workspace. Each
+// worker claims one layer at a time and takes it through all the stages
+struct WorkspaceExportData
+{
+  // The layers to export
+  std::vector<std::string> InputFiles, BaseNames;
+  std::vector<Registry> IOHints;
+  std::string OutputDir;
+  bool ScrambleFilenames, UseLayerCache;
+  int GzipThreads, NumberOfWorkers;
+
+  // The exported files, in layer order
+  std::vector<std::string> OutputFiles;
+
+  // Guarded by the mutex. Progress is counted in layers
+  size_t NextLayer;
+  int WorkersDone;
+  double Progress;
+  std::string Error;
+  itk::SimpleFastMutexLock Mutex;
+
+  TrivalProgressSource *ProgressSource;
+
+  // If set, exported layers are passed on to be uploaded
+  ParallelFileUploader *Uploader;
+
+  void AddProgress(double delta)
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(Mutex);
+    Progress += delta;
+    }
+};
+
+// The key of an exported layer in the layer cache. The hash of the voxel
+// data is combined with the geometry, since images that differ only in
+// their headers are exported to different files
+static string GetLayerCacheKey(GuidedNativeImageIO *io, const string &hash)
+{
+  itk::ImageBase<3> *image = io->GetNativeImage();
+  ostringstream oss;
+  oss.precision(17);
+  oss << hash << " " << io->GetComponentTypeInNativeImage()
+      << " " << image->GetNumberOfComponentsPerPixel();
+  for(int a = 0; a < 3; a++)
+    {
+    oss << " " << image->GetLargestPossibleRegion().GetSize()[a]
+        << " " << image->GetSpacing()[a] << " " << image->GetOrigin()[a];
+    for(int b = 0; b < 3; b++)
+      oss << " " << image->GetDirection()(a, b);
+    }
+  string geometry = oss.str();
+
+  char hex_code[33];
+  hex_code[32] = 0;
+  itksysMD5 *md5 = itksysMD5_New();
+  itksysMD5_Initialize(md5);
+  itksysMD5_Append(md5, (unsigned char *) geometry.c_str(), geometry.size());
+  itksysMD5_FinalizeHex(md5, hex_code);
+  itksysMD5_Delete(md5);
+  return hex_code;
+}
+
+static void ExportWorkspaceLayer(WorkspaceExportData *data, size_t i)
+{
+  // Create a native image IO object for this image. The layer is compressed
+  // from the image in memory, so the image must not be streamed
+  SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+  io->SetStreamingThreshold(0);
+
+  // Load the header of the image and the image data
+  io->ReadNativeImage(data->InputFiles[i].c_str(), data->IOHints[i]);
+  data->AddProgress(0.4);
+
+  // Compute the hash of the image data to generate filename
+  string fn_layer_basename = data->BaseNames[i];
+  string hash, cache_key;
+  if(data->ScrambleFilenames || data->UseLayerCache)
+    hash = io->GetNativeImageMD5Hash();
+  if(data->ScrambleFilenames)
+    {
+    // Use the hash as the basename
+    fn_layer_basename = hash;
+    }
+  if(data->UseLayerCache)
+    cache_key = GetLayerCacheKey(io, hash);
+  data->AddProgress(0.1);
+
+  // Create a filename that combines the layer index with the hash code
+  char fn_layer_new[4096];
+  sprintf(fn_layer_new, "%s/layer_%03d_%s.nii.gz", data->OutputDir.c_str(), (int) i, fn_layer_basename.c_str());
+
+  // If the layer has been exported before, copy the file exported then. It
+  // has the same bytes, so the server can recognize it when it is uploaded.
+  // Another process pruning the cache may remove the file before it is
+  // copied, in which case the layer is compressed after all
+  string fn_cached = cache_key.size() ? LayerCache::FindLayer(cache_key) : string();
+  if(fn_cached.size() && SystemTools::CopyFileAlways(fn_cached.c_str(), fn_layer_new))
+    {
+    io = NULL;
+    data->AddProgress(0.5);
+    }
+  else
+    {
+    // Compress the layer as a NIfTI file on several threads, reading the
+    // file from the image in memory rather than saving it first. The
+    // compressor removes the output if it fails
+    ParallelGzipCompressor gz;
+    gz.SetNumberOfThreads(data->GzipThreads);
+    NativeImageNiftiStream nifti(io);
+    io = NULL;
+    data->AddProgress(0.1);
+    gz.Compress(&nifti, fn_layer_new);
+
+    // Keep the exported layer for the next export. This is not an error if
+    // it fails, since the cache only saves work
+    if(cache_key.size())
+      LayerCache::AddLayer(cache_key, fn_layer_new);
+    data->AddProgress(0.4);
+    }
+
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+    data->OutputFiles[i] = fn_layer_new;
+    }
+
+  if(data->Uploader)
+    data->Uploader->AddFile(fn_layer_new);
+}
+
+static ITK_THREAD_RETURN_TYPE ExportWorkspaceThreadCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *ti = static_cast<ThreadInfo *>(arg);
+  WorkspaceExportData *data = static_cast<WorkspaceExportData *>(ti->UserData);
+
+  // The calling thread only reports progress, since the observers of the
+  // progress may update the GUI
+  if(ti->ThreadID == 0)
+    {
+    double reported = 0.0;
+    while(true)
+      {
+      double progress;
+      int done;
+        {
+        itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+        progress = data->Progress;
+        done = data->WorkersDone;
+        }
+
+      if(progress > reported)
+        {
+        data->ProgressSource->AddProgress(progress - reported);
+        reported = progress;
+        }
+
+      if(done == data->NumberOfWorkers)
+        break;
+
+      SystemTools::Delay(50);
+      }
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  size_t n_layers = data->InputFiles.size();
+  while(true)
+    {
+    // Claim the next layer, unless another worker has failed
+    size_t i;
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      i = data->Error.empty() ? data->NextLayer++ : n_layers;
+      }
+    if(i >= n_layers)
+      break;
+
+    std::string error;
+    try
+      {
+      ExportWorkspaceLayer(data, i);
+      }
+    catch(IRISException &exc)
+      {
+      error = exc.what();
+      }
+    catch(std::exception &exc)
+      {
+      error = exc.what();
+      }
+
+    if(error.size())
+      {
+      itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+      if(data->Error.empty())
+        data->Error = error;
+      }
+    }
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(data->Mutex);
+  data->WorkersDone++;
+  return ITK_THREAD_RETURN_VALUE;
+}
+
 void WorkspaceAPI::ExportWorkspace(const char *new_workspace,
                                    CommandType *cmd_progress,
                                    bool scramble_filenames) const
+{
+  this->DoExportWorkspace(new_workspace, cmd_progress, scramble_filenames, NULL);
+}
+
+void WorkspaceAPI::DoExportWorkspace(const char *new_workspace,
+                                     CommandType *cmd_progress,
+                                     bool scramble_filenames,
+                                     ParallelFileUploader *uploader) const
 {
   // Create a progress tracker
   SmartPtr<TrivalProgressSource> progress = TrivalProgressSource::New();
@@ -787,53 +1014,65 @@ void WorkspaceAPI::ExportWorkspace(const char *new_workspace,
   // Report progress
   progress->StartProgress(n_layers);
 
-  // Load all of the layers in the current project
+  // Collect what the workers need to know about each layer up front, since
+  // the registry can not be accessed from several threads
+  WorkspaceExportData data;
+  data.OutputDir = wsdir;
+  data.ScrambleFilenames = scramble_filenames;
+  data.UseLayerCache = !LayerCache::GetDirectory().empty();
+  data.InputFiles.resize(n_layers);
+  data.BaseNames.resize(n_layers);
+  data.IOHints.resize(n_layers);
+  data.OutputFiles.resize(n_layers);
   for(int i = 0; i < n_layers; i++)
     {
     // Get the folder corresponding to the layer
     Registry &f_layer = wsexp.GetLayerFolder(i);
 
     // The the (possibly moved) absolute filename
-    string fn_layer = wsexp.GetLayerActualPath(f_layer);
+    data.InputFiles[i] = wsexp.GetLayerActualPath(f_layer);
 
     // Get the current layer base filename
-    string fn_layer_basename = SystemTools::GetFilenameWithoutExtension(fn_layer);
+    data.BaseNames[i] = SystemTools::GetFilenameWithoutExtension(data.InputFiles[i]);
 
     // The IO hints for the file
-    Registry io_hints, *layer_io_hints;
+    Registry *layer_io_hints;
     if((layer_io_hints = wsexp.GetLayerIOHints(f_layer)))
-      io_hints.Update(*layer_io_hints);
-
-    // Create a native image IO object for this image
-    SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
-
-    // Load the header of the image and the image data
-    io->ReadNativeImage(fn_layer.c_str(), io_hints);
-
-    // Report progress
-    progress->AddProgress(0.5);
-
-    // Compute the hash of the image data to generate filename
-    if(scramble_filenames)
-      {
-      // Use the hash as the basename
-      fn_layer_basename = io->GetNativeImageMD5Hash();
-      }
-
-    // Create a filename that combines the layer index with the hash code
-    char fn_layer_new[4096];
-    sprintf(fn_layer_new, "%s/layer_%03d_%s.nii.gz", wsdir.c_str(), i, fn_layer_basename.c_str());
+      data.IOHints[i].Update(*layer_io_hints);
+    }
 
-    // Save the layer there. Since we are saving as a NIFTI, we don't need to
-    // provide any hints
-    Registry dummy_hints;
-    io->SaveNativeImage(fn_layer_new, dummy_hints);
+  // Several layers are in flight at once, so that reading one layer overlaps
+  // with hashing and compressing another. The threads of the machine are
+  // shared out between the compressors of the layers in flight
+  int n_threads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  data.NumberOfWorkers = std::max(1, std::min(m_ExportLayersInFlight, n_layers));
+  data.GzipThreads = std::max(1, n_threads / data.NumberOfWorkers);
+  data.NextLayer = 0;
+  data.WorkersDone = 0;
+  data.Progress = 0.0;
+  data.ProgressSource = progress;
+  data.Uploader = uploader;
+
+  // The first thread reports progress, the others export the layers
+  itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+  mt->SetNumberOfThreads(data.NumberOfWorkers + 1);
+  mt->SetSingleMethod(ExportWorkspaceThreadCallback, &data);
+  mt->SingleMethodExecute();
+
+  if(data.Error.size())
+    {
+    for(int i = 0; i < n_layers; i++)
+      if(data.OutputFiles[i].size())
+        SystemTools::RemoveFile(data.OutputFiles[i].c_str());
+    throw IRISException("Error exporting workspace. %s", data.Error.c_str());
+    }
 
-    // Report progress
-    progress->AddProgress(0.5);
+  for(int i = 0; i < n_layers; i++)
+    {
+    Registry &f_layer = wsexp.GetLayerFolder(i);
 
     // Update the layer folder with the new path
-    f_layer["AbsolutePath"] << fn_layer_new;
+    f_layer["AbsolutePath"] << data.OutputFiles[i];
 
     // There are no hints necessary for NIFTI
     f_layer.Folder("IOHints").Clear();
@@ -867,55 +1106,31 @@ void WorkspaceAPI::UploadWorkspace(const char *url, int ticket_id,
   string tempdir = GetTempDirName();
   SystemTools::MakeDirectory(tempdir);
 
+  // Start the upload threads, so that the layers can be sent while the
+  // workspace is being exported
+  char url_buffer[4096];
+  sprintf(url_buffer, url, ticket_id);
+  ParallelFileUploader uploader;
+  uploader.Start(url_buffer);
+
   // Export the workspace file to the temporary directory
   char ws_fname_buffer[4096];
   sprintf(ws_fname_buffer, "%s/ticket_%08d%s.itksnap", tempdir.c_str(), ticket_id, wsfile_suffix);
-  ExportWorkspace(ws_fname_buffer, cmd_export);
-
-  // Count the number of files in the directory
-  std::vector<std::string> fn_to_upload;
-  Directory dir;
-  dir.Load(tempdir);
-  for(int i = 0; i < dir.GetNumberOfFiles(); i++)
-    {
-    const char *thisfile = dir.GetFile(i);
-    string file_full_path = SystemTools::CollapseFullPath(thisfile, dir.GetPath());
-    if(!SystemTools::FileIsDirectory(file_full_path))
-      fn_to_upload.push_back(file_full_path);
-    }
+  DoExportWorkspace(ws_fname_buffer, cmd_export, true, &uploader);
 
   cout << "Exported workspace to " << ws_fname_buffer << endl;
 
-  // Create a source for transfer progress
-  void *transfer_progress_src = accum_upload->RegisterGenericSource(fn_to_upload.size(), 1.0);
-
-  // For each of the files in the directory upload it
-  for(int i = 0; i < fn_to_upload.size(); i++)
-    {
-    const char *fn = fn_to_upload[i].c_str();
-
-    RESTClient rcu;
-
-    // Set progress callback
-    rcu.SetProgressCallback(transfer_progress_src,
-                            AllPurposeProgressAccumulator::GenericProgressCallback);
+  // The workspace file is sent last, once it refers to all the layers
+  uploader.AddFile(ws_fname_buffer);
 
-    // TODO: this is disgraceful!
-    std::map<string, string> empty_map;
-    if(!rcu.UploadFile(url, fn, empty_map, ticket_id))
-      throw IRISException("Failed up upload file %s (%s)", fn, rcu.GetResponseText());
-
-    // Reset progress counter for next run
-    accum_upload->StartNextRun(transfer_progress_src);
-
-    cout << "Upload " << fn << " (" << rcu.GetUploadStatistics() << ")" << endl;
-    }
+  // Wait for the remaining uploads. Each file is sent with its MD5, and sent
+  // again if the server does not accept it
+  void *transfer_progress_src = accum_upload->RegisterGenericSource(1, 1.0);
+  uploader.Finish(transfer_progress_src, AllPurposeProgressAccumulator::GenericProgressCallback);
 
   // Finish with the progress
   accum_upload->UnregisterAllSources();
   accum->UnregisterAllSources();
-
-  // TODO: we should verify that all the files were successfully sent, via MD5
 }
 
 int WorkspaceAPI::CreateWorkspaceTicket(const string &service_desc,
@@ -942,8 +1157,22 @@ int WorkspaceAPI::CreateWorkspaceTicket(const string &service_desc,
 
   cout << "Created new ticket (" << ticket_id << ")" << endl;
 
-  // Locally export and upload the workspace
-  UploadWorkspace("api/tickets/%d/files/input", ticket_id, "", cmd_progress);
+  // Locally export and upload the workspace. If this fails, some of the
+  // files may be on the server already, so the ticket is deleted rather than
+  // left behind with part of its input
+  try
+    {
+    UploadWorkspace("api/tickets/%d/files/input", ticket_id, "", cmd_progress);
+    }
+  catch(...)
+    {
+    RESTClient rcd;
+    if(rcd.Get("api/tickets/%d/delete", ticket_id))
+      cout << "Deleted ticket (" << ticket_id << ") after the upload failed" << endl;
+    else
+      cerr << "Failed to delete ticket " << ticket_id << " (" << rcd.GetResponseText() << ")" << endl;
+    throw;
+    }
 
   // Mark this ticket as ready
   if(!rc.Post("api/tickets/%d/status","status=ready", ticket_id))
@@ -1011,6 +1240,25 @@ string WorkspaceAPI::DownloadTicketFiles(
     // Make it into a full path
     string file_path = SystemTools::CollapseFullPath(file_name.c_str(), outdir);
 
+    // Servers that keep the MD5 of each file list it in the third column
+    string file_md5;
+    if(ft.Columns() >= 3 && ft(iFile, 2).length() == 32
+       && ft(iFile, 2).find_first_not_of("0123456789abcdef") == string::npos)
+      {
+      file_md5 = ft(iFile, 2);
+      }
+
+    // If the file has been uploaded or downloaded before, copy it from the
+    // layer cache instead of downloading it again
+    string fn_cached = file_md5.size() ? LayerCache::FindContent(file_md5) : string();
+    if(fn_cached.size() && SystemTools::CopyFileAlways(fn_cached.c_str(), file_path.c_str()))
+      {
+      AllPurposeProgressAccumulator::GenericProgressCallback(transfer_progress_src, 1.0);
+      accum->StartNextRun(transfer_progress_src);
+      oss << file_path << endl;
+      continue;
+      }
+
     // Create a file handle
     FILE *fout = fopen(file_path.c_str(), "wb");
     rc.SetOutputFile(fout);
@@ -1022,6 +1270,15 @@ string WorkspaceAPI::DownloadTicketFiles(
     rc.SetOutputFile(NULL);
     fclose(fout);
 
+    // Check the file against its MD5, and keep it for the next download
+    if(file_md5.size())
+      {
+      if(ParallelFileUploader::ComputeFileMD5(file_path.c_str()) != file_md5)
+        throw IRISException("Downloaded file %s for ticket %d does not match its MD5",
+          file_name.c_str(), ticket_id);
+      LayerCache::AddContent(file_md5, file_path);
+      }
+
     // Start next run of uploading
     accum->StartNextRun(transfer_progress_src);
 
@@ -5,6 +5,7 @@
 #include <set>
 
 namespace itk { class Command; }
+class ParallelFileUploader;
 
 struct MultiChannelDisplayMode;
 
@@ -22,6 +23,8 @@ public:
   // Progress callback signature
   typedef itk::Command CommandType;
 
+  WorkspaceAPI();
+
   /**
    * Read the workspace from a file, determine if it has been moved or copied
    * since it was saved originally.
@@ -193,19 +196,43 @@ public:
   /** Cross-platform way of getting a temporary path */
   static std::string GetTempDirName();
 
-  /** Export the workspace */
+  /**
+   * Export the workspace. Several layers are read, hashed and compressed at
+   * the same time, and the compression of each layer is itself spread over
+   * several threads. If the LayerCache is on, layers that have not changed
+   * since they were last exported are copied from it instead of being
+   * compressed
+   */
   void ExportWorkspace(const char *new_workspace, CommandType *cmd_progress = NULL, bool scramble_filenames = true) const;
 
-  /** Upload the workspace */
+  /**
+   * Set the number of layers that ExportWorkspace processes at the same time.
+   * Each of these layers is held in memory in full. Default is 2
+   */
+  void SetExportLayersInFlight(int n) { m_ExportLayersInFlight = n; }
+  int GetExportLayersInFlight() const { return m_ExportLayersInFlight; }
+
+  /**
+   * Upload the workspace. Each layer is uploaded as soon as it has been
+   * exported, while the next layers are being exported. If the export or an
+   * upload fails, the files sent so far stay on the server, and it is up to
+   * the caller to cancel the ticket
+   */
   void UploadWorkspace(const char *url, int ticket_id, const char *wsfile_suffix,
                        CommandType *cmd_progress = NULL) const;
 
-  /** Create a ticket from a workspace */
+  /**
+   * Create a ticket from a workspace. If the workspace can not be uploaded,
+   * the ticket is deleted
+   */
   int CreateWorkspaceTicket(const std::string &service_desc, CommandType *cmd_progress = NULL) const;
 
   /**
    * Download ticket files to a directory. Flag provider_mode switches between
-   * behavior for users and providers. String area is one of (input|results)
+   * behavior for users and providers. String area is one of (input|results).
+   * Files whose MD5 the server lists are checked against it, and are copied
+   * from the LayerCache, if it is on, instead of being downloaded if they
+   * are stored there
    */
   static std::string DownloadTicketFiles(
       int ticket_id, const char *outdir, bool provider_mode, const char *area,
@@ -222,6 +249,11 @@ public:
 
 protected:
 
+  // Export the workspace, passing each exported layer to the uploader if
+  // there is one
+  void DoExportWorkspace(const char *new_workspace, CommandType *cmd_progress,
+                         bool scramble_filenames, ParallelFileUploader *uploader) const;
+
   // The Registry object containing workspace data
   Registry m_Registry;
 
@@ -234,6 +266,9 @@ protected:
   // The directory where workspace was last saved
   std::string m_WorkspaceSavedDir;
 
+  // Number of layers exported at the same time
+  int m_ExportLayersInFlight;
+
 };
 
 
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include "SNAPCommon.h"
+#include <itkVectorImage.h>
+#include <itkImageAdaptor.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIterator.h>
+#include <itkTimeProbe.h>
+#include "VectorToScalarImageAccessor.h"
+#include "DerivedQuantityCache.h"
+
+typedef itk::VectorImage<GreyType, 3> VectorImageType;
+
+// Synthetic multi-component image with noise in every component
+VectorImageType::Pointer makeImage(int size, int nComp)
+{
+    VectorImageType::Pointer image = VectorImageType::New();
+    VectorImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->SetNumberOfComponentsPerPixel(nComp);
+    image->Allocate();
+
+    srand(1234);
+    GreyType *p = image->GetBufferPointer();
+    size_t n = image->GetPixelContainer()->Size();
+    for (size_t i = 0; i < n; i++)
+        p[i] = static_cast<GreyType>(rand() % 2000 - 500);
+    return image;
+}
+
+// Read every voxel of the adaptor, as the histogram and min/max filters do
+template <class TAdaptor>
+double readAll(TAdaptor *adaptor, std::vector<float> &values)
+{
+    itk::TimeProbe tp;
+    tp.Start();
+    values.clear();
+    itk::ImageRegionConstIterator<TAdaptor> it(adaptor, adaptor->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+        values.push_back(it.Get());
+    tp.Stop();
+    return tp.GetMean() * 1000;
+}
+
+// Time the accesses to a derived quantity computed on the fly and from
+// materialized values, which must be identical
+template <class TAdaptor>
+bool timeQuantity(VectorImageType *image, const char *name)
+{
+    typedef typename TAdaptor::AccessorType AccessorType;
+    typedef typename AccessorType::MaterializedContainer ContainerType;
+
+    typename TAdaptor::Pointer adaptor = TAdaptor::New();
+    adaptor->SetImage(image);
+    adaptor->GetPixelAccessor().SetSourceNativeMapping(0.5, 10.0);
+
+    std::vector<float> v1, v2;
+    double tOnAccess = readAll(adaptor.GetPointer(), v1);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    itk::SizeValueType n = image->GetBufferedRegion().GetNumberOfPixels();
+    int nc = image->GetNumberOfComponentsPerPixel();
+    typename ContainerType::Pointer values = ContainerType::New();
+    values->Reserve(n);
+    const GreyType *input = image->GetBufferPointer();
+    itk::SizeValueType bs = AbstractVectorToDerivedQuantityFunctor::BlockSize;
+    for (itk::SizeValueType j = 0; j < n; j += bs)
+    {
+        int m = (int) std::min(bs, n - j);
+        adaptor->GetPixelAccessor().GetFunctor().GetBlock(
+            input + j * nc, nc, values->GetBufferPointer() + j, m);
+    }
+    adaptor->GetPixelAccessor().SetMaterializedValues(input, values);
+    tp.Stop();
+
+    double tMaterialized = readAll(adaptor.GetPointer(), v2);
+
+    std::cout << name << ": on access " << tOnAccess << " ms, materializing "
+        << tp.GetMean() * 1000 << " ms, materialized " << tMaterialized << " ms" << std::endl;
+
+    if (v1 != v2)
+    {
+        std::cerr << name << ": materialized values differ from computed ones" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::set<int> released;
+
+void releaseClient(void *client)
+{
+    released.insert(*static_cast<int *>(client));
+}
+
+// The least recently used buffers are released first, never the latest one
+bool testEviction()
+{
+    DerivedQuantityCache &cache = DerivedQuantityCache::GetInstance();
+    std::size_t budget = cache.GetMemoryBudget();
+    cache.SetMemoryBudget(300);
+
+    int c[4] = { 0, 1, 2, 3 };
+    cache.Touch(&c[0], 100, releaseClient);
+    cache.Touch(&c[1], 100, releaseClient);
+    cache.Touch(&c[2], 100, releaseClient);
+    cache.Touch(&c[0], 100, releaseClient);
+    cache.Touch(&c[3], 150, releaseClient);
+
+    bool ok = released.size() == 2 && released.count(1) && released.count(2)
+        && cache.GetMemoryInUse() == 250;
+
+    cache.Remove(&c[0]);
+    cache.Remove(&c[3]);
+    ok = ok && cache.GetMemoryInUse() == 0;
+    cache.SetMemoryBudget(budget);
+
+    if (!ok)
+        std::cerr << "Derived quantity cache released the wrong buffers" << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 128;
+    int nComp = argc > 2 ? atoi(argv[2]) : 4;
+
+    std::cout << "Derived quantities of " << size << "^3 voxels with "
+        << nComp << " components" << std::endl;
+    VectorImageType::Pointer image = makeImage(size, nComp);
+
+    bool ok = testEviction();
+    ok &= timeQuantity<GreyVectorMagnitudeImageAdaptor>(image, "magnitude");
+    ok &= timeQuantity<GreyVectorMaxImageAdaptor>(image, "maximum");
+    ok &= timeQuantity<GreyVectorMeanImageAdaptor>(image, "mean");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
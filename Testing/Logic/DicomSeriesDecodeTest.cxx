@@ -0,0 +1,213 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <itkImage.h>
+#include <itkImageSeriesReader.h>
+#include <itkImageSeriesWriter.h>
+#include <itkMetaDataObject.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkGDCMImageIO.h>
+#include <itkMultiThreader.h>
+#include <itkNumericSeriesFileNames.h>
+#include <itkTimeProbe.h>
+#include <itkVectorImage.h>
+#include "itksys/SystemTools.hxx"
+#include "GuidedNativeImageIO.h"
+#include "ExtendedGDCMSerieHelper.h"
+#include "Registry.h"
+
+typedef itk::Image<short, 3> VolumeType;
+typedef itk::Image<short, 2> SliceType;
+typedef itk::VectorImage<short, 3> NativeImageType;
+
+// Counts the calls of the progress command
+class ProgressCounter : public itk::Command
+{
+public:
+    typedef ProgressCounter Self;
+    typedef itk::SmartPointer<Self> Pointer;
+    itkNewMacro(Self)
+
+    int Calls;
+    double LastProgress;
+
+    virtual void Execute(itk::Object *caller, const itk::EventObject &)
+    {
+        Calls++;
+        LastProgress = static_cast<GuidedNativeImageIO *>(caller)->GetReadProgress();
+    }
+
+    virtual void Execute(const itk::Object *, const itk::EventObject &) {}
+
+protected:
+    ProgressCounter() : Calls(0), LastProgress(0) {}
+};
+
+// Synthetic CT-like volume written as one DICOM file per slice
+std::vector<std::string> writeSeries(int size, const std::string &dir)
+{
+    VolumeType::Pointer image = VolumeType::New();
+    VolumeType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    double spacing[] = {0.7, 0.7, 1.25};
+    image->SetSpacing(spacing);
+    image->Allocate();
+
+    itk::ImageRegionIteratorWithIndex<VolumeType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        itk::Index<3> idx = it.GetIndex();
+        double c2 = 0;
+        for (int d = 0; d < 3; d++)
+            c2 += (idx[d] - 0.5 * size) * (idx[d] - 0.5 * size);
+        it.Set(static_cast<short>((c2 < size * size / 9.0 ? 1000 : -1000) + 3 * idx[2] + idx[0]));
+    }
+
+    itksys::SystemTools::MakeDirectory(dir.c_str());
+    itk::NumericSeriesFileNames::Pointer names = itk::NumericSeriesFileNames::New();
+    names->SetSeriesFormat((dir + "/slice%04d.dcm").c_str());
+    names->SetStartIndex(0);
+    names->SetEndIndex(size - 1);
+
+    // The position of each slice must be in its header for the files to be
+    // ordered by position
+    typedef itk::ImageSeriesWriter<VolumeType, SliceType> WriterType;
+    WriterType::DictionaryArrayType dicts;
+    std::vector<itk::MetaDataDictionary> dictStore(size);
+    for (int z = 0; z < size; z++)
+    {
+        std::ostringstream ipp;
+        ipp << "0\\0\\" << z * spacing[2];
+        itk::EncapsulateMetaData<std::string>(dictStore[z], "0020|0032", ipp.str());
+        itk::EncapsulateMetaData<std::string>(dictStore[z], "0020|0037", "1\\0\\0\\0\\1\\0");
+        dicts.push_back(&dictStore[z]);
+    }
+
+    // Number the files against the slice order, so that ordering them by
+    // name would flip the volume
+    std::vector<std::string> files(names->GetFileNames().rbegin(), names->GetFileNames().rend());
+
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetImageIO(itk::GDCMImageIO::New());
+    writer->SetFileNames(files);
+    writer->SetMetaDataDictionaryArray(&dicts);
+    writer->Update();
+    return files;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 128;
+    std::string dir = "DicomSeriesDecodeTest";
+    std::vector<std::string> files = writeSeries(size, dir);
+
+    // Read the series the way SNAP does, with the slices decoded in parallel
+    SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+    ProgressCounter::Pointer progress = ProgressCounter::New();
+    Registry hints;
+    GuidedNativeImageIO::SetFileFormat(hints, GuidedNativeImageIO::FORMAT_DICOM_DIR);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    io->ReadNativeImageHeader(dir.c_str(), hints);
+    io->ReadNativeImageData(progress);
+    tp.Stop();
+
+    std::cout << "DICOM series of " << size << " slices decoded on "
+        << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << " threads: "
+        << tp.GetMean() * 1000 << " ms, " << progress->Calls
+        << " progress updates" << std::endl;
+
+    // Reference: the series reader, one slice at a time
+    typedef itk::ImageSeriesReader<VolumeType> ReaderType;
+    ReaderType::Pointer reader = ReaderType::New();
+    reader->SetFileNames(files);
+    reader->SetImageIO(itk::GDCMImageIO::New());
+    itk::TimeProbe tpRef;
+    tpRef.Start();
+    reader->Update();
+    tpRef.Stop();
+    std::cout << "ImageSeriesReader: " << tpRef.GetMean() * 1000 << " ms" << std::endl;
+
+    // Order the slices by the positions kept from the directory scan, and
+    // with gdcm from the files themselves. Both must give the same order
+    SmartPtr<GuidedNativeImageIO> ioScan = GuidedNativeImageIO::New();
+    ioScan->ParseDicomDirectory(dir);
+    const GuidedNativeImageIO::DicomDirectoryParseResult &parse = ioScan->GetLastDicomParseResult();
+    std::vector<std::string> byPosition, byGdcm;
+    int perIPP = 0, perIPPGdcm = 0;
+    bool ordered = false;
+    if (parse.SeriesMap.size() == 1)
+    {
+        const GuidedNativeImageIO::DicomDirectoryParseResult::DicomSeriesInfo &series
+            = parse.SeriesMap.begin()->second;
+        byPosition = byGdcm = series.FileList;
+        ordered = ExtendedGDCMSerieHelper::OrderByPosition(
+            byPosition, series.PositionList, series.OrientationList, perIPP);
+        ExtendedGDCMSerieHelper helper;
+        helper.SetFilesAndOrder(byGdcm, perIPPGdcm);
+    }
+
+    for (size_t i = 0; i < files.size(); i++)
+        remove(files[i].c_str());
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+
+    if (!ordered || byPosition.size() != files.size())
+    {
+        std::cerr << "The scanned series could not be ordered by position" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (byPosition != byGdcm || perIPP != perIPPGdcm)
+    {
+        std::cerr << "Ordering by position differs from gdcm" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (progress->Calls == 0 || progress->LastProgress <= 0.0)
+    {
+        std::cerr << "Progress was not reported" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    NativeImageType *native = dynamic_cast<NativeImageType *>(io->GetNativeImage());
+    VolumeType *reference = reader->GetOutput();
+    if (!native || native->GetNumberOfComponentsPerPixel() != 1
+        || native->GetBufferedRegion() != reference->GetBufferedRegion())
+    {
+        std::cerr << "Native image does not match the series" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (int d = 0; d < 3; d++)
+    {
+        if (std::abs(native->GetSpacing()[d] - reference->GetSpacing()[d]) > 1e-6
+            || std::abs(native->GetOrigin()[d] - reference->GetOrigin()[d]) > 1e-6)
+        {
+            std::cerr << "Geometry differs in dimension " << d << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const short *p = native->GetBufferPointer();
+    itk::ImageRegionConstIterator<VolumeType> it(reference, reference->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it, ++p)
+    {
+        if (*p != it.Get())
+        {
+            std::cerr << "Voxel " << it.GetIndex() << " differs: " << *p
+                << " vs " << it.Get() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <vnl/vnl_math.h>
+#include "EMGaussianMixtures.h"
+
+// Samples from three well separated two-dimensional clusters
+std::vector<double> makeSamples(int n, int dim)
+{
+    srand(1234);
+    std::vector<double> samples(n * dim);
+    for (int i = 0; i < n; i++)
+    {
+        int c = i % 3;
+        for (int k = 0; k < dim; k++)
+        {
+            double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = rand() / (RAND_MAX + 1.0);
+            double noise = sqrt(-2.0 * log(u)) * cos(2 * vnl_math::pi * v);
+            samples[i * dim + k] = 100.0 * c * (k + 1) + 10.0 * noise;
+        }
+    }
+    return samples;
+}
+
+// Run a few EM iterations and return the parameters of the mixture
+std::vector<double> runEM(std::vector<double> &samples, int n, int dim, int nThreads)
+{
+    std::vector<double *> x(n);
+    for (int i = 0; i < n; i++)
+        x[i] = &samples[i * dim];
+
+    // Deterministic initialization
+    GaussianMixtureModel::MatrixType cov(dim, dim);
+    cov.set_identity();
+    cov *= 400.0;
+
+    EMGaussianMixtures em(&x[0], n, dim, 3);
+    em.SetNumberOfThreads(nThreads);
+    for (int c = 0; c < 3; c++)
+    {
+        GaussianMixtureModel::VectorType mean(dim);
+        for (int k = 0; k < dim; k++)
+            mean[k] = 90.0 * c * (k + 1) + 5.0;
+        em.SetParameters(c, mean, cov, 1.0 / 3);
+    }
+
+    for (int it = 0; it < 5; it++)
+        em.UpdateOnce();
+
+    std::vector<double> params;
+    GaussianMixtureModel *gmm = em.GetGaussianMixtureModel();
+    for (int c = 0; c < 3; c++)
+    {
+        params.push_back(gmm->GetWeight(c));
+        for (int k = 0; k < dim; k++)
+            params.push_back(gmm->GetMean(c)[k]);
+        for (int k = 0; k < dim * dim; k++)
+            params.push_back(gmm->GetCovariance(c).data_block()[k]);
+    }
+    return params;
+}
+
+int main(int, char *[])
+{
+    int n = 100000, dim = 2;
+    std::vector<double> samples = makeSamples(n, dim);
+
+    std::vector<double> p1 = runEM(samples, n, dim, 1);
+    std::vector<double> p4 = runEM(samples, n, dim, 4);
+
+    // The result must not depend on the number of threads
+    for (size_t i = 0; i < p1.size(); i++)
+    {
+        if (p1[i] != p4[i])
+        {
+            std::cerr << "Parameter " << i << " differs: " << p1[i] << " vs " << p4[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The clusters must have been recovered
+    for (int c = 0; c < 3; c++)
+    {
+        double mean0 = p1[c * (1 + dim + dim * dim) + 1];
+        if (fabs(mean0 - 100.0 * c) > 2.0)
+        {
+            std::cerr << "Cluster " << c << " has mean " << mean0 << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkTimeProbe.h>
+#include "EdgePreprocessingImageFilter.h"
+#include "EdgePreprocessingSettings.h"
+
+typedef itk::Image<short, 3> ImageType;
+typedef EdgePreprocessingImageFilter<ImageType, ImageType> FilterType;
+
+// Synthetic volume: a bright ball inside a darker box, with noise
+ImageType::Pointer makeImage(int size)
+{
+    ImageType::Pointer image = ImageType::New();
+    ImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    srand(1234);
+    itk::ImageRegionIteratorWithIndex<ImageType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        itk::Index<3> idx = it.GetIndex();
+        double c2 = 0;
+        bool inBox = true;
+        for (int d = 0; d < 3; d++)
+        {
+            c2 += (idx[d] - 0.5 * size) * (idx[d] - 0.5 * size);
+            inBox = inBox && idx[d] > size / 8 && idx[d] < 7 * size / 8;
+        }
+        double value = (c2 < size * size / 9.0) ? 1000 : (inBox ? 400 : 0);
+        it.Set(static_cast<short>(value + rand() % 100));
+    }
+    return image;
+}
+
+void writeImage(ImageType *image, const char *fn)
+{
+    typedef itk::ImageFileWriter<ImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(fn);
+    writer->Update();
+}
+
+ImageType::Pointer computeEdges(ImageType *image, EdgePreprocessingSettings *settings,
+    FilterType::BlurMode mode, double &time)
+{
+    FilterType::Pointer filter = FilterType::New();
+    filter->SetInput(image);
+    filter->SetParameters(settings);
+    filter->SetInputImageMaximumGradientMagnitude(500.0);
+    filter->SetBlurMode(mode);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    filter->Update();
+    tp.Stop();
+    time = tp.GetMean() * 1000;
+
+    ImageType::Pointer result = filter->GetOutput();
+    result->DisconnectPipeline();
+    return result;
+}
+
+// Compute the edges with both blur paths, which must agree, and with the
+// automatic choice of path. The automatic result and that of the expected
+// path are written for itkTestDriver to compare. Timings are only printed.
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        std::cerr << "Usage: " << argv[0]
+            << " size blur_scale kernel|recursive output expected" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int size = atoi(argv[1]);
+    double scale = atof(argv[2]);
+    bool recursive = strcmp(argv[3], "recursive") == 0;
+
+    ImageType::Pointer image = makeImage(size);
+    SmartPtr<EdgePreprocessingSettings> settings = EdgePreprocessingSettings::New();
+    settings->InitializeToDefaults();
+    settings->SetGaussianBlurScale(scale);
+
+    double tKernel, tRecursive, tAuto;
+    ImageType::Pointer eKernel = computeEdges(image, settings, FilterType::KERNEL_BLUR, tKernel);
+    ImageType::Pointer eRecursive = computeEdges(image, settings, FilterType::RECURSIVE_BLUR, tRecursive);
+    ImageType::Pointer eAuto = computeEdges(image, settings, FilterType::AUTOMATIC_BLUR, tAuto);
+
+    // The paths use different approximations of the Gaussian, so the
+    // outputs are only compared on average, in units of the output range
+    double sumDiff = 0;
+    itk::ImageRegionConstIterator<ImageType> it1(eKernel, eKernel->GetBufferedRegion());
+    itk::ImageRegionConstIterator<ImageType> it2(eRecursive, eRecursive->GetBufferedRegion());
+    for (; !it1.IsAtEnd(); ++it1, ++it2)
+        sumDiff += std::abs(it1.Get() - it2.Get());
+    double meanDiff = sumDiff / (eKernel->GetBufferedRegion().GetNumberOfPixels() * 0x7fff);
+
+    std::cout << "Edge preprocessing of " << size << "^3 voxels, scale " << scale
+        << ": kernel " << tKernel << " ms, recursive " << tRecursive
+        << " ms, mean difference " << meanDiff * 100 << "%" << std::endl;
+
+    if (meanDiff > 0.02)
+    {
+        std::cerr << "Recursive and kernel blur paths disagree" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    writeImage(eAuto, argv[4]);
+    writeImage(recursive ? eRecursive : eKernel, argv[5]);
+    return EXIT_SUCCESS;
+}
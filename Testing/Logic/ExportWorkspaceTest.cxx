@@ -0,0 +1,300 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkVectorImage.h>
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+#include "GuidedNativeImageIO.h"
+#include "IRISException.h"
+#include "LayerCache.h"
+#include "Registry.h"
+#include "WorkspaceAPI.h"
+
+typedef itk::Image<short, 3> ShortImageType;
+typedef itk::VectorImage<float, 3> VectorImageType;
+
+// A bright ball inside a darker box, with noise
+ShortImageType::Pointer makeBallImage(int size)
+{
+    ShortImageType::Pointer image = ShortImageType::New();
+    ShortImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    srand(1234);
+    itk::ImageRegionIteratorWithIndex<ShortImageType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        ShortImageType::IndexType idx = it.GetIndex();
+        double c2 = 0;
+        bool inBox = true;
+        for (int d = 0; d < 3; d++)
+        {
+            c2 += (idx[d] - 0.5 * size) * (idx[d] - 0.5 * size);
+            inBox = inBox && idx[d] > size / 8 && idx[d] < 7 * size / 8;
+        }
+        double value = (c2 < size * size / 9.0) ? 1000 : (inBox ? 400 : 0);
+        it.Set(static_cast<short>(value + rand() % 100));
+    }
+    return image;
+}
+
+template <class TImage>
+void writeImage(TImage *image, const std::string &fn)
+{
+    typedef itk::ImageFileWriter<TImage> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(fn.c_str());
+    writer->Update();
+}
+
+std::string readFile(const std::string &fn)
+{
+    std::string data;
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (!f)
+        return data;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        data.append(buffer, n);
+    fclose(f);
+    return data;
+}
+
+// Oblique geometry with unequal spacing, so that any mix-up of the axes or
+// of the RAS and LPS conventions in the exported header shows
+template <class TImage>
+void setGeometry(TImage *image)
+{
+    typename TImage::DirectionType dir;
+    double a = 0.5, c = std::cos(a), s = std::sin(a);
+    dir.SetIdentity();
+    dir(0, 0) = c; dir(0, 1) = -s;
+    dir(1, 0) = s; dir(1, 1) = c;
+    dir(2, 2) = -1.0;
+    image->SetDirection(dir);
+
+    typename TImage::SpacingType spacing;
+    spacing[0] = 0.9; spacing[1] = 1.1; spacing[2] = 2.5;
+    image->SetSpacing(spacing);
+
+    typename TImage::PointType origin;
+    origin[0] = -10.0; origin[1] = 20.0; origin[2] = 5.5;
+    image->SetOrigin(origin);
+}
+
+// Three components that differ from each other at every voxel
+VectorImageType::Pointer makeVectorImage(int size)
+{
+    VectorImageType::Pointer image = VectorImageType::New();
+    VectorImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size + 1); region.SetSize(2, size + 2);
+    image->SetRegions(region);
+    image->SetNumberOfComponentsPerPixel(3);
+    image->Allocate();
+
+    itk::ImageRegionIteratorWithIndex<VectorImageType> it(image, region);
+    VectorImageType::PixelType pixel(3);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        for (int k = 0; k < 3; k++)
+            pixel[k] = static_cast<float>(it.GetIndex()[k] + 0.25 * k + 100 * k);
+        it.Set(pixel);
+    }
+    return image;
+}
+
+SmartPtr<GuidedNativeImageIO> readImage(const std::string &fn)
+{
+    SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+    Registry hints;
+    io->ReadNativeImage(fn.c_str(), hints);
+    return io;
+}
+
+// The exported layer must hold the voxels of the input in the same type, and
+// place them at the same points in space
+bool compareLayers(const std::string &fnInput, const std::string &fnExported)
+{
+    SmartPtr<GuidedNativeImageIO> input = readImage(fnInput);
+    SmartPtr<GuidedNativeImageIO> exported = readImage(fnExported);
+
+    std::cout << fnExported << ": " << exported->GetComponentTypeAsStringInNativeImage()
+        << ", " << exported->GetNumberOfComponentsInNativeImage() << " components" << std::endl;
+
+    bool sameSize = true;
+    for (int d = 0; d < 3; d++)
+        sameSize = sameSize && exported->GetDimensionsOfNativeImage()[d] == input->GetDimensionsOfNativeImage()[d];
+    if (exported->GetComponentTypeInNativeImage() != input->GetComponentTypeInNativeImage()
+        || exported->GetNumberOfComponentsInNativeImage() != input->GetNumberOfComponentsInNativeImage()
+        || !sameSize)
+    {
+        std::cerr << "Exported layer has a different voxel type or size" << std::endl;
+        return false;
+    }
+
+    if (exported->GetNativeImageMD5Hash() != input->GetNativeImageMD5Hash())
+    {
+        std::cerr << "Exported layer has different voxels" << std::endl;
+        return false;
+    }
+
+    itk::ImageBase<3> *a = input->GetNativeImage(), *b = exported->GetNativeImage();
+    double err = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        err = std::max(err, std::fabs(a->GetSpacing()[i] - b->GetSpacing()[i]));
+        err = std::max(err, std::fabs(a->GetOrigin()[i] - b->GetOrigin()[i]));
+        for (int j = 0; j < 3; j++)
+            err = std::max(err, std::fabs(a->GetDirection()(i, j) - b->GetDirection()(i, j)));
+    }
+    if (err > 1e-4)
+    {
+        std::cerr << "Exported layer has a different geometry, error " << err << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Export a workspace with the two images into a directory, check that the
+// exported layers read back as the images they came from, and that no
+// uncompressed copies of the layers are left behind
+bool exportWorkspace(const std::string &fnMain, const std::string &fnVector,
+                     const std::string &dir, std::vector<std::string> &layers)
+{
+    itksys::SystemTools::MakeDirectory(dir.c_str());
+    std::string fnExported = dir + "/exported.itksnap";
+
+    WorkspaceAPI ws;
+    ws.SetLayer("MainRole", fnMain);
+    ws.AddLayer("OverlayRole", fnVector);
+    ws.ExportWorkspace(fnExported.c_str(), NULL, false);
+
+    WorkspaceAPI wsExported;
+    wsExported.ReadFromXMLFile(fnExported.c_str());
+    if (wsExported.GetNumberOfLayers() != 2)
+    {
+        std::cerr << "Exported workspace does not have two layers" << std::endl;
+        return false;
+    }
+
+    const std::string inputs[] = { fnMain, fnVector };
+    layers.clear();
+    for (int i = 0; i < 2; i++)
+    {
+        layers.push_back(wsExported.GetLayerActualPath(wsExported.GetLayerFolder(i)));
+        if (!compareLayers(inputs[i], layers.back()))
+            return false;
+    }
+
+    itksys::Directory listing;
+    listing.Load(dir.c_str());
+    for (unsigned long i = 0; i < listing.GetNumberOfFiles(); i++)
+    {
+        std::string fn = listing.GetFile(i);
+        if (fn != "." && fn != ".." && fn.find(".nii.gz") == std::string::npos
+            && fn.find(".itksnap") == std::string::npos)
+        {
+            std::cerr << "Unexpected file " << fn << " in the export" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Remove the layer files from the cache, keeping the keys that refer to them,
+// as happens when another process prunes the cache
+void removeCachedFiles(const std::string &dir)
+{
+    itksys::Directory listing;
+    listing.Load(dir.c_str());
+    for (unsigned long i = 0; i < listing.GetNumberOfFiles(); i++)
+    {
+        std::string fn = listing.GetFile(i);
+        if (fn.length() == 32 && fn.find('.') == std::string::npos)
+            itksys::SystemTools::RemoveFile((dir + "/" + fn).c_str());
+    }
+}
+
+// Export a workspace with an oblique scalar image and a vector image, and
+// check that the exported layers read back as the images they came from.
+// With the layer cache, a second export copies the layers of the first, and
+// the layers are compressed again once their files are gone from the cache
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " size work_dir" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int size = atoi(argv[1]);
+    std::string dir = itksys::SystemTools::CollapseFullPath(argv[2]);
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+    itksys::SystemTools::MakeDirectory(dir.c_str());
+
+    std::string fnMain = dir + "/main.mha", fnVector = dir + "/vector.mha";
+    ShortImageType::Pointer main = makeBallImage(size);
+    setGeometry<ShortImageType>(main);
+    writeImage<ShortImageType>(main, fnMain);
+
+    VectorImageType::Pointer vector = makeVectorImage(size);
+    setGeometry<VectorImageType>(vector);
+    writeImage<VectorImageType>(vector, fnVector);
+
+    try
+    {
+        // The cache is off unless it is asked for
+        std::vector<std::string> layers, layersCached;
+        if (LayerCache::GetDirectory().size())
+        {
+            std::cerr << "The layer cache is on by default" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!exportWorkspace(fnMain, fnVector, dir + "/export", layers))
+            return EXIT_FAILURE;
+
+        std::string dirCache = dir + "/cache";
+        LayerCache::SetDirectory(dirCache);
+        if (!exportWorkspace(fnMain, fnVector, dir + "/export_first", layers)
+            || !exportWorkspace(fnMain, fnVector, dir + "/export_cached", layersCached))
+            return EXIT_FAILURE;
+        for (int i = 0; i < 2; i++)
+        {
+            if (readFile(layersCached[i]) != readFile(layers[i]))
+            {
+                std::cerr << "Layer exported from the cache differs from the first export" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        removeCachedFiles(dirCache);
+        if (!exportWorkspace(fnMain, fnVector, dir + "/export_pruned", layers))
+            return EXIT_FAILURE;
+        LayerCache::SetDirectory("");
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (itk::ExceptionObject &exc)
+    {
+        std::cerr << exc << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "itksys/Directory.hxx"
+#include "itksys/SystemTools.hxx"
+#include "LayerCache.h"
+#include "ParallelFileUploader.h"
+
+// Bytes that do not compress, like a compressed layer
+std::string randomData(size_t size)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (rand() % 256);
+    return data;
+}
+
+bool writeFile(const std::string &fn, const std::string &data)
+{
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+std::string readFile(const std::string &fn)
+{
+    std::string data;
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (!f)
+        return data;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        data.append(buffer, n);
+    fclose(f);
+    return data;
+}
+
+// Total size of the content files in the store, which are named by MD5
+unsigned long long storedSize(const std::string &dir, int &n_files)
+{
+    unsigned long long total = 0;
+    n_files = 0;
+    itksys::Directory d;
+    d.Load(dir.c_str());
+    for (unsigned long i = 0; i < d.GetNumberOfFiles(); i++)
+    {
+        std::string name = d.GetFile(i);
+        if (name.length() == 32 && name.find('.') == std::string::npos)
+        {
+            total += itksys::SystemTools::FileLength((dir + "/" + name).c_str());
+            n_files++;
+        }
+    }
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " store_directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string dir = itksys::SystemTools::CollapseFullPath(argv[1]);
+    std::string work = dir + "_files";
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+    itksys::SystemTools::MakeDirectory(work.c_str());
+    LayerCache::SetDirectory(dir);
+    LayerCache::SetMaximumSize(1ull << 30);
+    srand(1234);
+
+    // A layer exported once is found again by its key, with the same bytes
+    std::string data = randomData(1 << 20);
+    std::string fn = work + "/layer.nii.gz";
+    writeFile(fn, data);
+    std::string md5 = ParallelFileUploader::ComputeFileMD5(fn.c_str());
+    std::string key = "0123456789abcdef0123456789abcdef";
+
+    if (LayerCache::FindLayer(key).size())
+    {
+        std::cerr << "Layer found before it was stored" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!LayerCache::AddLayer(key, fn))
+    {
+        std::cerr << "Layer could not be stored" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::string fn_cached = LayerCache::FindLayer(key);
+    if (fn_cached.empty() || readFile(fn_cached) != data)
+    {
+        std::cerr << "Stored layer not found by its key" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (LayerCache::FindContent(md5) != fn_cached)
+    {
+        std::cerr << "Stored layer not found by its MD5" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // A damaged file is not returned, and is removed from the store
+    std::string damaged = data;
+    damaged[100] = (char) (damaged[100] + 1);
+    writeFile(fn_cached, damaged);
+    if (LayerCache::FindLayer(key).size() || itksys::SystemTools::FileExists(fn_cached.c_str()))
+    {
+        std::cerr << "Damaged layer was returned or kept" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Old files are removed when the store grows past its maximum size
+    LayerCache::SetMaximumSize(5 << 19);
+    for (int i = 0; i < 4; i++)
+    {
+        std::string fn_i = work + "/content.bin";
+        writeFile(fn_i, randomData(1 << 20));
+        LayerCache::AddContent(ParallelFileUploader::ComputeFileMD5(fn_i.c_str()), fn_i);
+    }
+    int n_stored;
+    unsigned long long size = storedSize(dir, n_stored);
+    if (size > LayerCache::GetMaximumSize() || n_stored != 2)
+    {
+        std::cerr << n_stored << " files of " << size << " bytes stored" << std::endl;
+        std::cerr << "Store was not pruned to its maximum size" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // An empty directory turns the store off
+    LayerCache::SetDirectory("");
+    if (LayerCache::AddContent(md5, fn) || LayerCache::FindContent(md5).size())
+    {
+        std::cerr << "Store used while turned off" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+    itksys::SystemTools::RemoveADirectory(work.c_str());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#include <cstdlib>
+#include <iostream>
+#include <set>
+
+#include <itkImage.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkTimeProbe.h>
+#include "RLERegionOfInterestImageFilter.h"
+#include "MultiLabelMeshPipeline.h"
+#include "vtkPolyData.h"
+
+typedef MultiLabelMeshPipeline::InputImageType LabelRLEImageType;
+typedef itk::Image<LabelType, 3> LabelImageType;
+
+// Synthetic parcellation: a ball divided into the Voronoi cells of randomly
+// placed seeds, one label per cell
+LabelRLEImageType::Pointer makeParcellation(int size, int nLabels)
+{
+    LabelImageType::Pointer image = LabelImageType::New();
+    LabelImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    srand(1234);
+    std::vector<itk::Index<3> > seeds(nLabels);
+    for (int i = 0; i < nLabels; i++)
+        for (int d = 0; d < 3; d++)
+            seeds[i][d] = size / 8 + rand() % (3 * size / 4);
+
+    double r2 = 0.25 * 0.9 * 0.9 * size * size;
+    itk::ImageRegionIteratorWithIndex<LabelImageType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        itk::Index<3> idx = it.GetIndex();
+        double c2 = 0;
+        for (int d = 0; d < 3; d++)
+            c2 += (idx[d] - 0.5 * size) * (idx[d] - 0.5 * size);
+        if (c2 > r2)
+        {
+            it.Set(0);
+            continue;
+        }
+
+        long best = -1, bestDist = 0;
+        for (int i = 0; i < nLabels; i++)
+        {
+            long dist = 0;
+            for (int d = 0; d < 3; d++)
+                dist += (idx[d] - seeds[i][d]) * (idx[d] - seeds[i][d]);
+            if (best < 0 || dist < bestDist)
+            {
+                best = i;
+                bestDist = dist;
+            }
+        }
+        it.Set(best + 1);
+    }
+
+    typedef itk::RegionOfInterestImageFilter<LabelImageType, LabelRLEImageType> ConverterType;
+    ConverterType::Pointer conv = ConverterType::New();
+    conv->SetInput(image);
+    conv->SetRegionOfInterest(region);
+    conv->Update();
+    return conv->GetOutput();
+}
+
+// Mesh all labels with a fresh pipeline and report time and mesh sizes
+std::set<LabelType> timeMeshing(LabelRLEImageType *image, const char *name,
+    MultiLabelMeshPipeline::MeshingMode mode, int nThreads, unsigned long slabSize = 0)
+{
+    MultiLabelMeshPipeline::Pointer pipeline = MultiLabelMeshPipeline::New();
+    pipeline->SetImage(image);
+    pipeline->SetMeshingMode(mode);
+    pipeline->SetNumberOfThreads(nThreads);
+    if (slabSize > 0)
+        pipeline->SetSinglePassSlabSize(slabSize);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    pipeline->UpdateMeshes(NULL);
+    tp.Stop();
+
+    std::set<LabelType> labels;
+    vtkIdType nCells = 0;
+    const MultiLabelMeshPipeline::MeshInfoMap &mi = pipeline->GetMeshInfo();
+    for (MultiLabelMeshPipeline::MeshInfoMap::const_iterator it = mi.begin(); it != mi.end(); ++it)
+    {
+        if (it->second.Mesh && it->second.Mesh->GetNumberOfCells() > 0)
+        {
+            labels.insert(it->first);
+            nCells += it->second.Mesh->GetNumberOfCells();
+        }
+    }
+
+    std::cout << name << ": " << tp.GetMean() * 1000 << " ms, "
+        << labels.size() << " meshes, " << nCells << " cells" << std::endl;
+    return labels;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 128;
+    int nLabels = argc > 2 ? atoi(argv[2]) : 150;
+
+    std::cout << "Parcellation of " << size << "^3 voxels with " << nLabels << " labels" << std::endl;
+    LabelRLEImageType::Pointer image = makeParcellation(size, nLabels);
+
+    std::set<LabelType> l1 = timeMeshing(image, "per label, 1 thread",
+        MultiLabelMeshPipeline::PER_LABEL_MESHING, 1);
+    std::set<LabelType> l2 = timeMeshing(image, "per label, all threads",
+        MultiLabelMeshPipeline::PER_LABEL_MESHING, 0);
+    std::set<LabelType> l3 = timeMeshing(image, "single pass",
+        MultiLabelMeshPipeline::SINGLE_PASS_MESHING, 0);
+
+    // Slabs of about 8 slices, so that the sweep crosses several slab borders
+    std::set<LabelType> l4 = timeMeshing(image, "single pass in slabs",
+        MultiLabelMeshPipeline::SINGLE_PASS_MESHING, 0, 8ul * size * size);
+
+    if (l1 != l2 || l1 != l3 || l1 != l4)
+    {
+        std::cerr << "Meshing modes produced meshes for different labels" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#include <itkImage.h>
+#include <itkVectorImage.h>
+#include <itkImageRegionIterator.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkTimeProbe.h>
+#include "MomentTextures.h"
+
+typedef itk::Image<short, 3> InputImageType;
+typedef itk::VectorImage<short, 3> TextureImageType;
+typedef bilwaj::MomentTextureFilter<InputImageType, TextureImageType> MomentFilterType;
+
+// Synthetic image: a few overlapping blobs of different intensity on a
+// noisy background
+InputImageType::Pointer makeImage(int size)
+{
+    InputImageType::Pointer image = InputImageType::New();
+    InputImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    srand(1234);
+    itk::ImageRegionIteratorWithIndex<InputImageType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        itk::Index<3> idx = it.GetIndex();
+        double value = 100 + rand() % 50;
+        for (int b = 0; b < 3; b++)
+        {
+            double c2 = 0;
+            for (int d = 0; d < 3; d++)
+            {
+                double c = (b + 1) * size / 4.0;
+                c2 += (idx[d] - c) * (idx[d] - c);
+            }
+            if (c2 < size * size / 25.0)
+                value += 400 * (b + 1);
+        }
+        it.Set(static_cast<short>(value));
+    }
+    return image;
+}
+
+TextureImageType::Pointer computeTextures(InputImageType *image, int radius,
+    bool runningSums, double &time)
+{
+    MomentFilterType::SizeType r;
+    r.Fill(radius);
+
+    MomentFilterType::Pointer filter = MomentFilterType::New();
+    filter->SetInput(image);
+    filter->SetRadius(r);
+    filter->SetHighestDegree(3);
+    filter->SetUseRunningSums(runningSums);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    filter->Update();
+    tp.Stop();
+    time = tp.GetMean() * 1000;
+
+    TextureImageType::Pointer result = filter->GetOutput();
+    result->DisconnectPipeline();
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    int size = argc > 1 ? atoi(argv[1]) : 64;
+    InputImageType::Pointer image = makeImage(size);
+    std::cout << "Moment textures of degree 3 on " << size << "^3 voxels" << std::endl;
+
+    int radii[] = { 1, 2, 3, 5 };
+    bool ok = true;
+    for (int i = 0; i < 4; i++)
+    {
+        double tNeighborhood, tRunningSums;
+        TextureImageType::Pointer t1 = computeTextures(image, radii[i], false, tNeighborhood);
+        TextureImageType::Pointer t2 = computeTextures(image, radii[i], true, tRunningSums);
+
+        // The results are scaled by 1000 and truncated, so they can differ by
+        // one where the moments computed in float and double round differently
+        int maxDiff = 0;
+        itk::ImageRegionIterator<TextureImageType> it1(t1, t1->GetBufferedRegion());
+        itk::ImageRegionIterator<TextureImageType> it2(t2, t2->GetBufferedRegion());
+        for (; !it1.IsAtEnd(); ++it1, ++it2)
+        {
+            TextureImageType::PixelType p1 = it1.Get(), p2 = it2.Get();
+            for (unsigned int k = 0; k < p1.GetSize(); k++)
+                maxDiff = std::max(maxDiff, std::abs(p1[k] - p2[k]));
+        }
+
+        std::cout << "radius " << radii[i] << ": neighborhoods " << tNeighborhood
+            << " ms, running sums " << tRunningSums << " ms, max difference "
+            << maxDiff << std::endl;
+        if (maxDiff > 1)
+            ok = false;
+    }
+
+    if (!ok)
+    {
+        std::cerr << "Running sums do not match the neighborhood moments" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
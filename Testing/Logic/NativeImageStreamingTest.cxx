@@ -0,0 +1,196 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkTimeProbe.h>
+#include "GuidedNativeImageIO.h"
+#include "Registry.h"
+
+typedef itk::Image<GreyType, 3> GreyImageType;
+
+void writeImage(GreyImageType *image, const std::string &filename)
+{
+    typedef itk::ImageFileWriter<GreyImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(filename);
+    writer->Update();
+}
+
+std::string readFile(const std::string &filename)
+{
+    std::string data;
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f)
+        return data;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        data.append(buffer, n);
+    fclose(f);
+    return data;
+}
+
+bool writeFile(const std::string &filename, const std::string &data)
+{
+    FILE *f = fopen(filename.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Synthetic float volume with a smooth non-integer ramp and a bright ball,
+// so that loading it requires rescaling to the internal type. The file is
+// written one row at a time
+bool writeFloatImage(int size, const char *fn)
+{
+    FILE *f = fopen(fn, "wb");
+    if (!f)
+        return false;
+
+    fprintf(f, "ObjectType = Image\nNDims = 3\nBinaryData = True\n"
+        "BinaryDataByteOrderMSB = False\nDimSize = %d %d %d\n"
+        "ElementType = MET_FLOAT\nElementDataFile = LOCAL\n", size, size, size);
+
+    std::vector<float> row(size);
+    bool ok = true;
+    for (int z = 0; z < size; z++)
+    {
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                double c2 = (x - 0.5 * size) * (x - 0.5 * size)
+                    + (y - 0.5 * size) * (y - 0.5 * size) + (z - 0.5 * size) * (z - 0.5 * size);
+                row[x] = static_cast<float>(0.37 * x - 0.11 * z + ((c2 < size * size / 9.0) ? 250.5 : 0));
+            }
+            ok = ok && fwrite(&row[0], sizeof(float), size, f) == (size_t) size;
+        }
+    }
+    return fclose(f) == 0 && ok;
+}
+
+enum LoadMode { LOAD_WHOLE, LOAD_SLABS, LOAD_MAPPED };
+
+// Load the image and rescale it to the internal type, the way SNAP loads
+// anatomical images
+GreyImageType::Pointer loadImage(const char *fn, LoadMode mode, double &scale, double &shift)
+{
+    SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+    io->SetStreamingThreshold(mode == LOAD_SLABS ? 1 : 0);
+    io->SetStreamingSlabSize(1 << 20);
+    io->SetMappingThreshold(mode == LOAD_MAPPED ? 1 : 0);
+
+    Registry hints;
+    io->ReadNativeImage(fn, hints);
+    if (io->IsNativeImageStreamed() != (mode == LOAD_SLABS)
+        || io->IsNativeImageMapped() != (mode == LOAD_MAPPED))
+    {
+        std::cerr << "The image was not loaded the way requested" << std::endl;
+        return NULL;
+    }
+
+    RescaleNativeImageToIntegralType<GreyImageType> rescaler;
+    GreyImageType::Pointer image = rescaler(io);
+    scale = rescaler.GetNativeScale();
+    shift = rescaler.GetNativeShift();
+    io->DeallocateNativeImage();
+    return image;
+}
+
+// Whether a NIfTI file is mapped into memory, after setting the intensity
+// scaling in its header. The ImageIO applies the scaling as it reads the
+// file, so a file with scaling must be read rather than mapped
+bool isNiftiMapped(const std::string &fn, float slope, float inter)
+{
+    std::string data = readFile(fn);
+    memcpy(&data[112], &slope, sizeof(float));
+    memcpy(&data[116], &inter, sizeof(float));
+    writeFile(fn, data);
+
+    SmartPtr<GuidedNativeImageIO> io = GuidedNativeImageIO::New();
+    io->SetMappingThreshold(1);
+    Registry hints;
+    io->ReadNativeImage(fn.c_str(), hints);
+    return io->IsNativeImageMapped();
+}
+
+// Load a float image in slabs, mapped into memory or whole, and write it
+// along with the image loaded whole (or in slabs, if it was loaded whole),
+// for itkTestDriver to compare
+int main(int argc, char *argv[])
+{
+    if (argc < 6)
+    {
+        std::cerr << "Usage: " << argv[0]
+            << " size slabs|mapped|whole input.mha output reference" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int size = atoi(argv[1]);
+    LoadMode mode = strcmp(argv[2], "slabs") == 0 ? LOAD_SLABS
+        : (strcmp(argv[2], "mapped") == 0 ? LOAD_MAPPED : LOAD_WHOLE);
+    const char *fn = argv[3];
+
+    if (!writeFloatImage(size, fn))
+    {
+        std::cerr << "Failed to write the input image" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    double scale, shift;
+    itk::TimeProbe tp;
+    tp.Start();
+    GreyImageType::Pointer image = loadImage(fn, mode, scale, shift);
+    tp.Stop();
+    if (!image)
+        return EXIT_FAILURE;
+
+    std::cout << "Float image of " << size << "^3 voxels read " << argv[2] << ": "
+        << tp.GetMean() * 1000 << " ms" << std::endl;
+
+    // Reference result
+    double refScale, refShift;
+    GreyImageType::Pointer reference = loadImage(
+        fn, mode == LOAD_WHOLE ? LOAD_SLABS : LOAD_WHOLE, refScale, refShift);
+    remove(fn);
+    if (!reference)
+        return EXIT_FAILURE;
+
+    if (scale != refScale || shift != refShift)
+    {
+        std::cerr << "Native mapping differs: scale " << scale << " vs " << refScale
+            << ", shift " << shift << " vs " << refShift << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // A NIfTI file is only mapped if its header declares no scaling
+    if (mode == LOAD_MAPPED)
+    {
+        std::string fnNifti = std::string(fn) + ".nii";
+        writeImage(image, fnNifti);
+        bool mappedPlain = isNiftiMapped(fnNifti, 1.0f, 0.0f);
+        bool mappedScaled = isNiftiMapped(fnNifti, 2.0f, 0.0f);
+        remove(fnNifti.c_str());
+        if (!mappedPlain)
+        {
+            std::cerr << "NIfTI file without scaling was not mapped" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (mappedScaled)
+        {
+            std::cerr << "NIfTI file with scaling was mapped" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    writeImage(image, argv[4]);
+    writeImage(reference, argv[5]);
+    return EXIT_SUCCESS;
+}
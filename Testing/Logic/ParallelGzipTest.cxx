@@ -0,0 +1,165 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <itk_zlib.h>
+#include <itkMultiThreader.h>
+#include <itkTimeProbe.h>
+#include "itksys/SystemTools.hxx"
+#include "ParallelGzipCompressor.h"
+#include "IRISException.h"
+
+// Image-like bytes: smooth ramps with noise and runs of background, so that
+// the data compress about as well as a segmentation or an MRI volume
+std::string makeImageLikeData(size_t size)
+{
+    std::string data(size, 0);
+    srand(1234);
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t row = (i / 512) % 512;
+        if (row >= 128)
+            data[i] = static_cast<char>((i % 512) / 4 + row / 8 + rand() % 8);
+    }
+    return data;
+}
+
+bool writeFile(const std::string &fn, const std::string &data)
+{
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// Compress a few bytes with a block size of zero, which is taken as one byte
+bool compressTinyBlocks(const std::string &prefix)
+{
+    std::string data = makeImageLikeData(1000);
+    std::string fnRaw = prefix + "_tiny.raw", fnGz = prefix + "_tiny.gz";
+    if (!writeFile(fnRaw, data))
+        return false;
+
+    ParallelGzipCompressor gz;
+    gz.SetBlockSize(0);
+    gz.CompressFile(fnRaw.c_str(), fnGz.c_str());
+
+    std::vector<char> check(data.size() + 1);
+    gzFile gzp = gzopen(fnGz.c_str(), "rb");
+    int n = gzp ? gzread(gzp, &check[0], (unsigned) check.size()) : -1;
+    int rc = gzp ? gzclose(gzp) : Z_ERRNO;
+    remove(fnRaw.c_str());
+    remove(fnGz.c_str());
+
+    return gz.GetBlockSize() == 1 && n == (int) data.size() && rc == Z_OK
+        && memcmp(&check[0], data.data(), data.size()) == 0;
+}
+
+// Compress a file on all threads, and check that any gzip reader gets the
+// file back, and that little is lost to compressing the blocks separately.
+// The time taken on all threads and by single-threaded zlib is printed
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " size_in_mb work_prefix" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t size = atoi(argv[1]) * (size_t) (1 << 20);
+    std::string data = makeImageLikeData(size);
+
+    std::string prefix = argv[2];
+    std::string fnRaw = prefix + ".raw";
+    std::string fnParallel = prefix + "_parallel.gz";
+    std::string fnSerial = prefix + "_serial.gz";
+    if (!writeFile(fnRaw, data))
+    {
+        std::cerr << "Failed to write the input file" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Compress on all threads
+    itk::TimeProbe tp;
+    tp.Start();
+    try
+    {
+        ParallelGzipCompressor gz;
+        gz.CompressFile(fnRaw.c_str(), fnParallel.c_str());
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+    tp.Stop();
+
+    // Reference: single-threaded zlib, the way NIfTI files used to be written
+    itk::TimeProbe tpRef;
+    tpRef.Start();
+    gzFile gzs = gzopen(fnSerial.c_str(), "wb");
+    if (size)
+        gzwrite(gzs, data.data(), (unsigned) size);
+    gzclose(gzs);
+    tpRef.Stop();
+
+    unsigned long sizeParallel = itksys::SystemTools::FileLength(fnParallel.c_str());
+    unsigned long sizeSerial = itksys::SystemTools::FileLength(fnSerial.c_str());
+    int nThreads = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+
+    std::cout << (size >> 20) << " MB compressed on " << nThreads << " threads: "
+        << tp.GetMean() * 1000 << " ms, " << sizeParallel << " bytes" << std::endl;
+    std::cout << "single thread: " << tpRef.GetMean() * 1000 << " ms, "
+        << sizeSerial << " bytes" << std::endl;
+
+    // The output must be a gzip file that any reader accepts, with the same
+    // content as the input
+    std::vector<char> check(size + 1);
+    gzFile gzp = gzopen(fnParallel.c_str(), "rb");
+    int n = gzp ? gzread(gzp, &check[0], (unsigned) check.size()) : -1;
+    int rc = gzp ? gzclose(gzp) : Z_ERRNO;
+
+    remove(fnRaw.c_str());
+    remove(fnParallel.c_str());
+    remove(fnSerial.c_str());
+
+    if (n != (int) size || rc != Z_OK)
+    {
+        std::cerr << "Read back " << n << " bytes of " << size
+            << ", gzclose returned " << rc << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (size && memcmp(&check[0], data.data(), size) != 0)
+    {
+        std::cerr << "Decompressed data differ from the input" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        if (!compressTinyBlocks(prefix))
+        {
+            std::cerr << "Compressing with a block size of zero failed" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Blocks are primed with the preceding data, so little should be lost
+    if (sizeParallel > sizeSerial + sizeSerial / 20 + 64)
+    {
+        std::cerr << "Parallel output is much larger than the serial one" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,493 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+
+// The stand-in server below uses POSIX sockets
+int main(int, char *[])
+{
+    std::cout << "ParallelUploadTest is not supported on Windows" << std::endl;
+    return EXIT_SUCCESS;
+}
+
+#else
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+#include <itkMutexLockHolder.h>
+#include <itkTimeProbe.h>
+#include "itksys/MD5.h"
+#include "itksys/SystemTools.hxx"
+#include "ParallelFileUploader.h"
+#include "IRISException.h"
+
+typedef itk::MutexLockHolder<itk::SimpleFastMutexLock> LockHolder;
+
+const char *UploadURL = "api/tickets/1/files/input";
+
+std::string computeMD5(const std::string &data)
+{
+    char hex[33];
+    hex[32] = 0;
+    itksysMD5 *md5 = itksysMD5_New();
+    itksysMD5_Initialize(md5);
+    itksysMD5_Append(md5, (const unsigned char *) data.data(), (int) data.size());
+    itksysMD5_FinalizeHex(md5, hex);
+    itksysMD5_Delete(md5);
+    return hex;
+}
+
+// Bytes that do not compress, like an already compressed file
+std::string randomData(size_t size)
+{
+    std::string data(size, 0);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (char) (rand() % 256);
+    return data;
+}
+
+bool writeFile(const std::string &fn, const std::string &data)
+{
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+}
+
+// A minimal HTTP/1.1 server that accepts the multipart uploads of RESTClient
+// over keep-alive connections, checks the MD5 sent with each file, and
+// answers with the MD5 of the file it stored. It fails the first attempt to
+// send one of the files, and damages the first copy of another as it stores
+// it. Files are stored by MD5, and the server takes a file it has already
+// when asked for it by its MD5. In plain mode, the server answers uploads
+// with "OK" instead of the MD5 and does not know the request for a file it
+// has, like the servers in use
+struct TestServer
+{
+    int ListenSocket, Port;
+    bool Stop, Plain;
+    std::string FailFile, CorruptFile;
+    bool Failed, Corrupted;
+    int Connections, Uploads, Queries;
+    std::map<std::string, std::string> Received, Stored;
+    std::vector<std::string> Errors;
+    itk::SimpleFastMutexLock Mutex;
+
+    // Take a file the server has already, named in a url-encoded post, and
+    // answer with its MD5. A file the server does not have is answered with
+    // a plain "OK", like a server that ignores the request would, which the
+    // client must not take to mean the file has arrived
+    int HandleKnown(const std::string &body, std::string &reply)
+    {
+        std::map<std::string, std::string> fields;
+        std::istringstream iss(body);
+        std::string pair;
+        while (std::getline(iss, pair, '&'))
+            fields[pair.substr(0, pair.find('='))] = pair.substr(pair.find('=') + 1);
+
+        LockHolder holder(Mutex);
+        Queries++;
+        if (Plain)
+            return 404;
+        if (!Stored.count(fields["md5"]))
+            return 200;
+        Received[fields["filename"]] = Stored[fields["md5"]];
+        reply = fields["md5"];
+        return 200;
+    }
+
+    // Handle one complete request, returning the response code and the body
+    // of a successful response
+    int Handle(const std::string &head, const std::string &body, std::string &reply)
+    {
+        std::string known_line = "POST /" + std::string(UploadURL) + "/known ";
+        if (head.compare(0, known_line.size(), known_line) == 0)
+            return HandleKnown(body, reply);
+
+        std::string request_line = "POST /" + std::string(UploadURL) + " ";
+        if (head.compare(0, request_line.size(), request_line) != 0)
+            return 404;
+
+        size_t pb = head.find("boundary=");
+        if (pb == std::string::npos)
+            return 400;
+        std::string boundary = "--" + head.substr(pb + 9, head.find("\r\n", pb) - pb - 9);
+
+        // Split the body into its parts
+        std::map<std::string, std::string> fields;
+        size_t pos = body.find(boundary);
+        while (pos != std::string::npos)
+        {
+            size_t start = pos + boundary.size() + 2;
+            size_t next = body.find("\r\n" + boundary, start);
+            if (next == std::string::npos)
+                break;
+            std::string part = body.substr(start, next - start);
+            size_t hend = part.find("\r\n\r\n");
+            size_t pn = part.find("name=\"");
+            if (hend != std::string::npos && pn != std::string::npos && pn < hend)
+            {
+                std::string name = part.substr(pn + 6, part.find('"', pn + 6) - pn - 6);
+                fields[name] = part.substr(hend + 4);
+            }
+            pos = next + 2;
+        }
+
+        std::string fn = fields["filename"];
+        LockHolder holder(Mutex);
+        Uploads++;
+        if (fn == FailFile && !Failed)
+        {
+            Failed = true;
+            return 500;
+        }
+        if (computeMD5(fields["myfile"]) != fields["md5"])
+        {
+            Errors.push_back("MD5 mismatch for " + fn);
+            return 400;
+        }
+        std::string stored = fields["myfile"];
+        if (fn == CorruptFile && !Corrupted && stored.size())
+        {
+            Corrupted = true;
+            stored[0] = (char) (stored[0] + 1);
+        }
+        Received[fn] = stored;
+        Stored[computeMD5(stored)] = stored;
+        if (!Plain)
+            reply = computeMD5(stored);
+        return 200;
+    }
+
+    void Run()
+    {
+        std::map<int, std::string> clients;
+        while (true)
+        {
+            {
+                LockHolder holder(Mutex);
+                if (Stop)
+                    break;
+            }
+
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(ListenSocket, &fds);
+            int maxfd = ListenSocket;
+            for (std::map<int, std::string>::iterator it = clients.begin(); it != clients.end(); ++it)
+            {
+                FD_SET(it->first, &fds);
+                maxfd = std::max(maxfd, it->first);
+            }
+
+            timeval tv = { 0, 100000 };
+            if (select(maxfd + 1, &fds, NULL, NULL, &tv) <= 0)
+                continue;
+
+            if (FD_ISSET(ListenSocket, &fds))
+            {
+                int s = accept(ListenSocket, NULL, NULL);
+                if (s >= 0)
+                {
+                    clients[s] = std::string();
+                    LockHolder holder(Mutex);
+                    Connections++;
+                }
+            }
+
+            std::vector<int> closed;
+            for (std::map<int, std::string>::iterator it = clients.begin(); it != clients.end(); ++it)
+            {
+                if (!FD_ISSET(it->first, &fds))
+                    continue;
+
+                char buffer[65536];
+                ssize_t n = recv(it->first, buffer, sizeof(buffer), 0);
+                if (n <= 0)
+                {
+                    closed.push_back(it->first);
+                    continue;
+                }
+
+                // Answer the request once all of it has arrived
+                std::string &data = it->second;
+                data.append(buffer, n);
+                size_t hend = data.find("\r\n\r\n");
+                if (hend == std::string::npos)
+                    continue;
+
+                std::string head = data.substr(0, hend + 2);
+                size_t length = 0;
+                for (size_t p = 0; (p = head.find("\r\n", p)) != std::string::npos; p += 2)
+                    if (strncasecmp(head.c_str() + p + 2, "Content-Length:", 15) == 0)
+                        length = strtoul(head.c_str() + p + 17, NULL, 10);
+                if (data.size() < hend + 4 + length)
+                    continue;
+
+                std::string reply = "OK";
+                int code = Handle(head, data.substr(hend + 4, length), reply);
+                data.erase(0, hend + 4 + length);
+
+                std::ostringstream oss;
+                std::string text = (code == 200) ? reply : "Error";
+                oss << "HTTP/1.1 " << code << " " << ((code == 200) ? "OK" : "Error") << "\r\n"
+                    << "Content-Type: text/plain\r\n"
+                    << "Content-Length: " << text.size() << "\r\n\r\n" << text;
+                std::string response = oss.str();
+                if (send(it->first, response.c_str(), response.size(), 0) != (ssize_t) response.size())
+                    closed.push_back(it->first);
+            }
+
+            for (size_t i = 0; i < closed.size(); i++)
+            {
+                close(closed[i]);
+                clients.erase(closed[i]);
+            }
+        }
+
+        for (std::map<int, std::string>::iterator it = clients.begin(); it != clients.end(); ++it)
+            close(it->first);
+    }
+
+    static ITK_THREAD_RETURN_TYPE ThreadCallback(void *arg)
+    {
+        itk::MultiThreader::ThreadInfoStruct *ti = static_cast<itk::MultiThreader::ThreadInfoStruct *>(arg);
+        static_cast<TestServer *>(ti->UserData)->Run();
+        return ITK_THREAD_RETURN_VALUE;
+    }
+};
+
+// Progress may go back when a file is sent again, so only the last is kept
+void storeProgress(void *data, double progress)
+{
+    *static_cast<double *>(data) = progress;
+}
+
+// Upload the files on several threads. Files are added while earlier ones are
+// being sent, the way the exporter adds the layers
+std::string upload(const std::vector<std::string> &files, int n_threads,
+                   int &retried, int &known, double &progress)
+{
+    try
+    {
+        ParallelFileUploader uploader;
+        uploader.SetNumberOfThreads(n_threads);
+        uploader.Start(UploadURL);
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            uploader.AddFile(files[i].c_str());
+            if (i % 3 == 0)
+                itksys::SystemTools::Delay(30);
+        }
+        uploader.Finish(&progress, storeProgress);
+        retried = uploader.GetNumberOfRetriedFiles();
+        known = uploader.GetNumberOfKnownFiles();
+    }
+    catch (IRISException &exc)
+    {
+        return exc.what();
+    }
+    return std::string();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " n_files work_directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int n_files = atoi(argv[1]);
+    int n_threads = 4;
+    signal(SIGPIPE, SIG_IGN);
+
+    // Start the server on a free port
+    TestServer server;
+    server.ListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+    if (bind(server.ListenSocket, (sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(server.ListenSocket, 16) != 0
+        || getsockname(server.ListenSocket, (sockaddr *) &addr, &addr_len) != 0)
+    {
+        std::cerr << "Failed to start the test server" << std::endl;
+        return EXIT_FAILURE;
+    }
+    server.Port = ntohs(addr.sin_port);
+    server.Stop = false;
+    server.Plain = false;
+    server.Failed = false;
+    server.Corrupted = false;
+    server.Connections = 0;
+    server.Uploads = 0;
+    server.Queries = 0;
+
+    itk::MultiThreader::Pointer mt = itk::MultiThreader::New();
+    itk::ThreadIdType server_thread = mt->SpawnThread(&TestServer::ThreadCallback, &server);
+
+    std::ostringstream url;
+    url << "http://127.0.0.1:" << server.Port;
+    setenv("ITKSNAP_WT_DSS_SERVER", url.str().c_str(), 1);
+
+    // Files of different sizes, like the layers of a workspace
+    std::string dir = argv[2];
+    itksys::SystemTools::MakeDirectory(dir.c_str());
+    std::vector<std::string> files, contents;
+    srand(1234);
+    for (int i = 0; i < n_files; i++)
+    {
+        char fn[256];
+        sprintf(fn, "%s/layer_%03d.nii.gz", dir.c_str(), i);
+        std::string data = randomData(((i % 4) + 1) * 300000 + rand() % 1000);
+
+        writeFile(fn, data);
+        files.push_back(fn);
+        contents.push_back(data);
+    }
+    server.FailFile = itksys::SystemTools::GetFilenameName(files[n_files / 2]);
+    server.CorruptFile = itksys::SystemTools::GetFilenameName(files[n_files / 4]);
+
+    double progress = 0.0;
+    int retried = 0, known = 0;
+    itk::TimeProbe tp;
+    tp.Start();
+    std::string error = upload(files, n_threads, retried, known, progress);
+    tp.Stop();
+    int first_uploads = server.Uploads;
+
+    // Submit the files again with only the first one changed, which is the
+    // only one that should be sent
+    int retried_again = 0, known_again = 0;
+    double progress_again = 0.0;
+    if (error.empty())
+    {
+        contents[0][0] = (char) (contents[0][0] + 1);
+        writeFile(files[0], contents[0]);
+        error = upload(files, n_threads, retried_again, known_again, progress_again);
+    }
+    int second_uploads = server.Uploads;
+
+    // A server that answers "OK" instead of the MD5 takes the upload as it
+    // is, and one that does not know the request for a file it has is sent
+    // all the files
+    int queries = server.Queries;
+    int retried_plain = 0, known_plain = 0;
+    double progress_plain = 0.0;
+    if (error.empty())
+    {
+        {
+            LockHolder holder(server.Mutex);
+            server.Plain = true;
+        }
+        contents[1][0] = (char) (contents[1][0] + 1);
+        writeFile(files[1], contents[1]);
+        error = upload(files, n_threads, retried_plain, known_plain, progress_plain);
+    }
+
+    {
+        LockHolder holder(server.Mutex);
+        server.Stop = true;
+    }
+    mt->TerminateThread(server_thread);
+    close(server.ListenSocket);
+
+    for (int i = 0; i < n_files; i++)
+        remove(files[i].c_str());
+    itksys::SystemTools::RemoveADirectory(dir.c_str());
+
+    std::cout << n_files << " files uploaded on " << n_threads << " threads in "
+        << tp.GetMean() * 1000 << " ms, " << server.Uploads << " uploads and "
+        << server.Queries << " queries over " << server.Connections
+        << " connections" << std::endl;
+
+    if (error.size())
+    {
+        std::cerr << "Upload failed: " << error << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < server.Errors.size(); i++)
+        std::cerr << server.Errors[i] << std::endl;
+    if (server.Errors.size())
+        return EXIT_FAILURE;
+
+    for (int i = 0; i < n_files; i++)
+    {
+        std::string fn = itksys::SystemTools::GetFilenameName(files[i]);
+        if (server.Received[fn] != contents[i])
+        {
+            std::cerr << "File " << fn << " was not received intact" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The failed file and the damaged file must have been sent again, and
+    // nothing else
+    if (!server.Failed || !server.Corrupted || retried != 2 || known != 0
+        || first_uploads != n_files + 2)
+    {
+        std::cerr << "Expected two files to be sent again, " << retried
+            << " were, in " << first_uploads << " uploads" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // The second time, the server has all the files but the changed one
+    if (known_again != n_files - 1 || retried_again != 0
+        || second_uploads != first_uploads + 1)
+    {
+        std::cerr << "Expected only the changed file to be sent again, but "
+            << second_uploads - first_uploads << " were, and " << known_again
+            << " were known" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // An "OK" from the server is a success, not a reason to send again, and
+    // a server that answered 404 is not asked about the files that follow
+    if (retried_plain != 0 || known_plain != 0
+        || server.Uploads != second_uploads + n_files
+        || server.Queries > queries + n_threads)
+    {
+        std::cerr << "Expected each file to be sent once to the plain server, but "
+            << server.Uploads - second_uploads << " uploads and "
+            << server.Queries - queries << " queries were made" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Connections are kept open and reused for the files that follow
+    if (server.Connections > n_threads)
+    {
+        std::cerr << "Expected at most " << n_threads << " connections" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (progress < 1.0 || progress_again < 1.0 || progress_plain < 1.0)
+    {
+        std::cerr << "Progress ended at " << progress << ", "
+            << progress_again << " and " << progress_plain << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif
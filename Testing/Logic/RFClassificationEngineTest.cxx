@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include "IRISApplication.h"
+#include "IRISException.h"
+#include "ImageIODelegates.h"
+#include "GenericImageData.h"
+#include "SNAPImageData.h"
+#include "ImageWrapperBase.h"
+#include "LabelImageWrapper.h"
+#include "SNAPSegmentationROISettings.h"
+#include "RFClassificationEngine.h"
+#include "RandomForestClassifier.h"
+#include "Library/classification.h"
+#include "UIReporterDelegates.h"
+#include "itksys/SystemTools.hxx"
+
+typedef IRISApplication::RFEngine RFEngine;
+typedef RFEngine::ClassifierType ClassifierType;
+typedef LabelImageWrapper::ImageType LabelImageType;
+
+class DummySystemInfoDelegate : public SystemInfoDelegate
+{
+public:
+
+  DummySystemInfoDelegate(const char *argv0) 
+    {
+    m_ExecutableName = argv0; 
+    }
+
+  virtual std::string GetApplicationDirectory()
+    {
+    return itksys::SystemTools::GetFilenamePath(m_ExecutableName);
+    }
+
+  virtual std::string GetApplicationFile()
+    {
+    return m_ExecutableName;
+    }
+
+  virtual std::string GetApplicationPermanentDataLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string GetUserDocumentsLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string EncodeServerURL(const std::string &url)
+    {
+    return url;
+    }
+
+
+  typedef SystemInfoDelegate::GrayscaleImage GrayscaleImage;
+  typedef SystemInfoDelegate::RGBAPixelType RGBAPixelType;
+  typedef SystemInfoDelegate::RGBAImageType RGBAImageType;
+
+  virtual void LoadResourceAsImage2D(std::string tag, GrayscaleImage *image) {}
+  virtual void LoadResourceAsRegistry(std::string tag, Registry &reg) {}
+  virtual void WriteRGBAImage2D(std::string file, RGBAImageType *image) {}
+
+protected:
+  std::string m_ExecutableName;
+};
+
+// Label a box of voxels, given in fractions of the size of the image
+void paintBox(LabelImageType *seg, LabelType label,
+    double x0, double y0, double z0, double width)
+{
+    itk::Size<3> size = seg->GetBufferedRegion().GetSize();
+    itk::Index<3> lo, hi, idx;
+    for (int d = 0; d < 3; d++)
+    {
+        double f = (d == 0) ? x0 : (d == 1 ? y0 : z0);
+        lo[d] = (long) (f * size[d]);
+        hi[d] = std::min((long) size[d], lo[d] + std::max(1L, (long) (width * size[d])));
+    }
+    for (idx[2] = lo[2]; idx[2] < hi[2]; idx[2]++)
+        for (idx[1] = lo[1]; idx[1] < hi[1]; idx[1]++)
+            for (idx[0] = lo[0]; idx[0] < hi[0]; idx[0]++)
+                seg->SetPixel(idx, label);
+    seg->Modified();
+}
+
+// The trees of the forest, identified by their addresses
+std::vector<const void *> getTrees(ClassifierType *classifier)
+{
+    std::vector<const void *> trees;
+    for (size_t i = 0; i < classifier->GetForest()->trees_.size(); i++)
+        trees.push_back(classifier->GetForest()->trees_[i]);
+    return trees;
+}
+
+std::set<LabelType> getLabels(ClassifierType *classifier)
+{
+    std::set<LabelType> labels;
+    for (ClassifierType::MappingType::const_iterator it =
+        classifier->GetClassToLabelMapping().begin();
+        it != classifier->GetClassToLabelMapping().end(); ++it)
+        labels.insert(it->second);
+    return labels;
+}
+
+// Train the engine, and check the size of the forest, the number of trees
+// that were replaced and the labels the classes of the forest stand for
+bool train(RFEngine *engine, int nExpectedRetrained, const std::set<LabelType> &expectedLabels)
+{
+    std::vector<const void *> before = getTrees(engine->GetClassifier());
+    engine->TrainClassifier();
+    std::vector<const void *> after = getTrees(engine->GetClassifier());
+
+    int nReplaced = 0;
+    for (size_t i = 0; i < after.size(); i++)
+        if (i >= before.size() || after[i] != before[i])
+            nReplaced++;
+
+    std::cout << "Trained " << engine->GetNumberOfRetrainedTrees() << " trees, "
+        << engine->GetNumberOfChangedSamples() << " samples changed" << std::endl;
+
+    if ((int) after.size() != engine->GetForestSize())
+    {
+        std::cerr << "Forest has " << after.size() << " trees" << std::endl;
+        return false;
+    }
+    // A new forest may reuse the memory of the old trees, so the replaced
+    // trees are only counted when some of the trees are kept
+    if (engine->GetNumberOfRetrainedTrees() != nExpectedRetrained
+        || (nExpectedRetrained < engine->GetForestSize() && nReplaced != nExpectedRetrained))
+    {
+        std::cerr << "Expected " << nExpectedRetrained << " new trees, "
+            << nReplaced << " were replaced" << std::endl;
+        return false;
+    }
+    if (getLabels(engine->GetClassifier()) != expectedLabels)
+    {
+        std::cerr << "Classes of the forest do not match the labels of the sample" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " image" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    DummySystemInfoDelegate sidel(argv[0]);
+    SystemInterface::SetSystemInfoDelegate(&sidel);
+
+    IRISApplication::Pointer app = IRISApplication::New();
+    IRISWarningList warnings;
+    app->LoadImage(argv[1], MAIN_ROLE, warnings);
+
+    SNAPSegmentationROISettings roi;
+    roi.SetROI(app->GetIRISImageData()->GetMain()->GetBufferedRegion());
+    app->InitializeSNAPImageData(roi);
+
+    SNAPImageData *sid = app->GetSNAPImageData();
+    LabelImageType *seg = sid->GetFirstSegmentationLayer()->GetImage();
+    paintBox(seg, 1, 0.2, 0.2, 0.4, 0.1);
+    paintBox(seg, 2, 0.6, 0.6, 0.4, 0.1);
+
+    RFEngine::Pointer engine = RFEngine::New();
+    engine->SetDataSource(sid);
+    engine->SetForestSize(20);
+    engine->SetTreeDepth(10);
+
+    std::set<LabelType> labels;
+    labels.insert(1);
+    labels.insert(2);
+
+    try
+    {
+        // Incremental training is off by default, so every round grows the
+        // whole forest
+        if (engine->GetIncrementalTraining())
+        {
+            std::cerr << "Incremental training is on by default" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!train(engine, 20, labels))
+            return EXIT_FAILURE;
+        paintBox(seg, 1, 0.2, 0.2, 0.55, 0.02);
+        if (!train(engine, 20, labels))
+            return EXIT_FAILURE;
+
+        // With incremental training, a small change regrows the smallest
+        // fraction of the trees
+        engine->SetIncrementalTraining(true);
+        engine->SetIncrementalTrainingFraction(0.2);
+        paintBox(seg, 2, 0.6, 0.6, 0.55, 0.02);
+        if (!train(engine, 4, labels))
+            return EXIT_FAILURE;
+
+        // A new label changes the classes, so the whole forest is grown again
+        paintBox(seg, 3, 0.4, 0.7, 0.2, 0.1);
+        labels.insert(3);
+        if (!train(engine, 20, labels))
+            return EXIT_FAILURE;
+
+        // The classes are the same after a small change again
+        paintBox(seg, 3, 0.4, 0.7, 0.35, 0.02);
+        if (!train(engine, 4, labels))
+            return EXIT_FAILURE;
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
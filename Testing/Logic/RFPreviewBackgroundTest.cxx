@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <itkImageFileWriter.h>
+#include "IRISApplication.h"
+#include "IRISException.h"
+#include "GenericImageData.h"
+#include "SNAPImageData.h"
+#include "LabelImageWrapper.h"
+#include "SNAPSegmentationROISettings.h"
+#include "PreprocessingFilterConfigTraits.h"
+#include "SlicePreviewFilterWrapper.h"
+#include "RFClassificationEngine.h"
+#include "RandomForestClassifier.h"
+#include "RandomForestClassifyImageFilter.h"
+#include "RandomForestClassifyImageFilter.txx"
+#include "UIReporterDelegates.h"
+#include "itksys/SystemTools.hxx"
+
+typedef RFPreprocessingFilterConfigTraits Traits;
+typedef SlicePreviewFilterWrapper<Traits> WrapperType;
+typedef WrapperType::FilterType FilterType;
+typedef WrapperType::OutputImageType SpeedImageType;
+typedef LabelImageWrapper::ImageType LabelImageType;
+
+class DummySystemInfoDelegate : public SystemInfoDelegate
+{
+public:
+
+  DummySystemInfoDelegate(const char *argv0)
+    {
+    m_ExecutableName = argv0;
+    }
+
+  virtual std::string GetApplicationDirectory()
+    {
+    return itksys::SystemTools::GetFilenamePath(m_ExecutableName);
+    }
+
+  virtual std::string GetApplicationFile()
+    {
+    return m_ExecutableName;
+    }
+
+  virtual std::string GetApplicationPermanentDataLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string GetUserDocumentsLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string EncodeServerURL(const std::string &url)
+    {
+    return url;
+    }
+
+
+  typedef SystemInfoDelegate::GrayscaleImage GrayscaleImage;
+  typedef SystemInfoDelegate::RGBAPixelType RGBAPixelType;
+  typedef SystemInfoDelegate::RGBAImageType RGBAImageType;
+
+  virtual void LoadResourceAsImage2D(std::string tag, GrayscaleImage *image) {}
+  virtual void LoadResourceAsRegistry(std::string tag, Registry &reg) {}
+  virtual void WriteRGBAImage2D(std::string file, RGBAImageType *image) {}
+
+protected:
+  std::string m_ExecutableName;
+};
+
+// Label a box of voxels, given in fractions of the size of the image
+void paintBox(LabelImageType *seg, LabelType label,
+    double x0, double y0, double z0, double width)
+{
+    itk::Size<3> size = seg->GetBufferedRegion().GetSize();
+    itk::Index<3> lo, hi, idx;
+    for (int d = 0; d < 3; d++)
+    {
+        double f = (d == 0) ? x0 : (d == 1 ? y0 : z0);
+        lo[d] = (long) (f * size[d]);
+        hi[d] = std::min((long) size[d], lo[d] + std::max(1L, (long) (width * size[d])));
+    }
+    for (idx[2] = lo[2]; idx[2] < hi[2]; idx[2]++)
+        for (idx[1] = lo[1]; idx[1] < hi[1]; idx[1]++)
+            for (idx[0] = lo[0]; idx[0] < hi[0]; idx[0]++)
+                seg->SetPixel(idx, label);
+    seg->Modified();
+}
+
+void writeImage(SpeedImageType *image, const char *filename)
+{
+    typedef itk::ImageFileWriter<SpeedImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(filename);
+    writer->Update();
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " image output reference" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    DummySystemInfoDelegate sidel(argv[0]);
+    SystemInterface::SetSystemInfoDelegate(&sidel);
+
+    try
+    {
+        IRISApplication::Pointer app = IRISApplication::New();
+        IRISWarningList warnings;
+        app->LoadImage(argv[1], MAIN_ROLE, warnings);
+
+        SNAPSegmentationROISettings roi;
+        roi.SetROI(app->GetIRISImageData()->GetMain()->GetBufferedRegion());
+        app->InitializeSNAPImageData(roi);
+        app->EnterPreprocessingMode(PREPROCESS_RF);
+
+        // The examples are painted into the segmentation layer, which holds
+        // the examples in this mode
+        SNAPImageData *sid = app->GetSNAPImageData();
+        LabelImageType *seg = sid->GetFirstSegmentationLayer()->GetImage();
+        paintBox(seg, 1, 0.2, 0.2, 0.4, 0.1);
+        paintBox(seg, 2, 0.6, 0.6, 0.4, 0.1);
+
+        IRISApplication::RFEngine *engine = app->GetClassificationEngine();
+        engine->SetForestSize(10);
+        engine->SetTreeDepth(10);
+        engine->TrainClassifier();
+
+        WrapperType *wrapper = static_cast<WrapperType *>(
+            app->GetPreprocessingFilterPreviewer(PREPROCESS_RF));
+        wrapper->SetParameters(engine->GetClassifier());
+        SpeedImageType *speed = sid->GetSpeed()->GetImage();
+
+        // Aborting the background pass right away, or before it is started,
+        // must not hang or lose the bricks it got to
+        wrapper->AbortComputeOutputVolume();
+        wrapper->StartComputeOutputVolume();
+        wrapper->AbortComputeOutputVolume();
+
+        // Let the background pass run for a while, then finish the volume
+        wrapper->StartComputeOutputVolume();
+        itksys::SystemTools::Delay(100);
+        wrapper->ComputeOutputVolume(NULL);
+        if (!wrapper->IsOutputVolumeComplete())
+        {
+            std::cerr << "Volume is not complete after the background pass" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Toggling the preview mode and applying again reuses every brick
+        itk::ModifiedTimeType tSpeed = speed->GetMTime();
+        wrapper->SetPreviewMode(!wrapper->IsPreviewMode());
+        wrapper->SetPreviewMode(!wrapper->IsPreviewMode());
+        wrapper->StartComputeOutputVolume();
+        wrapper->ComputeOutputVolume(NULL);
+        if (speed->GetMTime() != tSpeed || !wrapper->IsOutputVolumeComplete())
+        {
+            std::cerr << "Current bricks were computed again" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Training again changes the classifier in place, which the filters do
+        // not see. The bricks are out of date once the classifier is set again
+        paintBox(seg, 3, 0.4, 0.7, 0.2, 0.1);
+        wrapper->AbortComputeOutputVolume();
+        engine->TrainClassifier();
+        wrapper->SetParameters(engine->GetClassifier());
+        if (wrapper->IsOutputVolumeComplete())
+        {
+            std::cerr << "Volume is complete after the classifier changed" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        wrapper->StartComputeOutputVolume();
+        itksys::SystemTools::Delay(100);
+        wrapper->ComputeOutputVolume(NULL);
+        if (speed->GetMTime() == tSpeed || !wrapper->IsOutputVolumeComplete())
+        {
+            std::cerr << "Volume was not computed with the new classifier" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // The reference is the whole volume classified in one piece
+        FilterType::Pointer reference = FilterType::New();
+        Traits::AttachInputs(sid, reference, 0);
+        reference->Update();
+
+        writeImage(speed, argv[2]);
+        writeImage(reference->GetOutput(), argv[3]);
+    }
+    catch (itk::ExceptionObject &exc)
+    {
+        std::cerr << exc << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
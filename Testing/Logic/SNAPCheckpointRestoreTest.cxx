@@ -0,0 +1,190 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "IRISApplication.h"
+#include "IRISException.h"
+#include "GenericImageData.h"
+#include "SNAPImageData.h"
+#include "GlobalState.h"
+#include "SNAPSegmentationROISettings.h"
+#include "UIReporterDelegates.h"
+#include "itksys/SystemTools.hxx"
+
+typedef SNAPImageData::LevelSetImageType LevelSetImageType;
+typedef SNAPImageData::SpeedImageType SpeedImageType;
+
+class DummySystemInfoDelegate : public SystemInfoDelegate
+{
+public:
+
+  DummySystemInfoDelegate(const char *argv0)
+    {
+    m_ExecutableName = argv0;
+    }
+
+  virtual std::string GetApplicationDirectory()
+    {
+    return itksys::SystemTools::GetFilenamePath(m_ExecutableName);
+    }
+
+  virtual std::string GetApplicationFile()
+    {
+    return m_ExecutableName;
+    }
+
+  virtual std::string GetApplicationPermanentDataLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string GetUserDocumentsLocation()
+    {
+    return std::string(".itksnap.test");
+    }
+
+  virtual std::string EncodeServerURL(const std::string &url)
+    {
+    return url;
+    }
+
+
+  typedef SystemInfoDelegate::GrayscaleImage GrayscaleImage;
+  typedef SystemInfoDelegate::RGBAPixelType RGBAPixelType;
+  typedef SystemInfoDelegate::RGBAImageType RGBAImageType;
+
+  virtual void LoadResourceAsImage2D(std::string tag, GrayscaleImage *image) {}
+  virtual void LoadResourceAsRegistry(std::string tag, Registry &reg) {}
+  virtual void WriteRGBAImage2D(std::string file, RGBAImageType *image) {}
+
+protected:
+  std::string m_ExecutableName;
+};
+
+// Which voxels are inside the evolving contour
+std::vector<bool> getInside(SNAPImageData *sid)
+{
+    LevelSetImageType *phi = sid->GetLevelSetImage();
+    const float *p = phi->GetBufferPointer();
+    std::vector<bool> inside(phi->GetBufferedRegion().GetNumberOfPixels());
+    for (size_t i = 0; i < inside.size(); i++)
+        inside[i] = p[i] < 0;
+    return inside;
+}
+
+std::string listCheckpoints(SNAPImageData *sid)
+{
+    std::vector<unsigned int> iters = sid->GetSegmentationCheckpoints();
+    std::string list;
+    for (size_t i = 0; i < iters.size(); i++)
+    {
+        if (i)
+            list += " ";
+        list += std::to_string(iters[i]);
+    }
+    return list;
+}
+
+// Restore checkpoints of the evolution through SNAPImageData, which is what
+// the snake wizard does, and continue the evolution from there
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " image" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    DummySystemInfoDelegate sidel(argv[0]);
+    SystemInterface::SetSystemInfoDelegate(&sidel);
+
+    try
+    {
+        IRISApplication::Pointer app = IRISApplication::New();
+        IRISWarningList warnings;
+        app->LoadImage(argv[1], MAIN_ROLE, warnings);
+
+        SNAPSegmentationROISettings roi;
+        roi.SetROI(app->GetIRISImageData()->GetMain()->GetBufferedRegion());
+        app->InitializeSNAPImageData(roi);
+        SNAPImageData *sid = app->GetSNAPImageData();
+
+        // A uniform positive speed grows the contour everywhere
+        SpeedImageType *speed = sid->GetSpeed()->GetImage();
+        speed->FillBuffer(0x4000);
+        speed->Modified();
+
+        Bubble bubble;
+        for (int d = 0; d < 3; d++)
+            bubble.center[d] = speed->GetBufferedRegion().GetSize(d) / 2;
+        bubble.radius = 4.0;
+        app->GetBubbleArray().push_back(bubble);
+
+        if (!app->InitializeActiveContourPipeline())
+        {
+            std::cerr << "Could not initialize the evolution" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Keep the contour at every iteration, since checkpoints that take
+        // too long to save compared with the evolution are skipped
+        std::vector<std::vector<bool> > inside(1, getInside(sid));
+        for (int i = 0; i < 25; i++)
+        {
+            sid->RunSegmentation(1);
+            inside.push_back(getInside(sid));
+        }
+
+        std::vector<unsigned int> iters = sid->GetSegmentationCheckpoints();
+        std::cout << "Checkpoints at [" << listCheckpoints(sid) << "]" << std::endl;
+        if (iters.empty() || iters.front() != 0 || iters.back() > 25)
+        {
+            std::cerr << "Checkpoints do not start at 0 and end by 25" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // Iteration 15 restores the latest checkpoint at or before it
+        unsigned int expected = 0;
+        for (size_t i = 0; i < iters.size(); i++)
+            if (iters[i] <= 15)
+                expected = iters[i];
+
+        unsigned int restored = sid->RestoreSegmentationCheckpoint(15);
+        if (restored != expected || sid->GetElapsedSegmentationIterations() != expected)
+        {
+            std::cerr << "Iteration 15 restored " << restored
+                << ", expected the checkpoint at " << expected << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (getInside(sid) != inside[expected])
+        {
+            std::cerr << "Restored contour differs from the contour at iteration "
+                << expected << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        // The later checkpoints are dropped once the evolution continues
+        sid->RunSegmentation(5);
+        iters = sid->GetSegmentationCheckpoints();
+        if (sid->GetElapsedSegmentationIterations() != expected + 5
+            || iters.back() > expected + 5)
+        {
+            std::cerr << "At iteration " << sid->GetElapsedSegmentationIterations()
+                << ", checkpoints at [" << listCheckpoints(sid) << "]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    catch (itk::ExceptionObject &exc)
+    {
+        std::cerr << exc << std::endl;
+        return EXIT_FAILURE;
+    }
+    catch (IRISException &exc)
+    {
+        std::cerr << exc.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkMultiThreader.h>
+#include "SNAPLevelSetDriver.h"
+#include "SnakeParameters.h"
+
+typedef SNAPLevelSetDriver3d DriverType;
+typedef DriverType::FloatImageType FloatImageType;
+typedef DriverType::ShortImageType ShortImageType;
+
+int fail(const char *message)
+{
+    std::cerr << message << std::endl;
+    return EXIT_FAILURE;
+}
+
+// Signed distance to a ball centered at the given height in the middle of
+// the image, negative inside
+FloatImageType::Pointer makeBallLevelSet(int size, double radius, double zCenter)
+{
+    FloatImageType::Pointer phi = FloatImageType::New();
+    FloatImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    phi->SetRegions(region);
+    phi->Allocate();
+
+    itk::ImageRegionIteratorWithIndex<FloatImageType> it(phi, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        double c2 = 0;
+        for (int d = 0; d < 3; d++)
+        {
+            double c = (d == 2) ? zCenter : 0.5 * size;
+            c2 += (it.GetIndex()[d] - c) * (it.GetIndex()[d] - c);
+        }
+        it.Set(static_cast<float>(std::sqrt(c2) - radius));
+    }
+    return phi;
+}
+
+ShortImageType::Pointer makeSpeed(FloatImageType *phi, short speed)
+{
+    ShortImageType::Pointer image = ShortImageType::New();
+    image->SetRegions(phi->GetBufferedRegion());
+    image->Allocate();
+    image->FillBuffer(speed);
+    return image;
+}
+
+// Which voxels are inside the snake
+std::vector<bool> getInside(DriverType *driver)
+{
+    FloatImageType *phi = driver->GetCurrentState();
+    const float *p = phi->GetBufferPointer();
+    std::vector<bool> inside(phi->GetBufferedRegion().GetNumberOfPixels());
+    for (size_t i = 0; i < inside.size(); i++)
+        inside[i] = p[i] < 0;
+    return inside;
+}
+
+size_t countInside(const std::vector<bool> &inside)
+{
+    return std::count(inside.begin(), inside.end(), true);
+}
+
+bool checkIterations(DriverType *driver, const char *expected)
+{
+    std::vector<unsigned int> iters = driver->GetCheckpointIterations();
+    std::string list;
+    for (size_t i = 0; i < iters.size(); i++)
+    {
+        char buffer[16];
+        sprintf(buffer, "%s%u", i ? " " : "", iters[i]);
+        list += buffer;
+    }
+    if (list != expected)
+    {
+        std::cerr << "Checkpoints at [" << list << "], expected [" << expected << "]" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Evolve a growing ball, and check that restoring a checkpoint brings back
+// the snake as it was at that iteration, and that the evolution continues
+// from there with new parameters
+int testCheckpoints(int size)
+{
+    FloatImageType::Pointer phi = makeBallLevelSet(size, size / 6.0, 0.5 * size);
+    ShortImageType::Pointer speed = makeSpeed(phi, 0x4000);
+    SnakeParameters param = SnakeParameters::GetDefaultInOutParameters();
+
+    DriverType driver(phi, speed, param);
+    driver.SetCheckpointInterval(10);
+    driver.SetCheckpointTimeLimit(0);
+
+    std::vector<bool> inside0 = getInside(&driver);
+    driver.Run(20);
+    std::vector<bool> inside20 = getInside(&driver);
+    driver.Run(10);
+    size_t n30 = countInside(getInside(&driver));
+
+    std::cout << "Voxels inside at iterations 0, 20, 30: " << countInside(inside0)
+        << ", " << countInside(inside20) << ", " << n30 << std::endl;
+    if (countInside(inside20) <= countInside(inside0) || n30 <= countInside(inside20))
+        return fail("The snake did not grow");
+    if (!checkIterations(&driver, "0 10 20 30"))
+        return EXIT_FAILURE;
+
+    // Rewind to the latest checkpoint at or before iteration 25
+    if (driver.RestoreCheckpoint(25) != 20 || driver.GetElapsedIterations() != 20)
+        return fail("Iteration 25 did not restore the checkpoint at 20");
+    if (getInside(&driver) != inside20)
+        return fail("Restored snake differs from the snake at iteration 20");
+
+    // Later checkpoints can still be restored until the snake runs again
+    if (!checkIterations(&driver, "0 10 20 30"))
+        return EXIT_FAILURE;
+    if (driver.RestoreCheckpoint(0) != 0 || getInside(&driver) != inside0)
+        return fail("Restored snake differs from the initial snake");
+
+    // Continue from iteration 20 with a shrinking snake
+    driver.RestoreCheckpoint(20);
+    param.SetPropagationWeight(-1.0);
+    driver.SetSnakeParameters(param);
+    driver.Run(10);
+    size_t n30shrunk = countInside(getInside(&driver));
+    std::cout << "Voxels inside at iteration 30 after shrinking: " << n30shrunk << std::endl;
+    if (driver.GetElapsedIterations() != 30 || n30shrunk >= countInside(inside20))
+        return fail("The snake did not shrink from the restored checkpoint");
+    if (!checkIterations(&driver, "0 10 20 30"))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+// Grow a small ball for a few iterations on four threads, and return the
+// number of voxels inside it and the utilization of the threads
+size_t growBall(int size, double zCenter, unsigned int nIterations,
+    std::vector<double> &utilization)
+{
+    FloatImageType::Pointer phi = makeBallLevelSet(size, 3.0, zCenter);
+    ShortImageType::Pointer speed = makeSpeed(phi, 0x4000);
+
+    DriverType driver(phi, speed, SnakeParameters::GetDefaultInOutParameters());
+    driver.SetCheckpointInterval(0);
+    driver.Run(nIterations);
+    if (driver.GetElapsedIterations() != nIterations)
+        return 0;
+
+    utilization = driver.GetThreadUtilization();
+    return countInside(getInside(&driver));
+}
+
+// The parallel solver gives each thread a slab of the image along the last
+// axis, thread 0 the lowest. A ball in the highest slab leaves thread 0 with
+// no active nodes of its own, and it only computes updates when it takes
+// them from the owner first. Either way it must not hold back the time step,
+// so the ball grows as fast as the same ball in the slab of thread 0
+int testThreads(int size)
+{
+    itk::MultiThreader::SetGlobalDefaultNumberOfThreads(4);
+
+    std::vector<double> utilStart, utilTop, utilBottom;
+    double zBottom = 0.15 * size, zTop = (size - 1) - zBottom;
+    size_t nStart = growBall(size, zTop, 0, utilStart);
+    size_t nTop = growBall(size, zTop, 10, utilTop);
+    size_t nBottom = growBall(size, zBottom, 10, utilBottom);
+
+    std::cout << "Voxels inside before and after 10 iterations: " << nStart
+        << ", " << nTop << " in the top slab, " << nBottom << " in the bottom slab" << std::endl;
+
+    if (nTop <= nStart || nBottom <= nStart)
+        return fail("The snake did not grow");
+    if (nTop > nBottom + nBottom / 20 || nBottom > nTop + nTop / 20)
+        return fail("The snake grew at a different speed away from thread 0");
+
+    if (utilTop.size() < 2)
+        return fail("The solver did not run on several threads");
+    for (size_t t = 0; t < utilTop.size(); t++)
+    {
+        std::cout << "Thread " << t << " utilization: " << utilTop[t] << std::endl;
+        if (utilTop[t] < 0.0 || utilTop[t] > 1.0)
+            return fail("Thread utilization out of range");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " checkpoints|threads size" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int size = atoi(argv[2]);
+    try
+    {
+        if (strcmp(argv[1], "checkpoints") == 0)
+            return testCheckpoints(size);
+        if (strcmp(argv[1], "threads") == 0)
+            return testThreads(size);
+    }
+    catch (itk::ExceptionObject &exc)
+    {
+        return fail(exc.what());
+    }
+
+    std::cerr << "Unknown test " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+}
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <utility>
@@ -160,13 +161,15 @@ Seg2DImageType::Pointer cropIRIS(Seg3DImageType::Pointer image)
     return roi->GetOutput();
 }
 
-Seg2DImageType::Pointer cropRLEiris(RLEImage3D::Pointer image)
+Seg2DImageType::Pointer cropRLEiris(RLEImage3D::Pointer image, int nThreads = 0)
 {
     typedef IRISSlicer<RLEImage3D, Seg2DImageType, RLEImage3D> roiType;
     roiType::Pointer roi = roiType::New();
     roi->SetInput(image);
     roi->SetSliceIndex(sliceIndex);
     roi->SetSliceDirectionImageAxis(axis);
+    if (nThreads > 0)
+        roi->SetNumberOfThreads(nThreads);
     if (axis == 0) //x
     {
         roi->SetLineDirectionImageAxis(2);
@@ -202,6 +205,35 @@ Seg3DImageType::Pointer cropRLE(Label3DType::Pointer image)
     return lm2li->GetOutput();
 }
 
+//slice the RLE image along each axis with 1, 2, 4 and 8 threads
+void reportThreadScaling(RLEImage3D::Pointer image)
+{
+    int oldAxis = axis, oldSliceIndex = sliceIndex;
+    const char *axisName = "XYZ";
+    itk::Size<3> size = image->GetLargestPossibleRegion().GetSize();
+    for (axis = 0; axis < 3; axis++)
+    {
+        //sweep through ten consecutive slices around the middle of the volume
+        int first = std::max(0, int(size[axis] / 2) - 5);
+        int last = std::min(int(size[axis]), first + 10);
+        cout << axisName[axis] << " axis:";
+        for (int nThreads = 1; nThreads <= 8; nThreads *= 2)
+        {
+            itk::TimeProbe tp;
+            for (sliceIndex = first; sliceIndex < last; sliceIndex++)
+            {
+                tp.Start();
+                cropRLEiris(image, nThreads);
+                tp.Stop();
+            }
+            cout << " " << nThreads << " threads: " << tp.GetMean() * 1000 << " ms;";
+        }
+        cout << endl;
+    }
+    axis = oldAxis;
+    sliceIndex = oldSliceIndex;
+}
+
 //do some slicing operations, measure time taken
 int main(int argc, char *argv[])
 {
@@ -307,6 +339,9 @@ int main(int argc, char *argv[])
 
     cout << " slicing took: " << tp.GetMean() * 1000 << " ms " << endl;
 
+    if (irisRLE)
+        reportThreadScaling(rleImage);
+
 
     if (!iris && !rli && !irisRLE)
     {
@@ -0,0 +1,155 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <itkImage.h>
+#include <itkImageFileWriter.h>
+#include <itkImageRegionIteratorWithIndex.h>
+#include <itkStreamingImageFilter.h>
+#include <itkTimeProbe.h>
+#include "PreprocessingFilterConfigTraits.h"
+#include "SlicePreviewFilterWrapper.h"
+#include "SmoothBinaryThresholdImageFilter.h"
+#include "EdgePreprocessingImageFilter.h"
+#include "EdgePreprocessingSettings.h"
+#include "ThresholdSettings.h"
+
+typedef SmoothBinaryThresholdFilterConfigTraits::GreyType GreyImageType;
+typedef SmoothBinaryThresholdFilterConfigTraits::SpeedType SpeedImageType;
+
+// Synthetic volume: a bright ball inside a darker box, with noise
+GreyImageType::Pointer makeImage(int size)
+{
+    GreyImageType::Pointer image = GreyImageType::New();
+    GreyImageType::RegionType region;
+    region.SetSize(0, size); region.SetSize(1, size); region.SetSize(2, size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    srand(1234);
+    itk::ImageRegionIteratorWithIndex<GreyImageType> it(image, region);
+    for (; !it.IsAtEnd(); ++it)
+    {
+        itk::Index<3> idx = it.GetIndex();
+        double c2 = 0;
+        bool inBox = true;
+        for (int d = 0; d < 3; d++)
+        {
+            c2 += (idx[d] - 0.5 * size) * (idx[d] - 0.5 * size);
+            inBox = inBox && idx[d] > size / 8 && idx[d] < 7 * size / 8;
+        }
+        double value = (c2 < size * size / 9.0) ? 1000 : (inBox ? 400 : 0);
+        it.Set(static_cast<GreyImageType::PixelType>(value + rand() % 100));
+    }
+    return image;
+}
+
+void writeImage(SpeedImageType *image, const char *fn)
+{
+    typedef itk::ImageFileWriter<SpeedImageType> WriterType;
+    WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(image);
+    writer->SetFileName(fn);
+    writer->Update();
+}
+
+SpeedImageType::Pointer makeTarget(GreyImageType *image)
+{
+    SpeedImageType::Pointer target = SpeedImageType::New();
+    target->CopyInformation(image);
+    target->SetRegions(image->GetLargestPossibleRegion());
+    target->Allocate();
+    return target;
+}
+
+// Fill the target volume the way the speed volume used to be computed: with
+// a streaming filter over nine slabs, grafted onto the target
+template <class TFilter>
+void computeBySlabs(TFilter *filter, SpeedImageType *target)
+{
+    typedef itk::StreamingImageFilter<SpeedImageType, SpeedImageType> StreamerType;
+    typename StreamerType::Pointer streamer = StreamerType::New();
+    streamer->SetInput(filter->GetOutput());
+    streamer->SetNumberOfStreamDivisions(9);
+    streamer->GraftOutput(target);
+    streamer->UpdateLargestPossibleRegion();
+    streamer->GraftOutput(streamer->GetOutput());
+}
+
+// Compute the speed volume by bricks or by slabs, and write it along with
+// the result of a plain update of the filter, for itkTestDriver to compare
+template <class TTraits>
+int computeSpeedVolume(typename TTraits::FilterType *filter, bool bricks,
+    const char *fnOutput, const char *fnReference)
+{
+    GreyImageType *image = const_cast<GreyImageType *>(filter->GetInput());
+    SpeedImageType::Pointer target = makeTarget(image);
+
+    itk::TimeProbe tp;
+    tp.Start();
+    if (bricks)
+        SlicePreviewFilterWrapper<TTraits>::UpdateByBricks(
+            filter, target, TTraits::GetStreamingRadius(filter), NULL);
+    else
+        computeBySlabs(filter, target.GetPointer());
+    tp.Stop();
+
+    std::cout << (bricks ? "bricks" : "slabs") << ": " << tp.GetMean() * 1000
+        << " ms" << std::endl;
+
+    // Reference result
+    filter->GetOutput()->SetRequestedRegionToLargestPossibleRegion();
+    filter->UpdateLargestPossibleRegion();
+    writeImage(target, fnOutput);
+    writeImage(filter->GetOutput(), fnReference);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 7)
+    {
+        std::cerr << "Usage: " << argv[0]
+            << " size bricks|slabs threshold|edge blur_scale output reference" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    int size = atoi(argv[1]);
+    bool bricks = strcmp(argv[2], "slabs") != 0;
+    bool edges = strcmp(argv[3], "threshold") != 0;
+    double scale = atof(argv[4]);
+
+    GreyImageType::Pointer image = makeImage(size);
+    std::cout << "Speed volume of " << size << "^3 voxels, " << argv[3]
+        << " pipeline, computed by " << argv[2] << std::endl;
+
+    if (!edges)
+    {
+        SmartPtr<ThresholdSettings> ts = ThresholdSettings::New();
+        ts->SetLowerThreshold(300);
+        ts->SetUpperThreshold(800);
+        ts->SetSmoothness(3);
+
+        typedef SmoothBinaryThresholdFilterConfigTraits::FilterType FilterType;
+        FilterType::Pointer filter = FilterType::New();
+        filter->SetInput(image);
+        filter->SetInputImageMinimum(0);
+        filter->SetInputImageMaximum(1100);
+        filter->SetParameters(ts);
+        return computeSpeedVolume<SmoothBinaryThresholdFilterConfigTraits>(
+            filter, bricks, argv[5], argv[6]);
+    }
+
+    SmartPtr<EdgePreprocessingSettings> es = EdgePreprocessingSettings::New();
+    es->InitializeToDefaults();
+    es->SetGaussianBlurScale(scale);
+
+    typedef EdgePreprocessingFilterConfigTraits::FilterType FilterType;
+    FilterType::Pointer filter = FilterType::New();
+    filter->SetInput(image);
+    filter->SetParameters(es);
+    filter->SetInputImageMaximumGradientMagnitude(500.0);
+    return computeSpeedVolume<EdgePreprocessingFilterConfigTraits>(
+        filter, bricks, argv[5], argv[6]);
+}
@@ -0,0 +1,169 @@
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "SNAPCommon.h"
+#include "UndoDataManager.h"
+#include "RLEImage.h"
+
+typedef UndoDelta<LabelType> DeltaType;
+typedef RLEImage<LabelType> LabelImageType;
+
+int fail(const char *message)
+{
+    std::cerr << message << std::endl;
+    return EXIT_FAILURE;
+}
+
+// The spans of a delta must list exactly the non-zero voxels of the dense
+// sequence that was encoded, in order
+bool checkSpans(const DeltaType &delta, const std::vector<LabelType> &dense)
+{
+    std::vector<LabelType> decoded(dense.size(), 0);
+    for (size_t i = 0; i < delta.GetNumberOfSpans(); i++)
+    {
+        if (delta.GetSpanValue(i) == 0 || delta.GetSpanLength(i) == 0)
+            return false;
+        for (size_t k = 0; k < delta.GetSpanLength(i); k++)
+            decoded[delta.GetSpanOffset(i) + k] = delta.GetSpanValue(i);
+    }
+    return delta.GetEncodedLength() == dense.size() && decoded == dense;
+}
+
+// Records the changes made by RewriteLineSpan in a delta, as the span
+// painting code does
+struct ReplaceAndRecord
+{
+    LabelType operator()(LabelType label, long n)
+    {
+        LabelType result = (label == Target) ? Label : label;
+        Delta->EncodeRun(LabelType(result - label), n);
+        return result;
+    }
+    LabelType Target, Label;
+    DeltaType *Delta;
+};
+
+// Adds the value of a delta span to the labels it covers
+struct AddLabel
+{
+    LabelType operator()(LabelType label, long) const { return LabelType(label + Value); }
+    LabelType Value;
+};
+
+int main(int, char *[])
+{
+    // Mixed single voxels and runs, with changes at both ends of the sequence
+    std::vector<LabelType> dense;
+    DeltaType delta;
+    const LabelType values[] = { 3, 0, 0, 5, 5, 5, 0, 2, 7, 7, 0, 0, 0, 1 };
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+    {
+        delta.Encode(values[i]);
+        dense.push_back(values[i]);
+    }
+    delta.EncodeRun(0, 1000);
+    dense.resize(dense.size() + 1000, 0);
+    delta.EncodeRun(4, 300);
+    delta.EncodeRun(4, 20);
+    dense.resize(dense.size() + 320, 4);
+    delta.FinishEncoding();
+
+    if (delta.GetNumberOfSpans() != 6 || !checkSpans(delta, dense))
+        return fail("Encoded spans do not match the encoded voxels");
+
+    // Compression is transparent
+    size_t memory = delta.GetMemorySize();
+    for (int k = 0; k < 2; k++)
+    {
+        delta.Compress();
+        delta.Decompress();
+        if (delta.GetMemorySize() > memory || !checkSpans(delta, dense))
+            return fail("Spans changed by compression");
+    }
+
+    // Many similar spans are compressed to less memory
+    DeltaType regular;
+    std::vector<LabelType> denseRegular;
+    for (int i = 0; i < 10000; i++)
+    {
+        regular.EncodeRun(0, 7);
+        regular.EncodeRun(2, 3);
+        denseRegular.resize(denseRegular.size() + 7, 0);
+        denseRegular.resize(denseRegular.size() + 3, 2);
+    }
+    regular.FinishEncoding();
+    size_t uncompressed = regular.GetMemorySize();
+    regular.Compress();
+    if (!regular.IsCompressed() || regular.GetMemorySize() * 4 > uncompressed)
+        return fail("Regular spans were not compressed");
+    regular.Decompress();
+    if (!checkSpans(regular, denseRegular))
+        return fail("Regular spans changed by compression");
+
+    // Runs longer than the length field are split
+    DeltaType huge;
+    huge.EncodeRun(0, 10);
+    huge.EncodeRun(9, 5000000000ull);
+    huge.FinishEncoding();
+    if (huge.GetNumberOfSpans() != 2 || huge.GetSpanOffset(0) != 10
+        || huge.GetSpanOffset(1) != 10 + (size_t) huge.GetSpanLength(0)
+        || (size_t) huge.GetSpanLength(0) + huge.GetSpanLength(1) != 5000000000ull)
+        return fail("Long run was not split into spans");
+
+    // A span rewritten in an RLE line, and reverted from its delta
+    LabelImageType::RegionType region;
+    region.SetSize(0, 60);
+    region.SetSize(1, 1);
+    region.SetSize(2, 1);
+    LabelImageType::Pointer image = LabelImageType::New();
+    image->SetRegions(region);
+    image->Allocate();
+    image->SetUseRunIndex(true);
+
+    LabelImageType::RLLine &line = image->GetBuffer()->GetPixel(
+        LabelImageType::truncateIndex(region.GetIndex()));
+    LabelImageType::RLLine buffer, original;
+    line.clear();
+    const LabelType labels[] = { 0, 1, 2, 1, 0, 1 };
+    for (int i = 0; i < 6; i++)
+        LabelImageType::AppendRun(line, labels[i], 10);
+    image->UpdateRunIndex(line);
+    original = line;
+
+    DeltaType paint;
+    ReplaceAndRecord replace;
+    replace.Target = 1;
+    replace.Label = 3;
+    replace.Delta = &paint;
+    paint.EncodeRun(0, 5);
+    if (image->RewriteLineSpan(line, 5, 55, replace, buffer) != 25)
+        return fail("Wrong number of voxels changed by the span");
+    paint.EncodeRun(0, 5);
+    paint.FinishEncoding();
+
+    LabelImageType::IndexType idx = region.GetIndex();
+    for (idx[0] = 0; idx[0] < 60; idx[0]++)
+    {
+        LabelType expected = labels[idx[0] / 10];
+        if (expected == 1 && idx[0] >= 5 && idx[0] < 55)
+            expected = 3;
+        if (image->GetPixel(idx) != expected)
+            return fail("Span was not painted correctly");
+    }
+    if (paint.GetEncodedLength() != 60 || paint.GetNumberOfSpans() != 3)
+        return fail("Delta of the span has the wrong layout");
+
+    for (size_t i = 0; i < paint.GetNumberOfSpans(); i++)
+    {
+        AddLabel revert;
+        revert.Value = LabelType(-paint.GetSpanValue(i));
+        long s0 = (long) paint.GetSpanOffset(i);
+        image->RewriteLineSpan(line, s0, s0 + (long) paint.GetSpanLength(i), revert, buffer);
+    }
+    if (line != original)
+        return fail("Reverting the delta did not restore the line");
+
+    std::cout << "Undo delta tests passed" << std::endl;
+    return EXIT_SUCCESS;
+}
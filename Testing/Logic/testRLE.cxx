@@ -1,7 +1,22 @@
 #include "RLEImageRegionIterator.h"
 #include "RLERegionOfInterestImageFilter.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+#else
+#include <unistd.h>
+#endif
+
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
 #include <itkTimeProbe.h>
@@ -58,7 +73,7 @@ inline char axisToLetter(unsigned axis)
 }
 
 //invokes IRISSlicer<itk> and IRISSlicer<rle> and compares results
-void testIRISSlicer(shortRLEImage::Pointer rleImage, Seg3DImageType::Pointer itkImage,
+long testIRISSlicer(shortRLEImage::Pointer rleImage, Seg3DImageType::Pointer itkImage,
     unsigned sliceIndex, unsigned sliceAxis, unsigned lineAxis, unsigned pixelAxis,
     bool lineForward, bool pixelForward)
 {
@@ -104,20 +119,265 @@ void testIRISSlicer(shortRLEImage::Pointer rleImage, Seg3DImageType::Pointer itk
     diff->UpdateLargestPossibleRegion();
     std::cout << "Number of pixels with difference: " << 
         diff->GetNumberOfPixelsWithDifferences() << std::endl << std::endl;
+    return diff->GetNumberOfPixelsWithDifferences();
 }
 
 //test all 4 combinations of bool parameters (lineForward and pixelForward)
-void test4bools(shortRLEImage::Pointer rleImage, Seg3DImageType::Pointer itkImage,
+long test4bools(shortRLEImage::Pointer rleImage, Seg3DImageType::Pointer itkImage,
     unsigned sliceIndex, unsigned sliceAxis, unsigned lineAxis, unsigned pixelAxis)
 {
-    testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, true, true);
-    testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, true, false);
-    testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, false, true);
-    testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, false, false);
+    return testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, true, true);
+        + testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, true, false)
+        + testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, false, true)
+        + testIRISSlicer(rleImage, itkImage, sliceIndex, sliceAxis, lineAxis, pixelAxis, false, false);
+}
+
+//resident memory of the process, in bytes
+double residentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+    return pmc.WorkingSetSize;
+#elif defined(__APPLE__)
+    mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count);
+    return info.resident_size;
+#else
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return double(resident) * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+//memory used by the RLE lines, per voxel, measured as the growth of the
+//resident memory when copies of the lines are made from the pool and with a
+//heap allocation per line
+void reportStorage(shortRLEImage::Pointer image, const char *when)
+{
+    typedef shortRLEImage::RLSegment RLSegment;
+    typedef std::vector<RLSegment> HeapLine;
+    itk::ImageRegionConstIterator<shortRLEImage::BufferType> it(
+        image->GetBuffer(), image->GetBuffer()->GetBufferedRegion());
+    size_t nLines = image->GetBuffer()->GetBufferedRegion().GetNumberOfPixels();
+
+    double rss0 = residentBytes();
+    std::vector<shortRLEImage::RLLine> pooled(nLines);
+    for (size_t i = 0; !it.IsAtEnd(); ++it, i++)
+    {
+        shortRLEImage::ReserveLine(pooled[i], it.Get().size());
+        pooled[i].assign(it.Get().begin(), it.Get().end());
+    }
+    double rss1 = residentBytes();
+    std::vector<HeapLine> heap(nLines);
+    it.GoToBegin();
+    for (size_t i = 0; !it.IsAtEnd(); ++it, i++)
+        heap[i].assign(it.Get().begin(), it.Get().end());
+    double rss2 = residentBytes();
+
+    double nVoxels = image->GetBufferedRegion().GetNumberOfPixels();
+    std::cout << "Bytes per voxel " << when << ": " << image->GetLineStorageInBytes() / nVoxels
+        << " in pool blocks; resident growth of a copy " << (rss1 - rss0) / nVoxels
+        << " pooled, " << (rss2 - rss1) / nVoxels << " with a heap allocation per line"
+        << std::endl;
+}
+
+//all the pool chunks but one per shard are released with the last line
+long testPoolRelease()
+{
+    const shortRLEImage::RLSegmentAllocator::PoolType & pool =
+        shortRLEImage::RLSegmentAllocator::PoolType::GetInstance();
+    std::cout << "Pool after releasing all images: " << pool.GetBytesInUse()
+        << " bytes in use, " << pool.GetBytesReserved() << " reserved" << std::endl;
+    return (pool.GetBytesInUse() == 0
+        && pool.GetBytesReserved() <= pool.GetMaximumIdleBytesReserved()) ? 0 : 1;
+}
+
+//random GetPixel/SetPixel on a noisy multi-label image, with and without the run index
+long testRunIndex(unsigned nLabels)
+{
+    std::cout << "Random access with " << nLabels << " labels" << std::endl;
+    itk::TimeProbe tp;
+    shortRLEImage::RegionType reg;
+    reg.SetSize(0, 512);
+    reg.SetSize(1, 64);
+    reg.SetSize(2, 64);
+
+    shortRLEImage::Pointer images[2];
+    for (int k = 0; k < 2; k++)
+    {
+        images[k] = shortRLEImage::New();
+        images[k]->SetRegions(reg);
+        images[k]->Allocate();
+        images[k]->SetUseRunIndex(k == 1);
+    }
+
+    //paint short runs of random labels, so that lines have hundreds of runs
+    const int nOps = 2000000;
+    for (int k = 0; k < 2; k++)
+    {
+        srand(1234);
+        tp.Start();
+        shortRLEImage::IndexType ind;
+        for (int i = 0; i < nOps; i++)
+        {
+            for (int d = 0; d < 3; d++)
+                ind[d] = rand() % reg.GetSize(d);
+            images[k]->SetPixel(ind, short(rand() % nLabels));
+        }
+        tp.Stop();
+        std::cout << (k ? "SetPixel with run index: " : "SetPixel without run index: ")
+            << tp.GetMean() * 1000 << " ms " << std::endl;
+        tp.Reset();
+    }
+
+    long sum[2] = { 0, 0 };
+    for (int k = 0; k < 2; k++)
+    {
+        srand(4321);
+        tp.Start();
+        shortRLEImage::IndexType ind;
+        for (int i = 0; i < nOps; i++)
+        {
+            for (int d = 0; d < 3; d++)
+                ind[d] = rand() % reg.GetSize(d);
+            sum[k] += images[k]->GetPixel(ind);
+        }
+        tp.Stop();
+        std::cout << (k ? "GetPixel with run index: " : "GetPixel without run index: ")
+            << tp.GetMean() * 1000 << " ms " << std::endl;
+        tp.Reset();
+    }
+
+    //the two images must be identical, including after a filter rebuilds the index
+    roiType::Pointer roi = roiType::New();
+    roi->SetInput(images[1]);
+    roi->SetRegionOfInterest(reg);
+    roi->Update();
+    shortRLEImage::Pointer copy = roi->GetOutput();
+    copy->SetUseRunIndex(true);
+
+    long nDiff = 0;
+    itk::ImageRegionConstIterator<shortRLEImage> it0(images[0], reg), it1(images[1], reg);
+    for (; !it0.IsAtEnd(); ++it0, ++it1)
+        if (it0.Get() != it1.Get() || copy->GetPixel(it0.GetIndex()) != it0.Get())
+            nDiff++;
+    std::cout << "Number of pixels with difference: " << nDiff
+        << (sum[0] == sum[1] ? "" : " (GetPixel mismatch!)") << std::endl;
+
+    //restore most of the image to background, then return the slack to the pool
+    images[1]->FillBuffer(0);
+    for (int i = 0; i < nOps / 100; i++)
+    {
+        shortRLEImage::IndexType ind;
+        for (int d = 0; d < 3; d++)
+            ind[d] = rand() % reg.GetSize(d);
+        images[1]->SetPixel(ind, short(rand() % nLabels));
+    }
+    reportStorage(images[0], "after editing");
+    reportStorage(images[1], "after clearing");
+    images[1]->Compact();
+    reportStorage(images[1], "after compaction");
+    std::cout << std::endl;
+    return nDiff + (sum[0] == sum[1] ? 0 : 1);
+}
+
+//compares every pixel of a single-line image against the expected values
+long countMismatches(shortRLEImage::Pointer image, const std::vector<short> & expected)
+{
+    long nDiff = 0;
+    shortRLEImage::IndexType ind;
+    ind[1] = ind[2] = 0;
+    for (ind[0] = 0; ind[0] < (long) expected.size(); ind[0]++)
+        if (image->GetPixel(ind) != expected[ind[0]])
+            nDiff++;
+
+    //iterator positioning goes through the run index as well
+    itk::ImageRegionConstIterator<shortRLEImage> it(image, image->GetBufferedRegion());
+    for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+        if (it.Get() != expected[it.GetIndex()[0]])
+            nDiff++;
+    return nDiff;
+}
+
+//rewrites which keep the number of segments of a line, but move its boundaries
+long testRunIndexRewrite()
+{
+    shortRLEImage::RegionType reg;
+    reg.SetSize(0, 40);
+    reg.SetSize(1, 1);
+    reg.SetSize(2, 1);
+    shortRLEImage::Pointer image = shortRLEImage::New();
+    image->SetRegions(reg);
+    image->Allocate();
+    image->SetUseRunIndex(true);
+
+    //runs 0:10 1:10 2:10 3:10, written directly into the buffer
+    std::vector<short> expected(40);
+    shortRLEImage::RLLine & line = image->GetBuffer()->GetPixel(
+        shortRLEImage::truncateIndex(reg.GetIndex()));
+    line.clear();
+    for (short v = 0; v < 4; v++)
+    {
+        line.push_back(shortRLEImage::RLSegment(10, v));
+        std::fill(expected.begin() + 10 * v, expected.begin() + 10 * v + 10, v);
+    }
+    image->UpdateRunIndex(line);
+    long nDiff = countMismatches(image, expected);
+
+    //same four runs with other lengths: 0:3 1:20 2:2 3:15
+    const unsigned short lengths[] = { 3, 20, 2, 15 };
+    for (short v = 0, x = 0; v < 4; x += lengths[v++])
+    {
+        line[v].first = lengths[v];
+        std::fill(expected.begin() + x, expected.begin() + x + lengths[v], v);
+    }
+    image->UpdateRunIndex(line);
+    nDiff += countMismatches(image, expected);
+
+    //SetPixel at the edges of runs grows one run and shrinks its neighbor,
+    //which keeps the number of segments as well
+    const long edits[] = { 3, 4, 23, 25, 26 };
+    for (size_t i = 0; i < sizeof(edits) / sizeof(edits[0]); i++)
+    {
+        shortRLEImage::IndexType ind = reg.GetIndex();
+        ind[0] = edits[i];
+        short value = expected[edits[i] - 1];
+        image->SetPixel(ind, value);
+        expected[edits[i]] = value;
+        nDiff += countMismatches(image, expected);
+    }
+
+    //move the boundary of the first two runs behind the back of the index,
+    //then declare the change: the line must be scanned until it is rebuilt
+    line[0].first++;
+    line[1].first--;
+    expected[line[0].first - 1] = line[0].second;
+    image->InvalidateRunIndex();
+    nDiff += countMismatches(image, expected);
+    image->RebuildRunIndex();
+    nDiff += countMismatches(image, expected);
+
+    std::cout << "Run index after same-length rewrites: " << nDiff
+        << " pixels with difference" << std::endl << std::endl;
+    return nDiff;
 }
 
 int main(int argc, char* argv[])
 {
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " segmentation_image" << std::endl;
+        return EXIT_FAILURE;
+    }
+
     itk::TimeProbe tp;
     std::cout << "Loading image: "; tp.Start();
     Seg3DImageType::Pointer inImage = loadImage(argv[1]);
@@ -132,14 +392,23 @@ int main(int argc, char* argv[])
     inConv->Update();
     test = inConv->GetOutput();
     tp.Stop(); std::cout << tp.GetMean() * 1000 << " ms " << std::endl; tp.Reset();
+    reportStorage(test, "after conversion");
 
     //Test all 6 permutations of axes
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(2) / 2, 2, 1, 0);
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(2) / 2, 2, 0, 1);
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(1) / 2, 1, 2, 0);
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(1) / 2, 1, 0, 2);
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(0) / 2, 0, 2, 1);
-    test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(0) / 2, 0, 1, 2);
-    std::cout << "All tests finished!";
-    getchar();
+    long nDiff = test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(2) / 2, 2, 1, 0);
+    nDiff += test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(2) / 2, 2, 0, 1);
+    nDiff += test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(1) / 2, 1, 2, 0);
+    nDiff += test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(1) / 2, 1, 0, 2);
+    nDiff += test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(0) / 2, 0, 2, 1);
+    nDiff += test4bools(test, inImage, inImage->GetBufferedRegion().GetSize(0) / 2, 0, 1, 2);
+
+    nDiff += testRunIndex(4);
+    nDiff += testRunIndex(100);
+    nDiff += testRunIndexRewrite();
+
+    test = NULL;
+    inConv = NULL;
+    nDiff += testPoolRelease();
+    std::cout << "All tests finished!" << std::endl;
+    return nDiff == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -40,6 +40,7 @@
 #include "WorkspaceAPI.h"
 #include "FormattedTable.h"
 #include "RESTClient.h"
+#include "LayerCache.h"
 
 #include "CommandLineHelper.h"
 #include "GuidedNativeImageIO.h"
@@ -136,6 +137,9 @@ int usage(int rc)
   cout << "  -dss-tickets-wait <id> [timeout]  : Wait for the ticket 'id' to complete" << endl;
   cout << "  -dss-tickets-download <id> <dir>  : Download the result for ticket 'id' to directory 'dir'" << endl;
   cout << "  -dss-tickets-delete <id>          : Delete a ticket" << endl;
+  cout << "  -dss-layer-cache <dir>            : Keep the layers exported and downloaded by the commands that" << endl;
+  cout << "                                      follow in 'dir', so that unchanged layers are not compressed or" << endl;
+  cout << "                                      sent again. 'default' is ~/.alfabis/layers, 'off' turns this off" << endl;
   cout << "DSS service provider commands: " << endl;
   cout << "  -dssp-services-list               : List all the services you are listed as provider for" << endl;
   cout << "  -dssp-services-claim <service_hash_list> <provider> <instance_id> [timeout]" << endl;
@@ -742,6 +746,16 @@ int main(int argc, char *argv[])
         int ticket_id = ws.CreateWorkspaceTicket(service_githash.c_str());
         cout << prefix << ticket_id << endl;
         }
+      else if(arg == "-dss-layer-cache")
+        {
+        string dir = cl.read_string();
+        if(dir == "off")
+          LayerCache::SetDirectory("");
+        else if(dir == "default")
+          LayerCache::SetDirectory(LayerCache::GetDefaultDirectory());
+        else
+          LayerCache::SetDirectory(SystemTools::CollapseFullPath(dir));
+        }
       else if(arg == "-dss-tickets-list" || arg == "-dtl")
         {
         RESTClient rc;